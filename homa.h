@@ -56,23 +56,37 @@ extern "C"
  * make sure they don't conflict with anything else.
  */
 
-#define HOMAIOCSEND   1003101
-#define HOMAIOCRECV   1003102
-#define HOMAIOCINVOKE 1003103
-#define HOMAIOCREPLY  1003104
-#define HOMAIOCABORT  1003105
+#define HOMAIOCSEND    1003101
+#define HOMAIOCRECV    1003102
+#define HOMAIOCINVOKE  1003103
+#define HOMAIOCREPLY   1003104
+#define HOMAIOCABORT   1003105
+#define HOMAIOCRELEASE 1003106
+#define HOMAIOCRECVMANY  1003107
+#define HOMAIOCREPLYMANY 1003108
+#define HOMAIOCSENDMANY  1003109
+
+struct homa_args_recv_ipv4;
+struct homa_args_reply_ipv4;
+struct homa_args_send_ipv4;
 
 extern int     homa_send(int sockfd, const void *request, size_t reqlen,
 			const struct sockaddr *dest_addr, size_t addrlen,
 			uint64_t *id);
 extern ssize_t homa_recv(int sockfd, void *buf, size_t len, int flags,
 			uint64_t *id, struct sockaddr *src_addr, size_t addrlen);
+extern int     homa_recvmany(int sockfd, struct homa_args_recv_ipv4 *args,
+			int count);
 extern ssize_t homa_invoke(int sockfd, const void *request, size_t reqlen,
 			const struct sockaddr *dest_addr, size_t addrlen,
 			void *response, size_t resplen);
 extern ssize_t homa_reply(int sockfd, const void *response, size_t resplen,
 			const struct sockaddr *dest_addr, size_t addrlen,
 			uint64_t id);
+extern int     homa_replymany(int sockfd, struct homa_args_reply_ipv4 *args,
+			int count);
+extern int     homa_sendmany(int sockfd, struct homa_args_send_ipv4 *args,
+			int count);
 extern int     homa_abort(int sockfd, uint64_t id);
 
 /**
@@ -98,11 +112,120 @@ struct homa_args_recv_ipv4 {
 	__u64 id;
 };
 
-/* Flag bits for homa_recv (see man page for documentation): 
+/* Flag bits for homa_recv (see man page for documentation):
  */
 #define HOMA_RECV_REQUEST       0x01
 #define HOMA_RECV_RESPONSE      0x02
 #define HOMA_RECV_NONBLOCKING   0x04
+#define HOMA_RECV_REGION        0x08
+
+/* HOMA_RECV_PARTIAL: return as soon as any contiguous bytes of the
+ * message are available, rather than waiting for the entire message;
+ * used to overlap the copy to user space with network arrival for large
+ * messages. The return value is the number of new bytes delivered by
+ * this call (delivery is always sequential from the start of the
+ * message), and the len field is filled in with the total message
+ * length; the caller invokes homa_recv repeatedly with the same id until
+ * the cumulative bytes received equal len. This flag requires a nonzero
+ * id (i.e., it is used when waiting for a response).
+ */
+#define HOMA_RECV_PARTIAL       0x10
+
+/**
+ * define HOMA_CMSG_RPC - Control message type (at level IPPROTO_HOMA)
+ * used with sendmsg and recvmsg on Homa sockets; the payload is a
+ * struct homa_rpc_cmsg.
+ */
+#define HOMA_CMSG_RPC 1
+
+/**
+ * define homa_rpc_cmsg - Carries the Homa-specific arguments of a sendmsg
+ * or recvmsg kernel call (the information that the homa_args structs carry
+ * on the ioctl path), so that RPCs can be issued through the standard
+ * sendmsg/recvmsg fast path and batched asynchronously with io_uring.
+ * Passed as the payload of a HOMA_CMSG_RPC control message; for recvmsg
+ * the kernel returns an updated copy in the control buffer.
+ */
+struct homa_rpc_cmsg {
+	/**
+	 * @id: For sendmsg, nonzero means the message is the response for
+	 * this RPC; zero means it is a new request. For recvmsg, nonzero
+	 * restricts the call to this particular RPC; on return, holds the
+	 * id of the message that was received.
+	 */
+	__u64 id;
+
+	/**
+	 * @id_addr: For sendmsg only: if nonzero, the user-space address
+	 * of a __u64 in which the kernel stores the id assigned to a new
+	 * request (sendmsg has no other way to return it; ancillary data
+	 * is input-only on the send path).
+	 */
+	__u64 id_addr;
+
+	/** @flags: For recvmsg only: an OR-ed set of HOMA_RECV_ flags. */
+	__u32 flags;
+
+	/** @_pad: Must be zero. */
+	__u32 _pad;
+};
+
+/**
+ * define HOMA_SO_POLL - Option for setsockopt (at level IPPROTO_HOMA):
+ * the argument is an int; a nonzero value means that threads receiving
+ * on this socket busy-wait briefly for an incoming message before
+ * sleeping (the duration is given by the poll_usecs sysctl value).
+ */
+#define HOMA_SO_POLL 1
+
+/**
+ * define HOMA_SO_RCVBUF - Option for setsockopt (at level IPPROTO_HOMA):
+ * registers a region of the application's memory with the socket, for use
+ * in receiving messages. The argument is a struct homa_rcvbuf_args. Once
+ * a region has been registered, homa_recv calls that specify
+ * HOMA_RECV_REGION deliver each message into a free slot of the region
+ * (slots are HOMA_MAX_MESSAGE_LENGTH bytes each) and return the slot's
+ * address instead of copying into a caller-provided buffer; the
+ * application returns ownership of a slot with the HOMAIOCRELEASE ioctl,
+ * whose argument is the slot's address.
+ */
+#define HOMA_SO_RCVBUF 2
+
+/**
+ * define HOMA_SO_EVENTFD - Option for setsockopt (at level IPPROTO_HOMA):
+ * the argument is an int holding an eventfd file descriptor. Homa signals
+ * the eventfd whenever a complete message becomes ready on the socket, so
+ * a client that pipelines RPCs (HOMAIOCSENDMANY followed by nonblocking
+ * HOMAIOCRECVMANY) can wait for completions on the eventfd, e.g. from an
+ * epoll loop. An argument of -1 removes the registration.
+ */
+#define HOMA_SO_EVENTFD 3
+
+/**
+ * define HOMA_SO_REUSEPORT - Option for setsockopt (at level IPPROTO_HOMA):
+ * the argument is an int; nonzero means this socket is willing to share
+ * its server port with other sockets that also set this option. It must
+ * be set before homa_bind. New incoming requests are spread across the
+ * sockets sharing a port (hashed by client address and RPC id), so each
+ * thread of a server can bind its own socket to the service's port
+ * instead of contending for a single socket.
+ */
+#define HOMA_SO_REUSEPORT 4
+
+/**
+ * struct homa_rcvbuf_args - Argument for the HOMA_SO_RCVBUF setsockopt
+ * option.
+ */
+struct homa_rcvbuf_args {
+	/** @start: First byte of the buffer region. */
+	void *start;
+
+	/**
+	 * @length: Total number of bytes available at @start; must be at
+	 * least HOMA_MAX_MESSAGE_LENGTH.
+	 */
+	size_t length;
+};
 
 /**
  * define homa_args_invoke_ipv4 - Structure that passes arguments and results
@@ -127,6 +250,60 @@ struct homa_args_reply_ipv4 {
 	__u64 id;
 };
 
+/**
+ * define homa_args_recvmany_ipv4 - Structure that passes arguments and
+ * results betweeen homa_recvmany and the HOMAIOCRECVMANY ioctl. Assumes
+ * IPV4 addresses.
+ */
+struct homa_args_recvmany_ipv4 {
+	/**
+	 * @args: Array with @count entries, each describing one receive
+	 * operation just as for HOMAIOCRECV; entries are filled in with
+	 * results as messages arrive. Only the first entry may block (as
+	 * determined by its flags); the rest are handled as if
+	 * HOMA_RECV_NONBLOCKING were specified.
+	 */
+	struct homa_args_recv_ipv4 *args;
+
+	/** @count: Number of entries in @args. */
+	int count;
+};
+
+/**
+ * define homa_args_sendmany_ipv4 - Structure that passes arguments and
+ * results betweeen homa_sendmany and the HOMAIOCSENDMANY ioctl. Assumes
+ * IPV4 addresses.
+ */
+struct homa_args_sendmany_ipv4 {
+	/**
+	 * @args: Array with @count entries, each describing one request
+	 * just as for HOMAIOCSEND; each entry's id field is filled in
+	 * with the id of the new RPC. Completed responses are harvested
+	 * separately (e.g. with HOMAIOCRECVMANY), so one thread can keep
+	 * many RPCs outstanding with two kernel calls per batch.
+	 */
+	struct homa_args_send_ipv4 *args;
+
+	/** @count: Number of entries in @args. */
+	int count;
+};
+
+/**
+ * define homa_args_replymany_ipv4 - Structure that passes arguments and
+ * results betweeen homa_replymany and the HOMAIOCREPLYMANY ioctl. Assumes
+ * IPV4 addresses.
+ */
+struct homa_args_replymany_ipv4 {
+	/**
+	 * @args: Array with @count entries, each describing one reply
+	 * just as for HOMAIOCREPLY.
+	 */
+	struct homa_args_reply_ipv4 *args;
+
+	/** @count: Number of entries in @args. */
+	int count;
+};
+
 /**
  * Meanings of the bits in Homa's flag word, which can be set using
  * "sysctl /net/homa/flags".
@@ -93,6 +93,32 @@ ssize_t homa_recv(int sockfd, void *buf, size_t len, int flags, uint64_t *id,
 	return result;
 }
 
+/**
+ * homa_recvmany() - Receive multiple incoming messages with a single
+ * kernel call.
+ * @sockfd:     File descriptor for the socket on which to receive messages.
+ * @args:       Array with @count entries, each describing one receive
+ *              operation just as for homa_recv; results (buf, len,
+ *              source_addr, and id) are returned in the entries. Only
+ *              the first entry may block, as determined by its flags;
+ *              the remaining entries are handled as if
+ *              HOMA_RECV_NONBLOCKING were specified, so this call returns
+ *              as soon as there are no more messages ready.
+ * @count:      Number of entries in @args.
+ *
+ * Return:      The number of messages received (at least 1). If an error
+ *              occurred before any message was received, -1 is returned
+ *              and errno is set appropriately.
+ */
+int homa_recvmany(int sockfd, struct homa_args_recv_ipv4 *args, int count)
+{
+	struct homa_args_recvmany_ipv4 many;
+
+	many.args = args;
+	many.count = count;
+	return ioctl(sockfd, HOMAIOCRECVMANY, &many);
+}
+
 /**
  * homa_reply() - Send a response message for an RPC previously received
  * with a call to homa_recv.
@@ -129,6 +155,29 @@ ssize_t homa_reply(int sockfd, const void *response, size_t resplen,
 	return ioctl(sockfd, HOMAIOCREPLY, &args);
 }
 
+/**
+ * homa_replymany() - Send response messages for multiple RPCs with a
+ * single kernel call.
+ * @sockfd:     File descriptor for the socket on which to send the messages.
+ * @args:       Array with @count entries, each describing one reply just
+ *              as for homa_reply.
+ * @count:      Number of entries in @args.
+ *
+ * Return:      The number of responses accepted for delivery. If this is
+ *              less than @count, then an error occurred on the next
+ *              entry; resubmitting the remaining entries will return the
+ *              error. If an error occurred on the first entry, -1 is
+ *              returned and errno is set appropriately.
+ */
+int homa_replymany(int sockfd, struct homa_args_reply_ipv4 *args, int count)
+{
+	struct homa_args_replymany_ipv4 many;
+
+	many.args = args;
+	many.count = count;
+	return ioctl(sockfd, HOMAIOCREPLYMANY, &many);
+}
+
 /**
  * homa_send() - Send a request message to initiate an RPC.
  * @sockfd:     File descriptor for the socket on which to send the message.
@@ -161,4 +210,31 @@ int homa_send(int sockfd, const void *request, size_t reqlen,
 	if (result >= 0)
 		*id = args.id;
 	return result;
+}
+
+/**
+ * homa_sendmany() - Send request messages to initiate multiple RPCs with
+ * a single kernel call, without waiting for any responses. Responses can
+ * be harvested later with homa_recvmany, and an eventfd registered with
+ * HOMA_SO_EVENTFD provides completion notification, so one thread can
+ * keep many RPCs in flight.
+ * @sockfd:     File descriptor for the socket on which to send the messages.
+ * @args:       Array with @count entries, each describing one request just
+ *              as for homa_send; each entry's id field is filled in with
+ *              the identifier of its RPC.
+ * @count:      Number of entries in @args.
+ *
+ * Return:      The number of requests accepted for delivery. If this is
+ *              less than @count, then an error occurred on the next
+ *              entry; resubmitting the remaining entries will return the
+ *              error. If an error occurred on the first entry, -1 is
+ *              returned and errno is set appropriately.
+ */
+int homa_sendmany(int sockfd, struct homa_args_send_ipv4 *args, int count)
+{
+	struct homa_args_sendmany_ipv4 many;
+
+	many.args = args;
+	many.count = count;
+	return ioctl(sockfd, HOMAIOCSENDMANY, &many);
 }
\ No newline at end of file
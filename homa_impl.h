@@ -21,18 +21,27 @@
 #define _HOMA_IMPL_H
 
 #include <linux/audit.h>
+#include <linux/completion.h>
+#include <linux/eventfd.h>
 #include <linux/icmp.h>
 #include <linux/if_vlan.h>
 #include <linux/init.h>
+#include <linux/jhash.h>
 #include <linux/list.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/kthread.h>
+#include <linux/llist.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/mmu_context.h>
+#include <linux/prefetch.h>
 #include <linux/proc_fs.h>
 #include <linux/sched/signal.h>
 #include <linux/skbuff.h>
 #include <linux/version.h>
 #include <linux/socket.h>
+#include <linux/workqueue.h>
 #include <linux/indirect_call_wrapper.h>
 #include <net/ip.h>
 #include <net/protocol.h>
@@ -71,13 +80,14 @@ extern void mock_rcu_read_unlock(void);
 /* Forward declarations. */
 struct homa_sock;
 struct homa_rpc;
+struct homa_link;
 struct homa;
 
 /* Declarations used in this file, so they can't be made at the end. */
 extern void     homa_grantable_lock_slow(struct homa *homa);
 extern void     homa_rpc_lock_slow(struct homa_rpc *rpc);
 extern void     homa_sock_lock_slow(struct homa_sock *hsk);
-extern void     homa_throttle_lock_slow(struct homa *homa);
+extern void     homa_throttle_lock_slow(struct homa_link *link);
 
 /**
  * enum homa_packet_type - Defines the possible types of Homa packets.
@@ -99,8 +109,9 @@ enum homa_packet_type {
 	RTS                = 28,
 	ACCEPT			   = 29,
 	DCACP_GRANT			   = 30,
+	ACK                = 31,
 
-	BOGUS              = 31,      /* Used only in unit tests. */
+	BOGUS              = 32,      /* Used only in unit tests. */
 	/* If you add a new type here, you must also do the following:
 	 * 1. Change BOGUS so it is the highest opcode
 	 * 2. Add support for the new opcode in homa_print_packet,
@@ -137,14 +148,14 @@ enum homa_packet_type {
  * define HOMA_MAX_HEADER - Largest allowable Homa header.  All Homa packets
  * must be at least this long.
  */
-#define HOMA_MAX_HEADER 64
+#define HOMA_MAX_HEADER 80
 
 /**
- * define ETHERNET_MAX_PAYLOAD - A maximum length of an Ethernet packet,
- * excluding preamble, frame delimeter, VLAN header, CRC, and interpacket gap;
- * i.e. all of this space is available for Homa.
+ * define HOMA_MAX_DATA_PAGES - Largest number of user pages that a single
+ * data_segment can span when its data is attached to a packet by pinning
+ * pages instead of copying (a segment never exceeds the MTU).
  */
-#define ETHERNET_MAX_PAYLOAD 1500
+#define HOMA_MAX_DATA_PAGES 8
 
 /**
  * define HOMA_MAX_PRIORITIES - The maximum number of priority levels that
@@ -273,9 +284,16 @@ struct data_header {
 	 * (it has already been sent previously).
 	 */
 	__u8 retransmit;
-	
-	__u8 pad;
-	
+
+	/**
+	 * @busy: 1 means the sender has additional granted data for this
+	 * message that it has deliberately chosen not to transmit yet
+	 * (e.g., it is transmitting other messages instead). Serves the
+	 * same purpose as a BUSY packet, without spending a separate
+	 * packet.
+	 */
+	__u8 busy;
+
 	/** @seg: First of possibly many segments */
 	struct data_segment seg;
 } __attribute__((packed));
@@ -287,6 +305,28 @@ _Static_assert(((sizeof(struct data_header) - sizeof(struct data_segment))
 		" data_header length not a multiple of 4 bytes (required "
 		"for TCP/TSO compatibility");
 
+/**
+ * struct homa_ack - Identifies an RPC that can be safely deleted by its
+ * server. After a client has received the entire response for an RPC, it
+ * acks the RPC by sending one of these to the server (piggybacked on an
+ * outgoing GRANT, or in a standalone ACK packet); the server can then
+ * free its state for the RPC immediately, rather than waiting for a
+ * timeout. See homa_peer_add_ack.
+ */
+struct homa_ack {
+	/**
+	 * @id: The id of the RPC, as chosen by its client. 0 means this
+	 * ack is unused.
+	 */
+	__u64 id;
+
+	/** @client_port: The client-side port for the RPC. */
+	__be16 client_port;
+
+	/** @server_port: The server-side port for the RPC. */
+	__be16 server_port;
+} __attribute__((packed));
+
 /**
  * struct grant_header - Wire format for GRANT packets, which are sent by
  * the receiver back to the sender to indicate that the sender may transmit
@@ -310,6 +350,30 @@ struct grant_header {
 	 * with higher offset. Larger numbers indicate higher priorities.
 	 */
 	__u8 priority;
+
+	/**
+	 * @cutoff_version: The current cutoff version at the sender of
+	 * this packet, or 0 if the packet carries no cutoff information.
+	 * Including the cutoffs here lets updates ride on grants, which
+	 * are being sent anyway, rather than requiring standalone CUTOFFS
+	 * packets.
+	 */
+	__be16 cutoff_version;
+
+	/**
+	 * @unsched_cutoffs: priorities to use for unscheduled packets
+	 * sent to the sender of this packet; ignored unless
+	 * @cutoff_version is nonzero. See @homa.unsched_cutoffs for the
+	 * meanings of these values.
+	 */
+	__be32 unsched_cutoffs[HOMA_MAX_PRIORITIES];
+
+	/**
+	 * @ack: If @ack.id is nonzero, identifies an earlier RPC whose
+	 * response has been completely received by the sender of this
+	 * packet; the recipient can free its state for that RPC.
+	 */
+	struct homa_ack ack;
 } __attribute__((packed));
 _Static_assert(sizeof(struct grant_header) <= HOMA_MAX_HEADER,
 		"grant_header too large");
@@ -424,6 +488,36 @@ struct freeze_header {
 _Static_assert(sizeof(struct freeze_header) <= HOMA_MAX_HEADER,
 		"freeze_header too large");
 
+/**
+ * define HOMA_MAX_ACKS - Maximum number of homa_acks that fit in a
+ * single ACK packet (limited by HOMA_MAX_HEADER); also the number of
+ * acks that can be buffered per peer before a standalone ACK packet
+ * must be sent.
+ */
+#define HOMA_MAX_ACKS 4
+
+/**
+ * struct ack_header - Wire format for ACK packets.
+ *
+ * A client sends an ACK packet when it has accumulated more RPC
+ * completions for a server than it can buffer while waiting to
+ * piggyback them on other traffic (see homa_peer_add_ack). The RPC
+ * named by common.id is acked implicitly, in addition to those in
+ * @acks.
+ */
+struct ack_header {
+	/** @common: Fields common to all packet types. */
+	struct common_header common;
+
+	/** @num_acks: Number of valid entries in @acks. */
+	__be16 num_acks;
+
+	/** @acks: RPCs whose server-side state can be freed. */
+	struct homa_ack acks[HOMA_MAX_ACKS];
+} __attribute__((packed));
+_Static_assert(sizeof(struct ack_header) <= HOMA_MAX_HEADER,
+		"ack_header too large");
+
 
 // ---
 
@@ -534,6 +628,45 @@ struct dcacp_grant_header {
 _Static_assert(sizeof(struct dcacp_grant_header) <= HOMA_MAX_HEADER,
 		"dcacp_grant_header too large");
 
+/**
+ * struct homa_pkt_geometry - Describes how an outgoing message will be
+ * divided into packets and sk_buffs. All of the values are derived from
+ * the path MTU of the message's peer and the GSO capabilities of the
+ * device, so jumbo frames automatically produce larger segments and
+ * correspondingly fewer packets. Filled in by homa_pkt_geometry.
+ */
+struct homa_pkt_geometry {
+	/**
+	 * @max_pkt_data: Most message bytes that will fit in a single
+	 * network packet, given the peer's MTU.
+	 */
+	int max_pkt_data;
+
+	/**
+	 * @gso_size: Number of bytes to allocate for each sk_buff (may
+	 * cover several network packets, for GSO/TSO).
+	 */
+	int gso_size;
+
+	/** @max_gso_data: Most message bytes in a single sk_buff. */
+	int max_gso_data;
+
+	/**
+	 * @unscheduled: Bytes of the message that will be sent without
+	 * waiting for grants (the effective RTT-bytes for the peer,
+	 * rounded up to an even number of sk_buffs, but never more than
+	 * the message length).
+	 */
+	int unscheduled;
+
+	/**
+	 * @zcopy: True means message data will be attached to packets
+	 * as pinned user pages rather than copied, which limits each
+	 * sk_buff to a single segment.
+	 */
+	bool zcopy;
+};
+
 /**
  * struct homa_message_out - Describes a message (either request or response)
  * for which this machine is the sender.
@@ -565,10 +698,20 @@ struct homa_message_out {
 	 * entire message has been sent.
 	 */
 	struct sk_buff *next_packet;
-	
+
+	/**
+	 * @init_cycles: Time (in get_cycles units) when this structure
+	 * was initialized; used to measure how long the message's first
+	 * grant takes to arrive (see homa_peer_update_rtt).
+	 */
+	__u64 init_cycles;
+
 	/**
 	 * @unscheduled: Initial bytes of message that we'll send
-	 * without waiting for grants. May be larger than @length;
+	 * without waiting for grants; never larger than @length. This
+	 * is the same value that was advertised to the receiver in the
+	 * incoming fields of the message's packets (see
+	 * homa_pkt_geometry).
 	 */
 	int unscheduled;
 	
@@ -582,11 +725,49 @@ struct homa_message_out {
 	
 	/** @priority: Priority level to use for future scheduled packets. */
 	__u8 sched_priority;
+
+	/**
+	 * @busy_pending: Nonzero means a RESEND for this message was
+	 * declined because we're favoring other traffic (see
+	 * homa_resend_pkt); the next data packet transmitted for the
+	 * message should have its @busy flag set, in lieu of a
+	 * standalone BUSY packet.
+	 */
+	__u8 busy_pending;
+};
+
+/**
+ * struct homa_gap - Represents a contiguous range of bytes that have not
+ * yet been received for an incoming message. Tracking gaps incrementally
+ * allows packets to be added to a message and resend ranges to be
+ * computed without rescanning the message's entire packet list.
+ */
+struct homa_gap {
+	/**
+	 * @links: Used to link this gap into homa_message_in.gaps
+	 * (gaps are kept in increasing order of offset).
+	 */
+	struct list_head links;
+
+	/** @start: Offset of the first missing byte in this gap. */
+	int start;
+
+	/** @end: Offset of the first byte after this gap. */
+	int end;
+
+	/**
+	 * @prev_skb: The packet in homa_message_in.packets containing the
+	 * bytes immediately preceding this gap, or NULL if the gap starts
+	 * at offset 0. A packet whose data falls in this gap is inserted
+	 * just after this packet, which keeps the packet list sorted
+	 * without scanning it.
+	 */
+	struct sk_buff *prev_skb;
 };
 
 /**
  * struct homa_message_in - Holds the state of a message received by
- * this machine; used for both requests and responses. 
+ * this machine; used for both requests and responses.
  */
 struct homa_message_in {
 	/**
@@ -610,6 +791,22 @@ struct homa_message_in {
 	 * @total_length is less than 0.
 	 */
 	int num_skbs;
+
+	/**
+	 * @gaps: Contiguous ranges of bytes that have not yet been
+	 * received, in increasing order of offset. Together the gaps
+	 * account for every byte of the message that is missing.
+	 */
+	struct list_head gaps;
+
+	/**
+	 * @initial_gap: Describes the entire message when it is first
+	 * initialized (nothing has been received); having this structure
+	 * preallocated means homa_message_in_init needn't allocate
+	 * memory. Additional gaps are allocated dynamically when packets
+	 * arrive out of order.
+	 */
+	struct homa_gap initial_gap;
 	
 	/**
 	 * @bytes_remaining: Amount of data for this message that has
@@ -617,13 +814,32 @@ struct homa_message_in {
 	 */
 	int bytes_remaining;
 
+	/**
+	 * @delivered: Number of initial contiguous bytes of the message
+	 * that have already been copied to user space by homa_recv calls
+	 * that specified HOMA_RECV_PARTIAL. Always 0 for messages
+	 * delivered all at once.
+	 */
+	int delivered;
+
         /**
 	 * @incoming: Total # of bytes of the message that the sender will
 	 * transmit without additional grants. Never larger than @total_length.
 	 */
         int incoming;
-	
-	/** @priority: Priority level to include in future GRANTS. */
+
+	/**
+	 * @incoming_sent: The offset in the most recent GRANT packet
+	 * actually transmitted for this message (the initial value is the
+	 * number of unscheduled bytes). May lag @incoming when grants are
+	 * being coalesced; see @homa.grant_coalesce_bytes.
+	 */
+	int incoming_sent;
+
+	/**
+	 * @priority: Priority level in the most recent GRANT packet
+	 * transmitted for this message.
+	 */
 	int priority;
 	
 	/**
@@ -663,31 +879,29 @@ struct homa_interest {
 	
 	/**
 	 * @id: Id of the RPC that was found, or zero if none. This variable
-	 * is used for synchronization, and must be set after the variables
-	 * below it. This variable and the others below are used later to
-	 * look up and lock the RPC. It isn't safe to pass the RPC itself:
-	 * the locking rules create a window where the RPC could be deleted.
+	 * is used for synchronization, and must be set after @rpc. It is
+	 * also used to validate @rpc after locking it, in case the RPC
+	 * was deleted in the meantime.
 	 */
 	atomic_long_t id;
-	
-	/**
-	 * @peer_addr: IP address of the peer for the matching RPC. Valid
-	 * only if @id is nonzero.
-	 */
-	__be32 peer_addr;
-	
+
 	/**
-	 * @peer_port: Port of the peer for the matching RPC. Valid
-	 * only if @id is nonzero.
+	 * @rpc: The RPC that was found. Valid only if @id is nonzero.
+	 * Whoever sets this also acquires a reference on the socket's
+	 * @reap_disable, which keeps the RPC's memory stable (though the
+	 * RPC could still be deleted) until the waiting thread has locked
+	 * the RPC and released the reference; this allows the RPC to be
+	 * locked directly, without another hash-table lookup.
 	 */
-	__u16 peer_port;
-	
+	struct homa_rpc *rpc;
+
 	/**
-	 * @is_client: True means that the matching RPC is a client RPC. Valid
-	 * only if @id is nonzero.
+	 * @flags: Flags from the homa_recv invocation on whose behalf this
+	 * thread is waiting; used to tell whether the thread is willing to
+	 * accept a partial message (HOMA_RECV_PARTIAL).
 	 */
-	bool is_client;
-	
+	int flags;
+
 	/**
 	 * @reg_rpc: RPC whose @interest field points here, or
 	 * NULL if none.
@@ -707,6 +921,63 @@ struct homa_interest {
 	struct list_head response_links;
 };
 
+/**
+ * define HOMA_MAX_COPY_CHUNKS - The maximum number of pieces into which
+ * homa_message_in_copy_parallel will split a message (and hence the
+ * maximum number of cores that will copy a single message concurrently).
+ */
+#define HOMA_MAX_COPY_CHUNKS 8
+
+/**
+ * struct homa_copy_chunk - Describes one contiguous range of an incoming
+ * message that is being copied to user space by a workqueue worker on
+ * behalf of homa_message_in_copy_parallel.
+ */
+struct homa_copy_chunk {
+	/** @work: Used to schedule the copy on @homa.copy_wq. */
+	struct work_struct work;
+
+	/** @msgin: The message being copied. */
+	struct homa_message_in *msgin;
+
+	/**
+	 * @mm: Address space of the receiving application; the worker
+	 * must adopt this before it can copy to user space.
+	 */
+	struct mm_struct *mm;
+
+	/**
+	 * @buf: First byte of the application's buffer for the message
+	 * (not of this chunk: message offsets index directly into it).
+	 */
+	char __user *buf;
+
+	/** @start: Offset within the message of the first byte to copy. */
+	int start;
+
+	/** @end: Offset within the message just after the last byte to copy. */
+	int end;
+
+	/** @err: 0, or a negative errno if the copy failed. */
+	int err;
+
+	/** @done: Signalled once the worker has finished the copy. */
+	struct completion done;
+};
+
+/**
+ * struct homa_skb_reap - Describes a batch of dead packet buffers whose
+ * freeing has been handed off to a workqueue worker by homa_rpc_reap, so
+ * that application threads don't pay the cost of freeing them.
+ */
+struct homa_skb_reap {
+	/** @work: Used to schedule the frees on @homa.reap_wq. */
+	struct work_struct work;
+
+	/** @skbs: Buffers to free, chained through skb->next. */
+	struct sk_buff *skbs;
+};
+
 /**
  * struct homa_rpc - One of these structures exists for each active
  * RPC. The same structure is used to manage both outgoing RPCs on
@@ -757,11 +1028,19 @@ struct homa_rpc {
 	/** @is_client: True means this is a client RPC, false means server. */
 	bool is_client;
 	
-	/** 
+	/**
 	 * @dont_reap: True means data is still being copied out of the
 	 * RPC to a receiver, so it isn't safe to reap it yet.
 	 */
 	bool dont_reap;
+
+	/**
+	 * @grant_in_progress: True means homa_manage_grants is currently
+	 * transmitting a grant for this RPC without holding the grantable
+	 * lock, so it isn't safe to reap the RPC yet. Written only by the
+	 * core that owns homa->grant_active.
+	 */
+	bool grant_in_progress;
 	
 	/**
 	 * @peer: Information about the other machine (the server, if
@@ -823,10 +1102,18 @@ struct homa_rpc {
 	struct homa_interest *interest;
 	
 	/**
-	 * @ready_links: Used to link this object into
-	 * &homa_sock.ready_requests or &homa_sock.ready_responses.
+	 * @ready_links: Used to link this object into the @ready_requests
+	 * or @ready_responses list of one of the shards in
+	 * &homa_sock.ready_shards.
 	 */
 	struct list_head ready_links;
+
+	/**
+	 * @ready_shard: Index (within &homa_sock.ready_shards) of the shard
+	 * whose ready list holds this RPC; valid only while the RPC is
+	 * linked through @ready_links.
+	 */
+	int ready_shard;
 	
 	/**
 	 * @grantable_links: Used to link this RPC into homa->grantable_rpcs.
@@ -834,19 +1121,39 @@ struct homa_rpc {
 	 * list pointing to itself.
 	 */
 	struct list_head grantable_links;
+
+	/**
+	 * @grantable_bucket: If this RPC is linked into homa->grantable_rpcs,
+	 * the index of its entry in homa->grantable_tails (the value is
+	 * computed when the RPC is inserted; bytes_remaining may have
+	 * dropped since then). -1 means the RPC isn't in the list.
+	 */
+	int grantable_bucket;
 	
 	/**
-	 * @throttled_links: Used to link this RPC into homa->throttled_rpcs.
-	 * If this RPC isn't in homa->throttled_rpcs, this is an empty
-	 * list pointing to itself.
+	 * @throttled_links: Used to link this RPC into the throttled_rpcs
+	 * list of its peer's link. If this RPC isn't in a throttled_rpcs
+	 * list, this is an empty list pointing to itself.
 	 */
 	struct list_head throttled_links;
-	
+
 	/**
-	 * DCACP logic: Used to link this RPC into peer->incoming_rpcs if 
-	 * current state is HOMA_INCOMING;
-	 * If this RPC isn't in homa->throttled_rpcs, this is an empty
-	 * list pointing to itself.
+	 * @throttled_stage: Used to link this RPC into the
+	 * throttled_staging list of its peer's link.
+	 */
+	struct llist_node throttled_stage;
+
+	/**
+	 * @stage_pending: Nonzero means this RPC is currently linked into
+	 * a link's throttled_staging list. Modify only while holding the
+	 * RPC's lock.
+	 */
+	atomic_t stage_pending;
+
+	/**
+	 * @peer_links: Used to link this RPC into peer->rpcs, so that
+	 * peer-scoped operations such as homa_peer_abort don't have to
+	 * scan all sockets. Access only while holding peer->lock.
 	 */
 	struct list_head peer_links;
 
@@ -855,12 +1162,42 @@ struct homa_rpc {
 	 * since the last time a packet was received for this RPC.
 	 */
 	int silent_ticks;
-	
+
+	/**
+	 * @timer_tick: Value of homa->timer_ticks the last time
+	 * @silent_ticks was brought up to date; lets homa_timer compute
+	 * elapsed silence without visiting this RPC on every tick.
+	 */
+	__u32 timer_tick;
+
+	/**
+	 * @timer_links: Used to link this RPC into a bucket of
+	 * homa->timer_wheel, so homa_timer can find it when its next
+	 * timeout check is due. Access only while holding
+	 * homa->timer_lock.
+	 */
+	struct list_head timer_links;
+
 	/**
 	 * @num_resends: the number of RESEND requests we have sent since
 	 * the last time we received a packet for this RPC from @peer.
 	 */
 	int num_resends;
+
+	/**
+	 * @start_cycles: time (in get_cycles units) when this RPC was
+	 * created; used to record its latency (see
+	 * homa_record_rpc_latency).
+	 */
+	__u64 start_cycles;
+
+	/**
+	 * @tt_traced: true means timetrace events should be recorded for
+	 * this RPC; false means they are suppressed, because a timetrace
+	 * filter is active and this RPC didn't match it (see
+	 * homa_rpc_tt_filter).
+	 */
+	bool tt_traced;
 };
 
 /**
@@ -887,6 +1224,116 @@ inline static void homa_rpc_unlock(struct homa_rpc *rpc) {
 	spin_unlock_bh(rpc->lock);
 }
 
+/**
+ * define HOMA_RPC_CACHE_SIZE - Maximum number of free homa_rpc structs that
+ * a single core will stash for reuse; any surplus is returned to the
+ * backing kmem_cache.
+ */
+#define HOMA_RPC_CACHE_SIZE 16
+
+/**
+ * struct homa_rpc_cache - A per-core collection of free homa_rpc structs.
+ * A core can allocate from (and free to) its cache without synchronizing
+ * with other cores, so the RPC create/reap cycle normally doesn't touch
+ * the general-purpose allocator. See homa_rpc_alloc and homa_rpc_release.
+ */
+struct homa_rpc_cache {
+	/** @num_rpcs: Number of structs currently stored in @rpcs. */
+	int num_rpcs;
+
+	/** @rpcs: Free structs available for reuse by this core. */
+	struct homa_rpc *rpcs[HOMA_RPC_CACHE_SIZE];
+};
+
+/**
+ * define HOMA_CTL_SKB_POOL_SIZE - Maximum number of control-packet sk_buffs
+ * that a single core will cache for reuse. Must be a power of 2.
+ */
+#define HOMA_CTL_SKB_POOL_SIZE 16
+
+/**
+ * struct homa_ctl_skb_pool - A per-core pool of sk_buffs for outgoing
+ * control packets (GRANT, RESEND, etc.), which are all the same small
+ * size. Recycling them here makes control transmission allocation-free
+ * in the common case; see __homa_xmit_control. The pool is a FIFO ring:
+ * an sk_buff re-enters the pool right after it is handed to the IP stack
+ * (which still holds a reference until transmission completes), and by
+ * the time it cycles back to the head of the ring the transmission has
+ * normally completed, so it can be reused.
+ */
+struct homa_ctl_skb_pool {
+	/** @head: Index in @skbs of the oldest cached sk_buff. */
+	int head;
+
+	/** @count: Number of sk_buffs currently in @skbs. */
+	int count;
+
+	/** @skbs: Circular buffer of cached sk_buffs. */
+	struct sk_buff *skbs[HOMA_CTL_SKB_POOL_SIZE];
+};
+
+/**
+ * define HOMA_DATA_SKB_POOL_SIZE - Maximum number of data-packet sk_buffs
+ * that a single core will cache for reuse. Must be a power of 2.
+ */
+#define HOMA_DATA_SKB_POOL_SIZE 16
+
+/**
+ * struct homa_data_skb_pool - A per-core pool of sk_buffs for outgoing
+ * data packets. All of the buffers in a pool have the same underlying
+ * allocation size (in practice, the GSO batch size for the common path
+ * MTU), so steady-state sends on a core reuse the same warm, node-local
+ * buffers rather than going to the slab allocator for every message.
+ * Like homa_ctl_skb_pool, the pool is a FIFO ring: a buffer enters the
+ * pool while the IP stack may still hold a reference to it, and by the
+ * time it cycles back to the head of the ring its transmission has
+ * normally completed, so it can be reused.
+ */
+struct homa_data_skb_pool {
+	/**
+	 * @size: Aligned data-area size (as returned by skb_end_offset)
+	 * of the sk_buffs cached in this pool. When the pool is empty it
+	 * adopts the size of the next buffer recycled on this core.
+	 */
+	int size;
+
+	/** @head: Index in @skbs of the oldest cached sk_buff. */
+	int head;
+
+	/** @count: Number of sk_buffs currently in @skbs. */
+	int count;
+
+	/** @skbs: Circular buffer of cached sk_buffs. */
+	struct sk_buff *skbs[HOMA_DATA_SKB_POOL_SIZE];
+};
+
+/**
+ * define HOMA_SIZE_HIST_BUCKETS - Number of buckets in a homa_size_hist.
+ * Bucket i counts messages whose length is in [2**i, 2**(i+1)), so 32
+ * buckets cover any possible message length.
+ */
+#define HOMA_SIZE_HIST_BUCKETS 32
+
+/**
+ * define HOMA_CUTOFF_TUNE_MIN_SAMPLES - homa_tune_cutoffs does nothing
+ * unless at least this many incoming messages have been recorded since
+ * the previous recomputation (cutoffs derived from a handful of messages
+ * would be noise).
+ */
+#define HOMA_CUTOFF_TUNE_MIN_SAMPLES 1000
+
+/**
+ * struct homa_size_hist - A histogram of incoming message sizes; each
+ * core has one of these (see @homa_size_hists), so that recording a
+ * message costs a single increment of a core-local counter with no
+ * synchronization. The histograms are aggregated periodically by
+ * homa_tune_cutoffs to recompute the unscheduled priority cutoffs.
+ */
+struct homa_size_hist {
+	/** @counts: Number of incoming messages recorded in each bucket. */
+	__u64 counts[HOMA_SIZE_HIST_BUCKETS];
+};
+
 /**
  * define HOMA_SOCKTAB_BUCKETS - Number of hash buckets in a homa_socktab.
  * Must be a power of 2.
@@ -975,6 +1422,32 @@ struct homa_rpc_bucket {
 	struct hlist_head rpcs;
 };
 
+/**
+ * struct homa_ready_shard - Holds one core's share of the RPCs on a socket
+ * that are ready to be returned to the application. The ready queues are
+ * sharded per core so that the many receiving threads of a busy server
+ * don't all serialize on a single lock: an RPC is queued on the shard for
+ * the core where SoftIRQ processed it, and a receiving thread prefers its
+ * own core's shard (better cache locality), stealing from other shards
+ * when that one is empty.
+ */
+struct homa_ready_shard {
+	/** @lock: Protects the lists below. */
+	struct spinlock lock;
+
+	/**
+	 * @ready_requests: Contains server RPCs in RPC_READY state that
+	 * have not yet been claimed. The head is oldest, i.e. next to return.
+	 */
+	struct list_head ready_requests;
+
+	/**
+	 * @ready_responses: Contains client RPCs in RPC_READY state that
+	 * have not yet been claimed. The head is oldest, i.e. next to return.
+	 */
+	struct list_head ready_responses;
+};
+
 /**
  * struct homa_sock - Information about an open socket.
  */
@@ -983,8 +1456,8 @@ struct homa_sock {
 	struct inet_sock inet;
 	
 	/**
-	 * @lock: Must be held when modifying fields such as interests
-	 * and lists of RPCs. This lock is used in place of sk->sk_lock
+	 * @lock: Must be held when modifying fields such as the lists
+	 * of RPCs. This lock is used in place of sk->sk_lock
 	 * because it's used differently (it's always used as a simple
 	 * spin lock).  See sync.txt for more on Homa's synchronization
 	 * strategy.
@@ -1011,7 +1484,49 @@ struct homa_sock {
 	
 	/** @shutdown: True means the socket is no longer usable. */
 	bool shutdown;
-	
+
+	/**
+	 * @poll_mode: Nonzero means threads receiving on this socket will
+	 * busy-wait for homa->poll_cycles before sleeping; set with the
+	 * HOMA_SO_POLL setsockopt option.
+	 */
+	int poll_mode;
+
+	/**
+	 * @reuseport: Nonzero means this socket is willing to share its
+	 * server port with other sockets that also set this flag; set with
+	 * the HOMA_SO_REUSEPORT setsockopt option, before binding. See
+	 * homa_sock_bind and homa_sock_find_dispatch.
+	 */
+	int reuseport;
+
+	/**
+	 * @region_start: First byte of a receive buffer region registered
+	 * by the application with HOMA_SO_RCVBUF, or NULL if none. The
+	 * region is carved into slots of HOMA_MAX_MESSAGE_LENGTH bytes,
+	 * used to deliver messages for homa_recv calls that specify
+	 * HOMA_RECV_REGION.
+	 */
+	void __user *region_start;
+
+	/** @region_slots: Number of slots in the region; at most 64. */
+	int region_slots;
+
+	/**
+	 * @region_in_use: Bit i is set if slot i of the region currently
+	 * holds a message that the application hasn't yet released with
+	 * HOMAIOCRELEASE. Protected by the socket lock.
+	 */
+	__u64 region_in_use;
+
+	/**
+	 * @event_ctx: Eventfd registered by the application with
+	 * HOMA_SO_EVENTFD, or NULL if none; signaled whenever a complete
+	 * message becomes ready on this socket, so a pipelining client can
+	 * wait for completions without blocking in homa_recv.
+	 */
+	struct eventfd_ctx *event_ctx;
+
 	/**
 	 * @server_port: Port number for receiving incoming RPC requests.
 	 * Must be assigned explicitly with bind; 0 means not bound yet.
@@ -1059,23 +1574,30 @@ struct homa_sock {
 	int dead_skbs;
 	
 	/**
-	 * @ready_requests: Contains server RPCs in RPC_READY state that
-	 * have not yet been claimed. The head is oldest, i.e. next to return.
+	 * @ready_shards: Per-core queues of RPCs that are ready to be
+	 * returned to the application. Each shard is protected by its own
+	 * lock (not the socket lock), so SoftIRQ handlers on different
+	 * cores can queue ready RPCs without contending with each other
+	 * or with other socket operations.
 	 */
-	struct list_head ready_requests;
-	
+	struct homa_ready_shard ready_shards[NR_CPUS];
+
 	/**
-	 * @ready_responses: Contains client RPCs in RPC_READY state that
-	 * have not yet been claimed. The head is oldest, i.e. next to return.
+	 * @interest_lock: Protects @request_interests and @response_interests,
+	 * and also serializes handoffs of RPCs to the threads on those
+	 * lists. A separate lock from @lock because blocking and waking
+	 * receivers shouldn't contend with other socket operations.
 	 */
-	struct list_head ready_responses;
-	
+	struct spinlock interest_lock;
+
 	/**
 	 * @request_interests: List of threads that want to receive incoming
-	 * request messages.
+	 * request messages. Interests are only manipulated when a thread
+	 * blocks or wakes up, so (unlike the ready queues) these lists see
+	 * little contention and aren't sharded.
 	 */
 	struct list_head request_interests;
-	
+
 	/**
 	 * @response_interests: List of threads that want to receive incoming
 	 * response messages.
@@ -1098,14 +1620,24 @@ struct homa_sock {
 };
 
 /**
- * define HOMA_PEERTAB_BUCKETS - Number of bits in the bucket index for a
- * homa_peertab.  Should be large enough to hold an entry for every server
- * in a datacenter without long hash chains.
+ * define HOMA_PEERTAB_MIN_BITS - Number of bits in the bucket index of a
+ * newly created homa_peertab. The table grows as peers accumulate, so
+ * this only needs to cover the common case of talking to a modest
+ * number of peers. Unit tests use a tiny initial size so that table
+ * growth can be exercised with a few peers.
  */
-#define HOMA_PEERTAB_BUCKET_BITS 20
+#ifdef __UNIT_TEST__
+#define HOMA_PEERTAB_MIN_BITS 2
+#else
+#define HOMA_PEERTAB_MIN_BITS 7
+#endif
 
-/** define HOME_PEERTAB_BUCKETS - Number of buckets in a homa_peertab. */
-#define HOMA_PEERTAB_BUCKETS (1 << HOMA_PEERTAB_BUCKET_BITS)
+/**
+ * define HOMA_PEERTAB_MAX_BITS - Upper limit on the number of bits in
+ * the bucket index of a homa_peertab. Should be large enough to hold an
+ * entry for every server in a datacenter without long hash chains.
+ */
+#define HOMA_PEERTAB_MAX_BITS 20
 
 /**
  * struct homa_peertab - A hash table that maps from IPV4 addresses
@@ -1119,21 +1651,76 @@ struct homa_sock {
  */
 struct homa_peertab {
 	/**
-	 * @write_lock: Synchronizes addition of new entries; not needed
-	 * for lookups (RCU is used instead).
+	 * @write_lock: Synchronizes addition of new entries and table
+	 * resizes; not needed for lookups (RCU is used instead).
 	 */
 	struct spinlock write_lock;
-	
+
 	/**
-	 * @buckets: Pointer to heads of chains of homa_peers for each bucket.
-	 * Malloc-ed, and must eventually be freed. NULL means this structure
-	 * has not been initialized.
+	 * @dead_dsts: List of dst_entries that have been replaced by
+	 * homa_dst_check but whose references can't be released yet
+	 * (see homa_peertab_gc_dsts). Protected by @write_lock.
 	 */
-	struct hlist_head *buckets;
-};
+	struct list_head dead_dsts;
 
-/**
- * struct homa_peer - One of these objects exists for each machine that we
+	/**
+	 * @num_peers: Total number of entries in @table; used to decide
+	 * when the table should grow. Protected by @write_lock.
+	 */
+	int num_peers;
+
+	/**
+	 * @table: Current bucket array; replaced with a larger one as
+	 * peers accumulate. NULL means this structure has not been
+	 * initialized. Readers must use rcu_dereference; updates are
+	 * protected by @write_lock.
+	 */
+	struct homa_peertab_buckets __rcu *table;
+};
+
+/**
+ * struct homa_dead_dst - Used to retain dst_entries that are no longer
+ * the cached route for a peer, but which might still be in the process
+ * of being acquired by a sender that read peer->dst before the route
+ * was replaced. Each of these objects holds a reference on its dst,
+ * which is released after a delay by homa_peertab_gc_dsts.
+ */
+struct homa_dead_dst {
+	/** @dst: Reference to a dst that is no longer in use. */
+	struct dst_entry *dst;
+
+	/**
+	 * @gc_jiffies: Time (in jiffies) at which it will be safe to
+	 * release the reference to @dst.
+	 */
+	unsigned long gc_jiffies;
+
+	/** @dst_links: Links this object into @homa_peertab.dead_dsts. */
+	struct list_head dst_links;
+};
+
+/**
+ * struct homa_peertab_buckets - The bucket array for a homa_peertab,
+ * sized separately from the peertab itself so the table can start small
+ * and grow (a new array is published with RCU and the old one is freed
+ * after a grace period).
+ */
+struct homa_peertab_buckets {
+	/** @bucket_bits: log2 of the number of entries in @buckets. */
+	int bucket_bits;
+
+	/** @rcu: Used to free this object after a resize. */
+	struct rcu_head rcu;
+
+	/**
+	 * @buckets: Heads of chains of homa_peers, one for each bucket;
+	 * there are 2^bucket_bits of them.
+	 */
+	struct hlist_head buckets[];
+};
+
+/**
+ * struct homa_peer - One of these objects exists for each machine that we
  * have communicated with (either as client or server). 
  */
 struct homa_peer {
@@ -1148,7 +1735,32 @@ struct homa_peer {
 	 * to this, which we must eventually release.
 	 */
 	struct dst_entry *dst;
-	
+
+	/**
+	 * @dst_check_jiffies: Time in jiffies when we last checked whether
+	 * @dst is still valid; the check is repeated (and @dst replaced,
+	 * if the route has changed) about once a second.
+	 */
+	unsigned long dst_check_jiffies;
+
+	/**
+	 * @link_idx: Used to assign this peer to an egress interface
+	 * (see homa_peer_link); set round-robin when the peer is created,
+	 * so peers spread evenly across interfaces.
+	 */
+	int link_idx;
+
+	/**
+	 * @rtt_bytes: Estimate of the number of bytes we can transmit to
+	 * this peer in the time it takes its first grant for a message to
+	 * arrive; used instead of @homa.rtt_bytes to size unscheduled data
+	 * when @homa.peer_rtt_adapt is set (see homa_pkt_geometry and
+	 * homa_peer_update_rtt). 0 means we haven't yet observed a grant
+	 * from this peer. Updated without synchronization, like
+	 * @unsched_cutoffs, so readers may see a slightly stale value.
+	 */
+	int rtt_bytes;
+
 	/**
 	 * @unsched_cutoffs: priorities to use for unscheduled packets
 	 * sent to this host, as specified in the most recent CUTOFFS
@@ -1178,11 +1790,30 @@ struct homa_peer {
 	 */
 	__u32 last_resend_tick;
 	
+	/** @ack_lock: Must be held when modifying @acks or @num_acks. */
+	struct spinlock ack_lock;
+
 	/**
-	* TODO: DCACP homa_message_in priority queue based on remaining flow size;
-	*/
-	struct list_head incoming_rpcs;
+	 * @acks: Completed RPCs for which this peer was the server, waiting
+	 * to be communicated to the peer so that it can free its state for
+	 * them (see homa_peer_add_ack).
+	 */
+	struct homa_ack acks[HOMA_MAX_ACKS];
+
+	/** @num_acks: Number of entries currently occupied in @acks. */
+	int num_acks;
+
+	/** @lock: Must be held when modifying @rpcs. */
+	struct spinlock lock;
 
+	/**
+	 * @rpcs: All of the active RPCs (both client and server) that
+	 * involve this peer, linked through their peer_links. This makes
+	 * the cost of peer-scoped operations, such as aborting all RPCs
+	 * when the peer dies, proportional to the number of RPCs actually
+	 * affected rather than the total number of RPCs in the system.
+	 */
+	struct list_head rpcs;
 
 	/**
 	 * @peertab_links: Links this object into a bucket of its
@@ -1192,22 +1823,47 @@ struct homa_peer {
 };
 
 #define MAX_DCACP_INCAST_RATIO 50
-/* 
- dcacp rts
+
+/* Number of matching iterations that make up one DCACP epoch. */
+#define DCACP_EPOCH_ITERS 10
+
+/*
+ dcacp rts: one sender that has asked to transmit to this host during the
+ current epoch (src_addr and sport identify the sender; remaining_sz is
+ the number of unsent bytes in its message, in host byte order; addresses
+ are kept in network byte order).
 */
 struct dcacp_rts {
     uint8_t iter;
     uint32_t src_addr;
-    __be64 remaining_sz;
+    __u16 sport;
+    __u64 remaining_sz;
 };
 
 /*
-dcacp grant
+dcacp grant: one receiver that has offered to accept this host's data
+during the current epoch (dst_addr and sport identify the receiver;
+remaining_sz echoes the backlog from our RTS, in host byte order;
+addresses are kept in network byte order).
 */
 struct dcacp_grant {
     bool prompt;
     uint32_t dst_addr;
-    __be64 remaining_sz;
+    __u16 sport;
+    __u64 remaining_sz;
+};
+
+/*
+dcacp core: candidates collected by the packet handlers, which run at
+SoftIRQ level. Each core appends to its own structure without locking;
+dcacp_run_iteration drains all cores into homa->epoch, so the matching
+rounds never add a shared lock to the packet-processing path.
+*/
+struct dcacp_core {
+	int rts_size;
+	struct dcacp_rts rts_q[MAX_DCACP_INCAST_RATIO];
+	int grant_size;
+	struct dcacp_grant grants_q[MAX_DCACP_INCAST_RATIO];
 };
 
 
@@ -1240,9 +1896,141 @@ struct dcacp_epoch {
 	// struct pim_timer_params pim_timer_params;
 	// uint64_t start_cycle;
 };
+/**
+ * define HOMA_GRANTABLE_BUCKETS - Number of entries in the index used
+ * to speed up insertions into homa->grantable_rpcs (see
+ * homa_grantable_bucket).
+ */
+#define HOMA_GRANTABLE_BUCKETS 32
+
+/**
+ * define HOMA_MAX_GRANTS - Maximum number of GRANT packets that a single
+ * pass through homa_manage_grants will send (homa->max_overcommit is
+ * clamped to this when collecting candidates).
+ */
+#define HOMA_MAX_GRANTS 10
+
+/**
+ * define HOMA_LATENCY_SIZE_CLASSES - Number of message size classes for
+ * which separate RPC latency histograms are kept: class 0 is messages
+ * up to 4 KB, class 1 up to 64 KB, class 2 everything larger (matching
+ * the boundaries of small_msg_bytes/medium_msg_bytes/large_msg_bytes).
+ */
+#define HOMA_LATENCY_SIZE_CLASSES 3
+
+/**
+ * define HOMA_LATENCY_HIST_BUCKETS - Number of buckets in each RPC
+ * latency histogram; bucket i counts RPCs whose latency was in
+ * [2**i, 2**(i+1)) microseconds, with the last bucket also absorbing
+ * anything larger.
+ */
+#define HOMA_LATENCY_HIST_BUCKETS 24
+
+/**
+ * define HOMA_MAX_LINKS - Maximum number of egress interfaces (NICs)
+ * that one Homa stack can pace independently.
+ */
+#define HOMA_MAX_LINKS 4
+
+/**
+ * define HOMA_TX_QUEUES - Number of NIC transmit queues modeled by
+ * @link_idle_time in each homa_link. Must be a power of 2.
+ */
+#define HOMA_TX_QUEUES 16
+
+/**
+ * struct homa_link - Pacing state for one egress interface (NIC).
+ * The uplink bandwidth that the pacer protects is a per-interface
+ * resource, so a machine with multiple NICs gets one of these (with
+ * its own throttled queue and pacer thread) per interface; otherwise
+ * a single pacer modeling a single link would cap output at one NIC's
+ * bandwidth. Each peer is bound to one link (see homa_peer_link), so
+ * all of the traffic for a given destination is paced consistently.
+ */
+struct homa_link {
+	/** @homa: The Homa instance this link belongs to. */
+	struct homa *homa;
+
+	/** @id: Index of this link within homa->links. */
+	int id;
+
+	/**
+	 * @throttle_lock: Used to synchronize access to @throttled_rpcs. To
+	 * insert or remove an RPC from throttled_rpcs, must first acquire
+	 * the RPC's socket lock, then this lock.
+	 */
+	struct spinlock throttle_lock;
+
+	/**
+	 * @throttled_rpcs: Contains all homa_rpcs bound to this link that
+	 * have bytes ready for transmission, but which couldn't be sent
+	 * without exceeding the queue limits for transmission. Manipulate
+	 * only with "_rcu" functions.
+	 */
+	struct list_head throttled_rpcs;
+
+	/**
+	 * @throttled_staging: Lock-free list of RPCs that have been passed
+	 * to homa_add_to_throttled but haven't yet been positioned in
+	 * @throttled_rpcs; this allows sending cores to hand RPCs to the
+	 * pacer without acquiring @throttle_lock. Drained (in SRPT order)
+	 * into @throttled_rpcs by homa_throttle_drain_staging.
+	 */
+	struct llist_head throttled_staging;
+
+	/**
+	 * @pacer_kthread: Kernel thread that transmits packets from
+	 * @throttled_rpcs in a way that limits queue buildup in the
+	 * NIC.
+	 */
+	struct task_struct *pacer_kthread;
+
+	/**
+	 * @pacer_exit: true means that the pacer thread should exit as
+	 * soon as possible.
+	 */
+	bool pacer_exit;
+
+	/**
+	 * @pacer_active: synchronization variable: 1 means an instance
+	 * of homa_pacer_xmit is already running for this link, 0 means
+	 * not.
+	 */
+	atomic_t pacer_active;
+
+	/**
+	 * @pacer_hrtimer: Fires when this link's NIC queue is expected to
+	 * have drained enough for the pacer to transmit another packet;
+	 * lets the pacer thread sleep until exactly that time instead of
+	 * busy-waiting.
+	 */
+	struct hrtimer pacer_hrtimer;
+
+	/**
+	 * @pacer_busy_passes: The number of consecutive passes through
+	 * the pacer main loop that found throttled RPCs waiting. Accessed
+	 * only by the pacer thread.
+	 */
+	int pacer_busy_passes;
+
+	/**
+	 * @link_idle_time: One entry per modeled NIC transmit queue; the
+	 * time, measured by get_cycles(), at which we estimate that all of
+	 * the packets we have passed to Linux for transmission on that
+	 * queue will have been transmitted. May be in the past. Modern NICs
+	 * have many transmit queues, and XPS typically assigns a queue per
+	 * core, so we approximate the skb's queue by the sending core (the
+	 * actual queue isn't chosen until ip_queue_xmit). This estimate
+	 * assumes that only Homa is transmitting data, so it could be a
+	 * severe underestimate if there is competing traffic from, say,
+	 * TCP. Access only with atomic ops.
+	 */
+	atomic64_t link_idle_time[HOMA_TX_QUEUES];
+};
+
 /**
  * struct homa - Overall information about the Homa protocol implementation.
- * 
+ *
  * There will typically only exist one of these at a time, except during
  * unit tests.
  */
@@ -1273,8 +2061,18 @@ struct homa {
 	struct dcacp_epoch epoch;
 
 	/**
-	 * TODO: add epoch thread to handle request 
+	 * @dcacp_iter_ticks: how frequently (in units of timer ticks)
+	 * dcacp_run_iteration runs one round of the sender/receiver
+	 * matching protocol. 0 disables the matching engine. Set
+	 * externally via sysctl.
 	 */
+	int dcacp_iter_ticks;
+
+	/**
+	 * @last_dcacp_iter: value of timer_ticks the last time
+	 * dcacp_run_iteration ran.
+	 */
+	__u32 last_dcacp_iter;
 	/**
 	 * @rtt_bytes: A conservative estimate of the amount of data that
 	 * can be sent over the wire in the time it takes to send a full-size
@@ -1285,7 +2083,16 @@ struct homa {
 	 * full-size packets.
 	 */
 	int rtt_bytes;
-	
+
+	/**
+	 * @peer_rtt_adapt: Nonzero means size each outgoing message's
+	 * unscheduled bytes using a per-peer estimate of RTT-bytes,
+	 * learned from how long that peer's grants take to arrive (see
+	 * homa_peer.rtt_bytes); zero means always use @rtt_bytes. Set
+	 * externally via sysctl.
+	 */
+	int peer_rtt_adapt;
+
 	/**
 	 * @link_bandwidth: The raw bandwidth of the network uplink, in
 	 * units of 1e06 bits per second.  Set externally via sysctl.
@@ -1336,19 +2143,111 @@ struct homa {
 	 * next version change.  Can be set externally via sysctl.
 	 */
 	int cutoff_version;
-	
+
+	/**
+	 * @cutoff_tune_ticks: If nonzero, homa_tune_cutoffs recomputes
+	 * @unsched_cutoffs from the observed distribution of incoming
+	 * message sizes every this-many homa_timer ticks, replacing
+	 * whatever an operator configured; 0 means cutoffs change only
+	 * via sysctl. Set externally via sysctl.
+	 */
+	int cutoff_tune_ticks;
+
+	/**
+	 * @cycle_metrics: Nonzero means collect fine-grained cycle counts
+	 * for the stages of the receive path (see the dispatch_*_cycles
+	 * and wait_*_cycles metrics); set externally via sysctl. Off by
+	 * default, since it adds several get_cycles calls per packet to
+	 * the hot path.
+	 */
+	int cycle_metrics;
+
+	/**
+	 * @last_cutoff_tune: The value of @timer_ticks the last time
+	 * homa_tune_cutoffs was invoked.
+	 */
+	__u32 last_cutoff_tune;
+
+	/**
+	 * @prev_size_hist: Aggregate (across all cores) of
+	 * @homa_size_hists as of the last call to homa_tune_cutoffs that
+	 * actually recomputed cutoffs; used to restrict each recomputation
+	 * to messages that arrived since the previous one, so that the
+	 * cutoffs track shifts in the workload.
+	 */
+	__u64 prev_size_hist[HOMA_SIZE_HIST_BUCKETS];
+
 	/**
 	 * @grant_increment: each grant sent by a Homa receiver will allow
 	 * this many additional bytes to be sent by the receiver.
 	 */
 	int grant_increment;
-	
+
+	/**
+	 * @grant_coalesce_bytes: Don't send a GRANT packet for a message
+	 * unless it advances the granted offset at least this many bytes
+	 * beyond the last GRANT actually sent (the grant is accumulated and
+	 * sent later instead). Reduces the rate of control packets during
+	 * incast. Must be less than @rtt_bytes, so that a deferred grant is
+	 * always sent before the sender runs out of granted bytes. Set
+	 * externally via sysctl.
+	 */
+	int grant_coalesce_bytes;
+
 	/**
 	 * @max_overcommit: The maximum number of messages to which Homa will
-	 * send grants at any given point in time.  Set externally via sysctl.
+	 * send grants at any given point in time.  Set externally via sysctl;
+	 * also adjusted automatically by homa_tune_overcommit when
+	 * @overcommit_tune_ticks is nonzero.
 	 */
 	int max_overcommit;
-	
+
+	/**
+	 * @overcommit_tune_ticks: homa_tune_overcommit runs this many timer
+	 * ticks after its last run, adjusting @max_overcommit to match the
+	 * observed behavior of senders. 0 means @max_overcommit is static.
+	 * Set externally via sysctl.
+	 */
+	int overcommit_tune_ticks;
+
+	/**
+	 * @last_overcommit_tune: the value of @timer_ticks the last time
+	 * homa_tune_overcommit ran.
+	 */
+	__u64 last_overcommit_tune;
+
+	/**
+	 * @sched_grant_bytes: total number of bytes of scheduled data that
+	 * have ever been granted (each grant adds the amount by which it
+	 * advanced the granted offset); used by homa_tune_overcommit.
+	 */
+	atomic64_t sched_grant_bytes;
+
+	/**
+	 * @sched_arrival_bytes: total number of bytes of scheduled data that
+	 * have ever arrived in DATA packets; used by homa_tune_overcommit.
+	 */
+	atomic64_t sched_arrival_bytes;
+
+	/**
+	 * @prev_grant_bytes: value of @sched_grant_bytes the last time
+	 * homa_tune_overcommit ran.
+	 */
+	__u64 prev_grant_bytes;
+
+	/**
+	 * @prev_arrival_bytes: value of @sched_arrival_bytes the last time
+	 * homa_tune_overcommit ran.
+	 */
+	__u64 prev_arrival_bytes;
+
+	/**
+	 * @last_tune_cycles: get_cycles() time of the last run of
+	 * homa_tune_overcommit; used to estimate link capacity over the
+	 * measurement interval.
+	 */
+	__u64 last_tune_cycles;
+
 	/**
 	 * @resend_ticks: When an RPC's @silent_ticks reaches this value,
 	 * start sending RESEND requests.
@@ -1382,7 +2281,21 @@ struct homa {
 	 * to reaping RPCs, which is more likely to impact performance.
 	 */
 	int max_dead_buffs;
-	
+
+	/**
+	 * @poll_usecs: Amount of time (in microseconds) that a thread will
+	 * busy-wait in homa_wait_for_message for an incoming message before
+	 * giving up its core and sleeping, if polling has been enabled on
+	 * its socket (see HOMA_SO_POLL). 0 means always sleep immediately.
+	 * Set externally via sysctl.
+	 */
+	int poll_usecs;
+
+	/**
+	 * @poll_cycles: Same as poll_usecs except in get_cycles() units.
+	 */
+	__u64 poll_cycles;
+
 	/**
 	 * @grantable_lock: Used to synchronize access to @grantable_rpcs and
 	 * @num_grantable.
@@ -1399,22 +2312,42 @@ struct homa {
 	
 	/** @num_grantable: The number of messages in grantable_msgs. */
 	int num_grantable;
-	
+
 	/**
-	 * @throttle_lock: Used to synchronize access to @throttled_rpcs. To
-	 * insert or remove an RPC from throttled_rpcs, must first acquire
-	 * the RPC's socket lock, then this lock.
+	 * @grantable_tails: An index into @grantable_rpcs that allows
+	 * insertions to skip directly to the relevant portion of the list,
+	 * rather than scanning it from the front. Entry i points to the
+	 * grantable_links of the last RPC in @grantable_rpcs whose bucket
+	 * (see homa_grantable_bucket) was i when it was inserted, or NULL
+	 * if the list contains no such RPC.
 	 */
-	struct spinlock throttle_lock;
-	
+	struct list_head *grantable_tails[HOMA_GRANTABLE_BUCKETS];
+
 	/**
-	 * @throttled_rpcs: Contains all homa_rpcs that have bytes ready
-	 * for transmission, but which couldn't be sent without exceeding
-	 * the queue limits for transmission. Manipulate only with "_rcu"
-	 * functions.
+	 * @grant_active: synchronization variable: 1 means some core is
+	 * currently sending grants (after releasing @grantable_lock), so
+	 * other cores should skip the grant-sending pass rather than
+	 * waiting their turn; grants will be reconsidered when the next
+	 * data packet arrives.
 	 */
-	struct list_head throttled_rpcs;
+	atomic_t grant_active;
 	
+	/**
+	 * @num_links: Number of entries in @links that are actually in
+	 * use; peers are spread across this many interfaces (see
+	 * homa_peer_link). Must be at least 1 and at most HOMA_MAX_LINKS.
+	 * Set externally via sysctl.
+	 */
+	int num_links;
+
+	/**
+	 * @links: Per-interface pacing state (throttled queue, pacer
+	 * thread, NIC queue estimates); see struct homa_link. All
+	 * HOMA_MAX_LINKS entries are initialized, so @num_links can be
+	 * raised at runtime without creating new threads.
+	 */
+	struct homa_link links[HOMA_MAX_LINKS];
+
 	/**
 	 * @throttle_min_bytes: If a packet has fewer bytes than this, then it
 	 * bypasses the throttle mechanism and is transmitted immediately.
@@ -1426,36 +2359,51 @@ struct homa {
 	 * via sysctl.
 	 */
 	int throttle_min_bytes;
-	
+
 	/**
-	 * @pacer_kthread: Kernel thread that transmits packets from
-	 * throttled_rpcs in a way that limits queue buildup in the
-	 * NIC.
+	 * @zerocopy_min_bytes: An outgoing message with at least this many
+	 * bytes has its data attached to packet buffers by pinning the
+	 * application's pages, rather than copying the data into the
+	 * buffers (for smaller messages the copy is cheaper than pinning).
+	 * When a message is transmitted this way, the application must not
+	 * modify the message buffer until the RPC completes (for clients,
+	 * when the response has been received; for servers, when the reply
+	 * has been sent). 0 means always copy. Set externally via sysctl.
 	 */
-	struct task_struct *pacer_kthread;
-	
+	int zerocopy_min_bytes;
+
 	/**
-	 * @pacer_exit: true means that the pacer thread should exit as
-	 * soon as possible.
+	 * @parallel_copy_bytes: An incoming message larger than this is
+	 * split into chunks of roughly this many bytes, which are copied
+	 * to user space concurrently by workqueue workers (up to
+	 * HOMA_MAX_COPY_CHUNKS of them, including the receiving thread
+	 * itself); for smaller messages the receiving thread does the
+	 * entire copy, since handing off work costs more than it saves.
+	 * 0 means never copy in parallel. Set externally via sysctl.
 	 */
-	bool pacer_exit;
-	
+	int parallel_copy_bytes;
+
 	/**
-	 * @pacer_active: synchronization variable: 1 means an instance
-	 * of homa_pacer_xmit is already running, 0 means not.
+	 * @copy_wq: Workqueue used by homa_message_in_copy_parallel to
+	 * spread the copying of large messages across idle cores.
 	 */
-	atomic_t pacer_active;
-	
+	struct workqueue_struct *copy_wq;
+
 	/**
-	 * @link_idle_time: The time, measured by get_cycles() at which we
-	 * estimate that all of the packets we have passed to Linux for
-	 * transmission will have been transmitted. May be in the past.
-	 * This estimate assumes that only Homa is transmitting data, so
-	 * it could be a severe underestimate if there is competing traffic 
-	 * from, say, TCP. Access only with atomic ops.
+	 * @reap_wq: Workqueue used by homa_rpc_reap to free dead packet
+	 * buffers in the background (see struct homa_skb_reap).
 	 */
-	atomic64_t link_idle_time;
-	
+	struct workqueue_struct *reap_wq;
+
+	/**
+	 * @pacer_spin_threshold: Once a link's pacer_busy_passes reaches
+	 * this value that pacer stops sleeping on its hrtimer and
+	 * busy-waits instead: the throttled queue is persistently
+	 * nonempty, so wakeup latency would leave the link idle. 0 means
+	 * always busy-wait. Set externally via sysctl.
+	 */
+	int pacer_spin_threshold;
+
 	/**
 	 * @max_nic_queue_ns: Limits the NIC queue length: we won't queue
 	 * up a packet for transmission if link_idle_time is this many
@@ -1501,6 +2449,28 @@ struct homa {
 	 * (may wraparound, which is safe).
 	 */
 	uint32_t timer_ticks;
+
+	/**
+	 * @timer_lock: Used to synchronize access to @timer_wheel and to
+	 * the timer_links of RPCs.
+	 */
+	struct spinlock timer_lock;
+
+	/**
+	 * define HOMA_TIMER_WHEEL_SIZE - Number of buckets in @timer_wheel.
+	 * Must be a power of 2. RPCs whose next check is more than this
+	 * many ticks away just get checked early, which is harmless.
+	 */
+#define HOMA_TIMER_WHEEL_SIZE 64
+
+	/**
+	 * @timer_wheel: One bucket for each of the next HOMA_TIMER_WHEEL_SIZE
+	 * ticks; bucket i holds the RPCs whose next timeout check is due at
+	 * tick i (mod HOMA_TIMER_WHEEL_SIZE). This way each tick only has
+	 * to examine the RPCs that may actually be at risk of timeout,
+	 * rather than scanning every active RPC.
+	 */
+	struct list_head timer_wheel[HOMA_TIMER_WHEEL_SIZE];
 	
 	/**
 	 * @metrics_lock: Used to synchronize accesses to @metrics_active_opens
@@ -1536,7 +2506,53 @@ struct homa {
 	 * to trigger various behaviors.
 	 */
 	int flags;
-	
+
+	/**
+	 * @freeze_slo_usecs: latency SLO for each message size class
+	 * (the same classes as client_rpc_latency), in microseconds.
+	 * When an RPC completes after more than its class's threshold,
+	 * the local timetrace is frozen and a FREEZE packet is sent to
+	 * the peer, capturing a two-sided trace of the tail event (see
+	 * homa_check_freeze_slo). 0 means no SLO for that class. Set
+	 * externally via sysctl.
+	 */
+	int freeze_slo_usecs[HOMA_LATENCY_SIZE_CLASSES];
+
+	/**
+	 * @tt_filter_id: if nonzero, trace only RPCs whose (low 32 bits
+	 * of) id matches this value. Set externally via sysctl. The
+	 * tt_filter_* parameters combine as a disjunction: an RPC is
+	 * traced if it matches any of the nonzero ones; if all are zero
+	 * every RPC is traced (the traditional behavior).
+	 */
+	int tt_filter_id;
+
+	/**
+	 * @tt_filter_interval: if nonzero, trace one in this many RPCs,
+	 * regardless of the other filters. Set externally via sysctl.
+	 */
+	int tt_filter_interval;
+
+	/**
+	 * @tt_filter_count: number of RPCs still to be created before
+	 * @tt_filter_interval selects the next sampled one.
+	 */
+	atomic_t tt_filter_count;
+
+	/**
+	 * @tt_filter_min_length: if nonzero, trace only RPCs whose
+	 * request message contains at least this many bytes. Set
+	 * externally via sysctl.
+	 */
+	int tt_filter_min_length;
+
+	/**
+	 * @tt_filter_port: if nonzero, trace only RPCs for which this
+	 * value is the peer's port or one of the local socket's ports.
+	 * Set externally via sysctl.
+	 */
+	int tt_filter_port;
+
 	/**
 	 * @temp: the values in this array can be read and written with sysctl.
 	 * They have no officially defined purpose, and are available for
@@ -1559,7 +2575,8 @@ struct homa {
  */
 #define HOMA_NUM_SMALL_COUNTS 64
 #define HOMA_NUM_MEDIUM_COUNTS 64
-struct homa_metrics {	
+
+struct homa_metrics {
 	/**
 	 * @small_msg_counts: entry i holds the total number of bytes
 	 * received in messages whose length is between 64*i and 64*i + 63,
@@ -1580,7 +2597,28 @@ struct homa_metrics {
 	 * length is 0x100 or greater.
 	 */
 	__u64 large_msg_bytes;
-	
+
+	/**
+	 * @client_rpc_latency: log-scale histograms of end-to-end latency
+	 * for client RPCs (from creation of the RPC until its response
+	 * message was complete), in microseconds, with a separate
+	 * histogram for each response size class. See
+	 * HOMA_LATENCY_SIZE_CLASSES and HOMA_LATENCY_HIST_BUCKETS for the
+	 * class and bucket boundaries.
+	 */
+	__u64 client_rpc_latency[HOMA_LATENCY_SIZE_CLASSES]
+			[HOMA_LATENCY_HIST_BUCKETS];
+
+	/**
+	 * @server_rpc_latency: log-scale histograms of server-side RPC
+	 * latency (from arrival of the first request packet until the
+	 * RPC was freed after its response was transmitted), in
+	 * microseconds, with a separate histogram for each request size
+	 * class.
+	 */
+	__u64 server_rpc_latency[HOMA_LATENCY_SIZE_CLASSES]
+			[HOMA_LATENCY_HIST_BUCKETS];
+
 	/**
 	 * @packets_sent: total number of packets sent for each packet type
 	 * (entry 0 corresponds to DATA, and so on).
@@ -1671,6 +2709,20 @@ struct homa_metrics {
 	 * failed when transmitting a control packet.
 	 */
 	__u64 control_xmit_errors;
+
+	/**
+	 * @control_skbs_reused: total number of control packets that were
+	 * sent using a recycled sk_buff from a homa_ctl_skb_pool, rather
+	 * than a freshly allocated one.
+	 */
+	__u64 control_skbs_reused;
+
+	/**
+	 * @data_skbs_reused: total number of outgoing data packet buffers
+	 * that were allocated from a homa_data_skb_pool, rather than
+	 * freshly allocated.
+	 */
+	__u64 data_skbs_reused;
 	
 	/**
 	 * @data_xmit_errors errors: total number of times ip_queue_xmit
@@ -1799,7 +2851,130 @@ struct homa_metrics {
 	 * reaper_calls is incremented.
 	 */
 	__u64 reaper_dead_skbs;
-	
+
+	/**
+	 * @deferred_skb_frees: total number of dead packet buffers whose
+	 * freeing was handed off to a workqueue worker by homa_rpc_reap,
+	 * rather than being freed inline.
+	 */
+	__u64 deferred_skb_frees;
+
+	/**
+	 * @grant_skips: total number of times homa_manage_grants skipped
+	 * the grant-sending pass because another core was already
+	 * sending grants.
+	 */
+	__u64 grant_skips;
+
+	/**
+	 * @grants_coalesced: total number of times homa_manage_grants
+	 * deferred sending a GRANT packet because it would have advanced
+	 * the granted offset by less than grant_coalesce_bytes.
+	 */
+	__u64 grants_coalesced;
+
+	/**
+	 * @poll_cycles: total time spent busy-waiting for incoming
+	 * messages in homa_wait_for_message, as measured with get_cycles.
+	 */
+	__u64 poll_cycles;
+
+	/* The following metrics break down where receive-path CPU time
+	 * goes; they are collected only when the cycle_metrics sysctl
+	 * value is nonzero.
+	 */
+
+	/**
+	 * @dispatch_lookup_cycles: total time spent by homa_pkt_dispatch
+	 * finding and locking the RPC for an incoming packet, as measured
+	 * with get_cycles.
+	 */
+	__u64 dispatch_lookup_cycles;
+
+	/**
+	 * @dispatch_data_cycles: total time spent by homa_pkt_dispatch
+	 * processing DATA packets (after the RPC lookup), as measured
+	 * with get_cycles.
+	 */
+	__u64 dispatch_data_cycles;
+
+	/**
+	 * @dispatch_grant_cycles: total time spent by homa_pkt_dispatch
+	 * processing GRANT packets (after the RPC lookup), as measured
+	 * with get_cycles.
+	 */
+	__u64 dispatch_grant_cycles;
+
+	/**
+	 * @dispatch_other_cycles: total time spent by homa_pkt_dispatch
+	 * processing packets of all other types (after the RPC lookup),
+	 * as measured with get_cycles.
+	 */
+	__u64 dispatch_other_cycles;
+
+	/**
+	 * @wakeup_cycles: total time spent in homa_rpc_ready queueing
+	 * ready RPCs and waking up waiting threads, as measured with
+	 * get_cycles.
+	 */
+	__u64 wakeup_cycles;
+
+	/**
+	 * @wait_find_cycles: total active time spent by
+	 * homa_wait_for_message locating and claiming a ready RPC (not
+	 * including time spent blocked, polling, or reaping), as measured
+	 * with get_cycles.
+	 */
+	__u64 wait_find_cycles;
+
+	/**
+	 * @wait_reap_cycles: total time spent by homa_wait_for_message
+	 * reaping dead RPCs before blocking, as measured with get_cycles.
+	 */
+	__u64 wait_reap_cycles;
+
+	/**
+	 * @single_pkt_msgs: total number of incoming messages that fit
+	 * entirely in one packet and were handled by the fast path in
+	 * homa_data_pkt_single.
+	 */
+	__u64 single_pkt_msgs;
+
+	/**
+	 * @gro_batched_packets: total number of DATA packets that were
+	 * dispatched as part of a chain of packets for the same RPC
+	 * (sharing a single RPC lock acquisition), not counting the first
+	 * packet of each chain.
+	 */
+	__u64 gro_batched_packets;
+
+	/**
+	 * @parallel_copy_chunks: total number of message chunks that were
+	 * handed to workqueue workers by homa_message_in_copy_parallel
+	 * (not counting the chunk copied by the receiving thread itself).
+	 */
+	__u64 parallel_copy_chunks;
+
+	/**
+	 * @cutoff_retunes: total number of times homa_tune_cutoffs
+	 * recomputed new values for unsched_cutoffs (calls that left the
+	 * cutoffs unchanged are not counted).
+	 */
+	__u64 cutoff_retunes;
+
+	/**
+	 * @overcommit_retunes: total number of times homa_tune_overcommit
+	 * changed the value of max_overcommit.
+	 */
+	__u64 overcommit_retunes;
+
+	/**
+	 * @slo_freezes: total number of times an RPC completion exceeded
+	 * its freeze_slo_usecs threshold, freezing the timetrace (see
+	 * homa_check_freeze_slo).
+	 */
+	__u64 slo_freezes;
+
 	/**
 	 * @temp1: this value, and the others below it, are reserved for
 	 * temporary use during testing.
@@ -1810,6 +2985,47 @@ struct homa_metrics {
 	__u64 temp4;
 };
 
+/* Identifies /proc/net/homa_metrics_bin data; "HOMA" in ASCII. */
+#define HOMA_METRICS_BIN_MAGIC 0x484f4d41
+
+/* Current layout version for /proc/net/homa_metrics_bin; increment
+ * whenever the header below or struct homa_metrics changes in a way
+ * that isn't just appending new counters.
+ */
+#define HOMA_METRICS_BIN_VERSION 1
+
+/**
+ * struct homa_metrics_bin_header - The first bytes returned by reads of
+ * /proc/net/homa_metrics_bin. The header is followed immediately by
+ * @num_cores records, each a raw copy of one core's struct homa_metrics
+ * (core 0 first). Since all counters are free-running, readers can
+ * compute rates by diffing successive reads; no snapshotting is needed.
+ */
+struct homa_metrics_bin_header {
+	/** @magic: always HOMA_METRICS_BIN_MAGIC; identifies the format. */
+	__u32 magic;
+
+	/** @version: layout version (HOMA_METRICS_BIN_VERSION). */
+	__u32 version;
+
+	/** @num_cores: number of per-core records that follow the header. */
+	__u32 num_cores;
+
+	/**
+	 * @record_size: size in bytes of each per-core record (i.e.
+	 * sizeof(struct homa_metrics) in this kernel's build); readers
+	 * must use this as the record stride, so new counters can be
+	 * appended without a version bump.
+	 */
+	__u32 record_size;
+
+	/**
+	 * @cpu_khz: processor clock rate, used to convert the cycle
+	 * counters in the records to time units.
+	 */
+	__u64 cpu_khz;
+};
+
 #define homa_bucket_lock(bucket, type)                      \
 	if (unlikely(!spin_trylock_bh(&bucket->lock))) {    \
 		__u64 start = get_cycles();                 \
@@ -1855,14 +3071,49 @@ static inline int homa_data_offset(struct sk_buff *skb)
 inline static void homa_interest_set(struct homa_interest *interest,
 		struct homa_rpc *rpc)
 {
-	interest->peer_addr = rpc->peer->addr;
-	interest->peer_port = rpc->dport;
-	interest->is_client = rpc->is_client;
-	
+	/* The reference keeps @rpc's memory stable until the waiting
+	 * thread has locked the RPC; the waiter releases the reference
+	 * (see homa_wait_for_message).
+	 */
+	atomic_inc(&rpc->hsk->reap_disable);
+	interest->rpc = rpc;
+
 	/* Must set last for proper synchronization. */
 	atomic_long_set_release(&interest->id, rpc->id);
 }
 
+/**
+ * homa_prefix_end() - Return the offset just after the initial contiguous
+ * range of bytes that have been received for an incoming message (i.e.,
+ * the bytes that could be delivered to an application without waiting
+ * for more packets).
+ * @msgin:   Message of interest; must have been initialized.
+ */
+static inline int homa_prefix_end(struct homa_message_in *msgin)
+{
+	struct homa_gap *gap = list_first_entry_or_null(&msgin->gaps,
+			struct homa_gap, links);
+	return gap ? gap->start : msgin->total_length;
+}
+
+/**
+ * homa_flow_hash() - Compute the hash identifying the "flow" to which an
+ * incoming packet belongs. Each RPC is a distinct flow, so that RPS/RFS
+ * can steer all of an RPC's packets to the core where the results will
+ * be consumed (see homa_gro_complete and homa_steer_flow, which must
+ * compute identical hashes for the same RPC).
+ * @saddr:   Address of the peer that sent (or will send) the packets.
+ * @sport:   Port on @saddr, in network byte order.
+ * @dport:   Local port that the packets target, in network byte order.
+ * @id:      Unique identifier for the RPC.
+ */
+static inline __u32 homa_flow_hash(__be32 saddr, __be16 sport, __be16 dport,
+		__u64 id)
+{
+	return jhash_3words((__u32) saddr, ((__u32) sport << 16) | dport,
+			(__u32) id, 0);
+}
+
 /**
  * homa_next_skb() - Compute address of Homa's private link field in @skb.
  * @skb:     Socket buffer containing private link field.
@@ -1971,28 +3222,156 @@ static inline void homa_grantable_unlock(struct homa *homa) {
 }
 
 /**
- * homa_throttle_lock() - Acquire the throttle lock. If the lock
+ * homa_grantable_bucket() - Compute the entry in homa->grantable_tails
+ * corresponding to a given message size. Buckets are scaled
+ * logarithmically (messages close to completion change buckets quickly,
+ * while the long tail of large messages shares a few buckets), and the
+ * bucket number never decreases as bytes_remaining grows.
+ * @bytes_remaining:  Number of bytes still needed for a message.
+ *
+ * Return:   The index of the bucket for messages with this many
+ *           remaining bytes.
+ */
+static inline int homa_grantable_bucket(int bytes_remaining) {
+	int bucket = fls(bytes_remaining >> 10);
+	if (bucket >= HOMA_GRANTABLE_BUCKETS)
+		bucket = HOMA_GRANTABLE_BUCKETS - 1;
+	return bucket;
+}
+
+/**
+ * homa_throttle_lock() - Acquire a link's throttle lock. If the lock
  * isn't immediately available, record stats on the waiting time.
- * @homa:    Overall data about the Homa protocol implementation.
+ * @link:    The egress interface whose throttled queue is to be locked.
  */
-static inline void homa_throttle_lock(struct homa *homa) {
-	if (!spin_trylock_bh(&homa->throttle_lock)) {
-		homa_throttle_lock_slow(homa);
+static inline void homa_throttle_lock(struct homa_link *link) {
+	if (!spin_trylock_bh(&link->throttle_lock)) {
+		homa_throttle_lock_slow(link);
 	}
 }
 
 /**
- * homa_throttle_unlock() - Release the throttle lock.
+ * homa_throttle_unlock() - Release a link's throttle lock.
+ * @link:    The egress interface whose throttled queue is locked.
+ */
+static inline void homa_throttle_unlock(struct homa_link *link) {
+	spin_unlock_bh(&link->throttle_lock);
+}
+
+/**
+ * homa_tx_idle_time() - Return the idle-time estimate for the NIC
+ * transmit queue that packets sent from this core will use (XPS
+ * typically maps transmit queues to cores, so the sending core is
+ * our best guess at the queue before ip_queue_xmit picks it).
+ * @link:    The egress interface on which transmission will occur.
+ *
+ * Return:   The link_idle_time entry for this core's transmit queue.
+ */
+static inline atomic64_t *homa_tx_idle_time(struct homa_link *link) {
+	return &link->link_idle_time[smp_processor_id()
+			& (HOMA_TX_QUEUES - 1)];
+}
+
+/**
+ * homa_peer_link() - Return the egress interface used for all traffic
+ * to a given peer.
  * @homa:    Overall data about the Homa protocol implementation.
+ * @peer:    The destination of interest.
+ *
+ * Return:   The link over which messages to @peer are transmitted.
  */
-static inline void homa_throttle_unlock(struct homa *homa) {
-	spin_unlock_bh(&homa->throttle_lock);
+static inline struct homa_link *homa_peer_link(struct homa *homa,
+		struct homa_peer *peer) {
+	return &homa->links[peer->link_idx % homa->num_links];
 }
 
 #define INC_METRIC(metric, count) \
 		(homa_metrics[smp_processor_id()]->metric) += (count)
 
 extern struct homa_metrics *homa_metrics[NR_CPUS];
+extern struct homa_rpc_cache homa_rpc_caches[NR_CPUS];
+extern struct homa_ctl_skb_pool homa_ctl_skb_pools[NR_CPUS];
+extern struct homa_data_skb_pool homa_data_skb_pools[NR_CPUS];
+extern struct homa_size_hist homa_size_hists[NR_CPUS];
+extern struct kmem_cache *homa_rpc_slab;
+
+/**
+ * homa_record_message_size() - Count an incoming message in this core's
+ * size histogram (see homa_tune_cutoffs).
+ * @length:   Total number of bytes in the message.
+ */
+static inline void homa_record_message_size(int length)
+{
+	int bucket = (length <= 1) ? 0 : ilog2(length);
+	if (bucket >= HOMA_SIZE_HIST_BUCKETS)
+		bucket = HOMA_SIZE_HIST_BUCKETS - 1;
+	homa_size_hists[smp_processor_id()].counts[bucket]++;
+}
+
+/**
+ * homa_record_rpc_latency() - Count a completed RPC in the appropriate
+ * latency histogram (client_rpc_latency or server_rpc_latency), based
+ * on the time elapsed since the RPC was created and the size of its
+ * incoming message.
+ * @rpc:   The RPC that completed.
+ */
+static inline void homa_record_rpc_latency(struct homa_rpc *rpc)
+{
+	__u64 us = ((get_cycles() - rpc->start_cycles) * 1000) / cpu_khz;
+	int length = rpc->msgin.total_length;
+	int size_class, bucket;
+
+	if (length <= 4096)
+		size_class = 0;
+	else if (length <= 0x10000)
+		size_class = 1;
+	else
+		size_class = 2;
+	bucket = (us <= 1) ? 0 : ilog2(us);
+	if (bucket >= HOMA_LATENCY_HIST_BUCKETS)
+		bucket = HOMA_LATENCY_HIST_BUCKETS - 1;
+	if (rpc->is_client)
+		INC_METRIC(client_rpc_latency[size_class][bucket], 1);
+	else
+		INC_METRIC(server_rpc_latency[size_class][bucket], 1);
+}
+
+/**
+ * tt_record_rpcN(): record a timetrace event concerning a particular RPC,
+ * but only if that RPC is being traced (see homa_rpc_tt_filter). These are
+ * used instead of tt_recordN for per-RPC events, so that a timetrace
+ * filter can reduce the event rate enough for tracing to stay enabled
+ * permanently in production. The format string should include the RPC's
+ * id as one of its arguments, so per-RPC timelines can be extracted from
+ * the trace.
+ * @rpc:       RPC that the event concerns; must not be NULL.
+ *
+ * The remaining arguments are the same as for tt_recordN.
+ */
+static inline void tt_record_rpc4(struct homa_rpc *rpc, const char* format,
+		__u32 arg0, __u32 arg1, __u32 arg2, __u32 arg3)
+{
+	if (rpc->tt_traced)
+		tt_record4(format, arg0, arg1, arg2, arg3);
+}
+static inline void tt_record_rpc3(struct homa_rpc *rpc, const char* format,
+		__u32 arg0, __u32 arg1, __u32 arg2)
+{
+	if (rpc->tt_traced)
+		tt_record3(format, arg0, arg1, arg2);
+}
+static inline void tt_record_rpc2(struct homa_rpc *rpc, const char* format,
+		__u32 arg0, __u32 arg1)
+{
+	if (rpc->tt_traced)
+		tt_record2(format, arg0, arg1);
+}
+static inline void tt_record_rpc1(struct homa_rpc *rpc, const char* format,
+		__u32 arg0)
+{
+	if (rpc->tt_traced)
+		tt_record1(format, arg0);
+}
 
 #ifdef __UNIT_TEST__
 extern void unit_log_printf(const char *separator, const char* format, ...)
@@ -2002,15 +3381,18 @@ extern void unit_log_printf(const char *separator, const char* format, ...)
 #define UNIT_LOG(...)
 #endif
 
+extern void     homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk);
 extern void     homa_add_packet(struct homa_message_in *msgin,
 			struct sk_buff *skb);
 extern void     homa_add_to_throttled(struct homa_rpc *rpc);
 extern void     homa_append_metric(struct homa *homa, const char* format, ...);
 extern int      homa_backlog_rcv(struct sock *sk, struct sk_buff *skb);
 extern int      homa_bind(struct socket *sk, struct sockaddr *addr, int addr_len);
+extern void     homa_check_freeze_slo(struct homa_rpc *rpc);
 extern int      homa_check_timeout(struct homa_rpc *rpc);
 extern void     homa_prios_changed(struct homa *homa);
-extern int      homa_check_nic_queue(struct homa *homa, struct sk_buff *skb,
+extern int      homa_check_nic_queue(struct homa_link *link,
+                    struct sk_buff *skb,
 			bool force);
 extern void     homa_close(struct sock *sock, long timeout);
 extern void     homa_compile_metrics(struct homa_metrics *m);
@@ -2018,11 +3400,20 @@ extern void     homa_cutoffs_pkt(struct sk_buff *skb, struct homa_sock *hsk);
 extern void     homa_data_from_server(struct sk_buff *skb,
 			struct homa_rpc *crpc);
 extern int      homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc);
+extern int      __homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
+			bool send_grants);
+extern int      homa_data_pkt_single(struct sk_buff *skb,
+			struct homa_rpc *rpc);
+extern struct sk_buff
+                *homa_data_skb_alloc(int size);
+extern int      homa_data_skb_recycle(struct sk_buff *skb);
 extern void     homa_destroy(struct homa *homa);
 extern int      homa_diag_destroy(struct sock *sk, int err);
 extern int      homa_disconnect(struct sock *sk, int flags);
 extern int      homa_dointvec(struct ctl_table *table, int write,
 			void __user *buffer, size_t *lenp, loff_t *ppos);
+extern void     homa_dst_check(struct homa_peertab *peertab,
+			struct homa_peer *peer, struct inet_sock *inet);
 extern int     homa_err_handler(struct sk_buff *skb, u32 info);
 extern struct sk_buff
                 *homa_fill_packets(struct homa *homa, struct homa_peer *peer,
@@ -2032,6 +3423,7 @@ extern struct homa_rpc
 extern struct homa_rpc
 	       *homa_find_server_rpc(struct homa_sock *hsk, __be32 saddr,
 			__u16 sport, __u64 id);
+extern void     homa_free_gaps(struct homa_message_in *msgin);
 extern void     homa_free_skbs(struct sk_buff *skb);
 extern int      homa_get_port(struct sock *sk, unsigned short snum);
 extern void     homa_get_resend_range(struct homa_message_in *msgin,
@@ -2046,13 +3438,25 @@ extern int      homa_hash(struct sock *sk);
 extern enum hrtimer_restart
 		homa_hrtimer(struct hrtimer *timer);
 extern int      homa_init(struct homa *homa);
+extern void     homa_insert_grantable(struct homa *homa, struct homa_rpc *rpc);
+extern void     homa_insert_throttled(struct homa_link *link,
+                    struct homa_rpc *rpc);
 extern int      homa_ioc_recv(struct sock *sk, unsigned long arg);
+extern int      homa_ioc_recvmany(struct sock *sk, unsigned long arg);
+extern int      homa_ioc_release(struct sock *sk, unsigned long arg);
 extern int      homa_ioc_reply(struct sock *sk, unsigned long arg);
+extern int      homa_ioc_replymany(struct sock *sk, unsigned long arg);
 extern int      homa_ioc_send(struct sock *sk, unsigned long arg);
+extern int      homa_ioc_sendmany(struct sock *sk, unsigned long arg);
 extern int      homa_ioctl(struct sock *sk, int cmd, unsigned long arg);
 extern void     homa_manage_grants(struct homa *homa, struct homa_rpc *rpc);
 extern int      homa_message_in_copy_data(struct homa_message_in *msgin,
 			struct iov_iter *iter, int max_bytes);
+extern int      homa_message_in_copy_parallel(struct homa *homa,
+			struct homa_message_in *msgin, char __user *buf,
+			int max_bytes);
+extern int      homa_message_in_copy_partial(struct homa_message_in *msgin,
+			struct iov_iter *iter, int offset, int end);
 extern void     homa_message_in_destroy(struct homa_message_in *msgin);
 extern void     homa_message_in_init(struct homa_message_in *msgin, int length,
 			int incoming);
@@ -2060,6 +3464,8 @@ extern void     homa_message_out_destroy(struct homa_message_out *msgout);
 extern void     homa_message_out_init(struct homa_rpc *rpc, int sport,
 			struct sk_buff *skb, int len);
 extern int      homa_message_out_reset(struct homa_rpc *rpc);
+extern ssize_t  homa_metrics_bin_read(struct file *file, char __user *buffer,
+			size_t length, loff_t *offset);
 extern int      homa_metrics_open(struct inode *inode, struct file *file);
 extern ssize_t  homa_metrics_read(struct file *file, char __user *buffer,
 			size_t length, loff_t *offset);
@@ -2067,18 +3473,31 @@ extern int      homa_metrics_release(struct inode *inode, struct file *file);
 extern int      homa_offload_end(void);
 extern int      homa_offload_init(void);
 extern void     homa_outgoing_sysctl_changed(struct homa *homa);
-extern int      homa_pacer_main(void *transportInfo);
+extern enum hrtimer_restart
+                homa_pacer_hrtimer(struct hrtimer *timer);
+extern int      homa_pacer_main(void *linkInfo);
 extern void     homa_pacer_stop(struct homa *homa);
-extern void     homa_pacer_xmit(struct homa *homa);
+extern void     homa_pacer_xmit(struct homa_link *link);
 extern void     homa_peer_abort(struct homa *homa, __be32 addr, int error);
+extern void     homa_peer_add_ack(struct homa_rpc *rpc);
+extern int      homa_peer_get_acks(struct homa_peer *peer, int count,
+			struct homa_ack *dst);
 extern void     homa_peertab_destroy(struct homa_peertab *peertab);
+extern void     homa_peertab_gc_dsts(struct homa_peertab *peertab,
+			unsigned long now);
 extern int      homa_peertab_init(struct homa_peertab *peertab);
 extern struct homa_peer
                *homa_peer_find(struct homa_peertab *peertab, __be32 addr,
 			struct inet_sock *inet);
+extern struct homa_peer
+               *homa_peer_lookup(struct homa_peertab *peertab, __be32 addr);
 extern void     homa_peer_set_cutoffs(struct homa_peer *peer, int c0, int c1,
 			int c2, int c3, int c4, int c5, int c6, int c7);
+extern void     homa_peer_update_rtt(struct homa *homa,
+			struct homa_peer *peer, __u64 elapsed_cycles);
 extern void     homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk);
+extern void     homa_pkt_geometry(struct homa *homa, struct homa_peer *peer,
+			size_t len, struct homa_pkt_geometry *geo);
 extern int      homa_pkt_recv(struct sk_buff *skb);
 extern __poll_t homa_poll(struct file *file, struct socket *sock,
 			struct poll_table_struct *wait);
@@ -2089,17 +3508,26 @@ extern char    *homa_print_packet_short(struct sk_buff *skb, char *buffer,
 			int buf_len);
 extern int      homa_proc_read_metrics(char *buffer, char **start, off_t offset,
 			int count, int *eof, void *data);
+extern int      homa_recv_common(struct homa_sock *hsk,
+			struct homa_args_recv_ipv4 __user *uargs,
+			int extra_flags);
 extern int      homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len,
 			int noblock, int flags, int *addr_len);
 extern void     homa_rehash(struct sock *sk);
 extern void     homa_remove_from_grantable(struct homa *homa,
 			struct homa_rpc *rpc);
+extern int      homa_reply_common(struct homa_sock *hsk,
+			struct homa_args_reply_ipv4 *args);
 extern void     homa_resend_data(struct homa_rpc *rpc, int start, int end,
 			int priority);
 extern void     homa_resend_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 			struct homa_sock *hsk);
 extern void     homa_restart_pkt(struct sk_buff *skb, struct homa_rpc *rpc);
 extern void     homa_rpc_abort(struct homa_rpc *crpc, int error);
+extern void     homa_rpc_acked(struct homa_sock *hsk, __be32 saddr,
+			struct homa_ack *ack);
+extern struct homa_rpc
+               *homa_rpc_alloc(void);
 extern void     homa_rpc_free(struct homa_rpc *rpc);
 extern void     homa_rpc_free_rcu(struct rcu_head *rcu_head);
 extern struct homa_rpc
@@ -2108,14 +3536,23 @@ extern struct homa_rpc
 extern struct homa_rpc
                *homa_rpc_new_server(struct homa_sock *hsk, __be32 source,
 			struct data_header *h);
+extern void     homa_rpc_partial_ready(struct homa_rpc *rpc);
 extern void     homa_rpc_ready(struct homa_rpc *rpc);
 extern int      homa_rpc_reap(struct homa_sock *hsk);
+extern void     homa_rpc_release(struct homa_rpc *rpc);
+extern void     homa_rpc_tt_filter(struct homa *homa, struct homa_rpc *rpc,
+			int length);
+extern int      homa_send_common(struct homa_sock *hsk,
+			struct homa_args_send_ipv4 *args,
+			__u64 __user *user_id);
 extern int      homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t len);
 extern int      homa_sendpage(struct sock *sk, struct page *page, int offset,
 			size_t size, int flags);
 extern int      homa_setsockopt(struct sock *sk, int level, int optname,
 			char __user *optval, unsigned int optlen);
 extern int      homa_shutdown(struct socket *sock, int how);
+extern int      homa_skb_fill_user_pages(struct sk_buff *skb,
+			char __user *buffer, int length);
 extern int      homa_snprintf(char *buffer, int size, int used,
 			const char* format, ...)
 			__attribute__((format(printf, 4, 5)));
@@ -2124,7 +3561,14 @@ extern int      homa_sock_bind(struct homa_socktab *socktab,
 extern void     homa_sock_destroy(struct homa_sock *hsk);
 extern struct homa_sock *
 	        homa_sock_find(struct homa_socktab *socktab, __u16 port);
+extern struct homa_sock *
+	        homa_sock_find_dispatch(struct homa_socktab *socktab,
+			__u16 port, __be32 saddr, __u64 id);
 extern void     homa_sock_init(struct homa_sock *hsk, struct homa *homa);
+extern void __user
+               *homa_sock_region_alloc(struct homa_sock *hsk);
+extern int      homa_sock_region_release(struct homa_sock *hsk,
+			void __user *addr);
 extern void     homa_sock_shutdown(struct homa_sock *hsk);
 extern int      homa_socket(struct sock *sk);
 extern void     homa_socktab_destroy(struct homa_socktab *socktab);
@@ -2135,11 +3579,18 @@ extern struct homa_sock
                *homa_socktab_start_scan(struct homa_socktab *socktab,
 			struct homa_socktab_scan *scan);
 extern void     homa_spin(int usecs);
+extern void     homa_steer_flow(struct homa_sock *hsk, struct homa_rpc *rpc);
 extern char    *homa_symbol_for_state(struct homa_rpc *rpc);
 extern char    *homa_symbol_for_type(uint8_t type);
 extern void     homa_tasklet_handler(unsigned long data);
+extern void     homa_throttle_drain_staging(struct homa_link *link);
 extern void	homa_timer(struct homa *homa);
+extern void     homa_timer_schedule(struct homa *homa, struct homa_rpc *rpc,
+			__u32 tick);
+extern void     homa_tune_cutoffs(struct homa *homa);
+extern void     homa_tune_overcommit(struct homa *homa);
 extern void     homa_unhash(struct sock *sk);
+extern void     homa_unlink_grantable(struct homa *homa, struct homa_rpc *rpc);
 extern int      homa_unsched_priority(struct homa *homa,
 			struct homa_peer *peer, int length);
 extern int      homa_v4_early_demux(struct sk_buff *skb);
@@ -2160,10 +3611,15 @@ extern void     __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc,
 /*
   DCACP logic
 */
-extern void dcacp_notification_pkt(struct sk_buff *skb);
-extern void dcacp_rts_pkt(struct sk_buff *skb);
-extern void dcacp_grant_pkt(struct sk_buff* skb);
-extern void dcacp_accept_pkt(struct sk_buff* skb);
+extern void dcacp_accept_pkt(struct sk_buff *skb, struct homa_sock *hsk);
+extern void dcacp_epoch_init(struct homa *homa);
+extern void dcacp_grant_pkt(struct sk_buff *skb, struct homa_sock *hsk);
+extern void dcacp_notification_pkt(struct sk_buff *skb,
+		struct homa_sock *hsk);
+extern void dcacp_rts_pkt(struct sk_buff *skb, struct homa_sock *hsk);
+extern void dcacp_run_iteration(struct homa *homa);
+
+extern struct dcacp_core dcacp_cores[NR_CPUS];
 
 
 
@@ -2179,13 +3635,20 @@ extern void dcacp_accept_pkt(struct sk_buff* skb);
  */
 static inline void check_pacer(struct homa *homa, int softirq)
 {
-	if (list_first_or_null_rcu(&homa->throttled_rpcs,
-			struct homa_rpc, throttled_links) == NULL)
-		return;
-	if ((get_cycles() + homa->max_nic_queue_cycles) <
-			atomic64_read(&homa->link_idle_time))
-		return;
-	homa_pacer_xmit(homa);
+	int i;
+
+	for (i = 0; i < homa->num_links; i++) {
+		struct homa_link *link = &homa->links[i];
+
+		if ((list_first_or_null_rcu(&link->throttled_rpcs,
+				struct homa_rpc, throttled_links) == NULL)
+				&& llist_empty(&link->throttled_staging))
+			continue;
+		if ((get_cycles() + homa->max_nic_queue_cycles) <
+				atomic64_read(homa_tx_idle_time(link)))
+			continue;
+		homa_pacer_xmit(link);
+	}
 }
 
 #endif /* _HOMA_IMPL_H */
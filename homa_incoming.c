@@ -31,10 +31,19 @@ void homa_message_in_init(struct homa_message_in *msgin, int length,
 	msgin->total_length = length;
 	skb_queue_head_init(&msgin->packets);
 	msgin->num_skbs = 0;
+	INIT_LIST_HEAD(&msgin->gaps);
+	if (length > 0) {
+		msgin->initial_gap.start = 0;
+		msgin->initial_gap.end = length;
+		msgin->initial_gap.prev_skb = NULL;
+		list_add(&msgin->initial_gap.links, &msgin->gaps);
+	}
 	msgin->bytes_remaining = length;
+	msgin->delivered = 0;
 	msgin->incoming = incoming;
 	if (msgin->incoming > msgin->total_length)
 		msgin->incoming = msgin->total_length;
+	msgin->incoming_sent = msgin->incoming;
 	msgin->priority = 0;
 	msgin->scheduled = length > incoming;
 	msgin->possibly_in_grant_queue = msgin->scheduled;
@@ -45,6 +54,7 @@ void homa_message_in_init(struct homa_message_in *msgin, int length,
 	} else {
 		INC_METRIC(large_msg_bytes, length);
 	}
+	homa_record_message_size(length);
 }
 
 /**
@@ -59,9 +69,26 @@ void homa_message_in_destroy(struct homa_message_in *msgin)
 	skb_queue_walk_safe(&msgin->packets, skb, next)
 		kfree_skb(skb);
 	__skb_queue_head_init(&msgin->packets);
+	homa_free_gaps(msgin);
 	msgin->total_length = -1;
 }
 
+/**
+ * homa_free_gaps() - Release all of the gaps in an incoming message
+ * (such as when the message is complete or its RPC is being destroyed).
+ * @msgin:       Message of interest; must have been initialized.
+ */
+void homa_free_gaps(struct homa_message_in *msgin)
+{
+	while (!list_empty(&msgin->gaps)) {
+		struct homa_gap *gap = list_first_entry(&msgin->gaps,
+				struct homa_gap, links);
+		list_del(&gap->links);
+		if (gap != &msgin->initial_gap)
+			kfree(gap);
+	}
+}
+
 /**
  * homa_add_packet() - Add an incoming packet to the contents of a
  * partially received message.
@@ -74,53 +101,82 @@ void homa_add_packet(struct homa_message_in *msgin, struct sk_buff *skb)
 {
 	struct data_header *h = (struct data_header *) skb->data;
 	int offset = ntohl(h->seg.offset);
-	int data_bytes = ntohl(h->seg.segment_length);
-	struct sk_buff *skb2;
-	
-	/* Any data from the packet with offset less than this is
-	 * of no value.*/
-	int floor = 0;
-	
-	/* Any data with offset >= this is useless. */
-	int ceiling = msgin->total_length;
-	
-	/* Figure out where in the list of existing packets to insert the
-	 * new one. It doesn't necessarily go at the end, but it almost
-	 * always will in practice, so work backwards from the end of the
-	 * list.
+	int end = offset + ntohl(h->seg.segment_length);
+	struct homa_gap *gap;
+	struct sk_buff *prev_skb;
+
+	/* Find the gap containing this packet's data. The gaps account
+	 * for every byte of the message that hasn't been received, so if
+	 * no gap overlaps the packet then the packet is redundant. In the
+	 * common case of in-order arrival the packet falls in the last
+	 * gap, so search backwards.
 	 */
-	skb_queue_reverse_walk(&msgin->packets, skb2) {
-		struct data_header *h2 = (struct data_header *) skb2->data;
-		int offset2 = ntohl(h2->seg.offset);
-		int data_bytes2 = skb2->len - sizeof32(struct data_header);
-		if (offset2 < offset) {
-			floor = offset2 + data_bytes2;
+	list_for_each_entry_reverse(gap, &msgin->gaps, links) {
+		if (gap->end <= offset) {
+			/* All remaining gaps precede the packet. */
 			break;
 		}
-		ceiling = offset2;
-	} 
-		
-	/* New packet goes right after skb2 (which may refer to the header).
-	 * Packets shouldn't overlap in byte ranges, but the code below
-	 * assumes they might, so it computes how many non-overlapping bytes
-	 * are contributed by the new packet.
-	 */
-	if (unlikely(floor < offset)) {
-		floor = offset;
-	}
-	if (ceiling > offset + data_bytes) {
-		ceiling = offset + data_bytes;
+		if (gap->start < end)
+			goto found;
 	}
-	if (floor >= ceiling) {
-		/* This packet is redundant. */
-//		char buffer[100];
-//		printk(KERN_NOTICE "redundant Homa packet: %s\n",
-//			homa_print_packet(skb, buffer, sizeof(buffer)));
-		kfree_skb(skb);
-		return;
+
+	/* This packet is redundant. */
+//	char buffer[100];
+//	printk(KERN_NOTICE "redundant Homa packet: %s\n",
+//		homa_print_packet(skb, buffer, sizeof(buffer)));
+	kfree_skb(skb);
+	return;
+
+    found:
+	/* Packets shouldn't overlap in byte ranges, but the code below
+	 * assumes they might, so it clamps the packet's range to the gap
+	 * in order to count only the bytes the packet actually contributes.
+	 */
+	if (unlikely(offset < gap->start))
+		offset = gap->start;
+	if (end > gap->end)
+		end = gap->end;
+	prev_skb = gap->prev_skb;
+
+	/* Update the gap to reflect the new data. */
+	if ((offset > gap->start) && (end < gap->end)) {
+		/* Data in the middle of the gap: the gap must split in
+		 * two. If there is no memory for the new gap, drop the
+		 * packet (the sender will eventually retransmit it).
+		 */
+		struct homa_gap *gap2 = kmalloc(sizeof(*gap2), GFP_ATOMIC);
+		if (unlikely(!gap2)) {
+			kfree_skb(skb);
+			return;
+		}
+		gap2->start = end;
+		gap2->end = gap->end;
+		gap2->prev_skb = skb;
+		gap->end = offset;
+		list_add(&gap2->links, &gap->links);
+	} else if (offset == gap->start) {
+		gap->start = end;
+		gap->prev_skb = skb;
+		if (gap->start >= gap->end) {
+			/* The packet fills the gap completely. */
+			list_del(&gap->links);
+			if (gap != &msgin->initial_gap)
+				kfree(gap);
+		}
+	} else {
+		/* Data at the end of the gap. */
+		gap->end = offset;
 	}
-	__skb_insert(skb, skb2, skb2->next, &msgin->packets);
-	msgin->bytes_remaining -= (ceiling - floor);
+
+	/* Insert the packet just after the packet preceding its gap;
+	 * there are no packets in between, so this keeps the list sorted
+	 * by offset.
+	 */
+	if (prev_skb)
+		__skb_insert(skb, prev_skb, prev_skb->next, &msgin->packets);
+	else
+		__skb_queue_head(&msgin->packets, skb);
+	msgin->bytes_remaining -= (end - offset);
 	msgin->num_skbs++;
 }
 
@@ -177,6 +233,175 @@ int homa_message_in_copy_data(struct homa_message_in *msgin,
 	return max_bytes - remaining;
 }
 
+/**
+ * homa_message_in_copy_partial() - Copy a contiguous range of an incoming
+ * message to buffer(s) in user space; used by HOMA_RECV_PARTIAL to deliver
+ * prefixes of a message before the message is complete.
+ * @msgin:      The message whose data should be extracted.
+ * @iter:       Describes the available buffer space at user-level; message
+ *              data gets copied here.
+ * @offset:     Offset within the message of the first byte to copy.
+ * @end:        Offset just after the last byte to copy. The caller must
+ *              have chosen @offset and @end while holding the RPC's lock,
+ *              such that every byte in the range had already been
+ *              received; this guarantees that the copy only touches
+ *              packets that were fully linked into @msgin->packets at
+ *              that point, so it is safe to copy without the RPC's lock
+ *              even while new packets are arriving for the message.
+ *
+ * Return:      The number of bytes copied, or a negative errno.
+ */
+int homa_message_in_copy_partial(struct homa_message_in *msgin,
+		struct iov_iter *iter, int offset, int end)
+{
+	struct sk_buff *skb;
+	int copied = 0;
+
+	skb_queue_walk(&msgin->packets, skb) {
+		struct data_header *h = (struct data_header *) skb->data;
+		int pkt_offset = ntohl(h->seg.offset);
+		int pkt_bytes = skb->len - sizeof32(struct data_header);
+		int from, to, err;
+
+		if (pkt_offset >= end)
+			break;
+		from = (offset > pkt_offset) ? offset : pkt_offset;
+		to = pkt_offset + pkt_bytes;
+		if (to > end)
+			to = end;
+		if (to <= from)
+			continue;
+		err = skb_copy_datagram_iter(skb, sizeof32(struct data_header)
+				+ (from - pkt_offset), iter, to - from);
+		if (err)
+			return err;
+		copied += to - from;
+		offset = to;
+
+		/* Must stop before stepping past the last packet in the
+		 * range: packets beyond it may be getting linked in
+		 * concurrently (see above).
+		 */
+		if (offset >= end)
+			break;
+	}
+	return copied;
+}
+
+/**
+ * homa_message_in_copy_range() - Copy one contiguous range of a complete
+ * incoming message to user space, addressing the user buffer directly
+ * (rather than through a caller-supplied iterator, as the functions
+ * above do). Used for the pieces of a parallel copy.
+ * @msgin:   The message whose data should be extracted.
+ * @buf:     First byte of the user-space buffer for the entire message.
+ * @start:   Offset within the message of the first byte to copy.
+ * @end:     Offset within the message just after the last byte to copy.
+ *
+ * Return:   0 on success, or a negative errno.
+ */
+static int homa_message_in_copy_range(struct homa_message_in *msgin,
+		char __user *buf, int start, int end)
+{
+	struct iovec iov;
+	struct iov_iter iter;
+	int err;
+
+	err = import_single_range(READ, buf + start, end - start, &iov,
+			&iter);
+	if (err)
+		return err;
+	err = homa_message_in_copy_partial(msgin, &iter, start, end);
+	return (err < 0) ? err : 0;
+}
+
+/**
+ * homa_copy_worker() - Workqueue callback that copies one chunk of an
+ * incoming message to user space on behalf of
+ * homa_message_in_copy_parallel.
+ * @work:    Embedded in the struct homa_copy_chunk describing the copy.
+ */
+static void homa_copy_worker(struct work_struct *work)
+{
+	struct homa_copy_chunk *chunk = container_of(work,
+			struct homa_copy_chunk, work);
+
+	/* The worker runs in a kernel thread with no address space of
+	 * its own; adopt the receiving application's so that we can
+	 * write its buffer.
+	 */
+	use_mm(chunk->mm);
+	chunk->err = homa_message_in_copy_range(chunk->msgin, chunk->buf,
+			chunk->start, chunk->end);
+	unuse_mm(chunk->mm);
+	complete(&chunk->done);
+}
+
+/**
+ * homa_message_in_copy_parallel() - Extract the data from a complete
+ * incoming message and copy it to user space, farming most of the work
+ * out to workqueue workers so that several cores copy concurrently.
+ * For multi-megabyte messages this is the difference between a receive
+ * limited by one core's memcpy bandwidth and one limited by memory
+ * bandwidth.
+ * @homa:       Overall information about the Homa transport.
+ * @msgin:      The message whose data should be extracted; must be
+ *              complete (no new packets arriving), since the workers
+ *              traverse @msgin->packets without synchronization.
+ * @buf:        User-space buffer in which to store the message.
+ * @max_bytes:  Total amount of space available at @buf.
+ *
+ * Return:      The number of bytes copied, or a negative errno.
+ */
+int homa_message_in_copy_parallel(struct homa *homa,
+		struct homa_message_in *msgin, char __user *buf,
+		int max_bytes)
+{
+	struct homa_copy_chunk chunks[HOMA_MAX_COPY_CHUNKS];
+	int length = msgin->total_length;
+	int num_chunks, chunk_bytes, offset, err, i;
+
+	if (length > max_bytes)
+		length = max_bytes;
+	num_chunks = DIV_ROUND_UP(length, homa->parallel_copy_bytes);
+	if (num_chunks > HOMA_MAX_COPY_CHUNKS)
+		num_chunks = HOMA_MAX_COPY_CHUNKS;
+	if (num_chunks < 1)
+		num_chunks = 1;
+	chunk_bytes = DIV_ROUND_UP(length, num_chunks);
+
+	/* Hand out all of the chunks except the first, then copy that
+	 * one ourselves: no point in this thread just twiddling its
+	 * thumbs while the workers run.
+	 */
+	offset = chunk_bytes;
+	for (i = 1; i < num_chunks; i++) {
+		struct homa_copy_chunk *chunk = &chunks[i];
+		chunk->msgin = msgin;
+		chunk->mm = current->mm;
+		chunk->buf = buf;
+		chunk->start = offset;
+		chunk->end = offset + chunk_bytes;
+		if (chunk->end > length)
+			chunk->end = length;
+		chunk->err = 0;
+		init_completion(&chunk->done);
+		INIT_WORK(&chunk->work, homa_copy_worker);
+		queue_work(homa->copy_wq, &chunk->work);
+		offset = chunk->end;
+		INC_METRIC(parallel_copy_chunks, 1);
+	}
+	err = homa_message_in_copy_range(msgin, buf, 0, chunk_bytes);
+	for (i = 1; i < num_chunks; i++) {
+		wait_for_completion(&chunks[i].done);
+		if (chunks[i].err && !err)
+			err = chunks[i].err;
+	}
+	if (err)
+		return err;
+	return length;
+}
+
 /**
  * homa_get_resend_range() - Given a message for which some input data
  * is missing, find the first range of missing data.
@@ -188,11 +413,9 @@ int homa_message_in_copy_data(struct homa_message_in *msgin,
 void homa_get_resend_range(struct homa_message_in *msgin,
 		struct resend_header *resend)
 {
-	struct sk_buff *skb;
-	int missing_bytes;
-	/* This will eventually be the top of the first missing range. */
-	int end_offset;
-	
+	struct homa_gap *gap;
+	int end;
+
 	if (msgin->total_length < 0) {
 		/* Haven't received any data for this message; request
 		 * retransmission of just the first packet (the sender
@@ -203,42 +426,31 @@ void homa_get_resend_range(struct homa_message_in *msgin,
 		resend->length = htonl(100);
 		return;
 	}
-	
-	missing_bytes = msgin->bytes_remaining
-			- (msgin->total_length - msgin->incoming);
-	end_offset = msgin->incoming;
-	
-	/* Basic idea: walk backwards through the message's packets until
-	 * we have accounted for all missing bytes; this will identify
-	 * the first missing range.
+
+	/* The first gap in the message is the first missing range; limit
+	 * the request to granted bytes (the sender isn't expected to have
+	 * transmitted anything past msgin->incoming).
 	 */
-	skb_queue_reverse_walk(&msgin->packets, skb) {
-		struct data_header *h = (struct data_header *) skb->data;
-		int offset = ntohl(h->seg.offset);
-		int pkt_length = ntohl(h->seg.segment_length);
-		int gap;
-
-		if (pkt_length > (msgin->total_length - offset))
-			pkt_length = msgin->total_length - offset;
-		gap = end_offset - (offset + pkt_length);
-		missing_bytes -= gap;
-		if (missing_bytes == 0) {
-			resend->offset = htonl(offset + pkt_length);
-			resend->length = htonl(gap);
-			return;
-		}
-		end_offset = offset;
+	gap = list_first_entry_or_null(&msgin->gaps, struct homa_gap, links);
+	if ((gap == NULL) || (gap->start >= msgin->incoming)) {
+		/* No granted data is missing. */
+		resend->offset = htonl(msgin->incoming);
+		resend->length = 0;
+		return;
 	}
-	
-	/* The first packet(s) are missing. */
-	resend->offset = 0;
-	resend->length = htonl(missing_bytes);
+	end = (gap->end < msgin->incoming) ? gap->end : msgin->incoming;
+	resend->offset = htonl(gap->start);
+	resend->length = htonl(end - gap->start);
 }
 
 /**
  * homa_pkt_dispatch() - Top-level function for handling an incoming packet.
- * @skb:        The incoming packet. This function takes ownership of the
- *              packet and will ensure that it is eventually freed.
+ * @skb:        The incoming packet. May be the first in a group of DATA
+ *              packets for the same RPC, linked through skb->next; the
+ *              whole group is processed with a single acquisition of the
+ *              RPC's lock (see homa_pkt_recv). This function takes
+ *              ownership of all of the packets and will ensure that they
+ *              are eventually freed.
  * @hsk:        Homa socket that owns the packet's destination port. This socket
  *              is not locked, but its existence is ensured for the life
  *              of this method.
@@ -249,7 +461,12 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk)
 {
 	struct common_header *h = (struct common_header *) skb->data;
 	struct homa_rpc *rpc;
-	
+	int type = h->type;
+	__u64 start_cycles = 0;
+
+	if (unlikely(hsk->homa->cycle_metrics))
+		start_cycles = get_cycles();
+
 	/* Find and lock the RPC for this packet. */
 	if (ntohs(h->dport) < HOMA_MIN_CLIENT_PORT) {
 		/* We are the server for this RPC. */
@@ -281,7 +498,11 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk)
 					homa_print_packet(skb, buffer,
 					sizeof(buffer)));
 		}
-		if ((h->type != CUTOFFS) && (h->type != RESEND)) {
+		if ((h->type != CUTOFFS) && (h->type != RESEND)
+				&& (h->type != ACK)
+				&& (h->type != NOTIFICATION)
+				&& (h->type != RTS) && (h->type != ACCEPT)
+				&& (h->type != DCACP_GRANT)) {
 			tt_record4("Discarding packet for unknown RPC, id %u, "
 					"type %d, peer 0x%x:%d",
 					h->id & 0xffffffff, h->type,
@@ -292,19 +513,81 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk)
 		}
 	} else {
 		rpc->silent_ticks = 0;
+		rpc->timer_tick = hsk->homa->timer_ticks;
 		rpc->num_resends = 0;
 	}
-	
+	if (unlikely(start_cycles != 0)) {
+		__u64 now = get_cycles();
+		INC_METRIC(dispatch_lookup_cycles, now - start_cycles);
+		start_cycles = now;
+	}
+
 	switch (h->type) {
-	case DATA:
-		INC_METRIC(packets_received[DATA - DATA], 1);
-		if (homa_data_pkt(skb, rpc) != 0)
-			return;
+	case DATA: {
+		/* The packet may be the first in a chain of DATA packets
+		 * for this RPC (see homa_pkt_recv); process the entire chain
+		 * here, while we hold the RPC's lock. Grants are evaluated
+		 * only for the last packet in the chain, after all of the
+		 * chain's bytes have been incorporated into the message.
+		 */
+		struct sk_buff *next;
+		do {
+			struct data_header *hd = (struct data_header *)
+					skb->data;
+			next = skb->next;
+			skb->next = NULL;
+			INC_METRIC(packets_received[DATA - DATA], 1);
+
+			/* Messages that fit entirely in one packet (the common
+			 * case for many workloads) don't need packet assembly
+			 * or the grant machinery; handle them on a streamlined
+			 * path. Packets with stale cutoff versions take the
+			 * slow path, which will send a CUTOFFS packet.
+			 */
+			if ((hd->seg.offset == 0)
+					&& (hd->seg.segment_length
+					== hd->message_length)
+					&& (ntohs(hd->cutoff_version)
+					== hsk->homa->cutoff_version)) {
+				if (homa_data_pkt_single(skb, rpc) != 0)
+					goto chain_dead;
+			} else if (__homa_data_pkt(skb, rpc, next == NULL) != 0)
+				goto chain_dead;
+			skb = next;
+		} while (skb != NULL);
 		break;
-	case GRANT:
+
+	    chain_dead:
+		/* The RPC has been unlocked and deleted; discard any
+		 * remaining packets in the chain.
+		 */
+		for (skb = next; skb != NULL; skb = next) {
+			next = skb->next;
+			kfree_skb(skb);
+		}
+		if (unlikely(start_cycles != 0))
+			INC_METRIC(dispatch_data_cycles,
+					get_cycles() - start_cycles);
+		return;
+	}
+	case GRANT: {
+		/* Copy the piggybacked ack (if any) out of the header before
+		 * homa_grant_pkt frees the packet. It must be processed after
+		 * rpc has been unlocked: the acked RPC could share a lock
+		 * bucket with rpc.
+		 */
+		struct homa_ack ack = ((struct grant_header *) h)->ack;
+		__be32 saddr = ip_hdr(skb)->saddr;
+
 		INC_METRIC(packets_received[GRANT - DATA], 1);
 		homa_grant_pkt(skb, rpc);
+		if (ack.id != 0) {
+			homa_rpc_unlock(rpc);
+			rpc = NULL;
+			homa_rpc_acked(hsk, saddr, &ack);
+		}
 		break;
+	}
 	case RESEND:
 		INC_METRIC(packets_received[RESEND - DATA], 1);
 		homa_resend_pkt(skb, rpc, hsk);
@@ -323,24 +606,39 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk)
 		INC_METRIC(packets_received[CUTOFFS - DATA], 1);
 		homa_cutoffs_pkt(skb, hsk);
 		break;
+	case ACK:
+		INC_METRIC(packets_received[ACK - DATA], 1);
+		if (rpc) {
+			/* The packet's common header implicitly acks the RPC
+			 * it names; free that RPC here, and drop its lock so
+			 * that homa_ack_pkt can lock other RPCs that may
+			 * share its bucket.
+			 */
+			if (!rpc->is_client)
+				homa_rpc_free(rpc);
+			homa_rpc_unlock(rpc);
+			rpc = NULL;
+		}
+		homa_ack_pkt(skb, hsk);
+		break;
 	/*
 	* DCACP logic
 	*/
 	case NOTIFICATION:
 		INC_METRIC(packets_received[NOTIFICATION - DATA], 1);
-		dcacp_notification_pkt(skb);
+		dcacp_notification_pkt(skb, hsk);
 		break;
 	case RTS:
 		INC_METRIC(packets_received[RTS - DATA], 1);
-		dcacp_rts_pkt(skb);
+		dcacp_rts_pkt(skb, hsk);
 		break;
 	case DCACP_GRANT:
 		INC_METRIC(packets_received[DCACP_GRANT - DATA], 1);
-		dcacp_grant_pkt(skb);
+		dcacp_grant_pkt(skb, hsk);
 		break;
 	case ACCEPT:
 		INC_METRIC(packets_received[ACCEPT - DATA], 1);
-		dcacp_accept_pkt(skb);
+		dcacp_accept_pkt(skb, hsk);
 		break;
 
 	default:
@@ -350,11 +648,24 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk)
 	goto done;
 	
     discard:
-	kfree_skb(skb);
-    
+	while (skb != NULL) {
+		struct sk_buff *next = skb->next;
+		kfree_skb(skb);
+		skb = next;
+	}
+
     done:
 	if (rpc)
 		homa_rpc_unlock(rpc);
+	if (unlikely(start_cycles != 0)) {
+		__u64 elapsed = get_cycles() - start_cycles;
+		if (type == DATA)
+			INC_METRIC(dispatch_data_cycles, elapsed);
+		else if (type == GRANT)
+			INC_METRIC(dispatch_grant_cycles, elapsed);
+		else
+			INC_METRIC(dispatch_other_cycles, elapsed);
+	}
 }
 
 /**
@@ -369,13 +680,33 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk)
  * may change the RPC's state to RPC_READY.
  */
 int homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
+{
+	return __homa_data_pkt(skb, rpc, true);
+}
+
+/**
+ * __homa_data_pkt() - Lower-level handler for incoming DATA packets; allows
+ * the caller to defer grant evaluation when processing a chain of packets
+ * for the same RPC (grants need only be evaluated once, after the last
+ * packet in the chain has been incorporated into the message).
+ * @skb:         Incoming packet; size known to be large enough for the header.
+ *               This function now owns the packet.
+ * @rpc:         Information about the RPC corresponding to this packet.
+ * @send_grants: True means evaluate grants for the RPC if its message is
+ *               scheduled; false means skip grant evaluation (a later
+ *               packet in the chain will trigger it).
+ *
+ * Return: See homa_data_pkt.
+ */
+int __homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
+		bool send_grants)
 {
 	struct homa *homa = rpc->hsk->homa;
 	struct data_header *h = (struct data_header *) skb->data;
 	int incoming = ntohl(h->incoming);
 	
-	tt_record4("incoming data packet, id %llu, port %d, offset %d/%d",
-			h->common.id,
+	tt_record_rpc4(rpc, "incoming data packet, id %llu, port %d, "
+			"offset %d/%d", h->common.id,
 			rpc->is_client ? rpc->hsk->client_port
 			: rpc->hsk->server_port,
 			ntohl(h->seg.offset), ntohl(h->message_length));
@@ -398,14 +729,17 @@ int homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 		}
 	}
 	homa_add_packet(&rpc->msgin, skb);
-	if (rpc->msgin.scheduled)
-		homa_manage_grants(homa, rpc);
+	if (rpc->msgin.scheduled) {
+		atomic64_add(ntohl(h->seg.segment_length),
+				&homa->sched_arrival_bytes);
+		if (send_grants)
+			homa_manage_grants(homa, rpc);
+	}
 	if (rpc->active_links.next == LIST_POISON1) {
 		/* This is the first packet of a server RPC, so we have to
 		 * add the RPC to @hsk->active_rpcs. We do it here, rather
-		 * than in homa_rpc_new_server, so we can acquire the socket
-		 * lock just once to both add the RPC to active_rpcs and
-		 * also add the RPC to the ready list, if appropriate.
+		 * than in homa_rpc_new_server, so the check against
+		 * shutdown below covers the entire life of the RPC.
 		 */
 		INC_METRIC(requests_received, 1);
 		homa_sock_lock(rpc->hsk, "homa_data_pkt (first)");
@@ -416,23 +750,34 @@ int homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 			homa_message_in_destroy(&rpc->msgin);
 			homa_sock_unlock(rpc->hsk);
 			homa_rpc_unlock(rpc);
-			kfree(rpc);
+			homa_rpc_release(rpc);
 			return 1;
 		}
-			
+
 		list_add_tail_rcu(&rpc->active_links, &rpc->hsk->active_rpcs);
+		homa_sock_unlock(rpc->hsk);
 		if (rpc->msgin.bytes_remaining == 0)
 			homa_rpc_ready(rpc);
-		homa_sock_unlock(rpc->hsk);
 	} else {
 		if (rpc->msgin.bytes_remaining == 0) {
-			homa_sock_lock(rpc->hsk, "homa_data_pkt (not first)");
 			homa_rpc_ready(rpc);
-			homa_sock_unlock(rpc->hsk);
+		} else if ((rpc->interest != NULL)
+				&& (rpc->interest->flags & HOMA_RECV_PARTIAL)
+				&& (homa_prefix_end(&rpc->msgin)
+				> rpc->msgin.delivered)) {
+			/* Someone is waiting to receive this (incomplete)
+			 * message incrementally, and there are new contiguous
+			 * bytes for it.
+			 */
+			homa_rpc_partial_ready(rpc);
 		}
 	}
-	if (ntohs(h->cutoff_version) != homa->cutoff_version) {
-		/* The sender has out-of-date cutoffs. Note: we may need
+	if ((ntohs(h->cutoff_version) != homa->cutoff_version)
+			&& !rpc->msgin.scheduled) {
+		/* The sender has out-of-date cutoffs. If the message is
+		 * scheduled there is nothing to do here: the grants we send
+		 * for it carry the current cutoffs. For unscheduled messages
+		 * we must send a standalone CUTOFFS packet. Note: we may need
 		 * to resend CUTOFFS packets if one gets lost, but we don't
 		 * want to send multiple CUTOFFS packets when a stream of
 		 * packets arrives with stale cutoff_versions. Thus, we
@@ -456,6 +801,72 @@ int homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 	return 0;
 }
 
+/**
+ * homa_data_pkt_single() - Fast-path handler for incoming DATA packets
+ * whose single segment contains an entire message. Such messages never
+ * need grants, and their msgin consists of exactly this packet, so most
+ * of the work in homa_data_pkt can be bypassed.
+ * @skb:     Incoming packet; the caller has verified that its segment
+ *           covers the complete message. This function now owns the packet.
+ * @rpc:     Information about the RPC corresponding to this packet.
+ *
+ * Return: Zero means the function completed successfully. Nonzero means
+ * that the RPC had to be unlocked and deleted because the socket has been
+ * shut down; the caller should not access the RPC anymore. Note: this method
+ * may change the RPC's state to RPC_READY.
+ */
+int homa_data_pkt_single(struct sk_buff *skb, struct homa_rpc *rpc)
+{
+	struct data_header *h = (struct data_header *) skb->data;
+
+	tt_record_rpc3(rpc, "incoming single-packet message, id %llu, port %d, "
+			"length %d", h->common.id,
+			rpc->is_client ? rpc->hsk->client_port
+			: rpc->hsk->server_port, ntohl(h->message_length));
+
+	if (rpc->state != RPC_INCOMING) {
+		if (unlikely(!rpc->is_client || (rpc->state == RPC_READY))) {
+			kfree_skb(skb);
+			return 0;
+		}
+		homa_message_in_init(&rpc->msgin, ntohl(h->message_length),
+				ntohl(h->incoming));
+		INC_METRIC(responses_received, 1);
+		rpc->state = RPC_INCOMING;
+	} else if (unlikely(rpc->msgin.bytes_remaining
+			!= rpc->msgin.total_length)) {
+		/* Must be a retransmit of a packet we already have. */
+		kfree_skb(skb);
+		return 0;
+	}
+	__skb_queue_tail(&rpc->msgin.packets, skb);
+	rpc->msgin.num_skbs++;
+	rpc->msgin.bytes_remaining = 0;
+	homa_free_gaps(&rpc->msgin);
+	INC_METRIC(single_pkt_msgs, 1);
+	if (rpc->active_links.next == LIST_POISON1) {
+		/* This is the first packet of a server RPC; see the
+		 * corresponding code in homa_data_pkt for details.
+		 */
+		INC_METRIC(requests_received, 1);
+		homa_sock_lock(rpc->hsk, "homa_data_pkt_single (first)");
+		if (rpc->hsk->shutdown) {
+			homa_message_in_destroy(&rpc->msgin);
+			homa_sock_unlock(rpc->hsk);
+			homa_rpc_unlock(rpc);
+			homa_rpc_release(rpc);
+			return 1;
+		}
+
+		list_add_tail_rcu(&rpc->active_links, &rpc->hsk->active_rpcs);
+		homa_sock_unlock(rpc->hsk);
+		homa_rpc_ready(rpc);
+	} else {
+		homa_rpc_ready(rpc);
+	}
+	return 0;
+}
+
 /**
  * homa_grant_pkt() - Handler for incoming GRANT packets
  * @skb:     Incoming packet; size already verified large enough for header.
@@ -465,12 +876,33 @@ int homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 void homa_grant_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 {
 	struct grant_header *h = (struct grant_header *) skb->data;
-	tt_record3("processing grant for id %llu, offset %d, priority %d",
+	tt_record_rpc3(rpc, "processing grant for id %llu, offset %d, priority %d",
 			h->common.id, ntohl(h->offset), h->priority);
+	if ((h->cutoff_version != 0)
+			&& (h->cutoff_version != rpc->peer->cutoff_version)) {
+		/* The grant carries a piggybacked cutoff update; apply it
+		 * just as if a CUTOFFS packet had arrived.
+		 */
+		int i;
+
+		rpc->peer->unsched_cutoffs[0] = INT_MAX;
+		for (i = 1; i < HOMA_MAX_PRIORITIES; i++)
+			rpc->peer->unsched_cutoffs[i] =
+					ntohl(h->unsched_cutoffs[i]);
+		rpc->peer->cutoff_version = h->cutoff_version;
+	}
 	if (rpc->state == RPC_OUTGOING) {
 		int new_offset = ntohl(h->offset);
 
 		if (new_offset > rpc->msgout.granted) {
+			if (rpc->msgout.granted == rpc->msgout.unscheduled)
+				/* First grant for this message; how long it
+				 * took to arrive tells us how many RTT-bytes
+				 * this peer needs.
+				 */
+				homa_peer_update_rtt(rpc->hsk->homa, rpc->peer,
+						get_cycles()
+						- rpc->msgout.init_cycles);
 			rpc->msgout.granted = new_offset;
 			if (new_offset > rpc->msgout.length)
 				rpc->msgout.granted = rpc->msgout.length;
@@ -544,10 +976,13 @@ void homa_resend_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 	}
 	if (rpc->msgout.next_packet && (homa_data_offset(rpc->msgout.next_packet)
 			< rpc->msgout.granted)) {
-		/* We have chosen not to transmit data from this message;
-		 * send BUSY instead.
+		/* We have chosen not to transmit data from this message.
+		 * The message has granted bytes waiting in the throttle
+		 * queue, so data packets will flow shortly; piggyback the
+		 * busy indication on the next one of them rather than
+		 * spending a standalone BUSY packet.
 		 */
-		homa_xmit_control(BUSY, &busy, sizeof(busy), rpc);
+		rpc->msgout.busy_pending = 1;
 	} else {
 		homa_resend_data(rpc, ntohl(h->offset),
 				ntohl(h->offset) + ntohl(h->length),
@@ -567,7 +1002,7 @@ void homa_resend_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 void homa_restart_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 {
 	int err;
-	tt_record3("Received restart for id %llu, server %x:%d", rpc->id,
+	tt_record_rpc3(rpc, "Received restart for id %llu, server %x:%d", rpc->id,
 			rpc->peer->addr, rpc->dport);
 	if (rpc->hsk->homa->verbose)
 		printk(KERN_NOTICE "Restarting rpc to server %s:%d, id %llu",
@@ -609,73 +1044,458 @@ void homa_cutoffs_pkt(struct sk_buff *skb, struct homa_sock *hsk)
 	kfree_skb(skb);
 }
 
+/**
+ * homa_ack_pkt() - Handler for incoming ACK packets
+ * @skb:     Incoming packet; size already verified large enough for header.
+ *           This function now owns the packet.
+ * @hsk:     Socket on which the packet was received. The caller must not
+ *           hold any RPC locks (see homa_rpc_acked).
+ */
+void homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk)
+{
+	struct ack_header *h = (struct ack_header *) skb->data;
+	int i, count = ntohs(h->num_acks);
+
+	if (count > HOMA_MAX_ACKS)
+		count = HOMA_MAX_ACKS;
+	for (i = 0; i < count; i++)
+		homa_rpc_acked(hsk, ip_hdr(skb)->saddr, &h->acks[i]);
+	kfree_skb(skb);
+}
+
 
 /* DCACP logic
+ *
+ * The matching engine pairs up senders and receivers in rounds: each
+ * epoch consists of DCACP_EPOCH_ITERS iterations, run by
+ * dcacp_run_iteration from the timer. In an iteration, an unmatched
+ * sender advertises its backlog with an RTS, an unmatched receiver
+ * offers itself to the smallest advertised backlog with a DCACP_GRANT,
+ * and a sender commits to the best offer with an ACCEPT. The packet
+ * handlers below run at SoftIRQ level and only append candidates to
+ * per-core queues (dcacp_cores), so they take no locks; all shared
+ * state is touched only under homa->epoch.lock, off the data path.
+ */
+
+/* Candidates collected on each core by the DCACP packet handlers. */
+struct dcacp_core dcacp_cores[NR_CPUS];
+
+/**
+ * dcacp_epoch_init() - Initialize the matching-engine state in @homa
+ * (invoked by homa_init).
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void dcacp_epoch_init(struct homa *homa)
+{
+	struct dcacp_epoch *epoch = &homa->epoch;
+
+	spin_lock_init(&epoch->lock);
+	epoch->epoch = 0;
+	epoch->iter = 0;
+	epoch->prompt = false;
+	epoch->match_src_addr = 0;
+	epoch->match_dst_addr = 0;
+	epoch->rts_size = 0;
+	epoch->grant_size = 0;
+	epoch->min_rts = NULL;
+	epoch->min_grant = NULL;
+	memset(dcacp_cores, 0, sizeof(dcacp_cores));
+}
 
-* dcacp_notification_pkt() - Handler for incoming NOTIFICATIOn packets
-*
-*/
-void dcacp_notification_pkt(struct sk_buff *skb) {
+/**
+ * dcacp_queue_rts() - Add an entry to this core's queue of senders that
+ * want to transmit to this host, unless the queue is full.
+ * @iter:          Matching iteration to which the request applies.
+ * @src_addr:      Address of the sender (network byte order).
+ * @sport:         Sender's port (host byte order).
+ * @remaining_sz:  Unsent bytes in the sender's message.
+ */
+static void dcacp_queue_rts(uint8_t iter, uint32_t src_addr, __u16 sport,
+		__u64 remaining_sz)
+{
+	struct dcacp_core *core = &dcacp_cores[smp_processor_id()];
+	struct dcacp_rts *rts;
 
+	if (core->rts_size >= MAX_DCACP_INCAST_RATIO)
+		return;
+	rts = &core->rts_q[core->rts_size];
+	rts->iter = iter;
+	rts->src_addr = src_addr;
+	rts->sport = sport;
+	rts->remaining_sz = remaining_sz;
+	core->rts_size++;
 }
 
-/*
-* dcacp_rts_pkt() - Handler for incoming RTS packets
-*
-*/
-void dcacp_rts_pkt(struct sk_buff *skb) {
+/**
+ * dcacp_notification_pkt() - Handler for incoming NOTIFICATION packets.
+ * These announce a new message from a sender; the sender is queued as a
+ * matching candidate just like an RTS.
+ * @skb:     Incoming packet; this function takes ownership.
+ * @hsk:     Socket on which the packet was received.
+ */
+void dcacp_notification_pkt(struct sk_buff *skb, struct homa_sock *hsk)
+{
+	struct notification_header *h = (struct notification_header *)
+			skb->data;
 
+	dcacp_queue_rts(0, ip_hdr(skb)->saddr, ntohs(h->common.sport),
+			be64_to_cpu(h->message_size));
+	kfree_skb(skb);
 }
 
-/*
-* dcacp_grant_pkt() - Handler for incoming GRANT packets
-*
-*/
-void dcacp_grant_pkt(struct sk_buff *skb) {
+/**
+ * dcacp_rts_pkt() - Handler for incoming RTS packets: a sender is asking
+ * to transmit to this host during the current matching iteration.
+ * @skb:     Incoming packet; this function takes ownership.
+ * @hsk:     Socket on which the packet was received.
+ */
+void dcacp_rts_pkt(struct sk_buff *skb, struct homa_sock *hsk)
+{
+	struct rts_header *h = (struct rts_header *) skb->data;
 
+	dcacp_queue_rts(hsk->homa->epoch.iter, ip_hdr(skb)->saddr,
+			ntohs(h->common.sport), be64_to_cpu(h->message_size));
+	kfree_skb(skb);
 }
 
-/*
-* dcacp_accept_pkt() - Handler for incoming ACCEPT packets
-*
-*/
-void dcacp_accept_pkt(struct sk_buff *skb) {
+/**
+ * dcacp_grant_pkt() - Handler for incoming DCACP_GRANT packets: a
+ * receiver has offered to accept this host's data during the current
+ * epoch. The offer is queued; dcacp_run_iteration picks the best one.
+ * @skb:     Incoming packet; this function takes ownership.
+ * @hsk:     Socket on which the packet was received.
+ */
+void dcacp_grant_pkt(struct sk_buff *skb, struct homa_sock *hsk)
+{
+	struct dcacp_grant_header *h = (struct dcacp_grant_header *)
+			skb->data;
+	struct dcacp_core *core = &dcacp_cores[smp_processor_id()];
+	struct dcacp_grant *grant;
 
+	if (core->grant_size >= MAX_DCACP_INCAST_RATIO)
+		goto done;
+	grant = &core->grants_q[core->grant_size];
+	grant->prompt = hsk->homa->epoch.prompt;
+	grant->dst_addr = ip_hdr(skb)->saddr;
+	grant->sport = ntohs(h->common.sport);
+	grant->remaining_sz = be64_to_cpu(h->message_size);
+	core->grant_size++;
+done:
+	kfree_skb(skb);
 }
 
+/**
+ * dcacp_accept_pkt() - Handler for incoming ACCEPT packets: a sender has
+ * committed to the grant this host sent, so this host is matched as a
+ * receiver for the rest of the epoch.
+ * @skb:     Incoming packet; this function takes ownership.
+ * @hsk:     Socket on which the packet was received.
+ */
+void dcacp_accept_pkt(struct sk_buff *skb, struct homa_sock *hsk)
+{
+	struct dcacp_epoch *epoch = &hsk->homa->epoch;
+
+	spin_lock_bh(&epoch->lock);
+	if (epoch->match_src_addr == 0)
+		epoch->match_src_addr = ip_hdr(skb)->saddr;
+	spin_unlock_bh(&epoch->lock);
+	kfree_skb(skb);
+}
 
 /**
- * homa_manage_grants() - This function is invoked to set priorities of
- * messages for grants, determine whether grants can be sent out and, if so,
- * send them.
+ * dcacp_xmit_rts() - Send an RTS packet advertising this host's backlog
+ * to a receiver.
+ * @homa:       Overall data about the Homa protocol implementation.
+ * @hsk:        Socket to use for transmission.
+ * @dst_addr:   Address of the receiver (network byte order).
+ * @dport:      Receiver's port (host byte order).
+ * @remaining:  Unsent bytes in the message we'd like to transmit.
+ */
+static void dcacp_xmit_rts(struct homa *homa, struct homa_sock *hsk,
+		uint32_t dst_addr, __u16 dport, __u64 remaining)
+{
+	struct rts_header h;
+	struct homa_peer *peer;
+
+	peer = homa_peer_find(&homa->peers, dst_addr, &hsk->inet);
+	if (IS_ERR(peer))
+		return;
+	h.common.type = RTS;
+	h.common.sport = htons(hsk->client_port);
+	h.common.dport = htons(dport);
+	h.common.id = 0;
+	h.message_size = cpu_to_be64(remaining);
+	h.priority = homa->num_priorities - 1;
+	__homa_xmit_control(&h, sizeof(h), peer, hsk);
+}
+
+/**
+ * dcacp_xmit_grant() - Send a DCACP_GRANT packet offering to receive
+ * from the given sender.
  * @homa:    Overall data about the Homa protocol implementation.
- * @rpc:     If non-null, this is an RPC whose msgin just received a packet;
- *           rpc->msgin->scheduled should be true.  This RPC may need to
- *           be (re-)positioned in the grant queue. NULL typically means
- *           an RPC has just been removed from the queue, which may allow
- *           grants to be sent for other RPCs.
+ * @hsk:     Socket to use for transmission.
+ * @rts:     The chosen sender's request.
  */
-void homa_manage_grants(struct homa *homa, struct homa_rpc *rpc)
+static void dcacp_xmit_grant(struct homa *homa, struct homa_sock *hsk,
+		struct dcacp_rts *rts)
 {
-	/* The overall goal is to grant simultaneously to up to
-	 * homa->max_overcommit messages. Ideally, each message should use
-	 * a different priority level, determined by bytes_remaining (fewest
-	 * bytes_remaining gets the highest priority). If there aren't enough
-	 * scheduled priority levels for all of the messages, then the lowest
-	 * level gets shared by multiple messages. If there are fewer messages
-	 * than priority levels, then we use the lowest available levels
-	 * (new higher-priority messages can use the higher levels to achieve
-	 * instantaneous preemption).
-	 */
-	struct list_head *pos;
-	struct homa_rpc *candidate;
-	int rank;
-	struct homa_message_in *msgin = &rpc->msgin;
-	static int invocation = 0;
-	
-	homa_grantable_lock(homa);
-	invocation++;
-	
+	struct dcacp_grant_header h;
+	struct homa_peer *peer;
+
+	peer = homa_peer_find(&homa->peers, rts->src_addr, &hsk->inet);
+	if (IS_ERR(peer))
+		return;
+	h.common.type = DCACP_GRANT;
+	h.common.sport = htons(hsk->client_port);
+	h.common.dport = htons(rts->sport);
+	h.common.id = 0;
+	h.message_size = cpu_to_be64(rts->remaining_sz);
+	h.priority = homa->num_priorities - 1;
+	__homa_xmit_control(&h, sizeof(h), peer, hsk);
+}
+
+/**
+ * dcacp_xmit_accept() - Send an ACCEPT packet committing to the given
+ * receiver's grant.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @hsk:     Socket to use for transmission.
+ * @grant:   The chosen receiver's offer.
+ */
+static void dcacp_xmit_accept(struct homa *homa, struct homa_sock *hsk,
+		struct dcacp_grant *grant)
+{
+	struct accept_header h;
+	struct homa_peer *peer;
+
+	peer = homa_peer_find(&homa->peers, grant->dst_addr, &hsk->inet);
+	if (IS_ERR(peer))
+		return;
+	h.common.type = ACCEPT;
+	h.common.sport = htons(hsk->client_port);
+	h.common.dport = htons(grant->sport);
+	h.common.id = 0;
+	h.priority = homa->num_priorities - 1;
+	__homa_xmit_control(&h, sizeof(h), peer, hsk);
+}
+
+/**
+ * dcacp_run_iteration() - Run one iteration of the DCACP matching
+ * protocol. Invoked from homa_timer every dcacp_iter_ticks ticks; never
+ * called from the packet-processing path.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void dcacp_run_iteration(struct homa *homa)
+{
+	struct dcacp_epoch *epoch = &homa->epoch;
+	struct homa_socktab_scan scan;
+	struct homa_sock *hsk;
+	struct homa_rpc *rpc;
+	uint32_t rts_addr = 0;
+	__u16 rts_port = 0;
+	__u64 rts_remaining = 0;
+	int i, core;
+
+	rcu_read_lock();
+	hsk = homa_socktab_start_scan(&homa->port_map, &scan);
+	spin_lock_bh(&epoch->lock);
+
+	/* Drain the candidates that SoftIRQ handlers have collected on
+	 * each core since the last iteration.
+	 */
+	for (core = 0; core < NR_CPUS; core++) {
+		struct dcacp_core *cc = &dcacp_cores[core];
+		for (i = 0; (i < cc->rts_size) && (epoch->rts_size
+				< MAX_DCACP_INCAST_RATIO); i++)
+			epoch->rts_q[epoch->rts_size++] = cc->rts_q[i];
+		cc->rts_size = 0;
+		for (i = 0; (i < cc->grant_size) && (epoch->grant_size
+				< MAX_DCACP_INCAST_RATIO); i++)
+			epoch->grants_q[epoch->grant_size++] =
+					cc->grants_q[i];
+		cc->grant_size = 0;
+	}
+	if (hsk == NULL)
+		goto advance;
+
+	/* Sender side: if receivers have offered to accept our data,
+	 * commit to the one with the smallest backlog (it will finish
+	 * soonest).
+	 */
+	if ((epoch->match_dst_addr == 0) && (epoch->grant_size > 0)) {
+		epoch->min_grant = &epoch->grants_q[0];
+		for (i = 1; i < epoch->grant_size; i++) {
+			if (epoch->grants_q[i].remaining_sz
+					< epoch->min_grant->remaining_sz)
+				epoch->min_grant = &epoch->grants_q[i];
+		}
+		dcacp_xmit_accept(homa, hsk, epoch->min_grant);
+		epoch->match_dst_addr = epoch->min_grant->dst_addr;
+	}
+
+	/* Receiver side: if senders have asked to transmit to us, offer
+	 * ourselves to the one with the least data remaining (SRPT). We
+	 * aren't matched until that sender responds with an ACCEPT.
+	 */
+	if ((epoch->match_src_addr == 0) && (epoch->rts_size > 0)) {
+		epoch->min_rts = &epoch->rts_q[0];
+		for (i = 1; i < epoch->rts_size; i++) {
+			if (epoch->rts_q[i].remaining_sz
+					< epoch->min_rts->remaining_sz)
+				epoch->min_rts = &epoch->rts_q[i];
+		}
+		dcacp_xmit_grant(homa, hsk, epoch->min_rts);
+	}
+
+	/* Sender side: if we still aren't matched and have backlogged
+	 * output, ask the receiver of the first throttled message for a
+	 * grant in the next iteration.
+	 */
+	if (epoch->match_dst_addr == 0) {
+		for (i = 0; i < homa->num_links; i++) {
+			struct homa_link *link = &homa->links[i];
+
+			homa_throttle_lock(link);
+			rpc = list_first_entry_or_null(&link->throttled_rpcs,
+					struct homa_rpc, throttled_links);
+			if (rpc != NULL) {
+				rts_addr = rpc->peer->addr;
+				rts_port = rpc->dport;
+				rts_remaining = rpc->msgout.length
+						- rpc->msgout.granted;
+			}
+			homa_throttle_unlock(link);
+			if (rts_addr != 0)
+				break;
+		}
+		if (rts_addr != 0)
+			dcacp_xmit_rts(homa, hsk, rts_addr, rts_port,
+					rts_remaining);
+	}
+
+advance:
+	/* Candidates don't carry over: each iteration collects a fresh
+	 * set, so stale RTSs from matched senders age out naturally.
+	 */
+	epoch->rts_size = 0;
+	epoch->grant_size = 0;
+	epoch->min_rts = NULL;
+	epoch->min_grant = NULL;
+	epoch->iter++;
+	if (epoch->iter >= DCACP_EPOCH_ITERS) {
+		epoch->epoch++;
+		epoch->iter = 0;
+		epoch->prompt = false;
+		epoch->match_src_addr = 0;
+		epoch->match_dst_addr = 0;
+	}
+	spin_unlock_bh(&epoch->lock);
+	rcu_read_unlock();
+}
+
+
+/**
+ * homa_insert_grantable() - Add an RPC to homa->grantable_rpcs in priority
+ * order (fewest bytes_remaining first), updating homa->grantable_tails.
+ * The caller must hold the grantable lock, and the RPC must not currently
+ * be in the list.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @rpc:     RPC to add; its msgin must be partially received.
+ */
+void homa_insert_grantable(struct homa *homa, struct homa_rpc *rpc)
+{
+	struct homa_rpc *candidate;
+	struct list_head *start, *pos;
+	int i, bucket;
+
+	bucket = homa_grantable_bucket(rpc->msgin.bytes_remaining);
+	rpc->grantable_bucket = bucket;
+
+	/* Skip over all of the entries in buckets that precede this
+	 * RPC's bucket.
+	 */
+	start = &homa->grantable_rpcs;
+	for (i = bucket-1; i >= 0; i--) {
+		if (homa->grantable_tails[i]) {
+			start = homa->grantable_tails[i];
+			break;
+		}
+	}
+
+	/* Scan (only within this RPC's bucket) for the insertion point. */
+	for (pos = start->next; pos != &homa->grantable_rpcs;
+			pos = pos->next) {
+		candidate = list_entry(pos, struct homa_rpc, grantable_links);
+		if (candidate->msgin.bytes_remaining
+				> rpc->msgin.bytes_remaining)
+			break;
+	}
+	list_add_tail(&rpc->grantable_links, pos);
+
+	/* This RPC is the new tail of its bucket unless it's followed by
+	 * another entry from the same bucket.
+	 */
+	if ((pos == &homa->grantable_rpcs) || (list_entry(pos,
+			struct homa_rpc, grantable_links)->grantable_bucket
+			!= bucket))
+		homa->grantable_tails[bucket] = &rpc->grantable_links;
+}
+
+/**
+ * homa_unlink_grantable() - Remove an RPC from homa->grantable_rpcs,
+ * updating homa->grantable_tails. The caller must hold the grantable lock,
+ * and the RPC must currently be in the list.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @rpc:     RPC to remove.
+ */
+void homa_unlink_grantable(struct homa *homa, struct homa_rpc *rpc)
+{
+	int bucket = rpc->grantable_bucket;
+	if (homa->grantable_tails[bucket] == &rpc->grantable_links) {
+		struct list_head *prev = rpc->grantable_links.prev;
+		if ((prev == &homa->grantable_rpcs) || (list_entry(prev,
+				struct homa_rpc, grantable_links)
+				->grantable_bucket != bucket))
+			prev = NULL;
+		homa->grantable_tails[bucket] = prev;
+	}
+	rpc->grantable_bucket = -1;
+	list_del_init(&rpc->grantable_links);
+}
+
+/**
+ * homa_manage_grants() - This function is invoked to set priorities of
+ * messages for grants, determine whether grants can be sent out and, if so,
+ * send them.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @rpc:     If non-null, this is an RPC whose msgin just received a packet;
+ *           rpc->msgin->scheduled should be true.  This RPC may need to
+ *           be (re-)positioned in the grant queue. NULL typically means
+ *           an RPC has just been removed from the queue, which may allow
+ *           grants to be sent for other RPCs.
+ */
+void homa_manage_grants(struct homa *homa, struct homa_rpc *rpc)
+{
+	/* The overall goal is to grant simultaneously to up to
+	 * homa->max_overcommit messages. Ideally, each message should use
+	 * a different priority level, determined by bytes_remaining (fewest
+	 * bytes_remaining gets the highest priority). If there aren't enough
+	 * scheduled priority levels for all of the messages, then the lowest
+	 * level gets shared by multiple messages. If there are fewer messages
+	 * than priority levels, then we use the lowest available levels
+	 * (new higher-priority messages can use the higher levels to achieve
+	 * instantaneous preemption).
+	 */
+	struct list_head *pos;
+	struct homa_rpc *candidate;
+	struct homa_rpc *grant_rpcs[HOMA_MAX_GRANTS];
+	struct grant_header grants[HOMA_MAX_GRANTS];
+	int rank, num_grants, i;
+	struct homa_message_in *msgin = &rpc->msgin;
+	static int invocation = 0;
+
+	homa_grantable_lock(homa);
+	invocation++;
+	
 	if (!rpc)
 		goto check_grant;
 	
@@ -686,50 +1506,50 @@ void homa_manage_grants(struct homa *homa, struct homa_rpc *rpc)
 		/* Message fully granted; no need to track it anymore. */
 		if (!list_empty(&rpc->grantable_links)) {
 			homa->num_grantable--;
-			list_del_init(&rpc->grantable_links);
+			homa_unlink_grantable(homa, rpc);
 		}
 		msgin->possibly_in_grant_queue = 0;
 	} else if (list_empty(&rpc->grantable_links)) {
 		/* Message not yet tracked; add it in priority order. */
 		homa->num_grantable++;
-		list_for_each(pos, &homa->grantable_rpcs) {
-			candidate = list_entry(pos, struct homa_rpc,
-					grantable_links);
-			if (candidate->msgin.bytes_remaining
-					> msgin->bytes_remaining) {
-				list_add_tail(&rpc->grantable_links, pos);
-				goto check_grant;
-			}
-		}
-		list_add_tail(&rpc->grantable_links, &homa->grantable_rpcs);
-	} else while (homa->grantable_rpcs.next != &rpc->grantable_links) {
+		homa_insert_grantable(homa, rpc);
+	} else if (homa->grantable_rpcs.next != &rpc->grantable_links) {
 		/* Message is on the list, but its priority may have
 		 * increased because of the recent packet arrival. If so,
 		 * adjust its position in the list.
 		 */
 		candidate = list_prev_entry(rpc, grantable_links);
-		if (candidate->msgin.bytes_remaining <= msgin->bytes_remaining)
-			goto check_grant;
-		__list_del_entry(&candidate->grantable_links);
-		list_add(&candidate->grantable_links, &rpc->grantable_links);
+		if (candidate->msgin.bytes_remaining > msgin->bytes_remaining) {
+			homa_unlink_grantable(homa, rpc);
+			homa_insert_grantable(homa, rpc);
+		}
 	}
 	
     check_grant:
 	/* Next, see if there are any messages that deserve a grant (they have
-	 * fewer than homa->rtt_bytes of data in transit).
+	 * fewer than homa->rtt_bytes of data in transit). Only one core sends
+	 * grants at a time; if another core is already doing it, don't wait
+	 * for a turn (grants will be reconsidered when the next data packet
+	 * arrives, so there's no need for every core to serialize here).
 	 */
+	if (atomic_cmpxchg(&homa->grant_active, 0, 1) != 0) {
+		INC_METRIC(grant_skips, 1);
+		homa_grantable_unlock(homa);
+		return;
+	}
 	rank = 0;
+	num_grants = 0;
 	list_for_each(pos, &homa->grantable_rpcs) {
 		int extra_levels, priority;
 		int received, new_grant;
-		struct grant_header h;
-		
+
 		rank++;
-		if (rank > homa->max_overcommit) {
+		if ((rank > homa->max_overcommit)
+				|| (num_grants >= HOMA_MAX_GRANTS)) {
 			break;
 		}
 		candidate = list_entry(pos, struct homa_rpc, grantable_links);
-		
+
 		/* Invariant: candidate msgin's incoming < total_length
 		 * (otherwise it won't be on this list).
 		 */
@@ -742,25 +1562,84 @@ void homa_manage_grants(struct homa *homa, struct homa_rpc *rpc)
 			new_grant = received + homa->rtt_bytes;
 		if (new_grant > candidate->msgin.total_length)
 			new_grant = candidate->msgin.total_length;
-		
-		/* Send a grant for this message. */
+		atomic64_add(new_grant - candidate->msgin.incoming,
+				&homa->sched_grant_bytes);
 		candidate->msgin.incoming = new_grant;
-		h.offset = htonl(new_grant);
 		priority = homa->max_sched_prio - (rank - 1);
 		extra_levels = homa->max_sched_prio + 1 - homa->num_grantable;
 		if (extra_levels >= 0)
 			priority -= extra_levels;
 		else if (priority < 0)
 			priority = 0;
-		h.priority = priority;
-		if (!homa_xmit_control(GRANT, &h, sizeof(h), candidate)) {
+
+		/* Coalesce grants: if this grant would advance the offset
+		 * only slightly beyond the last GRANT packet we actually
+		 * sent, don't send a packet yet; the accumulated advance
+		 * will be covered by a single larger grant later. This cuts
+		 * the rate of control packets during incast. The deferral
+		 * can't stall the sender as long as grant_coalesce_bytes is
+		 * less than rtt_bytes (a grant always goes out while the
+		 * sender still has granted bytes left to transmit). Changes
+		 * in priority are sent immediately, since they are needed
+		 * for preemption.
+		 */
+		if ((new_grant < candidate->msgin.total_length)
+				&& (priority == candidate->msgin.priority)
+				&& ((new_grant - candidate->msgin.incoming_sent)
+				< homa->grant_coalesce_bytes)) {
+			INC_METRIC(grants_coalesced, 1);
+			continue;
+		}
+
+		/* Collect the grant for this message; it will be transmitted
+		 * below, after the grantable lock has been released. The
+		 * grant_in_progress flag keeps the RPC from being reaped
+		 * until then (its homa_rpc_free can't complete while we
+		 * hold the grantable lock).
+		 */
+		candidate->msgin.incoming_sent = new_grant;
+		candidate->msgin.priority = priority;
+		grants[num_grants].offset = htonl(new_grant);
+		grants[num_grants].priority = priority;
+
+		/* Piggyback the current cutoffs on the grant; this keeps
+		 * senders of scheduled messages up to date without
+		 * standalone CUTOFFS packets.
+		 */
+		grants[num_grants].cutoff_version = htons(homa->cutoff_version);
+		for (i = 0; i < HOMA_MAX_PRIORITIES; i++)
+			grants[num_grants].unsched_cutoffs[i] =
+					htonl(homa->unsched_cutoffs[i]);
+
+		/* Let the grant carry an RPC completion ack back to this
+		 * peer, if one is waiting (see homa_peer_add_ack).
+		 */
+		if (homa_peer_get_acks(candidate->peer, 1,
+				&grants[num_grants].ack) == 0)
+			grants[num_grants].ack.id = 0;
+		candidate->grant_in_progress = true;
+		grant_rpcs[num_grants] = candidate;
+		num_grants++;
+	}
+	homa_grantable_unlock(homa);
+
+	/* Transmit all of the collected grants without holding the grantable
+	 * lock, so that other cores can update the grantable list in the
+	 * meantime.
+	 */
+	for (i = 0; i < num_grants; i++) {
+		candidate = grant_rpcs[i];
+		if (!homa_xmit_control(GRANT, &grants[i], sizeof(grants[i]),
+				candidate)) {
 			/* Don't do anything if the grant couldn't be sent; let
 			 * other retry mechanisms handle this. */
 		}
-		tt_record3("sent grant for id %llu, offset %d, priority %d",
-			candidate->id, new_grant, priority);
+		tt_record_rpc3(candidate, "sent grant for id %llu, offset %d, "
+			"priority %d", candidate->id, ntohl(grants[i].offset),
+			grants[i].priority);
+		candidate->grant_in_progress = false;
 	}
-	homa_grantable_unlock(homa);
+	atomic_set(&homa->grant_active, 0);
 }
 
 /**
@@ -778,7 +1657,7 @@ void homa_remove_from_grantable(struct homa *homa, struct homa_rpc *rpc)
 		homa_grantable_lock(homa);
 		if (!list_empty(&rpc->grantable_links)) {
 			homa->num_grantable--;
-			list_del_init(&rpc->grantable_links);
+			homa_unlink_grantable(homa, rpc);
 			homa_grantable_unlock(homa);
 			homa_manage_grants(homa, NULL);
 			return;
@@ -797,13 +1676,13 @@ void homa_rpc_abort(struct homa_rpc *crpc, int error)
 {
 	homa_remove_from_grantable(crpc->hsk->homa, crpc);
 	crpc->error = error;
-	homa_sock_lock(crpc->hsk, "homa_rpc_abort");
 	homa_rpc_ready(crpc);
-	homa_sock_unlock(crpc->hsk);
 }
 
 /**
- * homa_peer_abort() - Abort all client RPCs to a particular host.
+ * homa_peer_abort() - Abort all client RPCs to a particular host. The
+ * cost of this function is proportional to the number of RPCs involving
+ * that host, not the total number of RPCs in the system.
  * @homa:    Overall data about the Homa protocol implementation.
  * @addr:    Address (network order) of the destination whose RPCs are
  *           to be aborted.
@@ -811,39 +1690,35 @@ void homa_rpc_abort(struct homa_rpc *crpc, int error)
  */
 void homa_peer_abort(struct homa *homa, __be32 addr, int error)
 {
-	struct homa_socktab_scan scan;
-	struct homa_sock *hsk;
-	struct homa_rpc *rpc, *tmp;
-	
-	rcu_read_lock();
-	for (hsk = homa_socktab_start_scan(&homa->port_map, &scan);
-			hsk !=  NULL; hsk = homa_socktab_next(&scan)) {
-		/* Skip the (expensive) lock acquisition if there's no
-		 * work to do.
+	struct homa_peer *peer;
+	struct homa_rpc *rpc;
+
+	peer = homa_peer_lookup(&homa->peers, addr);
+	if (!peer)
+		return;
+	spin_lock_bh(&peer->lock);
+	list_for_each_entry(rpc, &peer->rpcs, peer_links) {
+		/* RPC locks must be acquired before peer locks (see
+		 * sync.txt), so all we can do here is try the lock. If
+		 * the RPC is busy on another core, skip it: if it has
+		 * really lost contact with the peer, homa_timer will
+		 * eventually abort it.
 		 */
-		if (list_empty(&hsk->active_rpcs))
+		if (!spin_trylock_bh(rpc->lock))
 			continue;
-		atomic_inc(&hsk->reap_disable);
-		list_for_each_entry_safe(rpc, tmp, &hsk->active_rpcs,
-				active_links) {
-			if (rpc->peer->addr != addr)
-				continue;
-			homa_rpc_lock(rpc);
-			if ((rpc->state == RPC_DEAD)
-					|| (rpc->state == RPC_READY)) {
-				homa_rpc_unlock(rpc);
-				continue;
-			}
-			if (rpc->is_client) {
-				if (error == -ETIMEDOUT)
-					INC_METRIC(client_rpc_timeouts, 1);
-				homa_rpc_abort(rpc, error);
-			}
+		if ((rpc->state == RPC_DEAD)
+				|| (rpc->state == RPC_READY)) {
 			homa_rpc_unlock(rpc);
+			continue;
 		}
-		atomic_dec(&hsk->reap_disable);
+		if (rpc->is_client) {
+			if (error == -ETIMEDOUT)
+				INC_METRIC(client_rpc_timeouts, 1);
+			homa_rpc_abort(rpc, error);
+		}
+		homa_rpc_unlock(rpc);
 	}
-	rcu_read_unlock();
+	spin_unlock_bh(&peer->lock);
 }
 
 /**
@@ -910,6 +1785,187 @@ void homa_validate_grantable_list(struct homa *homa, char *where) {
 	BUG();
 }
 
+/**
+ * __homa_interest_unlink() - Remove an interest from the socket's interest
+ * lists, if it is present on them. The caller must hold the socket's
+ * interest_lock.
+ * @interest:   Interest to unlink.
+ */
+static void __homa_interest_unlink(struct homa_interest *interest)
+{
+	if (interest->request_links.next != LIST_POISON1) {
+		list_del(&interest->request_links);
+		interest->request_links.next = LIST_POISON1;
+	}
+	if (interest->response_links.next != LIST_POISON1) {
+		list_del(&interest->response_links);
+		interest->response_links.next = LIST_POISON1;
+	}
+}
+
+/**
+ * homa_interest_claim() - Attempt to assign @rpc to the caller's own
+ * @interest.
+ * @hsk:        Socket from which @rpc was taken.
+ * @interest:   The caller's interest, which may or may not be visible to
+ *              other threads (see below).
+ * @rpc:        RPC the caller wishes to claim for itself.
+ *
+ * Return: Normally true. False means some other thread handed a different
+ * RPC to @interest first (possible only if the interest was registered on
+ * the socket's interest lists or for a specific RPC id); in that case
+ * @rpc was not claimed.
+ */
+static bool homa_interest_claim(struct homa_sock *hsk,
+		struct homa_interest *interest, struct homa_rpc *rpc)
+{
+	bool claimed = true;
+
+	if ((interest->reg_rpc == NULL)
+			&& (interest->request_links.next == LIST_POISON1)
+			&& (interest->response_links.next == LIST_POISON1)) {
+		/* Fast path: the interest isn't visible to any other
+		 * thread, so no-one can be handing off an RPC to it
+		 * concurrently; no need to lock.
+		 */
+		homa_interest_set(interest, rpc);
+		return true;
+	}
+	spin_lock_bh(&hsk->interest_lock);
+	if (atomic_long_read(&interest->id) == 0)
+		homa_interest_set(interest, rpc);
+	else
+		claimed = false;
+	spin_unlock_bh(&hsk->interest_lock);
+	return claimed;
+}
+
+/**
+ * homa_interest_cleanup() - Remove all references to an interest, so that
+ * no other thread can hand off an RPC to it anymore.
+ * @hsk:        Socket on which the interest was registered.
+ * @interest:   Interest to clean up; typically lives on the stack of a
+ *              thread in homa_wait_for_message.
+ * @id:         Id of the specific RPC that the interest was registered
+ *              for (via @interest->reg_rpc), or 0 if none.
+ * @locked_rpc: An RPC that the caller has already locked, or NULL; used
+ *              to avoid deadlock when @interest->reg_rpc is that RPC.
+ */
+static void homa_interest_cleanup(struct homa_sock *hsk,
+		struct homa_interest *interest, __u64 id,
+		struct homa_rpc *locked_rpc)
+{
+	struct homa_rpc *rpc;
+
+	if (interest->reg_rpc != NULL) {
+		/* The RPC we registered with could have been deleted (or
+		 * even handed to us) since we registered; look it up again
+		 * and recheck before touching it.
+		 */
+		if (interest->reg_rpc == locked_rpc) {
+			if (locked_rpc->interest == interest)
+				locked_rpc->interest = NULL;
+		} else {
+			rpc = homa_find_client_rpc(hsk, id);
+			if (rpc != NULL) {
+				if (rpc->interest == interest)
+					rpc->interest = NULL;
+				homa_rpc_unlock(rpc);
+			}
+		}
+		interest->reg_rpc = NULL;
+	}
+	if ((interest->request_links.next != LIST_POISON1)
+			|| (interest->response_links.next != LIST_POISON1)) {
+		spin_lock_bh(&hsk->interest_lock);
+		__homa_interest_unlink(interest);
+		spin_unlock_bh(&hsk->interest_lock);
+	}
+	if (interest->rpc != NULL) {
+		/* An RPC was handed off but never claimed (e.g. the wait
+		 * was interrupted); release the reap_disable reference that
+		 * came with it.
+		 */
+		atomic_dec(&hsk->reap_disable);
+		interest->rpc = NULL;
+	}
+}
+
+/**
+ * homa_find_ready_rpc() - Scan the ready shards of a socket for an RPC
+ * matching @flags and @id, starting with the current core's shard (best
+ * cache locality) and stealing from the other shards if necessary. If an
+ * RPC is found, it is removed from its queue and assigned to @interest.
+ * @hsk:       Socket to scan.
+ * @flags:     Flags parameter from homa_recv.
+ * @id:        Nonzero means the caller wants a specific response, so
+ *             queued responses are ignored.
+ * @interest:  The caller's interest.
+ *
+ * Return: True means an RPC was assigned to @interest (though not
+ * necessarily one from the ready queues: see homa_interest_claim).
+ */
+static bool homa_find_ready_rpc(struct homa_sock *hsk, int flags, __u64 id,
+		struct homa_interest *interest)
+{
+	struct homa_ready_shard *shard;
+	struct homa_rpc *rpc;
+	int core = smp_processor_id();
+	int i;
+
+	for (i = 0; i < NR_CPUS; i++) {
+		shard = &hsk->ready_shards[(core + i) % NR_CPUS];
+		if (list_empty(&shard->ready_responses)
+				&& list_empty(&shard->ready_requests))
+			continue;
+		spin_lock_bh(&shard->lock);
+		rpc = NULL;
+		if ((id == 0) && (flags & HOMA_RECV_RESPONSE)
+				&& !list_empty(&shard->ready_responses))
+			rpc = list_first_entry(&shard->ready_responses,
+					struct homa_rpc, ready_links);
+		else if ((flags & HOMA_RECV_REQUEST)
+				&& !list_empty(&shard->ready_requests))
+			rpc = list_first_entry(&shard->ready_requests,
+					struct homa_rpc, ready_links);
+		if (rpc != NULL) {
+			if (homa_interest_claim(hsk, interest, rpc))
+				list_del_init(&rpc->ready_links);
+			spin_unlock_bh(&shard->lock);
+			return true;
+		}
+		spin_unlock_bh(&shard->lock);
+	}
+	return false;
+}
+
+/**
+ * homa_steer_flow() - Record the current core as the place where incoming
+ * packets of @rpc should be processed. homa_gro_complete gives all of an
+ * RPC's packets the same hash; entering that hash in the kernel's RFS flow
+ * table causes RPS to redirect softirq processing of those packets to this
+ * core, so homa_data_pkt no longer bounces the RPC's cachelines between
+ * the GRO core and the core that will consume the message.
+ * @hsk:    Socket via which the packets will arrive.
+ * @rpc:    RPC whose remaining packets should be processed here; caller
+ *          must hold the RPC's lock.
+ */
+void homa_steer_flow(struct homa_sock *hsk, struct homa_rpc *rpc)
+{
+#ifdef CONFIG_RPS
+	struct rps_sock_flow_table *flow_table;
+	__u32 hash = homa_flow_hash(rpc->peer->addr, htons(rpc->dport),
+			htons(rpc->is_client ? hsk->client_port
+			: hsk->server_port), rpc->id);
+
+	rcu_read_lock();
+	flow_table = rcu_dereference(rps_sock_flow_table);
+	if (flow_table != NULL)
+		rps_record_sock_flow(flow_table, hash);
+	rcu_read_unlock();
+#endif /* CONFIG_RPS */
+}
+
 /**
  * @homa_wait_for_message() - Wait for an appropriate incoming message.
  * @hsk:     Socket where messages will arrive.
@@ -926,33 +1982,39 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 	struct homa_rpc *rpc = NULL;
 	struct homa_rpc *result = NULL;
 	struct homa_interest interest;
-	int sock_locked = 0;
-	
+	struct homa_ready_shard *shard;
+	__u64 active_start = 0;
+
+	if (unlikely(hsk->homa->cycle_metrics))
+		active_start = get_cycles();
+	interest.reg_rpc = NULL;
+	interest.rpc = NULL;
+	interest.request_links.next = LIST_POISON1;
+	interest.response_links.next = LIST_POISON1;
+
 	/* Normally this loop only gets executed once, but we may have
 	 * to start again if a "found" RPC gets deleted from underneath us.
 	 */
 	while (1) {
-		while (hsk->dead_skbs > hsk->homa->max_dead_buffs) {
-			/* Way too many dead RPCs; must cleanup immediately. */
-			if (!sock_locked) {
-				homa_sock_lock(hsk, "homa_wait_for_message #1");
-				sock_locked = 1;
-			}
-			if (homa_rpc_reap(hsk) <= 0)
-				break;
-		}
-		
-		/* Check to see if there is an appropriate RPC already
-		 * available, and at the same time register interests
-		 * so we'll be notified if an RPC becomes available in
-		 * the future.
+		/* Clean up interest state left over from a previous
+		 * iteration (e.g. we were woken just to rescan the ready
+		 * queues), so no-one can hand us an RPC while we start over.
 		 */
+		homa_interest_cleanup(hsk, &interest, id, NULL);
 		interest.thread = current;
 		atomic_long_set(&interest.id, 0);
-		interest.reg_rpc = NULL;
-		interest.request_links.next = LIST_POISON1;
-		interest.response_links.next = LIST_POISON1;
-		
+		interest.flags = flags;
+
+		if (hsk->dead_skbs > hsk->homa->max_dead_buffs) {
+			/* Way too many dead RPCs; must cleanup immediately. */
+			homa_sock_lock(hsk, "homa_wait_for_message #1");
+			while (hsk->dead_skbs > hsk->homa->max_dead_buffs) {
+				if (homa_rpc_reap(hsk) <= 0)
+					break;
+			}
+			homa_sock_unlock(hsk);
+		}
+
 		if (id != 0) {
 			rpc = homa_find_client_rpc(hsk, id);
 			if (rpc == NULL) {
@@ -964,8 +2026,23 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 				result = ERR_PTR(-EINVAL);
 				goto done;
 			}
+			homa_steer_flow(hsk, rpc);
 			if (rpc->state == RPC_READY) {
+				shard = &hsk->ready_shards[rpc->ready_shard];
+				spin_lock_bh(&shard->lock);
 				list_del_init(&rpc->ready_links);
+				spin_unlock_bh(&shard->lock);
+				result = rpc;
+				goto done;
+			}
+			if ((flags & HOMA_RECV_PARTIAL)
+					&& (rpc->state == RPC_INCOMING)
+					&& (homa_prefix_end(&rpc->msgin)
+					> rpc->msgin.delivered)) {
+				/* The message is incomplete, but it has
+				 * contiguous bytes that haven't yet been
+				 * delivered, which is all this caller needs.
+				 */
 				result = rpc;
 				goto done;
 			}
@@ -973,20 +2050,18 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 			interest.reg_rpc = rpc;
 			homa_rpc_unlock(rpc);
 		}
-		if (!sock_locked) {
-			homa_sock_lock(hsk, "homa_wait_for_message #2");
-			sock_locked = 1;
-		}
+
+		/* See if an appropriate RPC is already queued on one of
+		 * the ready shards.
+		 */
+		if (homa_find_ready_rpc(hsk, flags, id, &interest))
+			goto lock_rpc;
+
+		/* Nothing is ready; register interests so we'll be
+		 * notified when an RPC becomes available.
+		 */
+		spin_lock_bh(&hsk->interest_lock);
 		if ((id == 0) && (flags & HOMA_RECV_RESPONSE)) {
-			if (!list_empty(&hsk->ready_responses)) {
-				rpc = list_first_entry(
-						&hsk->ready_responses,
-						struct homa_rpc,
-						ready_links);
-				homa_interest_set(&interest, rpc);
-				list_del_init(&rpc->ready_links);
-				goto lock_rpc;
-			}
 			/* Insert this thread at the *front* of the list;
 			 * we'll get better cache locality if we reuse
 			 * the same thread over and over, rather than
@@ -995,38 +2070,80 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 					&hsk->response_interests);
 		}
 		if (flags & HOMA_RECV_REQUEST) {
-			if (!list_empty(&hsk->ready_requests)) {
-				rpc = list_first_entry(&hsk->ready_requests,
-						struct homa_rpc, ready_links);
-				homa_interest_set(&interest, rpc);
-				list_del_init(&rpc->ready_links);
-				goto lock_rpc;
-			}
 			list_add(&interest.request_links,
 					&hsk->request_interests);
 		}
-		
+		spin_unlock_bh(&hsk->interest_lock);
+
+		/* An RPC could have been queued on some shard after we
+		 * scanned it but before we registered; scan once more (the
+		 * barrier pairs with the one in homa_rpc_ready and
+		 * guarantees that at least one of us sees the other).
+		 */
+		smp_mb();
+		if (homa_find_ready_rpc(hsk, flags, id, &interest))
+			goto lock_rpc;
+
 	        /* There is no ready RPC so far. Clean up dead RPCs before
 		 * going to sleep (do at least a little cleanup even in
 		 * nonblocking mode).
 		 */
+		if (unlikely(active_start != 0)) {
+			__u64 now = get_cycles();
+			INC_METRIC(wait_find_cycles, now - active_start);
+			active_start = now;
+		}
+		homa_sock_lock(hsk, "homa_wait_for_message #2");
 		while (!atomic_long_read(&interest.id)) {
 			int reaper_result = homa_rpc_reap(hsk);
 			if (flags & HOMA_RECV_NONBLOCKING) {
+				homa_sock_unlock(hsk);
+				if (unlikely(active_start != 0)) {
+					INC_METRIC(wait_reap_cycles,
+							get_cycles()
+							- active_start);
+					active_start = 0;
+				}
 				result = ERR_PTR(-EAGAIN);
 				goto done;
 			}
 			if (reaper_result <= 0)
 				break;
 		}
-		
-		/* Now it's time to sleep. */
 		homa_sock_unlock(hsk);
-		sock_locked = 0;
+		if (unlikely(active_start != 0)) {
+			__u64 now = get_cycles();
+			INC_METRIC(wait_reap_cycles, now - active_start);
+			active_start = now;
+		}
+
+		/* Before sleeping, busy-wait for a while if this socket is in
+		 * polling mode: this avoids a costly context switch if a
+		 * message arrives very soon.
+		 */
+		if (hsk->poll_mode && (hsk->homa->poll_cycles != 0)) {
+			__u64 start = get_cycles();
+			__u64 end = start + hsk->homa->poll_cycles;
+			while (!atomic_long_read(&interest.id)
+					&& !hsk->shutdown) {
+				if (get_cycles() >= end)
+					break;
+				cpu_relax();
+			}
+			INC_METRIC(poll_cycles, get_cycles() - start);
+		}
+
+		/* Now it's time to sleep. */
 		set_current_state(TASK_INTERRUPTIBLE);
 		if (!atomic_long_read(&interest.id) && !hsk->shutdown)
 			schedule();
 		__set_current_state(TASK_RUNNING);
+
+		/* Don't charge polling or blocked time to wait_find_cycles
+		 * (polling has its own metric).
+		 */
+		if (unlikely(hsk->homa->cycle_metrics))
+			active_start = get_cycles();
 		if (atomic_long_read(&interest.id) != 0)
 			tt_record1("homa_wait_for_message woke up, id %d",
 					atomic_long_read(&interest.id));
@@ -1045,28 +2162,28 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 		}
 
 		/* Nothing happened (perhaps the RPC we were waiting for
-		 * was deleted?). Start over. */
+		 * was deleted, or we were woken just so we'll rescan the
+		 * ready queues?). Start over. */
 		continue;
-		
+
 lock_rpc:
-		/* We need to lookup and lock the RPC we're going to return,
-		 * but we have to release the socket lock first. The RPC
-		 * could go away as soon as we release the socket lock;
-		 * be careful (see sync.txt for details)!
+		/* Whoever handed off the RPC stashed a pointer to it in the
+		 * interest, along with a reap_disable reference that keeps
+		 * its memory stable, so we can lock it directly rather than
+		 * looking it up in the hash table again. The RPC could still
+		 * have been deleted (reaping is merely deferred); check for
+		 * that after locking (see sync.txt for details).
 		 */
-		if (sock_locked) {
-			homa_sock_unlock(hsk);
-			sock_locked = 0;
-		}
-		if (interest.is_client)
-			result = homa_find_client_rpc(hsk,
-					atomic_long_read(&interest.id));
-		else
-			result = homa_find_server_rpc(hsk, interest.peer_addr,
-					interest.peer_port,
-					atomic_long_read(&interest.id));
-		if (result)
+		rpc = interest.rpc;
+		interest.rpc = NULL;
+		homa_rpc_lock(rpc);
+		atomic_dec(&hsk->reap_disable);
+		if ((rpc->state != RPC_DEAD) && (rpc->id == (__u64)
+				atomic_long_read(&interest.id))) {
+			result = rpc;
 			goto done;
+		}
+		homa_rpc_unlock(rpc);
 
 		/* Looks like the RPC got deleted? Try again.*/
 		UNIT_LOG("; ", "RPC appears to have been deleted");
@@ -1074,94 +2191,211 @@ lock_rpc:
 	}
 
 done:
-	/* Note: if we went to sleep, then this info was already cleaned
-	 * up by whoever woke us up. Also, values in the interest may
-	 * change between when we test them below and when we acquire
-	 * the socket lock.
-	 */
-	if ((interest.reg_rpc) || (interest.request_links.next != LIST_POISON1)
-			|| (interest.response_links.next != LIST_POISON1)) {
-		if (!sock_locked) {
-			homa_sock_lock(hsk, "homa_wait_for_message #3");
-			sock_locked = 1;
-		}
-		if (interest.reg_rpc)
-			interest.reg_rpc->interest = NULL;
-		if (interest.request_links.next != LIST_POISON1)
-			list_del(&interest.request_links);
-		if (interest.response_links.next != LIST_POISON1)
-			list_del(&interest.response_links);
-	}
-	if (sock_locked)
-		homa_sock_unlock(hsk);
+	if (unlikely(active_start != 0))
+		INC_METRIC(wait_find_cycles, get_cycles() - active_start);
+	homa_interest_cleanup(hsk, &interest, id,
+			IS_ERR_OR_NULL(result) ? NULL : result);
 	return result;
 }
 
 /**
- * @homa_rpc_ready: This function is called when the input message for
- * an RPC becomes complete. It marks the RPC as READY and either notifies
- * a waiting reader or queues the RPC.
+ * homa_prefetch_message() - Begin loading the first cache lines of an
+ * RPC's incoming message, so the thread that is about to receive the
+ * message doesn't stall on cold packet data. The lines land in a cache
+ * level shared with the core where the woken thread will run, which
+ * trims fixed cycles from the start of its copy to user space.
+ * @rpc:    RPC with a message to be received; must be locked.
+ */
+static void homa_prefetch_message(struct homa_rpc *rpc)
+{
+	struct sk_buff *skb;
+
+	if (rpc->msgin.total_length < 0)
+		return;
+	skb = skb_peek(&rpc->msgin.packets);
+	if (skb != NULL) {
+		prefetch(skb_transport_header(skb));
+		prefetch(skb_transport_header(skb) + SMP_CACHE_BYTES);
+	}
+}
+
+/**
+ * homa_interest_handoff() - Attempt to hand an RPC to a waiting thread,
+ * waking it up.
+ * @interest:           Identifies the waiting thread.
+ * @rpc:                RPC to hand to the thread; must be locked.
+ *
+ * Return: Normally true. False means the thread had already been given
+ * some other RPC (it was also waiting on an interest list), so @rpc was
+ * not handed off.
+ */
+static bool homa_interest_handoff(struct homa_interest *interest,
+		struct homa_rpc *rpc)
+{
+	struct homa_sock *hsk = rpc->hsk;
+	bool handed_off = false;
+
+	spin_lock_bh(&hsk->interest_lock);
+	__homa_interest_unlink(interest);
+	if (atomic_long_read(&interest->id) == 0) {
+		homa_interest_set(interest, rpc);
+		handed_off = true;
+	}
+	spin_unlock_bh(&hsk->interest_lock);
+	if (handed_off) {
+		homa_prefetch_message(rpc);
+		wake_up_process(interest->thread);
+	}
+	return handed_off;
+}
+
+/**
+ * homa_rpc_partial_ready() - This function is called when additional
+ * contiguous bytes arrive for an incomplete message whose RPC has a
+ * thread waiting on it with HOMA_RECV_PARTIAL. It wakes up that thread
+ * (if there still is one) without marking the RPC as READY, so the
+ * thread can copy the newly arrived prefix to user space while the rest
+ * of the message is still in flight.
+ * @rpc:                RPC with new contiguous message data; must be
+ *                      locked.
+ */
+void homa_rpc_partial_ready(struct homa_rpc *rpc)
+{
+	struct homa_interest *interest = rpc->interest;
+
+	if ((interest == NULL) || !(interest->flags & HOMA_RECV_PARTIAL))
+		return;
+	rpc->interest = NULL;
+	homa_interest_handoff(interest, rpc);
+}
+
+/**
+ * @__homa_rpc_ready: Does the real work of homa_rpc_ready: marks the RPC
+ * as READY and either notifies a waiting reader or queues the RPC.
  * @rpc:                RPC that now has a complete input message;
- *                      must be locked. The caller must also have
- *                      locked the socket for this RPC.
+ *                      must be locked.
  */
-void homa_rpc_ready(struct homa_rpc *rpc)
+static void __homa_rpc_ready(struct homa_rpc *rpc)
 {
+	struct homa_sock *hsk = rpc->hsk;
+	struct homa_ready_shard *shard;
 	struct homa_interest *interest;
+	struct list_head *interests;
 	struct sock *sk;
-	
+
+	if (rpc->is_client && (rpc->error == 0)
+			&& (rpc->msgin.total_length >= 0)) {
+		homa_record_rpc_latency(rpc);
+		homa_check_freeze_slo(rpc);
+	}
 	rpc->state = RPC_READY;
-	
+	interests = rpc->is_client ? &hsk->response_interests
+			: &hsk->request_interests;
+
+	/* Signal the application's eventfd (if it registered one with
+	 * HOMA_SO_EVENTFD) on every completion, even if a thread is woken
+	 * below: a pipelining client may be harvesting with nonblocking
+	 * receives and counting on the eventfd for all of its wakeups.
+	 */
+	if (hsk->event_ctx != NULL)
+		eventfd_signal(hsk->event_ctx, 1);
+
 	/* First, see if someone is interested in this RPC specifically.
 	 */
 	if (rpc->interest) {
 		interest = rpc->interest;
-		goto handoff;
+		rpc->interest = NULL;
+		if (homa_interest_handoff(interest, rpc))
+			return;
+		/* The thread was also waiting on an interest list and has
+		 * already been given some other RPC; queue this one like
+		 * any other.
+		 */
 	}
-	
+
 	/* Second, check the interest list for this type of RPC. */
-	if (rpc->is_client) {
-		interest = list_first_entry_or_null(
-				&rpc->hsk->response_interests,
-				struct homa_interest, response_links);
-		if (interest)
-			goto handoff;
-		list_add_tail(&rpc->ready_links, &rpc->hsk->ready_responses);
-	} else {
-		interest = list_first_entry_or_null(
-				&rpc->hsk->request_interests,
-				struct homa_interest, request_links);
-		if (interest)
-			goto handoff;
-		list_add_tail(&rpc->ready_links, &rpc->hsk->ready_requests);
+	if (!list_empty(interests)) {
+		spin_lock_bh(&hsk->interest_lock);
+		while (1) {
+			if (rpc->is_client)
+				interest = list_first_entry_or_null(interests,
+						struct homa_interest,
+						response_links);
+			else
+				interest = list_first_entry_or_null(interests,
+						struct homa_interest,
+						request_links);
+			if (interest == NULL)
+				break;
+			__homa_interest_unlink(interest);
+			if (atomic_long_read(&interest->id) == 0) {
+				homa_interest_set(interest, rpc);
+				spin_unlock_bh(&hsk->interest_lock);
+				homa_prefetch_message(rpc);
+				wake_up_process(interest->thread);
+				return;
+			}
+			/* Stale entry: that thread has already claimed an
+			 * RPC for itself but hasn't unregistered yet; skip
+			 * it and try the next one.
+			 */
+		}
+		spin_unlock_bh(&hsk->interest_lock);
 	}
-	
-	/* If we get here, no-one is waiting for the RPC, so it has been
-	 * queued.
+
+	/* No-one is waiting for the RPC, so queue it on this core's shard:
+	 * SoftIRQ runs on the core that performed GRO for the message, so
+	 * a thread that receives here will find the message's cache lines
+	 * warm. An idle thread on another core can still steal it.
 	 */
-	
-	/* Notify the poll mechanism. */
-	sk = (struct sock *) rpc->hsk;
-	sk->sk_data_ready(sk);
-	return;
-	
-handoff:
-	/* We found a waiting thread. Wakeup the thread and cleanup its
-	 * interest info, so it won't have to acquire the socket lock
-	 * again.
+	shard = &hsk->ready_shards[smp_processor_id()];
+	spin_lock_bh(&shard->lock);
+	rpc->ready_shard = shard - hsk->ready_shards;
+	if (rpc->is_client)
+		list_add_tail(&rpc->ready_links, &shard->ready_responses);
+	else
+		list_add_tail(&rpc->ready_links, &shard->ready_requests);
+	spin_unlock_bh(&shard->lock);
+
+	/* A thread could have registered an interest after we checked
+	 * above, but before the RPC was visible on the ready queue; if so,
+	 * wake it up so it will rescan the queues (the barrier pairs with
+	 * the one in homa_wait_for_message and guarantees that at least
+	 * one of us sees the other).
 	 */
-	homa_interest_set(interest, rpc);
-	if (interest->reg_rpc) {
-		interest->reg_rpc->interest = NULL;
-		interest->reg_rpc = NULL;
-	}
-	if (interest->request_links.next != LIST_POISON1) {
-		list_del(&interest->request_links);
-		interest->request_links.next = LIST_POISON1;
-	}
-	if (interest->response_links.next != LIST_POISON1) {
-		list_del(&interest->response_links);
-		interest->response_links.next = LIST_POISON1;
+	smp_mb();
+	if (!list_empty(interests)) {
+		spin_lock_bh(&hsk->interest_lock);
+		if (rpc->is_client)
+			interest = list_first_entry_or_null(interests,
+					struct homa_interest, response_links);
+		else
+			interest = list_first_entry_or_null(interests,
+					struct homa_interest, request_links);
+		if (interest != NULL)
+			wake_up_process(interest->thread);
+		spin_unlock_bh(&hsk->interest_lock);
 	}
-	wake_up_process(interest->thread);
+
+	/* Notify the poll mechanism. */
+	sk = (struct sock *) hsk;
+	sk->sk_data_ready(sk);
+}
+
+/**
+ * @homa_rpc_ready: This function is called when the input message for
+ * an RPC becomes complete. It marks the RPC as READY and either notifies
+ * a waiting reader or queues the RPC.
+ * @rpc:                RPC that now has a complete input message;
+ *                      must be locked.
+ */
+void homa_rpc_ready(struct homa_rpc *rpc)
+{
+	__u64 start = 0;
+
+	if (unlikely(rpc->hsk->homa->cycle_metrics))
+		start = get_cycles();
+	__homa_rpc_ready(rpc);
+	if (unlikely(start != 0))
+		INC_METRIC(wakeup_cycles, get_cycles() - start);
 }
\ No newline at end of file
@@ -186,14 +186,18 @@ int homa_gro_complete(struct sk_buff *skb, int hoffset)
 	
 	/* Set the hash for the skb, which will be used for RPS (the default
 	 * hash doesn't understand Homa, so it doesn't include port #'s).
+	 * All of the packets of an RPC get the same hash, and homa_steer_flow
+	 * records the consuming thread's core for that hash in the kernel's
+	 * RFS flow table, so softirq processing for an RPC happens on the
+	 * core where its message will be consumed.
 	 * Setting the hash here is suboptimal, because this function doesn't
 	 * get invoked for skb's where nothing was merged onto them.
 	 * However, setting the hash in homa_gro_receive doesn't work either,
 	 * because it messes up the same_flow computation, which will compare
 	 * the default hash of a new packet with the recomputed hash of a
-	 * held packet. 
+	 * held packet.
 	 */
-	__skb_set_sw_hash(skb, jhash_3words(ip_hdr(skb)->saddr,
-			h->sport, h->dport, 0), false);
+	__skb_set_sw_hash(skb, homa_flow_hash(ip_hdr(skb)->saddr,
+			h->sport, h->dport, h->id), false);
 	return 0;
 }
\ No newline at end of file
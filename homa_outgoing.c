@@ -19,6 +19,16 @@
 
 #include "homa_impl.h"
 
+/* Per-core pools of sk_buffs for outgoing control packets; see
+ * __homa_xmit_control.
+ */
+struct homa_ctl_skb_pool homa_ctl_skb_pools[NR_CPUS];
+
+/* Per-core pools of recycled sk_buffs for outgoing data packets; see
+ * homa_data_skb_alloc.
+ */
+struct homa_data_skb_pool homa_data_skb_pools[NR_CPUS];
+
 /**
  * set_priority() - Arrange for a packet to have a VLAN header that
  * specifies a priority for the packet. Note: vconfig must be used
@@ -41,6 +51,163 @@ inline static void set_priority(struct sk_buff *skb, struct homa_sock *hsk,
 			priority + hsk->homa->base_priority;
 }
 
+/**
+ * homa_pkt_geometry() - Compute how a message to a given peer will be
+ * divided into packets and sk_buffs. All of the results are derived from
+ * the peer's path MTU, so larger frames (e.g. on a jumbo-enabled fabric)
+ * automatically produce larger segments and fewer packets. The number of
+ * unscheduled bytes also depends on the peer's RTT-bytes estimate, if
+ * one is available (see homa_peer.rtt_bytes).
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @peer:    Peer to which the message will be sent.
+ * @len:     Number of bytes in the message.
+ * @geo:     Struct to fill in with the results.
+ */
+void homa_pkt_geometry(struct homa *homa, struct homa_peer *peer,
+		size_t len, struct homa_pkt_geometry *geo)
+{
+	int mtu = dst_mtu(peer->dst);
+
+	geo->max_pkt_data = mtu - HOMA_IPV4_HEADER_LENGTH
+			- sizeof(struct data_header);
+	geo->zcopy = (homa->zerocopy_min_bytes != 0)
+			&& (len >= homa->zerocopy_min_bytes)
+			&& (len > geo->max_pkt_data);
+	if (len <= geo->max_pkt_data) {
+		geo->unscheduled = geo->max_gso_data = len;
+		geo->gso_size = mtu;
+	} else {
+		int bufs_per_gso, rtt_bytes;
+
+		geo->gso_size = peer->dst->dev->gso_max_size;
+		if (geo->gso_size > homa->max_gso_size)
+			geo->gso_size = homa->max_gso_size;
+
+		/* Round gso_size down to an even # of mtus. */
+		bufs_per_gso = geo->gso_size/mtu;
+		if (bufs_per_gso == 0) {
+			bufs_per_gso = 1;
+			mtu = geo->gso_size;
+			geo->max_pkt_data = mtu - HOMA_IPV4_HEADER_LENGTH
+					- sizeof(struct data_header);
+		}
+		geo->max_gso_data = bufs_per_gso * geo->max_pkt_data;
+		geo->gso_size = bufs_per_gso * mtu;
+
+		/* Page frags don't mix with GSO: each data_segment's header
+		 * must precede its data in the packet's byte stream, which
+		 * can't be arranged when the data lives in frags. So zero-copy
+		 * messages use one segment per sk_buff.
+		 */
+		if (geo->zcopy) {
+			geo->max_gso_data = geo->max_pkt_data;
+			geo->gso_size = mtu;
+		}
+
+		/* Use the peer's own RTT-bytes estimate, if we have one:
+		 * peers differ in how quickly they return grants, so a
+		 * single global value overshoots on some destinations and
+		 * stalls on others (see homa_peer_update_rtt).
+		 */
+		rtt_bytes = homa->rtt_bytes;
+		if (homa->peer_rtt_adapt && (peer->rtt_bytes != 0))
+			rtt_bytes = peer->rtt_bytes;
+
+		/* Round unscheduled bytes *up* to an even number of gsos. */
+		geo->unscheduled = rtt_bytes + geo->max_gso_data - 1;
+		geo->unscheduled -= geo->unscheduled % geo->max_gso_data;
+		if (geo->unscheduled > len)
+			geo->unscheduled = len;
+	}
+}
+
+/**
+ * homa_data_skb_alloc() - Allocate an sk_buff for an outgoing data packet,
+ * preferring a warm buffer recycled on the current core over a fresh
+ * allocation (see struct homa_data_skb_pool).
+ * @size:    Number of bytes needed in the sk_buff's data area, as for
+ *           alloc_skb.
+ *
+ * Return:   The sk_buff, or NULL if memory was exhausted.
+ */
+struct sk_buff *homa_data_skb_alloc(int size)
+{
+	struct homa_data_skb_pool *pool;
+	struct sk_buff *skb = NULL;
+
+	local_bh_disable();
+	pool = &homa_data_skb_pools[smp_processor_id()];
+	if (pool->size == (int) SKB_DATA_ALIGN(size)) {
+		while (pool->count > 0) {
+			skb = pool->skbs[pool->head];
+			pool->head = (pool->head + 1)
+					& (HOMA_DATA_SKB_POOL_SIZE - 1);
+			pool->count--;
+			if (likely((refcount_read(&skb->users) == 1)
+					&& !skb_cloned(skb))) {
+				/* Return the sk_buff to its freshly-allocated
+				 * state (including clearing the GSO info left
+				 * over from its previous transmission).
+				 */
+				skb_dst_drop(skb);
+				skb->data = skb->head;
+				skb->len = 0;
+				skb_reset_tail_pointer(skb);
+				skb_shinfo(skb)->gso_size = 0;
+				skb_shinfo(skb)->gso_type = 0;
+				skb_shinfo(skb)->gso_segs = 0;
+				INC_METRIC(data_skbs_reused, 1);
+				break;
+			}
+
+			/* Still in use by the IP stack; drop our reference
+			 * and keep looking.
+			 */
+			kfree_skb(skb);
+			skb = NULL;
+		}
+	}
+	local_bh_enable();
+	if (skb == NULL)
+		skb = alloc_skb(size, GFP_KERNEL);
+	return skb;
+}
+
+/**
+ * homa_data_skb_recycle() - Offer a no-longer-needed data-packet sk_buff
+ * to the current core's pool for reuse. The caller's reference is
+ * transferred to the pool if the buffer is cached.
+ * @skb:     The buffer; must have been allocated by homa_data_skb_alloc.
+ *
+ * Return:   Nonzero means the buffer was cached; zero means it could not
+ *           be (the caller must free it, e.g. with kfree_skb).
+ */
+int homa_data_skb_recycle(struct sk_buff *skb)
+{
+	struct homa_data_skb_pool *pool;
+	int size = skb_end_offset(skb);
+	int result = 0;
+
+	if (skb->data_len != 0)
+		/* Nonlinear (e.g. zero-copy page frags); can't be rewound
+		 * for reuse.
+		 */
+		return 0;
+	local_bh_disable();
+	pool = &homa_data_skb_pools[smp_processor_id()];
+	if (pool->count == 0)
+		pool->size = size;
+	if ((pool->size == size)
+			&& (pool->count < HOMA_DATA_SKB_POOL_SIZE)) {
+		pool->skbs[(pool->head + pool->count)
+				& (HOMA_DATA_SKB_POOL_SIZE - 1)] = skb;
+		pool->count++;
+		result = 1;
+	}
+	local_bh_enable();
+	return result;
+}
+
 /**
  * homa_fill_packets() - Create one or more packets and fill them with
  * data from user space.
@@ -67,44 +234,23 @@ struct sk_buff *homa_fill_packets(struct homa *homa, struct homa_peer *peer,
 	int bytes_left, unsched;
 	struct sk_buff *skb;
 	struct sk_buff *first = NULL;
-	int err, mtu, max_pkt_data, gso_size, max_gso_data;
+	int err, max_pkt_data, gso_size, max_gso_data;
+	bool zcopy;
+	struct homa_pkt_geometry geo;
 	struct sk_buff **last_link;
 
 	if (unlikely((len > HOMA_MAX_MESSAGE_LENGTH) || (len == 0))) {
 		err = -EINVAL;
 		goto error;
 	}
-	
-	mtu = dst_mtu(peer->dst);
-	max_pkt_data = mtu - HOMA_IPV4_HEADER_LENGTH - sizeof(struct data_header);
-	if (len <= max_pkt_data) {
-		unsched = max_gso_data = len;
-		gso_size = mtu;
-	} else {
-		int bufs_per_gso;
-		
-		gso_size = peer->dst->dev->gso_max_size;
-		if (gso_size > homa->max_gso_size)
-			gso_size = homa->max_gso_size;
-		
-		/* Round gso_size down to an even # of mtus. */
-		bufs_per_gso = gso_size/mtu;
-		if (bufs_per_gso == 0) {
-			bufs_per_gso = 1;
-			mtu = gso_size;
-			max_pkt_data = mtu - HOMA_IPV4_HEADER_LENGTH
-					- sizeof(struct data_header);
-		}
-		max_gso_data = bufs_per_gso * max_pkt_data;
-		gso_size = bufs_per_gso * mtu;
-		
-		/* Round unscheduled bytes *up* to an even number of gsos. */
-		unsched = homa->rtt_bytes + max_gso_data - 1;
-		unsched -= unsched % max_gso_data;
-		if (unsched > len)
-			unsched = len;
-	}
-	
+
+	homa_pkt_geometry(homa, peer, len, &geo);
+	max_pkt_data = geo.max_pkt_data;
+	gso_size = geo.gso_size;
+	max_gso_data = geo.max_gso_data;
+	unsched = geo.unscheduled;
+	zcopy = geo.zcopy;
+
 	/* Copy message data from user space and form sk_buffs. Each
 	 * sk_buff may contain multiple data_segments, each of which will
 	 * turn into a separate packet, using either TSO in the NIC or
@@ -116,8 +262,8 @@ struct sk_buff *homa_fill_packets(struct homa *homa, struct homa_peer *peer,
 		int available, last_pkt_length;
 		
 		/* The sizeof32(void*) creates extra space for homa_next_skb. */
-		skb = alloc_skb(gso_size + HOMA_SKB_EXTRA + sizeof32(void*),
-				GFP_KERNEL);
+		skb = homa_data_skb_alloc(gso_size + HOMA_SKB_EXTRA
+				+ sizeof32(void*));
 		if (unlikely(!skb)) {
 			err = -ENOMEM;
 			goto error;
@@ -150,8 +296,21 @@ struct sk_buff *homa_fill_packets(struct homa *homa, struct homa_peer *peer,
 			else
 				seg_size = max_pkt_data;
 			seg->segment_length = htonl(seg_size);
-			if (copy_from_user(skb_put(skb, seg_size), buffer,
-					seg_size)) {
+			if (zcopy && ((seg_size + sizeof32(struct data_header))
+					>= HOMA_MAX_HEADER)) {
+				/* Short final segments fall through to the
+				 * copying path below, so the padding code
+				 * at the end of the outer loop never has to
+				 * extend a nonlinear sk_buff.
+				 */
+				err = homa_skb_fill_user_pages(skb, buffer,
+						seg_size);
+				if (unlikely(err != 0)) {
+					kfree_skb(skb);
+					goto error;
+				}
+			} else if (copy_from_user(skb_put(skb, seg_size),
+					buffer, seg_size)) {
 				err = -EFAULT;
 				kfree_skb(skb);
 				goto error;
@@ -181,6 +340,50 @@ struct sk_buff *homa_fill_packets(struct homa *homa, struct homa_peer *peer,
 	return ERR_PTR(err);
 }
 
+/**
+ * homa_skb_fill_user_pages() - Attach a range of user-space memory to an
+ * outgoing packet as page frags, pinning the pages rather than copying
+ * the data. The pages are unpinned automatically when the sk_buff is
+ * freed.
+ * @skb:      Packet buffer; all of its linear data (headers) must already
+ *            be present.
+ * @buffer:   First byte of message data in user space.
+ * @length:   Number of bytes of data at @buffer.
+ *
+ * Return:    0 for success, otherwise a negative errno.
+ */
+int homa_skb_fill_user_pages(struct sk_buff *skb, char __user *buffer,
+		int length)
+{
+	unsigned long addr = (unsigned long) buffer;
+	int offset = addr & (PAGE_SIZE - 1);
+	int npages = (offset + length + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	struct page *pages[HOMA_MAX_DATA_PAGES];
+	int i, npinned, chunk;
+
+	if (unlikely(npages > HOMA_MAX_DATA_PAGES))
+		return -EINVAL;
+	npinned = get_user_pages_fast(addr & PAGE_MASK, npages, 0, pages);
+	if (unlikely(npinned != npages)) {
+		for (i = 0; i < npinned; i++)
+			put_page(pages[i]);
+		return -EFAULT;
+	}
+	for (i = 0; i < npages; i++) {
+		chunk = PAGE_SIZE - offset;
+		if (chunk > length)
+			chunk = length;
+		skb_fill_page_desc(skb, skb_shinfo(skb)->nr_frags, pages[i],
+				offset, chunk);
+		skb->len += chunk;
+		skb->data_len += chunk;
+		skb->truesize += chunk;
+		length -= chunk;
+		offset = 0;
+	}
+	return 0;
+}
+
 /**
  * homa_message_out_init() - Initializes an RPC's msgout. Doesn't actually
  * send any packets.
@@ -193,16 +396,26 @@ struct sk_buff *homa_fill_packets(struct homa *homa, struct homa_peer *peer,
 void homa_message_out_init(struct homa_rpc *rpc, int sport, struct sk_buff *skb,
 		int len)
 {
+	struct homa_pkt_geometry geo;
+
 	rpc->msgout.length = len;
 	rpc->msgout.packets = skb;
 	rpc->msgout.num_skbs = 0;
 	rpc->msgout.next_packet = skb;
-	rpc->msgout.unscheduled = rpc->hsk->homa->rtt_bytes;
+	rpc->msgout.init_cycles = get_cycles();
+
+	/* Must compute unscheduled bytes the same way homa_fill_packets
+	 * did, so that msgout.unscheduled agrees with the incoming values
+	 * advertised in the packets (which depend on the peer's MTU).
+	 */
+	homa_pkt_geometry(rpc->hsk->homa, rpc->peer, len, &geo);
+	rpc->msgout.unscheduled = geo.unscheduled;
 	rpc->msgout.granted = rpc->msgout.unscheduled;
 	if (rpc->msgout.granted > rpc->msgout.length)
 		rpc->msgout.granted = rpc->msgout.length;
 	rpc->msgout.sched_priority = 0;
-	
+	rpc->msgout.busy_pending = 0;
+
 	/* Must scan the packets to fill in header fields that weren't
 	 * known when the packets were allocated.
 	 */
@@ -217,6 +430,7 @@ void homa_message_out_init(struct homa_rpc *rpc, int sport, struct sk_buff *skb,
 		h->message_length = htonl(len);
 		h->cutoff_version = rpc->peer->cutoff_version;
 		h->retransmit = 0;
+		h->busy = 0;
 		skb = *homa_next_skb(skb);
 	}
 }
@@ -248,7 +462,8 @@ int homa_message_out_reset(struct homa_rpc *rpc)
 	for (skb = msgout->packets; skb != NULL; skb = next) {
 		struct sk_buff *new_skb;
 		int length = skb_tail_pointer(skb) - skb_transport_header(skb);
-		new_skb = alloc_skb(length + HOMA_IPV4_HEADER_LENGTH
+		new_skb = alloc_skb(length + skb->data_len
+				+ HOMA_IPV4_HEADER_LENGTH
 				+ HOMA_SKB_EXTRA, GFP_KERNEL);
 		if (unlikely(!new_skb)) {
 			err = -ENOMEM;
@@ -261,6 +476,16 @@ int homa_message_out_reset(struct homa_rpc *rpc)
 			skb_reset_transport_header(new_skb);
 			__skb_put_data(new_skb, skb_transport_header(skb),
 					length);
+			if (skb->data_len != 0) {
+				/* Message data is in pinned user pages
+				 * (see homa_skb_fill_user_pages); the copy
+				 * below makes the new packet linear, which
+				 * is safe for retransmission.
+				 */
+				skb_copy_bits(skb, skb_headlen(skb),
+						skb_put(new_skb, skb->data_len),
+						skb->data_len);
+			}
 			skb_shinfo(new_skb)->gso_size =
 					skb_shinfo(skb)->gso_size;
 			skb_shinfo(new_skb)->gso_segs =
@@ -270,6 +495,7 @@ int homa_message_out_reset(struct homa_rpc *rpc)
 			h = ((struct data_header *)
 					skb_transport_header(new_skb));
 			h->retransmit = 0;
+			h->busy = 0;
 			*last_link = new_skb;
 			last_link = homa_next_skb(new_skb);
 		}
@@ -279,6 +505,7 @@ int homa_message_out_reset(struct homa_rpc *rpc)
 	*last_link = NULL;
 	
 	msgout->next_packet = msgout->packets;
+	msgout->init_cycles = get_cycles();
 	msgout->granted = msgout->unscheduled;
 	if (msgout->granted > msgout->length)
 		msgout->granted = msgout->length;
@@ -347,17 +574,53 @@ int homa_xmit_control(enum homa_packet_type type, void *contents,
 int __homa_xmit_control(void *contents, size_t length, struct homa_peer *peer,
 		struct homa_sock *hsk)
 {
+	struct homa_ctl_skb_pool *pool;
+	struct sk_buff *skb = NULL;
 	struct common_header *h;
 	int extra_bytes;
 	int result;
-	
-	/* Allocate the same size sk_buffs as for the smallest data
-         * packets (better reuse of sk_buffs?).
+
+	/* Control packets are all the same (small) size, so they are
+	 * sent using recycled sk_buffs from a per-core pool, which makes
+	 * control transmission allocation-free in the common case. An
+	 * sk_buff enters the pool with a reference still held by the IP
+	 * stack; the pool is FIFO, so by the time an sk_buff comes back
+	 * up for reuse its transmission has normally completed and we
+	 * hold the only reference. If not, it is freed and replaced.
 	 */
-	struct sk_buff *skb = alloc_skb(dst_mtu(peer->dst) + HOMA_SKB_EXTRA
-			+ sizeof32(void*), GFP_KERNEL);
-	if (unlikely(!skb))
-		return -ENOBUFS;
+	local_bh_disable();
+	pool = &homa_ctl_skb_pools[smp_processor_id()];
+	while (pool->count > 0) {
+		skb = pool->skbs[pool->head];
+		pool->head = (pool->head + 1) & (HOMA_CTL_SKB_POOL_SIZE - 1);
+		pool->count--;
+		if (likely((refcount_read(&skb->users) == 1)
+				&& !skb_cloned(skb))) {
+			/* Return the sk_buff to its freshly-allocated
+			 * state (the IP stack pushed headers onto it during
+			 * its previous transmission).
+			 */
+			skb_dst_drop(skb);
+			skb->data = skb->head;
+			skb->len = 0;
+			skb_reset_tail_pointer(skb);
+			INC_METRIC(control_skbs_reused, 1);
+			break;
+		}
+
+		/* Still in use by the IP stack; drop our reference and
+		 * keep looking.
+		 */
+		kfree_skb(skb);
+		skb = NULL;
+	}
+	local_bh_enable();
+	if (skb == NULL) {
+		skb = alloc_skb(HOMA_MAX_HEADER + HOMA_IPV4_HEADER_LENGTH
+				+ HOMA_SKB_EXTRA + sizeof32(void*), GFP_KERNEL);
+		if (unlikely(!skb))
+			return -ENOBUFS;
+	}
 	skb_reserve(skb, HOMA_IPV4_HEADER_LENGTH + HOMA_SKB_EXTRA);
 	skb_reset_transport_header(skb);
 	h = (struct common_header *) skb_put(skb, length);
@@ -385,8 +648,23 @@ int __homa_xmit_control(void *contents, size_t length, struct homa_peer *peer,
 			printk(KERN_NOTICE "ip_queue_xmit didn't free "
 					"Homa control packet after error\n");
 	}
-	kfree_skb(skb);
 	INC_METRIC(packets_sent[h->type - DATA], 1);
+
+	/* Keep our reference on the sk_buff and stash it in the pool for
+	 * reuse by a future control packet. If the pool is full, just
+	 * release the reference.
+	 */
+	local_bh_disable();
+	pool = &homa_ctl_skb_pools[smp_processor_id()];
+	if (pool->count < HOMA_CTL_SKB_POOL_SIZE) {
+		pool->skbs[(pool->head + pool->count)
+				& (HOMA_CTL_SKB_POOL_SIZE - 1)] = skb;
+		pool->count++;
+		skb = NULL;
+	}
+	local_bh_enable();
+	if (skb != NULL)
+		kfree_skb(skb);
 	return result;
 }
 
@@ -420,7 +698,8 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 			break;
 		
 		if ((rpc->msgout.length - offset) >= homa->throttle_min_bytes) {
-			if(!homa_check_nic_queue(homa, skb, force)) {
+			if(!homa_check_nic_queue(homa_peer_link(homa,
+					rpc->peer), skb, force)) {
 				homa_add_to_throttled(rpc);
 				break;
 			}
@@ -460,7 +739,13 @@ void __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc, int priority)
 	 * message was initially created.
 	 */
 	h->cutoff_version = rpc->peer->cutoff_version;
-	
+
+	/* If a RESEND for this message was answered with a deferred BUSY,
+	 * deliver the busy indication on this packet.
+	 */
+	h->busy = rpc->msgout.busy_pending;
+	rpc->msgout.busy_pending = 0;
+
 	dst_hold(rpc->peer->dst);
 	skb_dst_set(skb, rpc->peer->dst);
 	skb->ip_summed = CHECKSUM_PARTIAL;
@@ -550,7 +835,20 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 			__skb_put_data(new_skb, skb_transport_header(skb),
 					sizeof32(struct data_header)
 					- sizeof32(struct data_segment));
-			__skb_put_data(new_skb, seg, sizeof32(*seg) + length);
+			if (skb->data_len != 0) {
+				/* Segment data is in pinned user pages (see
+				 * homa_skb_fill_user_pages), so it must be
+				 * copied out of the frags. Such packets have
+				 * exactly one segment.
+				 */
+				__skb_put_data(new_skb, seg, sizeof32(*seg));
+				skb_copy_bits(skb, skb_headlen(skb),
+						skb_put(new_skb, length),
+						length);
+			} else {
+				__skb_put_data(new_skb, seg,
+						sizeof32(*seg) + length);
+			}
 			if (unlikely(new_skb->len < HOMA_MAX_HEADER))
 					skb_put(new_skb, HOMA_MAX_HEADER
 					- new_skb->len);
@@ -560,10 +858,11 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 				h->incoming = htonl(offset + length);
 			else
 				h->incoming = htonl(end);
-			tt_record3("retransmitting offset %d, length %d, id %d",
-					offset, length,
+			tt_record_rpc3(rpc, "retransmitting offset %d, length %d, "
+					"id %d", offset, length,
 					h->common.id & 0xffffffff);
-			homa_check_nic_queue(rpc->hsk->homa, new_skb, true);
+			homa_check_nic_queue(homa_peer_link(rpc->hsk->homa,
+					rpc->peer), new_skb, true);
 			__homa_xmit_data(new_skb, rpc, priority);
 			INC_METRIC(resent_packets, 1);
 		}
@@ -587,6 +886,13 @@ void homa_outgoing_sysctl_changed(struct homa *homa)
 	tmp = homa->max_nic_queue_ns;
 	tmp = (tmp*cpu_khz)/1000000;
 	homa->max_nic_queue_cycles = tmp;
+	tmp = homa->poll_usecs;
+	tmp = (tmp*cpu_khz)/1000;
+	homa->poll_cycles = tmp;
+	if (homa->num_links < 1)
+		homa->num_links = 1;
+	if (homa->num_links > HOMA_MAX_LINKS)
+		homa->num_links = HOMA_MAX_LINKS;
 }
 
 /**
@@ -595,7 +901,7 @@ void homa_outgoing_sysctl_changed(struct homa *homa)
  * an estimate of the NIC queue length. Second, it indicates to the caller
  * whether the NIC queue is so full that no new packets should be queued
  * (Homa's SRPT depends on keeping the NIC queue short).
- * @homa:     Overall data about the Homa protocol implementation.
+ * @link:     The egress interface on which the packet will be transmitted.
  * @skb:      Packet that is about to be transmitted.
  * @force:    True means this packet is going to be transmitted
  *            regardless of the queue length.
@@ -605,13 +911,17 @@ void homa_outgoing_sysctl_changed(struct homa *homa)
  *            the transmission of @skb. If nonzero is returned, then the
  *            queue estimate is updated to reflect the transmission of @skb.
  */
-int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
+int homa_check_nic_queue(struct homa_link *link, struct sk_buff *skb,
+		bool force)
 {
+	struct homa *homa = link->homa;
 	__u64 idle, new_idle, clock;
+	atomic64_t *idle_time;
 	int cycles_for_packet, segs, bytes;
-	
+
 	segs = skb_shinfo(skb)->gso_segs;
 	bytes = skb->tail - skb->transport_header;
+	bytes += skb->data_len;
 	bytes += HOMA_IPV4_HEADER_LENGTH + HOMA_VLAN_HEADER + HOMA_ETH_OVERHEAD;
 	if (segs > 0)
 		bytes += (segs - 1) * (sizeof32(struct data_header)
@@ -619,9 +929,10 @@ int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
 				+ HOMA_IPV4_HEADER_LENGTH + HOMA_VLAN_HEADER
 				+ HOMA_ETH_OVERHEAD);
 	cycles_for_packet = (bytes*homa->cycles_per_kbyte)/1000;
+	idle_time = homa_tx_idle_time(link);
 	while (1) {
 		clock = get_cycles();
-		idle = atomic64_read(&homa->link_idle_time);
+		idle = atomic64_read(idle_time);
 		if (((clock + homa->max_nic_queue_cycles) < idle) && !force
 				&& !(homa->flags & HOMA_FLAG_DONT_THROTTLE))
 			return 0;
@@ -629,47 +940,89 @@ int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
 			new_idle = clock + cycles_for_packet;
 		else
 			new_idle = idle + cycles_for_packet;
-		
+
 		/* This method must be thread-safe. */
-		if (atomic64_cmpxchg_relaxed(&homa->link_idle_time, idle,
-				new_idle) == idle)
+		if (atomic64_cmpxchg_relaxed(idle_time, idle, new_idle)
+				== idle)
 			break;
 	}
 	return 1;
 }
 
 /**
- * homa_pacer_thread() - Top-level function for the pacer thread.
- * @transportInfo:  Pointer to struct homa.
+ * homa_pacer_hrtimer() - Invoked when the pacer's hrtimer fires, meaning
+ * the NIC queue is expected to have space for the next throttled packet.
+ * Runs at IRQ level.
+ * @timer:   The timer that triggered.
  *
- * Return:         Always 0.
+ * Return:   Always HRTIMER_NORESTART.
  */
-int homa_pacer_main(void *transportInfo)
+enum hrtimer_restart homa_pacer_hrtimer(struct hrtimer *timer)
 {
-	cycles_t start;
-	struct homa *homa = (struct homa *) transportInfo;
-	
+	struct homa_link *link = container_of(timer, struct homa_link,
+			pacer_hrtimer);
+	wake_up_process(link->pacer_kthread);
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * homa_pacer_thread() - Top-level function for a pacer thread (there is
+ * one of these threads for each egress interface).
+ * @linkInfo:  Pointer to the struct homa_link this thread paces.
+ *
+ * Return:    Always 0.
+ */
+int homa_pacer_main(void *linkInfo)
+{
+	cycles_t start, now, idle;
+	__u64 delay_ns;
+	struct homa_link *link = (struct homa_link *) linkInfo;
+	struct homa *homa = link->homa;
+
 	while (1) {
-		if (homa->pacer_exit) {
+		if (link->pacer_exit) {
 			break;
 		}
-		
+
 		start = get_cycles();
-		homa_pacer_xmit(homa);
+		homa_pacer_xmit(link);
 		// INC_METRIC(pacer_cycles, get_cycles() - start);
-		
-		/* Sleep this thread if the throttled list is empty. Even
-		 * if the throttled list isn't empty, call the scheduler
-		 * to give other processes a chance to run (if we don't,
-		 * softirq handlers can get locked out, which prevents
-		 * incoming packets from being handled).
+
+		/* Sleep this thread if the throttled list is empty (the
+		 * next homa_add_to_throttled will wake us). If there are
+		 * throttled RPCs but the NIC queue is too full to transmit,
+		 * sleep on the hrtimer until the queue is expected to have
+		 * drained; but if the queue has been nonempty for many
+		 * passes in a row, busy-wait instead, since wakeup latency
+		 * would leave the link idle. Even when we don't sleep, call
+		 * the scheduler to give other processes a chance to run
+		 * (if we don't, softirq handlers can get locked out, which
+		 * prevents incoming packets from being handled).
 		 */
 		set_current_state(TASK_INTERRUPTIBLE);
-		if (list_first_or_null_rcu(&homa->throttled_rpcs,
+		if ((list_first_or_null_rcu(&link->throttled_rpcs,
 				struct homa_rpc, throttled_links) == NULL)
+				&& llist_empty(&link->throttled_staging)) {
+			link->pacer_busy_passes = 0;
 			tt_record("pacer sleeping");
-		else
-			__set_current_state(TASK_RUNNING);
+		} else {
+			now = get_cycles();
+			idle = atomic64_read(homa_tx_idle_time(link));
+			link->pacer_busy_passes++;
+			if (((now + homa->max_nic_queue_cycles) < idle)
+					&& (link->pacer_busy_passes
+					< homa->pacer_spin_threshold)) {
+				delay_ns = idle - now
+						- homa->max_nic_queue_cycles;
+				delay_ns = (delay_ns*1000000)/cpu_khz;
+				hrtimer_start(&link->pacer_hrtimer,
+						ns_to_ktime(delay_ns),
+						HRTIMER_MODE_REL);
+				tt_record1("pacer sleeping %d ns on hrtimer",
+						delay_ns);
+			} else
+				__set_current_state(TASK_RUNNING);
+		}
 		INC_METRIC(pacer_cycles, get_cycles() - start);
 		schedule();
 		__set_current_state(TASK_RUNNING);
@@ -689,10 +1042,11 @@ int homa_pacer_main(void *transportInfo)
  * this method gets invoked from other places as well, to increase the
  * likelihood that we keep the link busy. Those other invocations are not
  * guaranteed to happen, so the pacer thread provides a backstop.
- * @homa:    Overall data about the Homa protocol implementation.
+ * @link:    Egress link whose throttled RPCs should be transmitted.
  */
-void homa_pacer_xmit(struct homa *homa)
+void homa_pacer_xmit(struct homa_link *link)
 {
+	struct homa *homa = link->homa;
 	struct homa_rpc *rpc;
         int i;
 	static __u64 gap_start = 0;
@@ -701,9 +1055,9 @@ void homa_pacer_xmit(struct homa *homa)
 		gap_start = get_cycles();
 	
 	/* Make sure only one instance of this function executes at a
-	 * time.
+	 * time (per link).
 	 */
-	if (atomic_cmpxchg(&homa->pacer_active, 0, 1) != 0)
+	if (atomic_cmpxchg(&link->pacer_active, 0, 1) != 0)
 		return;
 	
 	/* Each iteration through the following loop sends one packet. We
@@ -716,7 +1070,7 @@ void homa_pacer_xmit(struct homa *homa)
 		
 		/* If the NIC queue is too long, wait until it gets shorter. */
 		now = get_cycles();
-		idle_time = atomic64_read(&homa->link_idle_time);
+		idle_time = atomic64_read(homa_tx_idle_time(link));
 		if (now > idle_time) {
 			INC_METRIC(pacer_lost_cycles, now - idle_time);
 			tt_record2("homa_pacer_xmit lost %d cycles (lockout %d)",
@@ -746,21 +1100,22 @@ void homa_pacer_xmit(struct homa *homa)
 		 * throttle lock while locking the RPC is important because
 		 * it keeps the RPC from being deleted before it can be locked.
 		 */
-		homa_throttle_lock(homa);
-		rpc = list_first_or_null_rcu(&homa->throttled_rpcs,
+		homa_throttle_lock(link);
+		homa_throttle_drain_staging(link);
+		rpc = list_first_or_null_rcu(&link->throttled_rpcs,
 				struct homa_rpc, throttled_links);
 		if (rpc == NULL) {
-			homa_throttle_unlock(homa);
+			homa_throttle_unlock(link);
 			break;
 		}
 		if (!(spin_trylock_bh(rpc->lock))) {
-			homa_throttle_unlock(homa);
+			homa_throttle_unlock(link);
 			INC_METRIC(pacer_skipped_rpcs, 1);
 			break;
 		}
-		homa_throttle_unlock(homa);
+		homa_throttle_unlock(link);
 		
-		tt_record2("pacer calling homa_xmit_data for rpc id %llu, "
+		tt_record_rpc2(rpc, "pacer calling homa_xmit_data for rpc id %llu, "
 				"port %d",
 				rpc->id, rpc->is_client ? rpc->hsk->client_port
 				: rpc->hsk->server_port);
@@ -771,7 +1126,7 @@ void homa_pacer_xmit(struct homa *homa)
 			/* Nothing more to transmit from this message (right now),
 			 * so remove it from the throttled list.
 			 */
-			homa_throttle_lock(homa);
+			homa_throttle_lock(link);
 			if (!list_empty(&rpc->throttled_links)) {
 				list_del_rcu(&rpc->throttled_links);
 
@@ -785,7 +1140,7 @@ void homa_pacer_xmit(struct homa *homa)
 				 */
 				INIT_LIST_HEAD_RCU(&rpc->throttled_links);
 			}
-			homa_throttle_unlock(homa);
+			homa_throttle_unlock(link);
 			if (!rpc->msgout.next_packet && !rpc->is_client) {
 				homa_rpc_free(rpc);
 			}
@@ -793,44 +1148,107 @@ void homa_pacer_xmit(struct homa *homa)
 		homa_rpc_unlock(rpc);
 	}
 	done:
-		atomic_set(&homa->pacer_active, 0);
+		atomic_set(&link->pacer_active, 0);
 }
 
 /**
- * homa_pacer_stop() - Will cause the pacer thread to exit (waking it up
- * if necessary); doesn't return until after the pacer thread has exited.
+ * homa_pacer_stop() - Will cause all of the pacer threads to exit (waking
+ * them up if necessary); doesn't return until after the threads have exited.
  * @homa:    Overall data about the Homa protocol implementation.
  */
 void homa_pacer_stop(struct homa *homa)
 {
-	homa->pacer_exit = true;
-	wake_up_process(homa->pacer_kthread);
-	kthread_stop(homa->pacer_kthread);
-	homa->pacer_kthread = NULL;
+	struct homa_link *link;
+	int i;
+
+	for (i = 0; i < HOMA_MAX_LINKS; i++) {
+		link = &homa->links[i];
+		if (link->pacer_kthread == NULL)
+			continue;
+		link->pacer_exit = true;
+		wake_up_process(link->pacer_kthread);
+		kthread_stop(link->pacer_kthread);
+		hrtimer_cancel(&link->pacer_hrtimer);
+		link->pacer_kthread = NULL;
+	}
 }
 
 /**
  * homa_add_to_throttled() - Make sure that an RPC is on the throttled list
- * and wake up the pacer thread if necessary.
+ * for its peer's link and wake up that link's pacer thread if necessary.
+ * This function doesn't acquire the throttle lock: it just pushes the RPC
+ * onto the link's throttled_staging, so sending cores never wait for the
+ * pacer. The RPC gets positioned in the link's throttled_rpcs later by
+ * homa_throttle_drain_staging.
  * @rpc:     RPC with outbound packets that have been granted but can't be
- *           sent because of NIC queue restrictions.
+ *           sent because of NIC queue restrictions. Must be locked by
+ *           the caller.
  */
 void homa_add_to_throttled(struct homa_rpc *rpc)
 {
-	struct homa *homa = rpc->hsk->homa;
-	struct homa_rpc *candidate;
-	int bytes_left;
+	struct homa_link *link = homa_peer_link(rpc->hsk->homa, rpc->peer);
 
 	if (!list_empty(&rpc->throttled_links)) {
 		return;
 	}
-	bytes_left = rpc->msgout.length - homa_data_offset(
-			rpc->msgout.next_packet);
-	homa_throttle_lock(homa);
-	list_for_each_entry_rcu(candidate, &homa->throttled_rpcs,
+	if (atomic_xchg(&rpc->stage_pending, 1) != 0) {
+		/* Already awaiting a drain. */
+		return;
+	}
+	llist_add(&rpc->throttled_stage, &link->throttled_staging);
+	wake_up_process(link->pacer_kthread);
+//	tt_record("woke up pacer thread");
+}
+
+/**
+ * homa_throttle_drain_staging() - Move all of the RPCs in
+ * link->throttled_staging into link->throttled_rpcs, maintaining SRPT
+ * order. The caller must hold the link's throttle lock.
+ * @link:    Egress link whose staged RPCs should be drained.
+ */
+void homa_throttle_drain_staging(struct homa_link *link)
+{
+	struct llist_node *staged;
+	struct homa_rpc *rpc;
+
+	staged = llist_del_all(&link->throttled_staging);
+	while (staged != NULL) {
+		rpc = llist_entry(staged, struct homa_rpc, throttled_stage);
+		staged = staged->next;
+		atomic_set(&rpc->stage_pending, 0);
+
+		/* Watch out: the RPC may have been added to (and removed
+		 * from) the throttled list since it was staged.
+		 */
+		if (list_empty(&rpc->throttled_links))
+			homa_insert_throttled(link, rpc);
+	}
+}
+
+/**
+ * homa_insert_throttled() - Add an RPC to link->throttled_rpcs in SRPT
+ * order (fewest remaining bytes first). The caller must hold the link's
+ * throttle lock, and the RPC must not currently be in the list.
+ * @link:    Egress link whose throttled list the RPC joins.
+ * @rpc:     RPC with outbound packets to add.
+ */
+void homa_insert_throttled(struct homa_link *link, struct homa_rpc *rpc)
+{
+	struct homa_rpc *candidate;
+	int bytes_left;
+
+	/* Watch out: all of the packets may have been transmitted since
+	 * this RPC was staged.
+	 */
+	if (!rpc->msgout.next_packet)
+		bytes_left = 0;
+	else
+		bytes_left = rpc->msgout.length - homa_data_offset(
+				rpc->msgout.next_packet);
+	list_for_each_entry_rcu(candidate, &link->throttled_rpcs,
 			throttled_links) {
 		int bytes_left_cand;
-	
+
 		/* Watch out: the pacer might have just transmitted the last
 		 * packet from candidate.
 		 */
@@ -842,12 +1260,8 @@ void homa_add_to_throttled(struct homa_rpc *rpc)
 		if (bytes_left_cand > bytes_left) {
 			list_add_tail_rcu(&rpc->throttled_links,
 					&candidate->throttled_links);
-			goto done;
+			return;
 		}
 	}
-	list_add_tail_rcu(&rpc->throttled_links, &homa->throttled_rpcs);
-done:
-	homa_throttle_unlock(homa);
-	wake_up_process(homa->pacer_kthread);
-//	tt_record("woke up pacer thread");
+	list_add_tail_rcu(&rpc->throttled_links, &link->throttled_rpcs);
 }
\ No newline at end of file
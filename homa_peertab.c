@@ -19,10 +19,45 @@
 
 #include "homa_impl.h"
 
+/**
+ * homa_peertab_alloc_buckets() - Allocate and initialize a bucket array
+ * for a homa_peertab.
+ * @bucket_bits:   Log2 of the number of buckets in the new array.
+ *
+ * Return:    The new array, or NULL if memory couldn't be allocated.
+ */
+static struct homa_peertab_buckets *homa_peertab_alloc_buckets(
+		int bucket_bits)
+{
+	struct homa_peertab_buckets *table;
+	int i;
+
+	table = kmalloc(sizeof(*table)
+			+ ((1 << bucket_bits) * sizeof(table->buckets[0])),
+			GFP_ATOMIC);
+	if (!table)
+		return NULL;
+	table->bucket_bits = bucket_bits;
+	for (i = 0; i < (1 << bucket_bits); i++) {
+		INIT_HLIST_HEAD(&table->buckets[i]);
+	}
+	return table;
+}
+
+/**
+ * homa_peertab_free_buckets_rcu() - Invoked after an RCU grace period to
+ * free a bucket array that was replaced by homa_peertab_grow.
+ * @head:     The rcu field of the homa_peertab_buckets to free.
+ */
+static void homa_peertab_free_buckets_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct homa_peertab_buckets, rcu));
+}
+
 /**
  * homa_peertab_init() - Constructor for homa_peertabs.
  * @peertab:  The object to initialize; previous contents are discarded.
- * 
+ *
  * Return:    0 in the normal case, or a negative errno if there was a problem.
  */
 int homa_peertab_init(struct homa_peertab *peertab)
@@ -31,15 +66,15 @@ int homa_peertab_init(struct homa_peertab *peertab)
 	 * safe to call homa_peertab_destroy, even if this function returns
 	 * an error.
 	 */
-	int i;
+	struct homa_peertab_buckets *table;
+
 	spin_lock_init(&peertab->write_lock);
-	peertab->buckets = (struct hlist_head *) vmalloc(
-			HOMA_PEERTAB_BUCKETS * sizeof(*peertab->buckets));
-	if (!peertab->buckets)
+	INIT_LIST_HEAD(&peertab->dead_dsts);
+	peertab->num_peers = 0;
+	table = homa_peertab_alloc_buckets(HOMA_PEERTAB_MIN_BITS);
+	RCU_INIT_POINTER(peertab->table, table);
+	if (!table)
 		return -ENOMEM;
-	for (i = 0; i < HOMA_PEERTAB_BUCKETS; i++) {
-		INIT_HLIST_HEAD(&peertab->buckets[i]);
-	}
 	return 0;
 }
 
@@ -52,20 +87,88 @@ int homa_peertab_init(struct homa_peertab *peertab)
  */
 void homa_peertab_destroy(struct homa_peertab *peertab)
 {
+	struct homa_peertab_buckets *table;
 	int i;
 	struct homa_peer *peer;
 	struct hlist_node *next;
-	if (!peertab->buckets)
+
+	table = rcu_dereference_protected(peertab->table, 1);
+	if (!table)
 		return;
-	
-	for (i = 0; i < HOMA_PEERTAB_BUCKETS; i++) {
-		hlist_for_each_entry_safe(peer, next, &peertab->buckets[i],
+	homa_peertab_gc_dsts(peertab, ~0UL);
+
+	for (i = 0; i < (1 << table->bucket_bits); i++) {
+		hlist_for_each_entry_safe(peer, next, &table->buckets[i],
 				peertab_links) {
 			dst_release(peer->dst);
 			kfree(peer);
 		}
 	}
-	vfree(peertab->buckets);
+	kfree(table);
+}
+
+/**
+ * homa_peertab_gc_dsts() - Release references to dst_entries that were
+ * replaced by homa_dst_check and have now been parked long enough that
+ * no sender can still be acquiring its own reference to them. The
+ * caller must hold @peertab's write_lock (except during peertab
+ * destruction, when there can be no concurrent senders).
+ * @peertab:    Table whose retired routes should be scanned.
+ * @now:        Current time, in jiffies; entries that came due before
+ *              this time are released. ~0 means release everything.
+ */
+void homa_peertab_gc_dsts(struct homa_peertab *peertab, unsigned long now)
+{
+	while (!list_empty(&peertab->dead_dsts)) {
+		struct homa_dead_dst *dead = list_first_entry(
+				&peertab->dead_dsts, struct homa_dead_dst,
+				dst_links);
+		if (dead->gc_jiffies > now)
+			break;
+		dst_release(dead->dst);
+		list_del(&dead->dst_links);
+		kfree(dead);
+	}
+}
+
+/**
+ * homa_peertab_grow() - Replace a peertab's bucket array with one twice
+ * as large, rehashing all existing entries. The caller must hold
+ * peertab->write_lock. If memory for the larger array can't be allocated,
+ * the existing array is retained (hash chains just stay longer).
+ * @peertab:  Table to grow.
+ */
+static void homa_peertab_grow(struct homa_peertab *peertab)
+{
+	struct homa_peertab_buckets *old, *new;
+	struct homa_peer *peer;
+	struct hlist_node *next;
+	int i;
+
+	old = rcu_dereference_protected(peertab->table, 1);
+	if (old->bucket_bits >= HOMA_PEERTAB_MAX_BITS)
+		return;
+	new = homa_peertab_alloc_buckets(old->bucket_bits + 1);
+	if (!new)
+		return;
+
+	/* Concurrent lookups may be traversing the old chains while we
+	 * move entries; a lookup that is passing through a moved entry
+	 * can end up in the new table's chains and miss peers, but that
+	 * just sends it to the slow path in homa_peer_find, which
+	 * rechecks under the write lock.
+	 */
+	for (i = 0; i < (1 << old->bucket_bits); i++) {
+		hlist_for_each_entry_safe(peer, next, &old->buckets[i],
+				peertab_links) {
+			hlist_del_rcu(&peer->peertab_links);
+			hlist_add_head_rcu(&peer->peertab_links,
+					&new->buckets[hash_32(peer->addr,
+					new->bucket_bits)]);
+		}
+	}
+	rcu_assign_pointer(peertab->table, new);
+	call_rcu_sched(&old->rcu, homa_peertab_free_buckets_rcu);
 }
 
 /**
@@ -84,27 +187,36 @@ struct homa_peer *homa_peer_find(struct homa_peertab *peertab, __be32 addr,
 	struct inet_sock *inet)
 {
 	/* Note: this function uses RCU operators to ensure safety even
-	 * if a concurrent call is adding a new entry.
+	 * if a concurrent call is adding a new entry or growing the
+	 * table.
 	 */
+	struct homa_peertab_buckets *table;
 	struct homa_peer *peer;
 	struct rtable *rt;
-	__u32 bucket = hash_32(addr, HOMA_PEERTAB_BUCKET_BITS);
-	hlist_for_each_entry_rcu(peer, &peertab->buckets[bucket],
+	__u32 bucket;
+
+	table = rcu_dereference(peertab->table);
+	bucket = hash_32(addr, table->bucket_bits);
+	hlist_for_each_entry_rcu(peer, &table->buckets[bucket],
 			peertab_links) {
 		if (peer->addr == addr) {
+			homa_dst_check(peertab, peer, inet);
 			return peer;
 		}
 		INC_METRIC(peer_hash_links, 1);
 	}
-	
+
 	/* No existing entry; create a new one.
-	 * 
+	 *
 	 * Note: after we acquire the lock, we have to check again to
 	 * make sure the entry still doesn't exist after grabbing
 	 * the lock (it might have been created by a concurrent invocation
-	 * of this function). */
+	 * of this function, or we may have missed it because the table
+	 * was being resized). */
 	spin_lock_bh(&peertab->write_lock);
-	hlist_for_each_entry_rcu(peer, &peertab->buckets[bucket],
+	table = rcu_dereference_protected(peertab->table, 1);
+	bucket = hash_32(addr, table->bucket_bits);
+	hlist_for_each_entry_rcu(peer, &table->buckets[bucket],
 			peertab_links) {
 		if (peer->addr == addr)
 			goto done;
@@ -130,19 +242,132 @@ struct homa_peer *homa_peer_find(struct homa_peertab *peertab, __be32 addr,
 		goto done;
 	}
 	peer->dst = &rt->dst;
+	peer->dst_check_jiffies = jiffies;
+	peer->rtt_bytes = 0;
 	peer->unsched_cutoffs[HOMA_MAX_PRIORITIES-1] = 0;
 	peer->unsched_cutoffs[HOMA_MAX_PRIORITIES-2] = INT_MAX;
 	peer->cutoff_version = 0;
 	peer->last_update_jiffies = 0;
 	peer->last_resend_tick = 0;
-	hlist_add_head_rcu(&peer->peertab_links, &peertab->buckets[bucket]);
+	spin_lock_init(&peer->ack_lock);
+	peer->num_acks = 0;
+	spin_lock_init(&peer->lock);
+	INIT_LIST_HEAD(&peer->rpcs);
+
+	/* Spread peers across egress links round-robin, in creation order
+	 * (see homa_peer_link). */
+	peer->link_idx = peertab->num_peers;
+	hlist_add_head_rcu(&peer->peertab_links, &table->buckets[bucket]);
 	INC_METRIC(peer_new_entries, 1);
-	
+	peertab->num_peers++;
+	if (peertab->num_peers > (1 << table->bucket_bits))
+		homa_peertab_grow(peertab);
+
+    done:
+	spin_unlock_bh(&peertab->write_lock);
+	return peer;
+}
+
+/**
+ * homa_peer_lookup() - Returns the peer associated with a given host, if
+ * one already exists. Unlike homa_peer_find, this function never creates
+ * a new entry.
+ * @peertab:    Peer table in which to perform lookup.
+ * @addr:       IPV4 address of the desired host.
+ *
+ * Return:      The peer associated with @addr, or NULL if there is none.
+ */
+struct homa_peer *homa_peer_lookup(struct homa_peertab *peertab, __be32 addr)
+{
+	struct homa_peertab_buckets *table;
+	struct homa_peer *peer;
+	__u32 bucket;
+
+	table = rcu_dereference(peertab->table);
+	bucket = hash_32(addr, table->bucket_bits);
+	hlist_for_each_entry_rcu(peer, &table->buckets[bucket],
+			peertab_links) {
+		if (peer->addr == addr)
+			return peer;
+	}
+
+	/* A concurrent resize could cause us to miss an entry; recheck
+	 * under the write lock before concluding that it doesn't exist.
+	 */
+	spin_lock_bh(&peertab->write_lock);
+	table = rcu_dereference_protected(peertab->table, 1);
+	bucket = hash_32(addr, table->bucket_bits);
+	hlist_for_each_entry_rcu(peer, &table->buckets[bucket],
+			peertab_links) {
+		if (peer->addr == addr)
+			goto done;
+	}
+	peer = NULL;
     done:
 	spin_unlock_bh(&peertab->write_lock);
 	return peer;
 }
 
+/**
+ * homa_dst_check() - Make sure a peer's cached route is still valid,
+ * replacing it if the route has changed. To keep the cost out of the
+ * common path, the route is only actually examined about once a second
+ * per peer.
+ * @peertab:    Table containing @peer; its write_lock protects updates
+ *              to peer->dst.
+ * @peer:       Peer whose cached dst should be checked.
+ * @inet:       Socket that will be used for sending packets.
+ */
+void homa_dst_check(struct homa_peertab *peertab, struct homa_peer *peer,
+	struct inet_sock *inet)
+{
+	struct homa_dead_dst *dead;
+	struct dst_entry *old;
+	struct rtable *rt;
+
+	if (likely(time_before(jiffies, peer->dst_check_jiffies + HZ)))
+		return;
+	spin_lock_bh(&peertab->write_lock);
+	homa_peertab_gc_dsts(peertab, jiffies);
+	if (time_before(jiffies, peer->dst_check_jiffies + HZ))
+		goto done;
+	peer->dst_check_jiffies = jiffies;
+	old = peer->dst;
+	if ((old->obsolete <= 0) || (old->ops->check(old, 0) == old))
+		goto done;
+	rt = ip_route_output_flow(sock_net(&inet->sk), &peer->flow.u.ip4,
+			&inet->sk);
+	if (IS_ERR(rt)) {
+		INC_METRIC(peer_route_errors, 1);
+		goto done;
+	}
+	dead = kmalloc(sizeof(*dead), GFP_ATOMIC);
+	if (!dead) {
+		/* Can't safely retire the old route; keep using it and
+		 * try again in a second.
+		 */
+		dst_release(&rt->dst);
+		goto done;
+	}
+
+	/* We can't just drop our reference to the old route here: a
+	 * concurrent sender may have read peer->dst but not yet called
+	 * dst_hold (see __homa_xmit_control and __homa_xmit_data), and
+	 * if ours was the last reference the sender would be acquiring
+	 * a freed entry. Instead, park the old route on a list and hold
+	 * our reference until enough time has passed that no sender can
+	 * still be in that window (sk_buffs already holding their own
+	 * references are unaffected; they keep the route alive for as
+	 * long as they need it).
+	 */
+	dead->dst = old;
+	dead->gc_jiffies = jiffies + HZ/10;
+	list_add_tail(&dead->dst_links, &peertab->dead_dsts);
+	peer->dst = &rt->dst;
+    done:
+	spin_unlock_bh(&peertab->write_lock);
+}
+
 /**
  * homa_peer_unsched_priority() - Returns the priority level to use for
  * unscheduled packets of a message.
@@ -187,4 +412,108 @@ void homa_peer_set_cutoffs(struct homa_peer *peer, int c0, int c1, int c2,
 	peer->unsched_cutoffs[5] = c5;
 	peer->unsched_cutoffs[6] = c6;
 	peer->unsched_cutoffs[7] = c7;
+}
+
+/**
+ * homa_peer_update_rtt() - Fold one observation of grant latency into a
+ * peer's RTT-bytes estimate. Invoked when the first grant for an outgoing
+ * message arrives; the elapsed time since the message was initialized
+ * measures how long this peer takes to start granting, which is exactly
+ * the interval that unscheduled bytes must cover to keep the uplink busy.
+ * @homa:            Overall data about the Homa protocol implementation.
+ * @peer:            Peer that sent the grant.
+ * @elapsed_cycles:  Time (in get_cycles units) between initializing the
+ *                   message and receiving its first grant.
+ */
+void homa_peer_update_rtt(struct homa *homa, struct homa_peer *peer,
+		__u64 elapsed_cycles)
+{
+	int bytes, estimate;
+
+	if (!homa->peer_rtt_adapt || (homa->cycles_per_kbyte == 0))
+		return;
+	bytes = (elapsed_cycles * 1000) / homa->cycles_per_kbyte;
+
+	/* Clamp each observation to a band around the global value:
+	 * grant latency can be inflated arbitrarily when the receiver
+	 * is deliberately withholding grants in favor of other messages,
+	 * and one such delay must not blow up the unscheduled size for
+	 * every future message to the peer. The lower bound similarly
+	 * keeps an unusually prompt grant from collapsing the estimate.
+	 */
+	if (bytes > 2*homa->rtt_bytes)
+		bytes = 2*homa->rtt_bytes;
+	if (bytes < homa->rtt_bytes/4)
+		bytes = homa->rtt_bytes/4;
+
+	estimate = peer->rtt_bytes;
+	if (estimate == 0)
+		estimate = bytes;
+	else
+		estimate += (bytes - estimate)/8;
+	peer->rtt_bytes = estimate;
+}
+
+/**
+ * homa_peer_add_ack() - Records that an RPC has completed, so the peer
+ * (the RPC's server) can be told to free its state for the RPC. The ack
+ * is buffered in the peer, where it will be piggybacked on an outgoing
+ * GRANT; if the peer has accumulated too many buffered acks, they are
+ * all transmitted immediately in a standalone ACK packet.
+ * @rpc:    Client RPC that has just completed. Must be locked by the
+ *          caller.
+ */
+void homa_peer_add_ack(struct homa_rpc *rpc)
+{
+	struct homa_peer *peer = rpc->peer;
+	struct ack_header ack;
+
+	spin_lock_bh(&peer->ack_lock);
+	if (peer->num_acks < HOMA_MAX_ACKS) {
+		peer->acks[peer->num_acks].id = rpc->id;
+		peer->acks[peer->num_acks].client_port =
+				htons(rpc->hsk->client_port);
+		peer->acks[peer->num_acks].server_port = htons(rpc->dport);
+		peer->num_acks++;
+		spin_unlock_bh(&peer->ack_lock);
+		return;
+	}
+
+	/* The peer has filled up with buffered acks; flush them all in an
+	 * explicit ACK packet (@rpc itself is acked implicitly, via the
+	 * id in the packet's common header).
+	 */
+	memcpy(ack.acks, peer->acks, sizeof(peer->acks));
+	ack.num_acks = htons(peer->num_acks);
+	peer->num_acks = 0;
+	spin_unlock_bh(&peer->ack_lock);
+	homa_xmit_control(ACK, &ack, sizeof(ack), rpc);
+}
+
+/**
+ * homa_peer_get_acks() - Remove acks that are buffered in a peer, so
+ * they can be transmitted in an outgoing packet.
+ * @peer:    Peer from which to remove acks.
+ * @count:   Maximum number of acks to remove.
+ * @dst:     Where to copy the removed acks; must hold at least @count
+ *           entries.
+ *
+ * Return:   The number of acks that were actually copied to @dst (may
+ *           be less than @count, if the peer doesn't have that many
+ *           buffered).
+ */
+int homa_peer_get_acks(struct homa_peer *peer, int count, struct homa_ack *dst)
+{
+	/* Don't waste time acquiring the lock if there are no acks. */
+	if (peer->num_acks == 0)
+		return 0;
+
+	spin_lock_bh(&peer->ack_lock);
+	if (count > peer->num_acks)
+		count = peer->num_acks;
+	memcpy(dst, &peer->acks[peer->num_acks - count],
+			count * sizeof(peer->acks[0]));
+	peer->num_acks -= count;
+	spin_unlock_bh(&peer->ack_lock);
+	return count;
 }
\ No newline at end of file
@@ -137,6 +137,17 @@ static const struct file_operations homa_metrics_fops = {
 /* Used to remove /proc/net/homa_metrics when the module is unloaded. */
 static struct proc_dir_entry *metrics_dir_entry = NULL;
 
+/* Describes file operations implemented for /proc/net/homa_metrics_bin.
+ * No open or release function is needed: reads copy the free-running
+ * counters directly, so there is no per-open state.
+ */
+static const struct file_operations homa_metrics_bin_fops = {
+	.read		= homa_metrics_bin_read,
+};
+
+/* Used to remove /proc/net/homa_metrics_bin when the module is unloaded. */
+static struct proc_dir_entry *metrics_bin_dir_entry = NULL;
+
 /* Used to configure sysctl access to Homa configuration parameters.*/
 static struct ctl_table homa_ctl_table[] = {
 	{
@@ -153,6 +164,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "cutoff_tune_ticks",
+		.data		= &homa_data.cutoff_tune_ticks,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "cutoff_version",
 		.data		= &homa_data.cutoff_version,
@@ -160,6 +178,20 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0444,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "cycle_metrics",
+		.data		= &homa_data.cycle_metrics,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "dcacp_iter_ticks",
+		.data		= &homa_data.dcacp_iter_ticks,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "flags",
 		.data		= &homa_data.flags,
@@ -167,6 +199,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "freeze_slo_usecs",
+		.data		= homa_data.freeze_slo_usecs,
+		.maxlen		= sizeof(homa_data.freeze_slo_usecs),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "grant_increment",
 		.data		= &homa_data.grant_increment,
@@ -174,6 +213,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "grant_coalesce_bytes",
+		.data		= &homa_data.grant_coalesce_bytes,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "link_mbps",
 		.data		= &homa_data.link_mbps,
@@ -223,6 +269,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0444,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "num_links",
+		.data		= &homa_data.num_links,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "num_priorities",
 		.data		= &homa_data.num_priorities,
@@ -230,6 +283,41 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "overcommit_tune_ticks",
+		.data		= &homa_data.overcommit_tune_ticks,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "pacer_spin_threshold",
+		.data		= &homa_data.pacer_spin_threshold,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "parallel_copy_bytes",
+		.data		= &homa_data.parallel_copy_bytes,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "peer_rtt_adapt",
+		.data		= &homa_data.peer_rtt_adapt,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "poll_usecs",
+		.data		= &homa_data.poll_usecs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "reap_limit",
 		.data		= &homa_data.reap_limit,
@@ -272,6 +360,34 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "tt_filter_id",
+		.data		= &homa_data.tt_filter_id,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "tt_filter_interval",
+		.data		= &homa_data.tt_filter_interval,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "tt_filter_min_length",
+		.data		= &homa_data.tt_filter_min_length,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "tt_filter_port",
+		.data		= &homa_data.tt_filter_port,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "unsched_cutoffs",
 		.data		= &homa_data.unsched_cutoffs,
@@ -286,6 +402,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "zerocopy_min_bytes",
+		.data		= &homa_data.zerocopy_min_bytes,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{}
 };
 
@@ -335,6 +458,13 @@ static int __init homa_load(void) {
 		status = -ENOMEM;
 		goto out_cleanup;
 	}
+	metrics_bin_dir_entry = proc_create("homa_metrics_bin", S_IRUGO,
+			init_net.proc_net, &homa_metrics_bin_fops);
+	if (!metrics_bin_dir_entry) {
+		printk(KERN_ERR "couldn't create /proc/net/homa_metrics_bin\n");
+		status = -ENOMEM;
+		goto out_cleanup;
+	}
 
 	homa_ctl_header = register_net_sysctl(&init_net, "net/homa",
 			homa_ctl_table);
@@ -363,6 +493,7 @@ static int __init homa_load(void) {
 
 out_cleanup:
 	unregister_net_sysctl_table(homa_ctl_header);
+	proc_remove(metrics_bin_dir_entry);
 	proc_remove(metrics_dir_entry);
 	homa_destroy(homa);
 	inet_del_protocol(&homa_protocol, IPPROTO_HOMA);
@@ -394,6 +525,7 @@ static void __exit homa_unload(void) {
 	if (homa_offload_end() != 0)
 		printk(KERN_ERR "Homa couldn't stop offloads\n");
 	unregister_net_sysctl_table(homa_ctl_header);
+	proc_remove(metrics_bin_dir_entry);
 	proc_remove(metrics_dir_entry);
 	homa_destroy(homa);
 	inet_del_protocol(&homa_protocol, IPPROTO_HOMA);
@@ -474,32 +606,54 @@ int homa_disconnect(struct sock *sk, int flags) {
 }
 
 /**
- * homa_ioc_recv() - The top-level function for the ioctl that implements
- * the homa_recv user-level API.
- * @sk:       Socket for this request.
- * @arg:      Used to pass information from/to user space.
+ * homa_recv_common() - Does all of the work of receiving a single
+ * incoming message; shared between homa_ioc_recv and homa_ioc_recvmany.
+ * @hsk:          Socket on which to receive.
+ * @uargs:        User-space address of a homa_args_recv_ipv4 struct.
+ * @extra_flags:  Additional flag bits (such as HOMA_RECV_NONBLOCKING)
+ *                to OR into those supplied in @uargs.
  *
- * Return: 0 on success, otherwise a negative errno.
+ * Return: The number of bytes copied for the message, otherwise a
+ * negative errno.
  */
-int homa_ioc_recv(struct sock *sk, unsigned long arg) {
-	struct homa_sock *hsk = homa_sk(sk);
+int homa_recv_common(struct homa_sock *hsk,
+		struct homa_args_recv_ipv4 __user *uargs, int extra_flags) {
 	struct homa_args_recv_ipv4 args;
 	struct iovec iov;
 	struct iov_iter iter;
+	size_t buf_len;
 	int err;
 	int result;
+	int finished = 1;
+	int copy_start = 0;
+	int copy_end = 0;
 	struct homa_rpc *rpc = NULL;
+	void __user *slot = NULL;
 
-	tt_record1("homa_ioc_recv starting, port %d",
-			hsk->server_port != 0 ? hsk->server_port : 
+	tt_record1("homa_recv_common starting, port %d",
+			hsk->server_port != 0 ? hsk->server_port :
 			hsk->client_port);
-	if (unlikely(copy_from_user(&args, (void *) arg,
-			sizeof(args))))
+	if (unlikely(copy_from_user(&args, uargs, sizeof(args))))
 		return -EFAULT;
-	err = import_single_range(READ, args.buf, args.len, &iov,
-		&iter);		
-	if (unlikely(err))
-		return err;
+	args.flags |= extra_flags;
+	if (args.flags & HOMA_RECV_PARTIAL) {
+		/* Partial delivery only makes sense when waiting for a
+		 * specific RPC, and streaming into region slots isn't
+		 * supported (each call would allocate a separate slot).
+		 */
+		if ((args.id == 0) || (args.flags & HOMA_RECV_REGION))
+			return -EINVAL;
+	}
+	buf_len = args.len;
+	if (args.flags & HOMA_RECV_REGION) {
+		if (hsk->region_start == NULL)
+			return -EINVAL;
+	} else {
+		err = import_single_range(READ, args.buf, args.len, &iov,
+			&iter);
+		if (unlikely(err))
+			return err;
+	}
 	rpc = homa_wait_for_message(hsk, args.flags, args.id);
 	if (IS_ERR(rpc)) {
 		err = PTR_ERR(rpc);
@@ -512,24 +666,42 @@ int homa_ioc_recv(struct sock *sk, unsigned long arg) {
 	 * even without holding its lock.
 	 */
 	rpc->dont_reap = true;
-	if (rpc->is_client)
-		homa_rpc_free(rpc);
-	else
-		rpc->state = RPC_IN_SERVICE;
+	if ((args.flags & HOMA_RECV_PARTIAL)
+			&& (rpc->msgin.total_length >= 0)) {
+		/* Deliver only the contiguous bytes that haven't already
+		 * been delivered. The range must be chosen now, while the
+		 * RPC is locked (see homa_message_in_copy_partial).
+		 */
+		copy_start = rpc->msgin.delivered;
+		copy_end = homa_prefix_end(&rpc->msgin);
+		if (copy_end > copy_start + (int) buf_len)
+			copy_end = copy_start + (int) buf_len;
+		rpc->msgin.delivered = copy_end;
+		if ((copy_end < rpc->msgin.total_length) && !rpc->error)
+			finished = 0;
+	}
+	if (finished) {
+		/* The entire message will have been delivered by the time
+		 * this call returns, so this is our last use of the RPC.
+		 */
+		if (rpc->is_client)
+			homa_rpc_free(rpc);
+		else
+			rpc->state = RPC_IN_SERVICE;
+	}
 	homa_rpc_unlock(rpc);
 	
 	args.id = rpc->id;
+	args.len = rpc->msgin.total_length;
 	args.source_addr.sin_family = AF_INET;
 	args.source_addr.sin_port = htons(rpc->dport);
 	args.source_addr.sin_addr.s_addr = rpc->peer->addr;
 	memset(args.source_addr.sin_zero, 0,
 			sizeof(args.source_addr.sin_zero));
-	if (unlikely(copy_to_user(
-			&((struct homa_args_recv_ipv4 *) arg)->source_addr,
-			&args.source_addr, sizeof(args) -
-			offsetof(struct homa_args_recv_ipv4, source_addr)))) {
+	if (unlikely(copy_to_user(&uargs->len, &args.len, sizeof(args) -
+			offsetof(struct homa_args_recv_ipv4, len)))) {
 		err = -EFAULT;
-		printk(KERN_NOTICE "homa_ioc_recv couldn't copy back args");
+		printk(KERN_NOTICE "homa_recv_common couldn't copy back args");
 		goto error;
 	}
 	
@@ -537,19 +709,53 @@ int homa_ioc_recv(struct sock *sk, unsigned long arg) {
 		err = rpc->error;
 		goto error;
 	}
-	
+
+	if (args.flags & HOMA_RECV_REGION) {
+		/* Deliver the message into a slot of the socket's registered
+		 * buffer region, and return the slot's address in args.buf.
+		 */
+		slot = homa_sock_region_alloc(hsk);
+		if (slot == NULL) {
+			err = -ENOSPC;
+			goto error;
+		}
+		err = import_single_range(READ, slot, HOMA_MAX_MESSAGE_LENGTH,
+			&iov, &iter);
+		if (unlikely(err))
+			goto error;
+		if (unlikely(copy_to_user(&uargs->buf, &slot,
+				sizeof(slot)))) {
+			err = -EFAULT;
+			goto error;
+		}
+		buf_len = HOMA_MAX_MESSAGE_LENGTH;
+	}
+
 //	tt_record1("starting copy_data, %d bytes in message",
 //			rpc->msgin.total_length);
-	result = homa_message_in_copy_data(&rpc->msgin, &iter, args.len);
+	if (args.flags & HOMA_RECV_PARTIAL)
+		result = homa_message_in_copy_partial(&rpc->msgin, &iter,
+				copy_start, copy_end);
+	else if ((hsk->homa->parallel_copy_bytes != 0)
+			&& (rpc->msgin.total_length
+			> hsk->homa->parallel_copy_bytes))
+		result = homa_message_in_copy_parallel(hsk->homa,
+				&rpc->msgin, (args.flags & HOMA_RECV_REGION)
+				? slot : args.buf, buf_len);
+	else
+		result = homa_message_in_copy_data(&rpc->msgin, &iter,
+				buf_len);
 //	tt_record1("finished copy_data, copied %d bytes", result);
-	tt_record2("homa_ioc_recv finished, id %u, port %d",
+	tt_record_rpc2(rpc, "homa_recv_common finished, id %u, port %d",
 			rpc->id & 0xffffffff,
 			rpc->is_client ? hsk->client_port : hsk->server_port);
 	rpc->dont_reap = false;
 	return result;
-	
+
 error:
-	tt_record1("homa_ioc_recv error %d", err);
+	tt_record1("homa_recv_common error %d", err);
+	if (slot != NULL)
+		homa_sock_region_release(hsk, slot);
 	if (rpc != NULL) {
 		rpc->dont_reap = false;
 	}
@@ -557,40 +763,98 @@ error:
 }
 
 /**
- * homa_ioc_reply() - The top-level function for the ioctl that implements
- * the homa_reply user-level API.
+ * homa_ioc_recv() - The top-level function for the ioctl that implements
+ * the homa_recv user-level API.
  * @sk:       Socket for this request.
  * @arg:      Used to pass information from/to user space.
  *
  * Return: 0 on success, otherwise a negative errno.
  */
-int homa_ioc_reply(struct sock *sk, unsigned long arg) {
+int homa_ioc_recv(struct sock *sk, unsigned long arg) {
+	return homa_recv_common(homa_sk(sk),
+			(struct homa_args_recv_ipv4 __user *) arg, 0);
+}
+
+/**
+ * homa_ioc_recvmany() - The top-level function for the ioctl that
+ * implements the homa_recvmany user-level API: receives up to a given
+ * number of messages in a single kernel call, so that syscall overhead
+ * is amortized across messages.
+ * @sk:       Socket for this request.
+ * @arg:      Used to pass information from/to user space.
+ *
+ * Return: The number of messages received (at least 1) on success,
+ * otherwise a negative errno.
+ */
+int homa_ioc_recvmany(struct sock *sk, unsigned long arg) {
 	struct homa_sock *hsk = homa_sk(sk);
-	struct homa_args_reply_ipv4 args;
+	struct homa_args_recvmany_ipv4 args;
+	int i, result;
+
+	if (unlikely(copy_from_user(&args, (void *) arg, sizeof(args))))
+		return -EFAULT;
+	if (args.count <= 0)
+		return -EINVAL;
+	for (i = 0; i < args.count; i++) {
+		/* Block (if permitted by the caller's flags) only for the
+		 * first message; after that, just drain whatever is ready.
+		 */
+		result = homa_recv_common(hsk, &args.args[i],
+				(i > 0) ? HOMA_RECV_NONBLOCKING : 0);
+		if (result < 0) {
+			if (i == 0)
+				return result;
+			break;
+		}
+	}
+	return i;
+}
+
+/**
+ * homa_ioc_release() - The top-level function for the ioctl that returns
+ * ownership of a receive buffer slot to Homa (see HOMA_SO_RCVBUF).
+ * @sk:       Socket for this request.
+ * @arg:      Address of a slot previously returned by homa_ioc_recv.
+ *
+ * Return: 0 on success, otherwise a negative errno.
+ */
+int homa_ioc_release(struct sock *sk, unsigned long arg) {
+	return homa_sock_region_release(homa_sk(sk), (void __user *) arg);
+}
+
+/**
+ * homa_reply_common() - Does all of the work of sending a single response
+ * message; shared between homa_ioc_reply and homa_ioc_replymany.
+ * @hsk:      Socket on which to send the response.
+ * @args:     Arguments describing the response (already copied in from
+ *            user space).
+ *
+ * Return: 0 on success, otherwise a negative errno.
+ */
+int homa_reply_common(struct homa_sock *hsk,
+		struct homa_args_reply_ipv4 *args) {
 	int err = 0;
 	struct homa_rpc *srpc;
 	struct homa_peer *peer;
 	struct sk_buff *skbs;
 
-	if (unlikely(copy_from_user(&args, (void *) arg, sizeof(args))))
-		return -EFAULT;
-	tt_record2("homa_ioc_reply starting, id %llu, port %d",
-			args.id, hsk->server_port);
-//	err = audit_sockaddr(sizeof(args.dest_addr), &args.dest_addr);
+	tt_record2("homa_reply_common starting, id %llu, port %d",
+			args->id, hsk->server_port);
+//	err = audit_sockaddr(sizeof(args->dest_addr), &args->dest_addr);
 //	if (unlikely(err))
 //		return err;
-	if (unlikely(args.dest_addr.sin_family != AF_INET))
+	if (unlikely(args->dest_addr.sin_family != AF_INET))
 		return -EAFNOSUPPORT;
-	peer = homa_peer_find(&hsk->homa->peers, args.dest_addr.sin_addr.s_addr,
+	peer = homa_peer_find(&hsk->homa->peers, args->dest_addr.sin_addr.s_addr,
 			&hsk->inet);
 	if (IS_ERR(peer))
 		return PTR_ERR(peer);
-	skbs = homa_fill_packets(hsk->homa, peer, args.response, args.resplen);
+	skbs = homa_fill_packets(hsk->homa, peer, args->response, args->resplen);
 	if (IS_ERR(skbs))
 		return PTR_ERR(skbs);
-	
-	srpc = homa_find_server_rpc(hsk, args.dest_addr.sin_addr.s_addr,
-			ntohs(args.dest_addr.sin_port), args.id);
+
+	srpc = homa_find_server_rpc(hsk, args->dest_addr.sin_addr.s_addr,
+			ntohs(args->dest_addr.sin_port), args->id);
 	if (!srpc) {
 		homa_free_skbs(skbs);
 		return -EINVAL;
@@ -602,7 +866,7 @@ int homa_ioc_reply(struct sock *sk, unsigned long arg) {
 	}
 	srpc->state = RPC_OUTGOING;
 
-	homa_message_out_init(srpc, hsk->server_port, skbs, args.resplen);
+	homa_message_out_init(srpc, hsk->server_port, skbs, args->resplen);
 	homa_xmit_data(srpc, false);
 	if (!srpc->msgout.next_packet) {
 		homa_rpc_free(srpc);
@@ -613,33 +877,90 @@ done:
 }
 
 /**
- * homa_ioc_send() - The top-level function for the ioctl that implements
- * the homa_send user-level API.
+ * homa_ioc_reply() - The top-level function for the ioctl that implements
+ * the homa_reply user-level API.
  * @sk:       Socket for this request.
  * @arg:      Used to pass information from/to user space.
  *
  * Return: 0 on success, otherwise a negative errno.
  */
-int homa_ioc_send(struct sock *sk, unsigned long arg) {
+int homa_ioc_reply(struct sock *sk, unsigned long arg) {
+	struct homa_args_reply_ipv4 args;
+
+	if (unlikely(copy_from_user(&args, (void *) arg, sizeof(args))))
+		return -EFAULT;
+	return homa_reply_common(homa_sk(sk), &args);
+}
+
+/**
+ * homa_ioc_replymany() - The top-level function for the ioctl that
+ * implements the homa_replymany user-level API: submits responses for
+ * several RPCs in a single kernel call.
+ * @sk:       Socket for this request.
+ * @arg:      Used to pass information from/to user space.
+ *
+ * Return: The number of responses accepted for delivery (at least 1)
+ * on success, otherwise a negative errno.
+ */
+int homa_ioc_replymany(struct sock *sk, unsigned long arg) {
 	struct homa_sock *hsk = homa_sk(sk);
-	struct homa_args_send_ipv4 args;
-	int err;
-	struct homa_rpc *crpc;
-			
+	struct homa_args_replymany_ipv4 args;
+	struct homa_args_reply_ipv4 reply;
+	int i, err;
+
 	if (unlikely(copy_from_user(&args, (void *) arg, sizeof(args))))
 		return -EFAULT;
-//	err = audit_sockaddr(sizeof(args.dest_addr), &args.dest_addr);
+	if (args.count <= 0)
+		return -EINVAL;
+	for (i = 0; i < args.count; i++) {
+		if (unlikely(copy_from_user(&reply, &args.args[i],
+				sizeof(reply)))) {
+			err = -EFAULT;
+			goto error;
+		}
+		err = homa_reply_common(hsk, &reply);
+		if (err != 0)
+			goto error;
+	}
+	return i;
+
+error:
+	/* If some responses were already accepted, report that; the error
+	 * will recur if the caller resubmits the failed entry.
+	 */
+	return (i > 0) ? i : err;
+}
+
+/**
+ * homa_send_common() - Does all of the work of sending a single request
+ * message; shared between homa_ioc_send and homa_ioc_sendmany.
+ * @hsk:      Socket on which to send the request.
+ * @args:     Arguments describing the request (already copied in from
+ *            user space).
+ * @user_id:  User-space address in which to store the id of the new RPC
+ *            (the id field of the caller's homa_args_send_ipv4). If the
+ *            store fails, the RPC is freed: the application has no way
+ *            to refer to the RPC without its id.
+ *
+ * Return: 0 on success, otherwise a negative errno.
+ */
+int homa_send_common(struct homa_sock *hsk, struct homa_args_send_ipv4 *args,
+		__u64 __user *user_id) {
+	int err;
+	struct homa_rpc *crpc;
+
+//	err = audit_sockaddr(sizeof(args->dest_addr), &args->dest_addr);
 //	if (unlikely(err))
 //		return err;
-	tt_record4("homa_ioc_send starting, target 0x%x:%d, port %d, id %u",
-			ntohl(args.dest_addr.sin_addr.s_addr),
-			ntohs(args.dest_addr.sin_port),
+	tt_record4("homa_send_common starting, target 0x%x:%d, port %d, id %u",
+			ntohl(args->dest_addr.sin_addr.s_addr),
+			ntohs(args->dest_addr.sin_port),
 			hsk->client_port, atomic64_read(&hsk->next_outgoing_id));
-	if (unlikely(args.dest_addr.sin_family != AF_INET))
+	if (unlikely(args->dest_addr.sin_family != AF_INET))
 		return -EAFNOSUPPORT;
 	
-	crpc = homa_rpc_new_client(hsk, &args.dest_addr, args.request,
-			args.reqlen);
+	crpc = homa_rpc_new_client(hsk, &args->dest_addr, args->request,
+			args->reqlen);
 	if (IS_ERR(crpc)) {
 		err = PTR_ERR(crpc);
 		crpc = NULL;
@@ -652,8 +973,7 @@ int homa_ioc_send(struct sock *sk, unsigned long arg) {
 
 	homa_xmit_data(crpc, false);
 
-	if (unlikely(copy_to_user(&((struct homa_args_send_ipv4 *) arg)->id,
-			&crpc->id, sizeof(crpc->id)))) {
+	if (unlikely(copy_to_user(user_id, &crpc->id, sizeof(crpc->id)))) {
 		err = -EFAULT;
 		goto error;
 	}
@@ -668,6 +988,67 @@ int homa_ioc_send(struct sock *sk, unsigned long arg) {
 	return err;
 }
 
+/**
+ * homa_ioc_send() - The top-level function for the ioctl that implements
+ * the homa_send user-level API.
+ * @sk:       Socket for this request.
+ * @arg:      Used to pass information from/to user space.
+ *
+ * Return: 0 on success, otherwise a negative errno.
+ */
+int homa_ioc_send(struct sock *sk, unsigned long arg) {
+	struct homa_sock *hsk = homa_sk(sk);
+	struct homa_args_send_ipv4 args;
+			
+	if (unlikely(copy_from_user(&args, (void *) arg, sizeof(args))))
+		return -EFAULT;
+	return homa_send_common(hsk, &args,
+			&((struct homa_args_send_ipv4 __user *) arg)->id);
+}
+
+/**
+ * homa_ioc_sendmany() - The top-level function for the ioctl that
+ * implements the homa_sendmany user-level API: submits several request
+ * messages in a single kernel call, without waiting for any responses.
+ * Together with HOMAIOCRECVMANY (to harvest completed responses) and
+ * HOMA_SO_EVENTFD (to wait for completions), this lets one client thread
+ * keep many RPCs outstanding at a cost of two kernel calls per batch.
+ * @sk:       Socket for this request.
+ * @arg:      Used to pass information from/to user space.
+ *
+ * Return: The number of requests accepted for delivery (at least 1) on
+ * success, otherwise a negative errno. The id field of each accepted
+ * entry is filled in with the id of its RPC.
+ */
+int homa_ioc_sendmany(struct sock *sk, unsigned long arg) {
+	struct homa_sock *hsk = homa_sk(sk);
+	struct homa_args_sendmany_ipv4 args;
+	struct homa_args_send_ipv4 request;
+	int i, err;
+
+	if (unlikely(copy_from_user(&args, (void *) arg, sizeof(args))))
+		return -EFAULT;
+	if (args.count <= 0)
+		return -EINVAL;
+	for (i = 0; i < args.count; i++) {
+		if (unlikely(copy_from_user(&request, &args.args[i],
+				sizeof(request)))) {
+			err = -EFAULT;
+			goto error;
+		}
+		err = homa_send_common(hsk, &request, &args.args[i].id);
+		if (err != 0)
+			goto error;
+	}
+	return i;
+
+error:
+	/* If some requests were already submitted, report that; the error
+	 * will recur if the caller resubmits the failed entry.
+	 */
+	return (i > 0) ? i : err;
+}
+
 /**
  * homa_ioctl() - Implements the ioctl system call for Homa sockets.
  * @sk:    Socket on which the system call was invoked.
@@ -683,9 +1064,15 @@ int homa_ioctl(struct sock *sk, int cmd, unsigned long arg) {
 	case HOMAIOCSEND:
 		result = homa_ioc_send(sk, arg);
 		break;
+	case HOMAIOCSENDMANY:
+		result = homa_ioc_sendmany(sk, arg);
+		break;
 	case HOMAIOCRECV:
 		result = homa_ioc_recv(sk, arg);
 		break;
+	case HOMAIOCRECVMANY:
+		result = homa_ioc_recvmany(sk, arg);
+		break;
 	case HOMAIOCINVOKE:
 		printk(KERN_NOTICE "HOMAIOCINVOKE not yet implemented\n");
 		result = -EINVAL;
@@ -693,10 +1080,16 @@ int homa_ioctl(struct sock *sk, int cmd, unsigned long arg) {
 	case HOMAIOCREPLY:
 		result = homa_ioc_reply(sk, arg);
 		break;
+	case HOMAIOCREPLYMANY:
+		result = homa_ioc_replymany(sk, arg);
+		break;
 	case HOMAIOCABORT:
 		printk(KERN_NOTICE "HOMAIOCABORT not yet implemented\n");
 		result = -EINVAL;
 		break;
+	case HOMAIOCRELEASE:
+		result = homa_ioc_release(sk, arg);
+		break;
 	default:
 		printk(KERN_NOTICE "Unknown Homa ioctl: %d\n", cmd);
 		result = -EINVAL;
@@ -731,11 +1124,73 @@ int homa_socket(struct sock *sk)
  */
 int homa_setsockopt(struct sock *sk, int level, int optname,
     char __user *optval, unsigned int optlen) {
-	printk(KERN_WARNING "unimplemented setsockopt invoked on Homa socket:"
+	struct homa_sock *hsk = homa_sk(sk);
+	int val;
+
+	if (level != IPPROTO_HOMA)
+		goto unsupported;
+	switch (optname) {
+	case HOMA_SO_POLL:
+		if (optlen != sizeof(int))
+			return -EINVAL;
+		if (copy_from_user(&val, optval, sizeof(val)))
+			return -EFAULT;
+		hsk->poll_mode = (val != 0);
+		return 0;
+	case HOMA_SO_EVENTFD: {
+		struct eventfd_ctx *ctx = NULL;
+
+		if (optlen != sizeof(int))
+			return -EINVAL;
+		if (copy_from_user(&val, optval, sizeof(val)))
+			return -EFAULT;
+		if (val >= 0) {
+			ctx = eventfd_ctx_fdget(val);
+			if (IS_ERR(ctx))
+				return PTR_ERR(ctx);
+		}
+		homa_sock_lock(hsk, "homa_setsockopt");
+		if (hsk->event_ctx != NULL)
+			eventfd_ctx_put(hsk->event_ctx);
+		hsk->event_ctx = ctx;
+		homa_sock_unlock(hsk);
+		return 0;
+	}
+	case HOMA_SO_REUSEPORT:
+		if (optlen != sizeof(int))
+			return -EINVAL;
+		if (copy_from_user(&val, optval, sizeof(val)))
+			return -EFAULT;
+		hsk->reuseport = (val != 0);
+		return 0;
+	case HOMA_SO_RCVBUF: {
+		struct homa_rcvbuf_args args;
+		int slots;
+
+		if (optlen != sizeof(args))
+			return -EINVAL;
+		if (copy_from_user(&args, optval, sizeof(args)))
+			return -EFAULT;
+		if ((args.start == NULL)
+				|| (args.length < HOMA_MAX_MESSAGE_LENGTH))
+			return -EINVAL;
+		slots = args.length/HOMA_MAX_MESSAGE_LENGTH;
+		if (slots > 64)
+			slots = 64;
+		homa_sock_lock(hsk, "homa_setsockopt");
+		hsk->region_start = (void __user *) args.start;
+		hsk->region_slots = slots;
+		hsk->region_in_use = 0;
+		homa_sock_unlock(hsk);
+		return 0;
+	}
+	}
+
+    unsupported:
+	printk(KERN_WARNING "unsupported setsockopt invoked on Homa socket:"
 			" level %d, optname %d, optlen %d\n",
 			level, optname, optlen);
-	return -EINVAL;
-
+	return -ENOPROTOOPT;
 }
 
 /**
@@ -756,35 +1211,219 @@ int homa_getsockopt(struct sock *sk, int level, int optname,
 }
 
 /**
- * homa_sendmsg() - Send a message on a Homa socket.
+ * homa_sendmsg() - Send a message on a Homa socket: either a new request
+ * or (if a HOMA_CMSG_RPC control message supplies a nonzero RPC id) the
+ * response for an existing RPC. This provides the same functionality as
+ * the HOMAIOCSEND and HOMAIOCREPLY ioctls, but through the standard
+ * syscall fast path, so operations can also be submitted via io_uring.
  * @sk:    Socket on which the system call was invoked.
  * @msg:   Structure describing the message to send.
  * @len:   Number of bytes of the message.
- * Return: 0 on success, otherwise a negative errno.
+ * Return: @len on success, otherwise a negative errno.
  */
 int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t len) {
-	/* Homa doesn't support the usual read-write kernel calls; must
-	 * invoke operations through ioctls in order to manipulate RPC ids.
+	struct homa_sock *hsk = homa_sk(sk);
+	struct sockaddr_in *dest = (struct sockaddr_in *) msg->msg_name;
+	struct homa_rpc_cmsg rinfo = {};
+	struct cmsghdr *cmsg;
+	struct homa_rpc *crpc;
+	char __user *buf;
+	int err;
+
+	if ((dest == NULL) || (msg->msg_namelen < sizeof(*dest)))
+		return -EINVAL;
+	if (unlikely(dest->sin_family != AF_INET))
+		return -EAFNOSUPPORT;
+	for_each_cmsghdr(cmsg, msg) {
+		if (!CMSG_OK(msg, cmsg))
+			return -EINVAL;
+		if (cmsg->cmsg_level != IPPROTO_HOMA)
+			continue;
+		if ((cmsg->cmsg_type != HOMA_CMSG_RPC)
+				|| (cmsg->cmsg_len != CMSG_LEN(sizeof(rinfo))))
+			return -EINVAL;
+		memcpy(&rinfo, CMSG_DATA(cmsg), sizeof(rinfo));
+	}
+
+	/* homa_fill_packets copies message data directly from a contiguous
+	 * user-space buffer; iovecs with multiple segments aren't (yet)
+	 * supported on this path.
 	 */
-	return -EINVAL;
+	if (!iter_is_iovec(&msg->msg_iter) || (msg->msg_iter.nr_segs != 1))
+		return -EINVAL;
+	buf = msg->msg_iter.iov->iov_base;
+
+	if (rinfo.id != 0) {
+		struct homa_args_reply_ipv4 args;
+		args.response = buf;
+		args.resplen = len;
+		args.dest_addr = *dest;
+		args.id = rinfo.id;
+		err = homa_reply_common(hsk, &args);
+		if (err != 0)
+			return err;
+		return len;
+	}
+
+	tt_record4("homa_sendmsg starting, target 0x%x:%d, port %d, id %u",
+			ntohl(dest->sin_addr.s_addr), ntohs(dest->sin_port),
+			hsk->client_port,
+			atomic64_read(&hsk->next_outgoing_id));
+	crpc = homa_rpc_new_client(hsk, dest, buf, len);
+	if (IS_ERR(crpc))
+		return PTR_ERR(crpc);
+	homa_xmit_data(crpc, false);
+	if ((rinfo.id_addr != 0) && unlikely(copy_to_user(
+			(__u64 __user *) rinfo.id_addr, &crpc->id,
+			sizeof(crpc->id)))) {
+		homa_rpc_free(crpc);
+		homa_rpc_unlock(crpc);
+		return -EFAULT;
+	}
+	homa_rpc_unlock(crpc);
+	return len;
 }
 
 /**
- * homa_recvmsg() - Receive a message from a Homa socket.
+ * homa_recvmsg() - Receive a message from a Homa socket; the counterpart
+ * of homa_sendmsg for the standard syscall fast path (and io_uring). A
+ * HOMA_CMSG_RPC control message supplied by the caller selects which
+ * message(s) to wait for; on return the control buffer holds an updated
+ * copy identifying the RPC that was received, and the sender's address
+ * is returned through @msg->msg_name in the usual way.
  * @sk:       Socket on which the system call was invoked.
  * @msg:      Describes where to copy the message data.
  * @len:      Bytes of space still left at msg.
  * @noblock:  Non-zero means MSG_DONTWAIT was specified
  * @flags:    Flags from system call, not including MSG_DONTWAIT
  * @addr_len: Store the length of the caller address here.
- * Return:    0 on success, otherwise a negative errno.
+ * Return:    The number of bytes copied for the message, otherwise a
+ *            negative errno.
  */
 int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len,
 		 int noblock, int flags, int *addr_len) {
-	/* Homa doesn't support the usual read-write kernel calls; must
-	 * invoke operations through ioctls in order to manipulate RPC ids.
+	struct homa_sock *hsk = homa_sk(sk);
+	struct homa_rpc_cmsg rinfo = {};
+	struct sockaddr_in *sender = (struct sockaddr_in *) msg->msg_name;
+	struct homa_rpc *rpc = NULL;
+	int rflags;
+	int err;
+	int result;
+	int finished = 1;
+	int copy_start = 0;
+	int copy_end = 0;
+
+	/* Unlike sendmsg, recvmsg leaves the control buffer in user space
+	 * (the kernel normally only writes ancillary data); Homa also reads
+	 * a HOMA_CMSG_RPC entry from it, if the caller provided one, to get
+	 * the receive flags and (optionally) a specific RPC id.
 	 */
-	return -EINVAL;
+	if (msg->msg_controllen >= CMSG_LEN(sizeof(rinfo))) {
+		struct cmsghdr chdr;
+		if (unlikely(copy_from_user(&chdr, msg->msg_control,
+				sizeof(chdr))))
+			return -EFAULT;
+		if ((chdr.cmsg_level != IPPROTO_HOMA)
+				|| (chdr.cmsg_type != HOMA_CMSG_RPC)
+				|| (chdr.cmsg_len != CMSG_LEN(sizeof(rinfo))))
+			return -EINVAL;
+		if (unlikely(copy_from_user(&rinfo, (char __user *)
+				msg->msg_control
+				+ CMSG_ALIGN(sizeof(struct cmsghdr)),
+				sizeof(rinfo))))
+			return -EFAULT;
+	} else {
+		/* No control info: accept anything (the common case for
+		 * plain io_uring reads on a server socket).
+		 */
+		rinfo.flags = HOMA_RECV_REQUEST | HOMA_RECV_RESPONSE;
+	}
+	rflags = rinfo.flags;
+	if (noblock)
+		rflags |= HOMA_RECV_NONBLOCKING;
+	if (rflags & HOMA_RECV_REGION)
+		/* Region slots return a buffer address, which doesn't fit
+		 * the recvmsg interface; use the HOMAIOCRECV ioctl instead.
+		 */
+		return -EINVAL;
+	if ((rflags & HOMA_RECV_PARTIAL) && (rinfo.id == 0))
+		return -EINVAL;
+	tt_record1("homa_recvmsg starting, port %d",
+			hsk->server_port != 0 ? hsk->server_port :
+			hsk->client_port);
+
+	rpc = homa_wait_for_message(hsk, rflags, rinfo.id);
+	if (IS_ERR(rpc))
+		return PTR_ERR(rpc);
+
+	/* Must free the RPC lock before copying to user space (see
+	 * sync.txt). Mark the RPC so we can still access the RPC
+	 * even without holding its lock.
+	 */
+	rpc->dont_reap = true;
+	if ((rflags & HOMA_RECV_PARTIAL) && (rpc->msgin.total_length >= 0)) {
+		copy_start = rpc->msgin.delivered;
+		copy_end = homa_prefix_end(&rpc->msgin);
+		if (copy_end > copy_start + (int) len)
+			copy_end = copy_start + (int) len;
+		rpc->msgin.delivered = copy_end;
+		if ((copy_end < rpc->msgin.total_length) && !rpc->error)
+			finished = 0;
+	}
+	if (finished) {
+		if (rpc->is_client)
+			homa_rpc_free(rpc);
+		else
+			rpc->state = RPC_IN_SERVICE;
+	}
+	homa_rpc_unlock(rpc);
+
+	if (sender != NULL) {
+		sender->sin_family = AF_INET;
+		sender->sin_port = htons(rpc->dport);
+		sender->sin_addr.s_addr = rpc->peer->addr;
+		memset(sender->sin_zero, 0, sizeof(sender->sin_zero));
+		*addr_len = sizeof(*sender);
+	}
+	rinfo.id = rpc->id;
+	rinfo.id_addr = 0;
+	err = put_cmsg(msg, IPPROTO_HOMA, HOMA_CMSG_RPC, sizeof(rinfo),
+			&rinfo);
+	if (unlikely(err != 0)) {
+		printk(KERN_NOTICE "homa_recvmsg couldn't return control "
+				"info\n");
+		goto error;
+	}
+
+	if (rpc->error) {
+		err = rpc->error;
+		goto error;
+	}
+
+	if (rflags & HOMA_RECV_PARTIAL)
+		result = homa_message_in_copy_partial(&rpc->msgin,
+				&msg->msg_iter, copy_start, copy_end);
+	else if ((hsk->homa->parallel_copy_bytes != 0)
+			&& (rpc->msgin.total_length
+			> hsk->homa->parallel_copy_bytes)
+			&& iter_is_iovec(&msg->msg_iter)
+			&& (msg->msg_iter.nr_segs == 1))
+		result = homa_message_in_copy_parallel(hsk->homa,
+				&rpc->msgin, msg->msg_iter.iov->iov_base,
+				len);
+	else
+		result = homa_message_in_copy_data(&rpc->msgin,
+				&msg->msg_iter, len);
+	tt_record_rpc2(rpc, "homa_recvmsg finished, id %u, port %d",
+			rpc->id & 0xffffffff,
+			rpc->is_client ? hsk->client_port : hsk->server_port);
+	rpc->dont_reap = false;
+	return result;
+
+error:
+	tt_record1("homa_recvmsg error %d", err);
+	rpc->dont_reap = false;
+	return err;
 }
 
 /**
@@ -871,6 +1510,47 @@ int homa_v4_early_demux_handler(struct sk_buff *skb) {
 	return 0;
 }
 
+/**
+ * homa_pkt_header() - Make sure a packet's Homa header is contiguous and
+ * available at skb->data, removing the IP header if it is still present
+ * (this happens for GRO packets on the frag_list, since they aren't
+ * handled explicitly by IP).
+ * @skb:   The incoming packet.
+ *
+ * Return: A pointer to the packet's common header, or NULL if the header
+ *         couldn't be made available; in that case the packet should be
+ *         discarded (metrics and logging have already been handled here).
+ */
+static struct common_header *homa_pkt_header(struct sk_buff *skb)
+{
+	int header_offset = skb_transport_header(skb) - skb->data;
+	if (skb->len < (HOMA_MAX_HEADER + header_offset)) {
+		if (homa->verbose)
+			printk(KERN_WARNING "Homa packet from %s too "
+					"short: %d bytes\n",
+					homa_print_ipv4_addr(
+					ip_hdr(skb)->saddr),
+					skb->len - header_offset);
+		INC_METRIC(short_packets, 1);
+		return NULL;
+	}
+
+	/* The code below makes the header available at skb->data, even
+	 * if the packet is fragmented.
+	 */
+	if (!pskb_may_pull(skb, HOMA_MAX_HEADER + header_offset)) {
+		if (homa->verbose)
+			printk(KERN_NOTICE "Homa can't handle fragmented "
+					"packet (no space for header); "
+					"discarding\n");
+		UNIT_LOG("", "pskb discard");
+		return NULL;
+	}
+	if (header_offset)
+		__skb_pull(skb, header_offset);
+	return (struct common_header *) skb->data;
+}
+
 /**
  * homa_handler() - Top-level input packet handler; invoked by IP through
  * homa_protocol.handler when a Homa packet arrives.
@@ -884,7 +1564,6 @@ int homa_pkt_recv(struct sk_buff *skb) {
 	__u16 dport;
 	static __u64 last = 0;
 	__u64 now;
-	int header_offset;
 	int first_packet = 1;
 	struct homa_sock *hsk;
 	
@@ -913,41 +1592,10 @@ int homa_pkt_recv(struct sk_buff *skb) {
 	skb_shinfo(skb)->frag_list = NULL;
 	while (1) {
 		saddr = ip_hdr(skb)->saddr;
-		
-		/* Make sure the header is available at skb->data. One
-		 * complication: it's possible that the IP header hasn't
-		 * yet been removed (this happens for GRO packets on
-		 * the frag_list, since they aren't handled explicitly
-		 * by IP.
-		 */
-		header_offset = skb_transport_header(skb) - skb->data;
-		if (skb->len < (HOMA_MAX_HEADER + header_offset)) {
-			if (homa->verbose)
-				printk(KERN_WARNING "Homa packet from %s too "
-						"short: %d bytes\n",
-						homa_print_ipv4_addr(saddr),
-						skb->len - header_offset);
-			INC_METRIC(short_packets, 1);
-			goto discard;
-		}
-	
-		/* The code below makes the header available at skb->data, even
-		 * if the packet is fragmented.
-		 */
-		if (!pskb_may_pull(skb, HOMA_MAX_HEADER + header_offset)) {
-			if (homa->verbose)
-				printk(KERN_NOTICE "Homa can't handle fragmented "
-						"packet (no space for header); "
-						"discarding\n");
-			UNIT_LOG("", "pskb discard");
+		skb->next = NULL;
+		h = homa_pkt_header(skb);
+		if (!h)
 			goto discard;
-		}
-		// The receive side of the transport layer might use this function during reception when removing a
-//       header from the packet. 
-		if (header_offset)
-			__skb_pull(skb, header_offset);
-		
-		h = (struct common_header *) skb->data;
 		if (first_packet) {
 			tt_record4("homa_pkt_recv: first packet from 0x%x:%d, "
 					"id %llu, type %d",
@@ -967,13 +1615,55 @@ int homa_pkt_recv(struct sk_buff *skb) {
 			tt_freeze();
 			goto discard;
 		}
-		
+
+		/* Batch any immediately following packets that belong to
+		 * the same RPC, linking them through skb->next, so that
+		 * homa_pkt_dispatch can process the whole group with a
+		 * single acquisition of the RPC's lock and a single grant
+		 * evaluation.
+		 */
+		if (h->type == DATA) {
+			struct sk_buff *tail = skb;
+			while (others) {
+				struct common_header *h2;
+				if (ip_hdr(others)->saddr != saddr)
+					break;
+				h2 = homa_pkt_header(others);
+				if (unlikely(!h2)) {
+					/* Bad packet (already logged above);
+					 * discard it here and keep scanning.
+					 */
+					struct sk_buff *bad = others;
+					others = others->next;
+					kfree_skb(bad);
+					continue;
+				}
+				if ((h2->type != DATA)
+						|| (h2->sport != h->sport)
+						|| (h2->dport != h->dport)
+						|| (h2->id != h->id))
+					break;
+				tail->next = others;
+				tail = others;
+				others = others->next;
+				tail->next = NULL;
+				INC_METRIC(gro_batched_packets, 1);
+			}
+		}
+
 		/* Find the socket and existing RPC (if there is one) for this
-		 * packet, and lock the RPC.
+		 * packet, and lock the RPC. The port lookup is lockless (the
+		 * socktab buckets are RCU lists); the rcu_read_lock keeps the
+		 * socket's memory from being reclaimed during dispatch if the
+		 * socket is concurrently shut down (sockets are freed via RCU:
+		 * see SOCK_RCU_FREE in homa_sock_destroy).
 		 */
 		dport = ntohs(h->dport);
-		hsk = homa_sock_find(&homa->port_map, dport);
+		rcu_read_lock();
+		hsk = homa_sock_find_dispatch(&homa->port_map, dport, saddr,
+				h->id);
 		if (!hsk) {
+			rcu_read_unlock();
 			/* Eventually should return an error result to sender if
 			 * it is a client.
 			 */
@@ -983,13 +1673,18 @@ int homa_pkt_recv(struct sk_buff *skb) {
 					homa_print_ipv4_addr(saddr), dport);
 			goto discard;
 		}
-		
+
 		homa_pkt_dispatch(skb, hsk);
+		rcu_read_unlock();
 		goto next_packet;
-		
+
 discard:
-		kfree_skb(skb);
-		
+		while (skb) {
+			struct sk_buff *next = skb->next;
+			kfree_skb(skb);
+			skb = next;
+		}
+
 next_packet:
 		if (others == NULL)
 			break;
@@ -1062,7 +1757,8 @@ __poll_t homa_poll(struct file *file, struct socket *sock,
 	       struct poll_table_struct *wait) {
 	struct sock *sk = sock->sk;
 	__poll_t mask;
-	
+	int i;
+
 	/* It seems to be standard practice for poll functions *not* to
 	 * acquire the socket lock, so we don't do it here; not sure
 	 * why...
@@ -1072,9 +1768,14 @@ __poll_t homa_poll(struct file *file, struct socket *sock,
 	// sock_poll_wait(file, sk_sleep(sk), wait);
 	mask = POLLOUT | POLLWRNORM;
 	
-	if (!list_empty(&homa_sk(sk)->ready_requests) ||
-			!list_empty(&homa_sk(sk)->ready_responses))
-		mask |= POLLIN | POLLRDNORM;
+	for (i = 0; i < NR_CPUS; i++) {
+		struct homa_ready_shard *shard = &homa_sk(sk)->ready_shards[i];
+		if (!list_empty(&shard->ready_requests)
+				|| !list_empty(&shard->ready_responses)) {
+			mask |= POLLIN | POLLRDNORM;
+			break;
+		}
+	}
 	return mask;
 }
 
@@ -1132,6 +1833,60 @@ ssize_t homa_metrics_read(struct file *file, char __user *buffer,
 	return copied;
 }
 
+/**
+ * homa_metrics_bin_read() - This function is invoked to handle read kernel
+ * calls on /proc/net/homa_metrics_bin. The file consists of a struct
+ * homa_metrics_bin_header followed by one raw struct homa_metrics for each
+ * core; the counters are copied straight out of the per-core structures,
+ * with no formatting or allocation.
+ * @file:    Information about the file being read.
+ * @buffer:  Address in user space of the buffer in which data from the file
+ *           should be returned.
+ * @length:  Number of bytes available at @buffer.
+ * @offset:  Current read offset within the file.
+ *
+ * Return: the number of bytes returned at @buffer. 0 means the end of the
+ * file was reached, and a negative number indicates an error (-errno).
+ */
+ssize_t homa_metrics_bin_read(struct file *file, char __user *buffer,
+		size_t length, loff_t *offset)
+{
+	struct homa_metrics_bin_header header;
+	loff_t total = sizeof(header)
+			+ ((loff_t) NR_CPUS) * sizeof(struct homa_metrics);
+	size_t copied = 0;
+
+	header.magic = HOMA_METRICS_BIN_MAGIC;
+	header.version = HOMA_METRICS_BIN_VERSION;
+	header.num_cores = NR_CPUS;
+	header.record_size = sizeof(struct homa_metrics);
+	header.cpu_khz = cpu_khz;
+	while ((copied < length) && ((*offset + copied) < total)) {
+		loff_t pos = *offset + copied;
+		size_t chunk;
+		char *src;
+
+		if (pos < sizeof(header)) {
+			src = ((char *) &header) + pos;
+			chunk = sizeof(header) - pos;
+		} else {
+			loff_t core = (pos - sizeof(header))
+					/ sizeof(struct homa_metrics);
+			size_t within = (pos - sizeof(header))
+					% sizeof(struct homa_metrics);
+			src = ((char *) homa_metrics[core]) + within;
+			chunk = sizeof(struct homa_metrics) - within;
+		}
+		if (chunk > (length - copied))
+			chunk = length - copied;
+		if (copy_to_user(buffer + copied, src, chunk))
+			return -EFAULT;
+		copied += chunk;
+	}
+	*offset += copied;
+	return copied;
+}
+
 /**
  * homa_metrics_release() - This function is invoked when the last reference to
  * an open /proc/net/homa_metrics is closed.  It performs cleanup.
@@ -1179,6 +1934,10 @@ int homa_dointvec(struct ctl_table *table, int write,
 				|| (table->data == &homa_data.num_priorities)) {
 			homa_prios_changed(homa);
 		}
+		if (table->data == &homa_data.tt_filter_interval) {
+			atomic_set(&homa->tt_filter_count,
+					homa->tt_filter_interval);
+		}
 	}
 	return result;
 }
@@ -130,6 +130,12 @@ void homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 	hsk->last_locker = "none";
 	hsk->homa = homa;
 	hsk->shutdown = false;
+	hsk->poll_mode = 0;
+	hsk->reuseport = 0;
+	hsk->region_start = NULL;
+	hsk->region_slots = 0;
+	hsk->region_in_use = 0;
+	hsk->event_ctx = NULL;
 	hsk->server_port = 0;
 	while (1) {
 		if (homa->next_client_port < HOMA_MIN_CLIENT_PORT) {
@@ -149,8 +155,13 @@ void homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 	INIT_LIST_HEAD(&hsk->active_rpcs);
 	INIT_LIST_HEAD(&hsk->dead_rpcs);
 	hsk->dead_skbs = 0;
-	INIT_LIST_HEAD(&hsk->ready_requests);
-	INIT_LIST_HEAD(&hsk->ready_responses);
+	for (i = 0; i < NR_CPUS; i++) {
+		struct homa_ready_shard *shard = &hsk->ready_shards[i];
+		spin_lock_init(&shard->lock);
+		INIT_LIST_HEAD(&shard->ready_requests);
+		INIT_LIST_HEAD(&shard->ready_responses);
+	}
+	spin_lock_init(&hsk->interest_lock);
 	INIT_LIST_HEAD(&hsk->request_interests);
 	INIT_LIST_HEAD(&hsk->response_interests);
 	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
@@ -213,13 +224,19 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 	}
 	homa_sock_lock(hsk, "homa_socket_shutdown #2");
 	
+	spin_lock_bh(&hsk->interest_lock);
 	list_for_each_entry(interest, &hsk->request_interests, request_links)
 		wake_up_process(interest->thread);
 	list_for_each_entry(interest, &hsk->response_interests, response_links)
 		wake_up_process(interest->thread);
+	spin_unlock_bh(&hsk->interest_lock);
 	
 	atomic_dec(&hsk->reap_disable);
 	while (homa_rpc_reap(hsk) != 0) {}
+	if (hsk->event_ctx != NULL) {
+		eventfd_ctx_put(hsk->event_ctx);
+		hsk->event_ctx = NULL;
+	}
 	homa_sock_unlock(hsk);
 }
 
@@ -258,9 +275,17 @@ int homa_sock_bind(struct homa_socktab *socktab, struct homa_sock *hsk,
 	mutex_lock(&socktab->write_lock);
 	owner = homa_sock_find(socktab, port);
 	if (owner != NULL) {
-		if (owner != hsk)
+		if (owner == hsk)
+			goto done;
+		if (!owner->reuseport || !hsk->reuseport) {
 			result = -EADDRINUSE;
-		goto done;
+			goto done;
+		}
+		/* Every socket bound to the port so far opted in with
+		 * HOMA_SO_REUSEPORT, and so did this one: share the port.
+		 * homa_sock_find_dispatch spreads incoming requests across
+		 * the members of the group.
+		 */
 	}
 	if (hsk->server_port) {
 		hlist_del_rcu(&hsk->server_links.hash_links);
@@ -300,6 +325,113 @@ struct homa_sock *homa_sock_find(struct homa_socktab *socktab,  __u16 port)
 	return result;
 }
 
+/**
+ * homa_sock_find_dispatch() - Returns the socket to which an incoming
+ * packet should be dispatched. Like homa_sock_find, except that when
+ * several sockets share @port (see HOMA_SO_REUSEPORT) the packet's client
+ * address and RPC id select one member of the group. The selection is a
+ * deterministic hash, so all of the packets for a given RPC arrive on
+ * the same socket (as long as the group's membership doesn't change)
+ * while new requests spread across the group.
+ * @socktab:    Hash table in which to perform lookup.
+ * @port:       Destination port of the packet; may be either a client or
+ *              a server port. Must not be 0.
+ * @saddr:      IP address from which the packet was sent.
+ * @id:         RPC identifier from the packet.
+ *
+ * Return:      The socket to dispatch to, or NULL if no socket has bound
+ *              @port. As with homa_sock_find, the caller should use RCU
+ *              to protect the lookup and its use of the socket.
+ */
+struct homa_sock *homa_sock_find_dispatch(struct homa_socktab *socktab,
+		__u16 port, __be32 saddr, __u64 id)
+{
+	struct homa_socktab_links *link;
+	struct homa_sock *result = NULL;
+	int count = 0;
+	int index;
+
+	hlist_for_each_entry_rcu(link, &socktab->buckets[homa_port_hash(port)],
+			hash_links) {
+		struct homa_sock *hsk = link->sock;
+		if ((hsk->client_port == port) || (hsk->server_port == port)) {
+			result = hsk;
+			count++;
+		}
+	}
+	if (count <= 1)
+		return result;
+	index = jhash_3words(ntohl(saddr), (__u32) id, (__u32) (id >> 32),
+			0) % count;
+	hlist_for_each_entry_rcu(link, &socktab->buckets[homa_port_hash(port)],
+			hash_links) {
+		struct homa_sock *hsk = link->sock;
+		if ((hsk->client_port == port) || (hsk->server_port == port)) {
+			if (index == 0)
+				return hsk;
+			index--;
+		}
+	}
+	return result;
+}
+
+/**
+ * homa_sock_region_alloc() - Allocate a free slot from the socket's
+ * registered receive buffer region.
+ * @hsk:     Socket whose region should be used; must have been registered
+ *           with HOMA_SO_RCVBUF.
+ *
+ * Return:   The (user-space) address of the first byte of the slot, or
+ *           NULL if there is no region or all of its slots are in use.
+ */
+void __user *homa_sock_region_alloc(struct homa_sock *hsk)
+{
+	void __user *result = NULL;
+	int i;
+
+	homa_sock_lock(hsk, "homa_sock_region_alloc");
+	for (i = 0; i < hsk->region_slots; i++) {
+		if (!(hsk->region_in_use & (((__u64) 1) << i))) {
+			hsk->region_in_use |= ((__u64) 1) << i;
+			result = (char __user *) hsk->region_start
+					+ i*((size_t) HOMA_MAX_MESSAGE_LENGTH);
+			break;
+		}
+	}
+	homa_sock_unlock(hsk);
+	return result;
+}
+
+/**
+ * homa_sock_region_release() - Return ownership of a receive buffer slot
+ * (previously returned by homa_sock_region_alloc) to the socket, so it can
+ * be used for another message.
+ * @hsk:     Socket that owns the slot.
+ * @addr:    Address of the first byte of the slot, as returned to the
+ *           application by homa_recv.
+ *
+ * Return:   0 on success, or a negative errno if @addr doesn't refer to
+ *           an allocated slot.
+ */
+int homa_sock_region_release(struct homa_sock *hsk, void __user *addr)
+{
+	size_t offset = (char __user *) addr - (char __user *)
+			hsk->region_start;
+	int i = offset/HOMA_MAX_MESSAGE_LENGTH;
+	int err = 0;
+
+	homa_sock_lock(hsk, "homa_sock_region_release");
+	if ((hsk->region_start == NULL) || (addr < hsk->region_start)
+			|| (i >= hsk->region_slots)
+			|| (offset != i*((size_t) HOMA_MAX_MESSAGE_LENGTH))
+			|| !(hsk->region_in_use & (((__u64) 1) << i)))
+		err = -EINVAL;
+	else
+		hsk->region_in_use &= ~(((__u64) 1) << i);
+	homa_sock_unlock(hsk);
+	return err;
+}
+
 /**
  * homa_sock_lock_slow() - This function implements the slow path for
  * acquiring a socketC lock. It is invoked when a socket lock isn't immediately
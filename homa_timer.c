@@ -64,7 +64,7 @@ int homa_check_timeout(struct homa_rpc *rpc)
 						homa_print_ipv4_addr(
 						rpc->peer->addr),
 						rpc->dport, rpc->id);
-			tt_record2("Client RPC timeout, id %llu, port %d",
+			tt_record_rpc2(rpc, "Client RPC timeout, id %llu, port %d",
 					rpc->id, rpc->dport);
 			return 1;
 		}
@@ -103,14 +103,14 @@ int homa_check_timeout(struct homa_rpc *rpc)
 	if (rpc->is_client) {
 		us = "server";
 		them = "client";
-		tt_record4("Sent RESEND for client RPC id %llu, server 0x%x:%d, "
+		tt_record_rpc4(rpc, "Sent RESEND for client RPC id %llu, server 0x%x:%d, "
 				"offset %d",
 				rpc->id, htonl(rpc->peer->addr), rpc->dport,
 				ntohl(resend.offset));
 	} else {
 		us = "client";
 		them = "server";
-		tt_record4("Sent RESEND for server RPC id %llu, client 0x%x:%d "
+		tt_record_rpc4(rpc, "Sent RESEND for server RPC id %llu, client 0x%x:%d "
 				"offset %d",
 				rpc->id, htonl(rpc->peer->addr), rpc->dport,
 				ntohl(resend.offset));
@@ -126,117 +126,204 @@ int homa_check_timeout(struct homa_rpc *rpc)
 }
 
 /**
- * homa_timer() - This function is invoked at regular intervals ("ticks")
- * to implement retries and aborts for Homa.
+ * homa_timer_schedule() - Arrange for homa_timer to check an RPC for
+ * timeouts at a given tick. The caller must hold homa->timer_lock.
  * @homa:    Overall data about the Homa protocol implementation.
+ * @rpc:     RPC that should be checked; may or may not currently be in
+ *           the timer wheel.
+ * @tick:    Value of homa->timer_ticks at which the check should occur.
+ *           If this is more than HOMA_TIMER_WHEEL_SIZE ticks in the
+ *           future the check will just happen early, which is harmless.
  */
-void homa_timer(struct homa *homa)
+void homa_timer_schedule(struct homa *homa, struct homa_rpc *rpc, __u32 tick)
+{
+	list_move_tail(&rpc->timer_links,
+			&homa->timer_wheel[tick & (HOMA_TIMER_WHEEL_SIZE-1)]);
+}
+
+/**
+ * homa_log_active_rpcs() - Print information about all active RPCs to
+ * the system log; invoked from homa_timer when requested via
+ * HOMA_FLAG_LOG_ACTIVE_RPCS. This scans every socket and RPC, but it
+ * only runs when explicitly requested, so its cost doesn't matter.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+static void homa_log_active_rpcs(struct homa *homa)
 {
 	struct homa_socktab_scan scan;
 	struct homa_sock *hsk;
 	struct homa_rpc *rpc;
-	cycles_t start, end;
-	bool print_active = false;
 	int num_active = 0;
-	struct homa_peer *dead_peer = NULL;
-	
-	start = get_cycles();
-	homa->timer_ticks++;
-	if (homa->flags & HOMA_FLAG_LOG_ACTIVE_RPCS) {
-		print_active = true;
-		homa->flags &= ~HOMA_FLAG_LOG_ACTIVE_RPCS;
-	}
 
-	/* Scan all existing RPCs in all sockets.  The rcu_read_lock
-	 * below prevents sockets from being deleted during the scan.
+	/* The rcu_read_lock below prevents sockets from being deleted
+	 * during the scan.
 	 */
 	rcu_read_lock();
 	for (hsk = homa_socktab_start_scan(&homa->port_map, &scan);
 			hsk !=  NULL; hsk = homa_socktab_next(&scan)) {
+		struct list_head *pos;
+		int requests = 0;
+		int responses = 0;
+		int i;
+
 		if (list_empty(&hsk->active_rpcs) || hsk->shutdown)
 			continue;
-		
+
 		atomic_inc(&hsk->reap_disable);
 		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
+			int in_remaining = 0;
+			int incoming = 0;
+			int out_sent;
+
 			homa_rpc_lock(rpc);
-			if (unlikely(print_active)) {
-				int in_remaining = 0;
-				int incoming = 0;
-				int out_sent = rpc->msgout.length;
-				if (rpc->msgin.total_length > 0) {
-					in_remaining =
-						rpc->msgin.bytes_remaining;
-					incoming = rpc->msgin.incoming;
-				}
-				if (rpc->msgout.next_packet)
-					out_sent = homa_data_offset(
-							rpc->msgout.next_packet);
-				printk(KERN_NOTICE "Active %s RPC, peer "
-					"%s, port %u, id %llu, state %s, "
-					"silent %d, msgin remaining %d/%d "
-					"incoming %d, msgout sent %d/%d, "
-					"error %d\n",
-					rpc->is_client ? "client" : "server",
-					homa_print_ipv4_addr(rpc->peer->addr),
-					rpc->dport, rpc->id,
-					homa_symbol_for_state(rpc),
-					rpc->silent_ticks,
-					in_remaining, rpc->msgin.total_length,
-					incoming, out_sent,
-					rpc->msgout.length, rpc->error);
-				num_active++;
-			}
-			if ((rpc->state == RPC_READY)
-					|| (rpc->state == RPC_IN_SERVICE)) {
-				rpc->silent_ticks = 0;
-				homa_rpc_unlock(rpc);
-				continue;
-			}
-			rpc->silent_ticks++;
-			if (rpc->silent_ticks >= homa->resend_ticks) {
-				if (homa_check_timeout(rpc)) {
-					tt_record4("rpc timed out: peer 0x%x, "
-							"port %d, id %d,"
-							"state %d",
-							rpc->peer->addr,
-							rpc->dport, rpc->id,
-							rpc->state);
-					if (rpc->is_client)
-						dead_peer = rpc->peer;
-					else {
-						INC_METRIC(server_rpc_timeouts, 1);
-						if (rpc->hsk->homa->verbose)
-							printk(KERN_NOTICE "Homa server "
-								"RPC timeout, client "
-								"%s:%d, id %llu",
-								homa_print_ipv4_addr(
-									rpc->peer->addr),
-								rpc->dport, rpc->id);
-						homa_rpc_free(rpc);
-					}
-				}
+			out_sent = rpc->msgout.length;
+			if (rpc->msgin.total_length > 0) {
+				in_remaining = rpc->msgin.bytes_remaining;
+				incoming = rpc->msgin.incoming;
 			}
+			if (rpc->msgout.next_packet)
+				out_sent = homa_data_offset(
+						rpc->msgout.next_packet);
+			printk(KERN_NOTICE "Active %s RPC, peer "
+				"%s, port %u, id %llu, state %s, "
+				"silent %d, msgin remaining %d/%d "
+				"incoming %d, msgout sent %d/%d, "
+				"error %d\n",
+				rpc->is_client ? "client" : "server",
+				homa_print_ipv4_addr(rpc->peer->addr),
+				rpc->dport, rpc->id,
+				homa_symbol_for_state(rpc),
+				rpc->silent_ticks,
+				in_remaining, rpc->msgin.total_length,
+				incoming, out_sent,
+				rpc->msgout.length, rpc->error);
+			num_active++;
 			homa_rpc_unlock(rpc);
 		}
-		if (print_active) {
-			struct list_head *pos;
-			int requests = 0;
-			int responses = 0;
-			homa_sock_lock(hsk, "homa_timer");
-			list_for_each(pos, &hsk->ready_requests) {
+		for (i = 0; i < NR_CPUS; i++) {
+			struct homa_ready_shard *shard = &hsk->ready_shards[i];
+			spin_lock_bh(&shard->lock);
+			list_for_each(pos, &shard->ready_requests) {
 				requests++;
 			}
-			list_for_each(pos, &hsk->ready_responses) {
+			list_for_each(pos, &shard->ready_responses) {
 				responses++;
 			}
-			homa_sock_unlock(hsk);
-			printk(KERN_NOTICE "%d ready requests, %d ready "
-					"responses for socket\n",
-					requests, responses);
+			spin_unlock_bh(&shard->lock);
 		}
+		printk(KERN_NOTICE "%d ready requests, %d ready "
+				"responses for socket\n",
+				requests, responses);
 		atomic_dec(&hsk->reap_disable);
 	}
 	rcu_read_unlock();
+	if (num_active) {
+		printk(KERN_NOTICE "Found %d active Homa RPCs\n", num_active);
+	}
+}
+
+/**
+ * homa_timer() - This function is invoked at regular intervals ("ticks")
+ * to implement retries and aborts for Homa.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_timer(struct homa *homa)
+{
+	struct homa_rpc *rpc;
+	cycles_t start, end;
+	struct homa_peer *dead_peer = NULL;
+	struct list_head expired;
+	__u32 next_tick;
+
+	start = get_cycles();
+	homa->timer_ticks++;
+	if (homa->flags & HOMA_FLAG_LOG_ACTIVE_RPCS) {
+		homa->flags &= ~HOMA_FLAG_LOG_ACTIVE_RPCS;
+		homa_log_active_rpcs(homa);
+	}
+	if ((homa->cutoff_tune_ticks != 0) && ((homa->timer_ticks
+			- homa->last_cutoff_tune)
+			>= homa->cutoff_tune_ticks)) {
+		homa->last_cutoff_tune = homa->timer_ticks;
+		homa_tune_cutoffs(homa);
+	}
+	if ((homa->overcommit_tune_ticks != 0) && ((homa->timer_ticks
+			- homa->last_overcommit_tune)
+			>= homa->overcommit_tune_ticks)) {
+		homa->last_overcommit_tune = homa->timer_ticks;
+		homa_tune_overcommit(homa);
+	}
+	if ((homa->dcacp_iter_ticks != 0) && ((homa->timer_ticks
+			- homa->last_dcacp_iter)
+			>= homa->dcacp_iter_ticks)) {
+		homa->last_dcacp_iter = homa->timer_ticks;
+		dcacp_run_iteration(homa);
+	}
+
+	/* Check the RPCs whose timeout checks are due at this tick. RPCs
+	 * with recent activity just get pushed further into the wheel, so
+	 * the cost of a tick scales with the number of RPCs actually at
+	 * risk of timeout, not with the total number of active RPCs.
+	 */
+	INIT_LIST_HEAD(&expired);
+	spin_lock_bh(&homa->timer_lock);
+	list_splice_init(&homa->timer_wheel[homa->timer_ticks
+			& (HOMA_TIMER_WHEEL_SIZE-1)], &expired);
+	while (!list_empty(&expired)) {
+		rpc = list_first_entry(&expired, struct homa_rpc, timer_links);
+
+		/* Lock the RPC while still holding the timer lock (this
+		 * keeps the RPC from being deleted before it can be locked).
+		 * We can't wait for the RPC lock because of lock ordering
+		 * constraints (see sync.txt); if it isn't available, check
+		 * this RPC again next tick.
+		 */
+		if (!(spin_trylock_bh(rpc->lock))) {
+			homa_timer_schedule(homa, rpc, homa->timer_ticks + 1);
+			continue;
+		}
+		list_del_init(&rpc->timer_links);
+		spin_unlock_bh(&homa->timer_lock);
+
+		rpc->silent_ticks += homa->timer_ticks - rpc->timer_tick;
+		rpc->timer_tick = homa->timer_ticks;
+		if ((rpc->state == RPC_READY)
+				|| (rpc->state == RPC_IN_SERVICE)) {
+			rpc->silent_ticks = 0;
+		} else if (rpc->silent_ticks >= homa->resend_ticks) {
+			if (homa_check_timeout(rpc)) {
+				tt_record_rpc4(rpc, "rpc timed out: peer 0x%x, "
+						"port %d, id %d,"
+						"state %d",
+						rpc->peer->addr,
+						rpc->dport, rpc->id,
+						rpc->state);
+				if (rpc->is_client)
+					dead_peer = rpc->peer;
+				else {
+					INC_METRIC(server_rpc_timeouts, 1);
+					if (rpc->hsk->homa->verbose)
+						printk(KERN_NOTICE "Homa server "
+							"RPC timeout, client "
+							"%s:%d, id %llu",
+							homa_print_ipv4_addr(
+								rpc->peer->addr),
+							rpc->dport, rpc->id);
+					homa_rpc_free(rpc);
+				}
+			}
+		}
+		if (rpc->silent_ticks >= homa->resend_ticks)
+			next_tick = homa->timer_ticks + 1;
+		else
+			next_tick = homa->timer_ticks + homa->resend_ticks
+					- rpc->silent_ticks;
+		spin_lock_bh(&homa->timer_lock);
+		if (rpc->state != RPC_DEAD)
+			homa_timer_schedule(homa, rpc, next_tick);
+		homa_rpc_unlock(rpc);
+	}
+	spin_unlock_bh(&homa->timer_lock);
 	if (dead_peer) {
 		/* We only timeout one peer per call to this function (it's
 		 * tricky from a synchronization standpoint to handle the
@@ -247,9 +334,6 @@ void homa_timer(struct homa *homa)
 		 */
 		homa_peer_abort(homa, dead_peer->addr, -ETIMEDOUT);
 	}
-	if (print_active && num_active) {
-		printk(KERN_NOTICE "Found %d active Homa RPCs\n", num_active);
-	}
 	end = get_cycles();
 	INC_METRIC(timer_cycles, end-start);
 }
\ No newline at end of file
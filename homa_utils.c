@@ -23,6 +23,20 @@ struct homa_metrics *homa_metrics[NR_CPUS];
 /* Points to block of memory holding all homa_metrics; used to free it. */
 char *metrics_memory;
 
+/* Backing allocator for homa_rpc structs; shared by all cores. */
+struct kmem_cache *homa_rpc_slab;
+
+/* Free homa_rpc structs cached separately by each core, so that the
+ * common create/reap cycle doesn't touch homa_rpc_slab at all.
+ */
+struct homa_rpc_cache homa_rpc_caches[NR_CPUS];
+
+/* Histograms of incoming message sizes, one per core; used by
+ * homa_tune_cutoffs to adapt the unscheduled priority cutoffs to the
+ * observed workload.
+ */
+struct homa_size_hist homa_size_hists[NR_CPUS];
+
 /**
  * homa_init() - Constructor for homa objects.
  * @homa:   Object to initialize.
@@ -57,7 +71,20 @@ int homa_init(struct homa *homa)
 		}
 	}
 	
-	homa->pacer_kthread = NULL;
+	/* Create the allocation cache for homa_rpc structs (if no-one else
+	 * has already done it).
+	 */
+	if (!homa_rpc_slab) {
+		homa_rpc_slab = kmem_cache_create("homa_rpc",
+				sizeof(struct homa_rpc), 0, 0, NULL);
+		if (!homa_rpc_slab) {
+			printk(KERN_ERR "Homa couldn't create slab for RPCs\n");
+			return -ENOMEM;
+		}
+		memset(homa_rpc_caches, 0, sizeof(homa_rpc_caches));
+	}
+
+	memset(homa->links, 0, sizeof(homa->links));
 	homa->next_client_port = HOMA_MIN_CLIENT_PORT;
 	homa_socktab_init(&homa->port_map);
 	err = homa_peertab_init(&homa->peers);
@@ -69,6 +96,7 @@ int homa_init(struct homa *homa)
 	
 	/* Wild guesses to initialize configuration values... */
 	homa->rtt_bytes = 10000;
+	homa->peer_rtt_adapt = 1;
 	homa->link_mbps = 10000;
 	homa->num_priorities = HOMA_MAX_PRIORITIES;
 	homa->base_priority = 1;
@@ -85,46 +113,101 @@ int homa_init(struct homa *homa)
 #else
 	homa->cutoff_version = 1;
 #endif
+	homa->cutoff_tune_ticks = 5000;
+	homa->cycle_metrics = 0;
+	homa->last_cutoff_tune = 0;
+	memset(homa->prev_size_hist, 0, sizeof(homa->prev_size_hist));
+	memset(homa_size_hists, 0, sizeof(homa_size_hists));
 	homa->grant_increment = 0;
+	homa->grant_coalesce_bytes = 5000;
 	homa->max_overcommit = 8;
+	homa->overcommit_tune_ticks = 1000;
+	homa->last_overcommit_tune = 0;
+	atomic64_set(&homa->sched_grant_bytes, 0);
+	atomic64_set(&homa->sched_arrival_bytes, 0);
+	homa->prev_grant_bytes = 0;
+	homa->prev_arrival_bytes = 0;
+	homa->last_tune_cycles = get_cycles();
 	homa->resend_ticks = 2;
 	homa->resend_interval = 5;
 	homa->abort_resends = 10;
 	homa->reap_limit = 10;
 	homa->max_dead_buffs = 10000;
+	homa->poll_usecs = 0;
 	spin_lock_init(&homa->grantable_lock);
 	INIT_LIST_HEAD(&homa->grantable_rpcs);
 	homa->num_grantable = 0;
-	spin_lock_init(&homa->throttle_lock);
-	INIT_LIST_HEAD_RCU(&homa->throttled_rpcs);
+	memset(homa->grantable_tails, 0, sizeof(homa->grantable_tails));
+	atomic_set(&homa->grant_active, 0);
 	homa->throttle_min_bytes = 300;
-	homa->pacer_kthread = kthread_run(homa_pacer_main, homa,
-			"homa_pacer");
-	if (IS_ERR(homa->pacer_kthread)) {
-		err = PTR_ERR(homa->pacer_kthread);
-		homa->pacer_kthread = NULL;
-		printk(KERN_ERR "couldn't create homa pacer thread: error %d\n",
-			err);
-		return err;
+	homa->zerocopy_min_bytes = 0;
+	homa->pacer_spin_threshold = 10;
+	homa->num_links = 1;
+	for (i = 0; i < HOMA_MAX_LINKS; i++) {
+		struct homa_link *link = &homa->links[i];
+		int j;
+
+		link->homa = homa;
+		link->id = i;
+		spin_lock_init(&link->throttle_lock);
+		INIT_LIST_HEAD_RCU(&link->throttled_rpcs);
+		init_llist_head(&link->throttled_staging);
+		hrtimer_init(&link->pacer_hrtimer, CLOCK_MONOTONIC,
+				HRTIMER_MODE_REL);
+		link->pacer_hrtimer.function = &homa_pacer_hrtimer;
+		link->pacer_busy_passes = 0;
+		for (j = 0; j < HOMA_TX_QUEUES; j++)
+			atomic64_set(&link->link_idle_time[j], get_cycles());
+		link->pacer_exit = false;
+		atomic_set(&link->pacer_active, 0);
+		link->pacer_kthread = kthread_run(homa_pacer_main, link,
+				"homa_pacer/%d", i);
+		if (IS_ERR(link->pacer_kthread)) {
+			err = PTR_ERR(link->pacer_kthread);
+			link->pacer_kthread = NULL;
+			printk(KERN_ERR "couldn't create homa pacer thread: "
+					"error %d\n", err);
+			return err;
+		}
+	}
+	homa->parallel_copy_bytes = 250000;
+	homa->copy_wq = alloc_workqueue("homa_copy", WQ_UNBOUND, 0);
+	if (!homa->copy_wq) {
+		printk(KERN_ERR "Homa couldn't create copy workqueue\n");
+		return -ENOMEM;
+	}
+	homa->reap_wq = alloc_workqueue("homa_reap", WQ_UNBOUND, 0);
+	if (!homa->reap_wq) {
+		printk(KERN_ERR "Homa couldn't create reap workqueue\n");
+		return -ENOMEM;
 	}
-	homa->pacer_exit = false;
-	atomic_set(&homa->pacer_active, 0);
 	/*
 	 * DCACP Logic
 	 */
-	
-	atomic64_set(&homa->link_idle_time, get_cycles());
+	dcacp_epoch_init(homa);
+	homa->dcacp_iter_ticks = 0;
+	homa->last_dcacp_iter = 0;
+
 	homa->max_nic_queue_ns = 2000;
 	homa->cycles_per_kbyte = 0;
 	homa->verbose = 0;
 	homa->max_gso_size = 1000000;
 	homa->max_gro_skbs = 20;
 	homa->timer_ticks = 0;
+	spin_lock_init(&homa->timer_lock);
+	for (i = 0; i < HOMA_TIMER_WHEEL_SIZE; i++)
+		INIT_LIST_HEAD(&homa->timer_wheel[i]);
 	spin_lock_init(&homa->metrics_lock);
 	homa->metrics = NULL;
 	homa->metrics_capacity = 0;
 	homa->metrics_length = 0;
 	homa->metrics_active_opens = 0;
+	memset(homa->freeze_slo_usecs, 0, sizeof(homa->freeze_slo_usecs));
+	homa->tt_filter_id = 0;
+	homa->tt_filter_interval = 0;
+	atomic_set(&homa->tt_filter_count, 0);
+	homa->tt_filter_min_length = 0;
+	homa->tt_filter_port = 0;
 	homa_outgoing_sysctl_changed(homa);
 	return 0;
 }
@@ -136,13 +219,42 @@ int homa_init(struct homa *homa)
 void homa_destroy(struct homa *homa)
 {
 	int i;
-	if (homa->pacer_kthread) {
-		homa_pacer_stop(homa);
+	homa_pacer_stop(homa);
+	if (homa->copy_wq) {
+		destroy_workqueue(homa->copy_wq);
+		homa->copy_wq = NULL;
 	}
-	
+	if (homa->reap_wq) {
+		destroy_workqueue(homa->reap_wq);
+		homa->reap_wq = NULL;
+	}
+
 	/* The order of the following 2 statements matters! */
 	homa_socktab_destroy(&homa->port_map);
 	homa_peertab_destroy(&homa->peers);
+
+	/* Release any cached control-packet sk_buffs (if a transmission
+	 * is somehow still pending, this just drops our reference).
+	 */
+	for (i = 0; i < NR_CPUS; i++) {
+		struct homa_ctl_skb_pool *pool = &homa_ctl_skb_pools[i];
+		while (pool->count > 0) {
+			kfree_skb(pool->skbs[pool->head]);
+			pool->head = (pool->head + 1)
+					& (HOMA_CTL_SKB_POOL_SIZE - 1);
+			pool->count--;
+		}
+	}
+	for (i = 0; i < NR_CPUS; i++) {
+		struct homa_data_skb_pool *pool = &homa_data_skb_pools[i];
+		while (pool->count > 0) {
+			kfree_skb(pool->skbs[pool->head]);
+			pool->head = (pool->head + 1)
+					& (HOMA_DATA_SKB_POOL_SIZE - 1);
+			pool->count--;
+		}
+		pool->size = 0;
+	}
 	if (metrics_memory) {
 		vfree(metrics_memory);
 		metrics_memory = NULL;
@@ -152,6 +264,67 @@ void homa_destroy(struct homa *homa)
 	}
 	if (homa->metrics)
 		kfree(homa->metrics);
+	if (homa_rpc_slab) {
+		/* Return all of the per-core caches' contents before
+		 * destroying the slab; all RPCs have been reaped by now.
+		 */
+		for (i = 0; i < NR_CPUS; i++) {
+			struct homa_rpc_cache *cache = &homa_rpc_caches[i];
+			while (cache->num_rpcs > 0) {
+				cache->num_rpcs--;
+				kmem_cache_free(homa_rpc_slab,
+						cache->rpcs[cache->num_rpcs]);
+			}
+		}
+		kmem_cache_destroy(homa_rpc_slab);
+		homa_rpc_slab = NULL;
+	}
+}
+
+/**
+ * homa_rpc_alloc() - Allocate storage for a struct homa_rpc, using the
+ * current core's cache if possible. The contents of the struct are
+ * undefined.
+ *
+ * Return:  A new (uninitialized) homa_rpc, or NULL if memory was exhausted.
+ */
+struct homa_rpc *homa_rpc_alloc(void)
+{
+	struct homa_rpc_cache *cache;
+	struct homa_rpc *rpc;
+
+	local_bh_disable();
+	cache = &homa_rpc_caches[smp_processor_id()];
+	if (cache->num_rpcs > 0) {
+		cache->num_rpcs--;
+		rpc = cache->rpcs[cache->num_rpcs];
+		local_bh_enable();
+		return rpc;
+	}
+	local_bh_enable();
+	return kmem_cache_alloc(homa_rpc_slab, GFP_KERNEL);
+}
+
+/**
+ * homa_rpc_release() - Return the storage for a struct homa_rpc, saving
+ * it in the current core's cache if there is room.
+ * @rpc:   Struct to release; must no longer be linked into any lists, and
+ *         no-one else may have a reference to it.
+ */
+void homa_rpc_release(struct homa_rpc *rpc)
+{
+	struct homa_rpc_cache *cache;
+
+	local_bh_disable();
+	cache = &homa_rpc_caches[smp_processor_id()];
+	if (cache->num_rpcs < HOMA_RPC_CACHE_SIZE) {
+		cache->rpcs[cache->num_rpcs] = rpc;
+		cache->num_rpcs++;
+		local_bh_enable();
+		return;
+	}
+	local_bh_enable();
+	kmem_cache_free(homa_rpc_slab, rpc);
 }
 
 /**
@@ -175,7 +348,7 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	struct homa_rpc_bucket *bucket;
 	struct sk_buff *skb = NULL;
 	
-	crpc = (struct homa_rpc *) kmalloc(sizeof(*crpc), GFP_KERNEL);
+	crpc = homa_rpc_alloc();
 	if (unlikely(!crpc))
 		return ERR_PTR(-ENOMEM);
 	
@@ -187,6 +360,7 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	crpc->state = RPC_OUTGOING;
 	crpc->is_client = true;
 	crpc->dont_reap = false;
+	crpc->grant_in_progress = false;
 	crpc->peer = homa_peer_find(&hsk->homa->peers,
 			dest->sin_addr.s_addr, &hsk->inet);
 	if (unlikely(IS_ERR(crpc->peer))) {
@@ -207,11 +381,19 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	INIT_LIST_HEAD(&crpc->dead_links);
 	crpc->interest = NULL;
 	INIT_LIST_HEAD(&crpc->ready_links);
+	crpc->ready_shard = 0;
 	INIT_LIST_HEAD(&crpc->grantable_links);
+	crpc->grantable_bucket = -1;
 	INIT_LIST_HEAD(&crpc->throttled_links);
+	atomic_set(&crpc->stage_pending, 0);
 	crpc->silent_ticks = 0;
+	crpc->timer_tick = hsk->homa->timer_ticks;
+	INIT_LIST_HEAD(&crpc->timer_links);
+	INIT_LIST_HEAD(&crpc->peer_links);
 	crpc->num_resends = 0;
-	
+	crpc->start_cycles = get_cycles();
+	homa_rpc_tt_filter(hsk->homa, crpc, len);
+
 	/* Initialize fields that require locking. This allows the most
 	 * expensive work, such as copying in the message from user space,
 	 * to be performed without holding locks. Also, can't hold spin
@@ -228,12 +410,19 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	hlist_add_head(&crpc->hash_links, &bucket->rpcs);
 	list_add_tail_rcu(&crpc->active_links, &hsk->active_rpcs);
 	homa_sock_unlock(hsk);
-	
+	spin_lock_bh(&crpc->peer->lock);
+	list_add_tail(&crpc->peer_links, &crpc->peer->rpcs);
+	spin_unlock_bh(&crpc->peer->lock);
+	spin_lock_bh(&hsk->homa->timer_lock);
+	homa_timer_schedule(hsk->homa, crpc, hsk->homa->timer_ticks
+			+ hsk->homa->resend_ticks);
+	spin_unlock_bh(&hsk->homa->timer_lock);
+
 	return crpc;
 	
 error:
 	homa_free_skbs(skb);
-	kfree(crpc);
+	homa_rpc_release(crpc);
 	return ERR_PTR(err);
 }
 
@@ -275,7 +464,7 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	}
 	
 	/* Initialize fields that don't require the socket lock. */
-	srpc = (struct homa_rpc *) kmalloc(sizeof(*srpc), GFP_KERNEL);
+	srpc = homa_rpc_alloc();
 	if (!srpc) {
 		err = -ENOMEM;
 		goto error;
@@ -285,10 +474,11 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	srpc->state = RPC_INCOMING;
 	srpc->is_client = false;
 	srpc->dont_reap = false;
+	srpc->grant_in_progress = false;
 	srpc->peer = homa_peer_find(&hsk->homa->peers, source, &hsk->inet);
 	if (unlikely(IS_ERR(srpc->peer))) {
 		err = PTR_ERR(srpc->peer);
-		kfree(srpc);
+		homa_rpc_release(srpc);
 		goto error;
 	}
 	srpc->dport = ntohs(h->common.sport);
@@ -301,12 +491,27 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	srpc->active_links.next = LIST_POISON1;
 	srpc->interest = NULL;
 	INIT_LIST_HEAD(&srpc->ready_links);
+	srpc->ready_shard = 0;
 	INIT_LIST_HEAD(&srpc->grantable_links);
+	srpc->grantable_bucket = -1;
 	INIT_LIST_HEAD(&srpc->throttled_links);
+	atomic_set(&srpc->stage_pending, 0);
 	srpc->silent_ticks = 0;
+	srpc->timer_tick = hsk->homa->timer_ticks;
+	INIT_LIST_HEAD(&srpc->timer_links);
+	INIT_LIST_HEAD(&srpc->peer_links);
 	srpc->num_resends = 0;
+	srpc->start_cycles = get_cycles();
+	homa_rpc_tt_filter(hsk->homa, srpc, ntohl(h->message_length));
 
 	hlist_add_head(&srpc->hash_links, &bucket->rpcs);
+	spin_lock_bh(&srpc->peer->lock);
+	list_add_tail(&srpc->peer_links, &srpc->peer->rpcs);
+	spin_unlock_bh(&srpc->peer->lock);
+	spin_lock_bh(&hsk->homa->timer_lock);
+	homa_timer_schedule(hsk->homa, srpc, hsk->homa->timer_ticks
+			+ hsk->homa->resend_ticks);
+	spin_unlock_bh(&hsk->homa->timer_lock);
 	return srpc;
 
 error:
@@ -314,6 +519,81 @@ error:
 	return ERR_PTR(err);
 }
 
+/**
+ * homa_rpc_tt_filter() - Decide whether timetrace events should be
+ * recorded for a new RPC, setting rpc->tt_traced accordingly. When any
+ * of the tt_filter_* sysctl parameters is nonzero, only matching (or
+ * sampled) RPCs are traced; this keeps the timetrace buffers from
+ * wrapping within milliseconds at production packet rates, so tracing
+ * can be left enabled permanently. When all of the parameters are zero
+ * (the default), every RPC is traced.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @rpc:     A new RPC; its id, dport, and hsk fields must already be set.
+ * @length:  Number of bytes in the RPC's request message.
+ */
+void homa_rpc_tt_filter(struct homa *homa, struct homa_rpc *rpc, int length)
+{
+	if ((homa->tt_filter_id == 0) && (homa->tt_filter_port == 0)
+			&& (homa->tt_filter_min_length == 0)
+			&& (homa->tt_filter_interval == 0)) {
+		rpc->tt_traced = true;
+		return;
+	}
+	rpc->tt_traced = false;
+	if ((homa->tt_filter_id != 0) && (((__u32) rpc->id)
+			== ((__u32) homa->tt_filter_id)))
+		rpc->tt_traced = true;
+	if ((homa->tt_filter_port != 0)
+			&& ((rpc->dport == homa->tt_filter_port)
+			|| (rpc->hsk->client_port == homa->tt_filter_port)
+			|| (rpc->hsk->server_port == homa->tt_filter_port)))
+		rpc->tt_traced = true;
+	if ((homa->tt_filter_min_length != 0)
+			&& (length >= homa->tt_filter_min_length))
+		rpc->tt_traced = true;
+	if ((homa->tt_filter_interval != 0)
+			&& (atomic_dec_return(&homa->tt_filter_count) <= 0)) {
+		atomic_set(&homa->tt_filter_count, homa->tt_filter_interval);
+		rpc->tt_traced = true;
+	}
+}
+
+/**
+ * homa_check_freeze_slo() - Invoked when an RPC completes; if the RPC
+ * took longer than the freeze_slo_usecs threshold for its message size
+ * class, freeze the local timetrace and send a FREEZE packet to the
+ * peer, so that both ends retain traces covering the tail event. By the
+ * time a human could react to a slow RPC, the trace buffers would have
+ * wrapped; this captures the evidence automatically.
+ * @rpc:    The RPC that just completed.
+ */
+void homa_check_freeze_slo(struct homa_rpc *rpc)
+{
+	struct homa *homa = rpc->hsk->homa;
+	struct freeze_header freeze;
+	int length = rpc->msgin.total_length;
+	int size_class, slo;
+	__u64 us;
+
+	if (length <= 4096)
+		size_class = 0;
+	else if (length <= 0x10000)
+		size_class = 1;
+	else
+		size_class = 2;
+	slo = homa->freeze_slo_usecs[size_class];
+	if ((slo == 0) || tt_frozen)
+		return;
+	us = ((get_cycles() - rpc->start_cycles) * 1000) / cpu_khz;
+	if (us <= slo)
+		return;
+	INC_METRIC(slo_freezes, 1);
+	tt_record3("RPC id %llu exceeded SLO: %d us > %d us; freezing",
+			rpc->id, (__u32) us, slo);
+	tt_freeze();
+	homa_xmit_control(FREEZE, &freeze, sizeof(freeze), rpc);
+}
+
 /**
  * homa_rpc_lock_slow() - This function implements the slow path for
  * acquiring an RPC lock. It is invoked when an RPC lock isn't immediately
@@ -344,10 +624,25 @@ void homa_rpc_free(struct homa_rpc *rpc)
 {
 	if (!rpc || (rpc->state == RPC_DEAD))
 		return;
-	tt_record3("Freeing rpc id %d, total_length %d, lock 0x%x", rpc->id,
-			rpc->msgin.total_length,
+	tt_record_rpc3(rpc, "Freeing rpc id %d, total_length %d, lock 0x%x",
+			rpc->id, rpc->msgin.total_length,
 			*(int *) &rpc->msgin.packets.lock);
-	
+	if (!rpc->is_client && (rpc->state == RPC_OUTGOING)) {
+		/* The response has been transmitted, so this is the normal
+		 * end of a server RPC's life; record how long it took.
+		 */
+		homa_record_rpc_latency(rpc);
+		homa_check_freeze_slo(rpc);
+	}
+	if (rpc->is_client && (rpc->msgin.total_length > 0)
+			&& (rpc->msgin.bytes_remaining == 0)) {
+		/* The response was received in its entirety; ack the RPC
+		 * so the server can free its state promptly, rather than
+		 * waiting for a timeout.
+		 */
+		homa_peer_add_ack(rpc);
+	}
+
 	/* Before doing anything else, unlink the input message from
 	 * homa->grantable_msgs. This will synchronize to ensure that
 	 * homa_manage_grants doesn't access this RPC after destruction
@@ -359,7 +654,14 @@ void homa_rpc_free(struct homa_rpc *rpc)
 	homa_sock_lock(rpc->hsk, "homa_rpc_free");
 	__hlist_del(&rpc->hash_links);
 	list_del_rcu(&rpc->active_links);
-	__list_del_entry(&rpc->ready_links);
+	if (!list_empty(&rpc->ready_links)) {
+		struct homa_ready_shard *shard =
+				&rpc->hsk->ready_shards[rpc->ready_shard];
+		spin_lock_bh(&shard->lock);
+		__list_del_entry(&rpc->ready_links);
+		INIT_LIST_HEAD(&rpc->ready_links);
+		spin_unlock_bh(&shard->lock);
+	}
 	if (rpc->interest != NULL) {
 		rpc->interest->reg_rpc = NULL;
 		wake_up_process(rpc->interest->thread);
@@ -370,12 +672,61 @@ void homa_rpc_free(struct homa_rpc *rpc)
 	rpc->state = RPC_DEAD;
 	homa_sock_unlock(rpc->hsk);
 	
-	if (unlikely(!list_empty(&rpc->throttled_links))) {
-		homa_throttle_lock(rpc->hsk->homa);
-		list_del(&rpc->throttled_links);
-		INIT_LIST_HEAD(&rpc->throttled_links);
-		homa_throttle_unlock(rpc->hsk->homa);
+	if (unlikely(!list_empty(&rpc->throttled_links)
+			|| atomic_read(&rpc->stage_pending))) {
+		struct homa_link *link = homa_peer_link(rpc->hsk->homa,
+				rpc->peer);
+
+		/* If the RPC is still in link->throttled_staging, the drain
+		 * below moves it to link->throttled_rpcs, so it can be
+		 * unlinked safely; the pacer must never see this RPC again
+		 * once the throttle lock is released.
+		 */
+		homa_throttle_lock(link);
+		homa_throttle_drain_staging(link);
+		if (!list_empty(&rpc->throttled_links)) {
+			list_del(&rpc->throttled_links);
+			INIT_LIST_HEAD(&rpc->throttled_links);
+		}
+		homa_throttle_unlock(link);
+	}
+
+	/* Remove the RPC from the timer wheel, so homa_timer will never
+	 * see it again. If homa_timer is currently checking this RPC then
+	 * it holds the RPC lock, which serializes with us here.
+	 */
+	if (!list_empty(&rpc->timer_links)) {
+		spin_lock_bh(&rpc->hsk->homa->timer_lock);
+		list_del_init(&rpc->timer_links);
+		spin_unlock_bh(&rpc->hsk->homa->timer_lock);
+	}
+
+	/* Likewise, remove the RPC from its peer's list, so peer-scoped
+	 * operations such as homa_peer_abort won't find it.
+	 */
+	if (!list_empty(&rpc->peer_links)) {
+		spin_lock_bh(&rpc->peer->lock);
+		list_del_init(&rpc->peer_links);
+		spin_unlock_bh(&rpc->peer->lock);
+	}
+}
+
+/**
+ * homa_reap_worker() - Workqueue callback that frees a batch of dead
+ * packet buffers collected by homa_rpc_reap.
+ * @work:   Embedded in the struct homa_skb_reap describing the batch.
+ */
+static void homa_reap_worker(struct work_struct *work)
+{
+	struct homa_skb_reap *reap = container_of(work,
+			struct homa_skb_reap, work);
+	struct sk_buff *skb, *next;
+
+	for (skb = reap->skbs; skb != NULL; skb = next) {
+		next = skb->next;
+		kfree_skb(skb);
 	}
+	kfree(reap);
 }
 
 /**
@@ -383,11 +734,14 @@ void homa_rpc_free(struct homa_rpc *rpc)
  * RPCs for a given socket. For a large RPC, it can take a long time to
  * free all of its packet buffers, so we try to perform this work
  * off the critical path where it won't delay applications. Each call to
- * this function does a small chunk of work.
+ * this function does a small chunk of work: it unlinks a batch of packet
+ * buffers while holding the socket lock, then hands them to a workqueue
+ * worker to be freed, so the calling thread never pays the cost of the
+ * frees themselves.
  * @hsk:   Homa socket that may contain dead RPCs. Must be locked by the
  *         caller. The lock may be released and then reacquired by this
  *         function.
- * 
+ *
  * Return: A value greater than 0 means the function found work to do;
  *         there may be additional RPCs that haven't yet been reaped.
  *         A value of zero means that there are no RPCs ready to be
@@ -397,25 +751,28 @@ void homa_rpc_free(struct homa_rpc *rpc)
  */
 int homa_rpc_reap(struct homa_sock *hsk)
 {
-	struct sk_buff **skbs = kmalloc(hsk->homa->reap_limit * sizeof(struct sk_buff*), GFP_KERNEL);
-	struct homa_rpc **rpcs = kmalloc(hsk->homa->reap_limit * sizeof(struct homa_rpc*), GFP_KERNEL);
-	// struct sk_buff *skbs[hsk->homa->reap_limit];
-	// struct homa_rpc *rpcs[hsk->homa->reap_limit];
+	/* Dead packet buffers are collected into a chain (linked through
+	 * skb->next), so an entire batch can be handed off with a single
+	 * pointer. The number of RPCs per batch is limited separately by
+	 * the size of this array.
+	 */
+	struct sk_buff *skbs = NULL;
+	struct homa_rpc *rpcs[10];
 	int num_skbs = 0;
+	int num_chained = 0;
 	int num_rpcs = 0;
 	struct homa_rpc *rpc;
+	struct homa_skb_reap *reap;
 	static int instance = 0;
 	int i;
-	
+
 	if (atomic_read(&hsk->reap_disable)) {
 		INC_METRIC(disabled_reaps, 1);
-		kfree(skbs);
-		kfree(rpcs);
 		return -1;
 	}
 	INC_METRIC(reaper_calls, 1);
 	INC_METRIC(reaper_dead_skbs, hsk->dead_skbs);
-	
+
 	/* Collect buffers and freeable RPCs until either we hit our limit
 	 * or run out of RPCs.
 	 */
@@ -423,59 +780,77 @@ int homa_rpc_reap(struct homa_sock *hsk)
 	tt_record3("Starting homa_rpc_reap, dead_skbs %d, instance %d, port %d",
 			hsk->dead_skbs, instance, hsk->client_port);
 	list_for_each_entry_rcu(rpc, &hsk->dead_rpcs, dead_links) {
-		if (rpc->dont_reap) {
+		if (rpc->dont_reap || rpc->grant_in_progress) {
 			INC_METRIC(disabled_rpc_reaps, 1);
 			continue;
 		}
 		if (rpc->msgout.length >= 0) {
 			while (rpc->msgout.packets) {
-				skbs[num_skbs] = rpc->msgout.packets;
-				rpc->msgout.packets = *homa_next_skb(
-						rpc->msgout.packets);
+				struct sk_buff *skb = rpc->msgout.packets;
+				rpc->msgout.packets = *homa_next_skb(skb);
+				if (!homa_data_skb_recycle(skb)) {
+					skb->next = skbs;
+					skbs = skb;
+					num_chained++;
+				}
 				num_skbs++;
 				rpc->msgout.num_skbs--;
 				if (num_skbs >= hsk->homa->reap_limit)
 					goto release;
 			}
 		}
-		i = 0;
 		if (rpc->msgin.total_length >= 0) {
 			while (1) {
 				struct sk_buff *skb = skb_dequeue(
 						&rpc->msgin.packets);
 				if (!skb)
 					break;
-				skbs[num_skbs] = skb;
+				skb->next = skbs;
+				skbs = skb;
+				num_chained++;
 				num_skbs++;
 				rpc->msgin.num_skbs--;
 				if (num_skbs >= hsk->homa->reap_limit)
 					goto release;
 			}
+			homa_free_gaps(&rpc->msgin);
 		}
-		
+
 		/* If we get here, it means all packets have been removed
 		 * from the RPC.
 		 */
 		rpcs[num_rpcs] = rpc;
 		num_rpcs++;
 		list_del_rcu(&rpc->dead_links);
+		if (num_rpcs >= ARRAY_SIZE(rpcs))
+			goto release;
 	}
-	
+
 	/* Free all of the collected resources; release the socket
 	 * lock while doing this.
 	 */
 release:
 	tt_record2("reaping %d skbs, %d rpcs", num_skbs, num_rpcs);
-        
-	if ((num_skbs == 0) && (num_rpcs == 0)) {
-		kfree(skbs);
-		kfree(rpcs);
+
+	if ((num_skbs == 0) && (num_rpcs == 0))
 		return 0;
-	}
 	hsk->dead_skbs -= num_skbs;
 	homa_sock_unlock(hsk);
-	for (i = 0; i < num_skbs; i++) {
-		kfree_skb(skbs[i]);
+	if (skbs != NULL) {
+		reap = kmalloc(sizeof(*reap), GFP_KERNEL);
+		if (reap != NULL) {
+			reap->skbs = skbs;
+			INIT_WORK(&reap->work, homa_reap_worker);
+			queue_work(hsk->homa->reap_wq, &reap->work);
+			INC_METRIC(deferred_skb_frees, num_chained);
+		} else {
+			/* Can't hand off to the worker; free inline. */
+			struct sk_buff *next;
+			for (; skbs != NULL; skbs = next) {
+				next = skbs->next;
+				kfree_skb(skbs);
+			}
+		}
 	}
 	for (i = 0; i < num_rpcs; i++) {
 		UNIT_LOG("; ", "reaped %llu", rpcs[i]->id);
@@ -485,11 +860,9 @@ release:
 		 */
 		homa_rpc_lock(rpcs[i]);
 		homa_rpc_unlock(rpcs[i]);
-		kfree(rpcs[i]);
+		homa_rpc_release(rpcs[i]);
 	}
 	homa_sock_lock(hsk, "homa_rpc_reap");
-	kfree(skbs);
-	kfree(rpcs);
 	return 1;
 }
 
@@ -545,6 +918,53 @@ struct homa_rpc *homa_find_server_rpc(struct homa_sock *hsk,
 	return NULL;
 }
 
+/**
+ * homa_rpc_acked() - This function is invoked when an ack is received
+ * for an RPC; if the RPC still exists, is freed.
+ * @hsk:     Socket on which the ack was received. May or may not be the
+ *           socket that owns the acked RPC.
+ * @saddr:   Source address from which the ack was received (the client
+ *           for the acked RPC).
+ * @ack:     Information about an RPC for which the client has received
+ *           the entire response.
+ *
+ * Note: the caller must not hold any RPC locks when invoking this
+ * function (it locks the acked RPC, which could deadlock with a lock
+ * already held).
+ */
+void homa_rpc_acked(struct homa_sock *hsk, __be32 saddr, struct homa_ack *ack)
+{
+	struct homa_rpc *rpc;
+	struct homa_sock *hsk2 = hsk;
+	__u16 client_port = ntohs(ack->client_port);
+	__u16 server_port = ntohs(ack->server_port);
+
+	if (hsk2->server_port != server_port) {
+		/* Without RCU, sockets other than hsk can be deleted
+		 * out from under us.
+		 */
+		rcu_read_lock();
+		/* Use the dispatch lookup so that, if the port is shared
+		 * (HOMA_SO_REUSEPORT), we find the same socket that received
+		 * the RPC's packets.
+		 */
+		hsk2 = homa_sock_find_dispatch(&hsk->homa->port_map,
+				server_port, saddr, ack->id);
+		if (!hsk2)
+			goto done;
+	}
+	rpc = homa_find_server_rpc(hsk2, saddr, client_port, ack->id);
+	if (rpc) {
+		tt_record_rpc1(rpc, "server RPC acked, id %llu", rpc->id);
+		homa_rpc_free(rpc);
+		homa_rpc_unlock(rpc);
+	}
+
+    done:
+	if (hsk->server_port != server_port)
+		rcu_read_unlock();
+}
+
 /**
  * homa_print_ipv4_addr() - Convert an IPV4 address to the standard string
  * representation.
@@ -605,12 +1025,13 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 		used = homa_snprintf(buffer, buf_len, used,
 				", message_length %d, offset %d, "
 				"data_length %d, incoming %d, "
-				"cutoff_version %d%s",
+				"cutoff_version %d%s%s",
 				ntohl(h->message_length),
 				ntohl(h->seg.offset), seg_length,
 				ntohl(h->incoming),
 				ntohs(h->cutoff_version),
-				h->retransmit ? ", RETRANSMIT" : "");
+				h->retransmit ? ", RETRANSMIT" : "",
+				h->busy ? ", BUSY" : "");
 		bytes_left = skb->len - sizeof32(*h) - seg_length;
 		if (skb_shinfo(skb)->gso_segs <= 1)
 			break;
@@ -629,8 +1050,14 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 	case GRANT: {
 		struct grant_header *h = (struct grant_header *) skb->data;
 		used = homa_snprintf(buffer, buf_len, used,
-				", offset %d, grant_prio %u",
-				ntohl(h->offset), h->priority);
+				", offset %d, grant_prio %u, cutoff_version %d",
+				ntohl(h->offset), h->priority,
+				ntohs(h->cutoff_version));
+		if (h->ack.id != 0)
+			used = homa_snprintf(buffer, buf_len, used,
+					", ack [cp %d, sp %d, id %llu]",
+					ntohs(h->ack.client_port),
+					ntohs(h->ack.server_port), h->ack.id);
 		break;
 	}
 	case RESEND: {
@@ -665,6 +1092,19 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 	case FREEZE:
 		/* Nothing to add here. */
 		break;
+	case ACK: {
+		struct ack_header *h = (struct ack_header *) skb->data;
+		int i, count = ntohs(h->num_acks);
+		used = homa_snprintf(buffer, buf_len, used, ", acks");
+		for (i = 0; i < count; i++) {
+			used = homa_snprintf(buffer, buf_len, used,
+					" [cp %d, sp %d, id %llu]",
+					ntohs(h->acks[i].client_port),
+					ntohs(h->acks[i].server_port),
+					h->acks[i].id);
+		}
+		break;
+	}
 	}
 	buffer[buf_len-1] = 0;
 	return buffer;
@@ -745,6 +1185,11 @@ char *homa_print_packet_short(struct sk_buff *skb, char *buffer, int buf_len)
 	case DCACP_GRANT:
 		snprintf(buffer, buf_len, "DCACP_GRANT");
 		break;
+	case ACK: {
+		struct ack_header *h = (struct ack_header *) common;
+		snprintf(buffer, buf_len, "ACK %d", ntohs(h->num_acks));
+		break;
+	}
 	default:
 		snprintf(buffer, buf_len, "unknown packet type %d",
 				common->type);
@@ -853,6 +1298,8 @@ char *homa_symbol_for_type(uint8_t type)
 		return "ACCEPT";
 	case DCACP_GRANT:
 		return "DCACP_GRANT";
+	case ACK:
+		return "ACK";
 	}
 	
 	/* Using a static buffer can produce garbled text under concurrency,
@@ -883,6 +1330,15 @@ void homa_compile_metrics(struct homa_metrics *m)
 		for (j = 0; j < HOMA_NUM_MEDIUM_COUNTS; j++)
 			m->medium_msg_bytes[j] += cm->medium_msg_bytes[j];
 		m->large_msg_bytes += cm->large_msg_bytes;
+		for (j = 0; j < HOMA_LATENCY_SIZE_CLASSES; j++) {
+			int k;
+			for (k = 0; k < HOMA_LATENCY_HIST_BUCKETS; k++) {
+				m->client_rpc_latency[j][k] +=
+						cm->client_rpc_latency[j][k];
+				m->server_rpc_latency[j][k] +=
+						cm->server_rpc_latency[j][k];
+			}
+		}
 		for (j = DATA; j < BOGUS;  j++) {
 			m->packets_sent[j-DATA] += cm->packets_sent[j-DATA];
 			m->packets_received[j-DATA] +=
@@ -901,6 +1357,8 @@ void homa_compile_metrics(struct homa_metrics *m)
 		m->peer_kmalloc_errors += cm->peer_kmalloc_errors;
 		m->peer_route_errors += cm->peer_route_errors;
 		m->control_xmit_errors += cm->control_xmit_errors;
+		m->control_skbs_reused += cm->control_skbs_reused;
+		m->data_skbs_reused += cm->data_skbs_reused;
 		m->data_xmit_errors += cm->data_xmit_errors;
 		m->unknown_rpcs += cm->unknown_rpcs;
 		m->server_cant_create_rpcs += cm->server_cant_create_rpcs;
@@ -922,6 +1380,23 @@ void homa_compile_metrics(struct homa_metrics *m)
 		m->disabled_rpc_reaps += cm->disabled_rpc_reaps;
 		m->reaper_calls += cm->reaper_calls;
 		m->reaper_dead_skbs += cm->reaper_dead_skbs;
+		m->deferred_skb_frees += cm->deferred_skb_frees;
+		m->grant_skips += cm->grant_skips;
+		m->grants_coalesced += cm->grants_coalesced;
+		m->poll_cycles += cm->poll_cycles;
+		m->dispatch_lookup_cycles += cm->dispatch_lookup_cycles;
+		m->dispatch_data_cycles += cm->dispatch_data_cycles;
+		m->dispatch_grant_cycles += cm->dispatch_grant_cycles;
+		m->dispatch_other_cycles += cm->dispatch_other_cycles;
+		m->wakeup_cycles += cm->wakeup_cycles;
+		m->wait_find_cycles += cm->wait_find_cycles;
+		m->wait_reap_cycles += cm->wait_reap_cycles;
+		m->single_pkt_msgs += cm->single_pkt_msgs;
+		m->gro_batched_packets += cm->gro_batched_packets;
+		m->parallel_copy_chunks += cm->parallel_copy_chunks;
+		m->cutoff_retunes += cm->cutoff_retunes;
+		m->overcommit_retunes += cm->overcommit_retunes;
+		m->slo_freezes += cm->slo_freezes;
 		m->temp1 += cm->temp1;
 		m->temp2 += cm->temp2;
 		m->temp3 += cm->temp3;
@@ -1029,6 +1504,32 @@ char *homa_print_metrics(struct homa *homa)
 			"large_msg_bytes           %15llu  "
 			"Bytes in incoming messages >= %d bytes\n",
 			m.large_msg_bytes, lower);
+	for (i = 0; i < HOMA_LATENCY_SIZE_CLASSES; i++) {
+		static const char *class_names[HOMA_LATENCY_SIZE_CLASSES] =
+				{"small", "medium", "large"};
+		char name[50];
+		int j;
+		for (j = 0; j < HOMA_LATENCY_HIST_BUCKETS; j++) {
+			snprintf(name, sizeof(name), "lat_client_%s_%u",
+					class_names[i], 2 << j);
+			homa_append_metric(homa,
+					"%-26s%15llu  "
+					"Client RPCs (%s response) with "
+					"latency < %u us\n",
+					name, m.client_rpc_latency[i][j],
+					class_names[i], 2 << j);
+		}
+		for (j = 0; j < HOMA_LATENCY_HIST_BUCKETS; j++) {
+			snprintf(name, sizeof(name), "lat_server_%s_%u",
+					class_names[i], 2 << j);
+			homa_append_metric(homa,
+					"%-26s%15llu  "
+					"Server RPCs (%s request) with "
+					"latency < %u us\n",
+					name, m.server_rpc_latency[i][j],
+					class_names[i], 2 << j);
+		}
+	}
 	for (i = DATA; i < BOGUS;  i++) {
 		char *symbol = homa_symbol_for_type(i);
 		homa_append_metric(homa,
@@ -1095,6 +1596,14 @@ char *homa_print_metrics(struct homa *homa)
 			"control_xmit_errors       %15llu  "
 			"Errors sending control packets\n",
 			m.control_xmit_errors);
+	homa_append_metric(homa,
+			"control_skbs_reused       %15llu  "
+			"Control packets sent with a recycled sk_buff\n",
+			m.control_skbs_reused);
+	homa_append_metric(homa,
+			"data_skbs_reused          %15llu  "
+			"Data packets sent with a recycled sk_buff\n",
+			m.data_skbs_reused);
 	homa_append_metric(homa,
 			"data_xmit_errors          %15llu  "
 			"Errors sending data packets\n",
@@ -1179,6 +1688,74 @@ char *homa_print_metrics(struct homa *homa)
 			"reaper_dead_skbs          %15llu  "
 			"Sum of hsk->dead_skbs across all reaper calls\n",
 			m.reaper_dead_skbs);
+	homa_append_metric(homa,
+			"deferred_skb_frees        %15llu  "
+			"Dead skb frees handed off to the reap workqueue\n",
+			m.deferred_skb_frees);
+	homa_append_metric(homa,
+			"grant_skips               %15llu  "
+			"Grant passes skipped because another core was granting\n",
+			m.grant_skips);
+	homa_append_metric(homa,
+			"grants_coalesced          %15llu  "
+			"GRANT packets deferred to coalesce with later grants\n",
+			m.grants_coalesced);
+	homa_append_metric(homa,
+			"poll_cycles               %15llu  "
+			"Time spent polling for incoming messages\n",
+			m.poll_cycles);
+	homa_append_metric(homa,
+			"dispatch_lookup_cycles    %15llu  "
+			"Time spent finding/locking RPCs in homa_pkt_dispatch\n",
+			m.dispatch_lookup_cycles);
+	homa_append_metric(homa,
+			"dispatch_data_cycles      %15llu  "
+			"Time spent processing DATA packets in homa_pkt_dispatch\n",
+			m.dispatch_data_cycles);
+	homa_append_metric(homa,
+			"dispatch_grant_cycles     %15llu  "
+			"Time spent processing GRANT packets in homa_pkt_dispatch\n",
+			m.dispatch_grant_cycles);
+	homa_append_metric(homa,
+			"dispatch_other_cycles     %15llu  "
+			"Time spent processing other packets in homa_pkt_dispatch\n",
+			m.dispatch_other_cycles);
+	homa_append_metric(homa,
+			"wakeup_cycles             %15llu  "
+			"Time spent queueing RPCs and waking threads in homa_rpc_ready\n",
+			m.wakeup_cycles);
+	homa_append_metric(homa,
+			"wait_find_cycles          %15llu  "
+			"Active time finding ready RPCs in homa_wait_for_message\n",
+			m.wait_find_cycles);
+	homa_append_metric(homa,
+			"wait_reap_cycles          %15llu  "
+			"Time spent reaping dead RPCs in homa_wait_for_message\n",
+			m.wait_reap_cycles);
+	homa_append_metric(homa,
+			"single_pkt_msgs           %15llu  "
+			"Messages that fit in one packet (fast path)\n",
+			m.single_pkt_msgs);
+	homa_append_metric(homa,
+			"gro_batched_packets       %15llu  "
+			"DATA packets dispatched as part of a same-RPC chain\n",
+			m.gro_batched_packets);
+	homa_append_metric(homa,
+			"parallel_copy_chunks      %15llu  "
+			"Message chunks copied to user space by workers\n",
+			m.parallel_copy_chunks);
+	homa_append_metric(homa,
+			"cutoff_retunes            %15llu  "
+			"Times unsched_cutoffs were recomputed from traffic\n",
+			m.cutoff_retunes);
+	homa_append_metric(homa,
+			"overcommit_retunes        %15llu  "
+			"Times homa_tune_overcommit changed max_overcommit\n",
+			m.overcommit_retunes);
+	homa_append_metric(homa,
+			"slo_freezes               %15llu  "
+			"Timetrace freezes from freeze_slo_usecs violations\n",
+			m.slo_freezes);
 	homa_append_metric(homa,
 			"temp1                     %15llu  "
 			"Temporary use in testing\n",
@@ -1237,6 +1814,155 @@ void homa_prios_changed(struct homa *homa)
 	homa->cutoff_version++;
 }
 
+/**
+ * homa_tune_cutoffs() - Recompute @homa->unsched_cutoffs from the observed
+ * distribution of incoming message sizes, so that each unscheduled priority
+ * level carries roughly the same unscheduled load. Invoked periodically
+ * from homa_timer when @homa->cutoff_tune_ticks is nonzero. The new
+ * cutoffs propagate to peers through the existing mechanism: data packets
+ * advertise @homa->cutoff_version, and a peer with a stale version is
+ * sent a CUTOFFS packet.
+ * @homa: Contains the cutoffs to be recomputed, plus the histogram
+ *        state used to compute them.
+ */
+void homa_tune_cutoffs(struct homa *homa)
+{
+	__u64 weight[HOMA_SIZE_HIST_BUCKETS];
+	int new_cutoffs[HOMA_MAX_PRIORITIES];
+	__u64 total_msgs = 0;
+	__u64 total_weight = 0;
+	__u64 cum;
+	int i, core, k, bucket, num_unsched;
+
+	/* Aggregate the per-core histograms, keeping only messages that
+	 * arrived since the last recomputation.
+	 */
+	for (i = 0; i < HOMA_SIZE_HIST_BUCKETS; i++) {
+		__u64 count = 0;
+		for (core = 0; core < NR_CPUS; core++)
+			count += homa_size_hists[core].counts[i];
+		weight[i] = count - homa->prev_size_hist[i];
+		total_msgs += weight[i];
+	}
+	if (total_msgs < HOMA_CUTOFF_TUNE_MIN_SAMPLES) {
+		/* Not enough traffic yet for the distribution to mean
+		 * anything; leave prev_size_hist alone so the samples
+		 * accumulate for the next attempt.
+		 */
+		return;
+	}
+	num_unsched = homa->num_priorities - 1 - homa->max_sched_prio;
+	if (num_unsched < 2) {
+		/* Only one priority level available for unscheduled
+		 * packets, so there are no cutoffs to choose.
+		 */
+		return;
+	}
+
+	/* Weight each bucket by the unscheduled load its messages
+	 * generated: a message contributes at most rtt_bytes of
+	 * unscheduled data, no matter how large it is.
+	 */
+	for (i = 0; i < HOMA_SIZE_HIST_BUCKETS; i++) {
+		__u64 mid = (i == 0) ? 1 : (3ULL << (i-1));
+		if (mid > homa->rtt_bytes)
+			mid = homa->rtt_bytes;
+		homa->prev_size_hist[i] += weight[i];
+		weight[i] *= mid;
+		total_weight += weight[i];
+	}
+
+	/* Walk up the histogram, placing a cutoff wherever the cumulative
+	 * load crosses an equal share. Priority num_priorities-1 (the
+	 * highest) gets the smallest messages; the lowest unscheduled
+	 * priority takes everything else.
+	 */
+	memcpy(new_cutoffs, homa->unsched_cutoffs, sizeof(new_cutoffs));
+	cum = 0;
+	bucket = 0;
+	for (k = 1; k < num_unsched; k++) {
+		__u64 target = (total_weight * k) / num_unsched;
+		while ((bucket < HOMA_SIZE_HIST_BUCKETS) && (cum < target)) {
+			cum += weight[bucket];
+			bucket++;
+		}
+		new_cutoffs[homa->num_priorities - k] = (bucket < 31)
+				? (1 << bucket) - 1 : HOMA_MAX_MESSAGE_SIZE;
+	}
+	new_cutoffs[homa->num_priorities - num_unsched] =
+			HOMA_MAX_MESSAGE_SIZE;
+
+	/* Don't bump cutoff_version (which makes every peer request a
+	 * CUTOFFS packet) unless something actually changed.
+	 */
+	if (memcmp(new_cutoffs, homa->unsched_cutoffs,
+			sizeof(new_cutoffs)) == 0)
+		return;
+	memcpy(homa->unsched_cutoffs, new_cutoffs,
+			sizeof(homa->unsched_cutoffs));
+	homa_prios_changed(homa);
+	INC_METRIC(cutoff_retunes, 1);
+}
+
+/**
+ * homa_tune_overcommit() - Adjust @homa->max_overcommit based on the
+ * rate at which scheduled data actually arrived over the last interval,
+ * compared to the rate at which grants were issued and to the link's
+ * capacity. Invoked periodically from homa_timer when
+ * @homa->overcommit_tune_ticks is nonzero. If the downlink is already
+ * running near capacity, granting to fewer senders shortens buffer
+ * queues (which helps short-message latency) without losing bandwidth.
+ * If senders are consuming grants more slowly than we issue them (e.g.
+ * because they are stalled or overcommitted at other receivers), then
+ * granting to more senders keeps the downlink from going idle.
+ * @homa: Contains max_overcommit plus the byte counters used to
+ *        compute the rates.
+ */
+void homa_tune_overcommit(struct homa *homa)
+{
+	__u64 granted = atomic64_read(&homa->sched_grant_bytes);
+	__u64 arrived = atomic64_read(&homa->sched_arrival_bytes);
+	__u64 delta_granted = granted - homa->prev_grant_bytes;
+	__u64 delta_arrived = arrived - homa->prev_arrival_bytes;
+	__u64 now = get_cycles();
+	__u64 capacity;
+
+	/* Bytes the link could have delivered during the interval (see
+	 * homa_outgoing_sysctl_changed for cycles_per_kbyte, which
+	 * already includes a 5% allowance for headers).
+	 */
+	capacity = ((now - homa->last_tune_cycles)*1000)
+			/ homa->cycles_per_kbyte;
+	homa->prev_grant_bytes = granted;
+	homa->prev_arrival_bytes = arrived;
+	homa->last_tune_cycles = now;
+
+	if (delta_granted < (__u64) homa->rtt_bytes) {
+		/* Too little scheduled traffic for the rates to mean
+		 * anything; leave max_overcommit alone.
+		 */
+		return;
+	}
+	if (delta_arrived >= (9*capacity)/10) {
+		/* Downlink is saturated: more overcommitment can't add
+		 * bandwidth, it can only build queues.
+		 */
+		if (homa->max_overcommit > 2) {
+			homa->max_overcommit--;
+			INC_METRIC(overcommit_retunes, 1);
+		}
+	} else if ((10*delta_arrived) < (9*delta_granted)) {
+		/* Link has headroom but granted bytes aren't arriving:
+		 * senders are stalling, so spread grants across more of
+		 * them.
+		 */
+		if (homa->max_overcommit < HOMA_MAX_GRANTS) {
+			homa->max_overcommit++;
+			INC_METRIC(overcommit_retunes, 1);
+		}
+	}
+}
+
 /**
  * homa_spin() - Delay (without sleeping) for a given time interval.
  * @usecs:   How long to delay (in microseconds)
@@ -1258,7 +1984,8 @@ void homa_free_skbs(struct sk_buff *head)
 {
 	while (head) {
 		struct sk_buff *next = *homa_next_skb(head);
-		kfree_skb(head);
+		if (!homa_data_skb_recycle(head))
+			kfree_skb(head);
 		head = next;
 	}
 }
@@ -1285,13 +2012,13 @@ void homa_grantable_lock_slow(struct homa *homa)
  * acquiring the throttle lock. It is invoked when the lock isn't immediately
  * available. It waits for the lock, but also records statistics about
  * the waiting time.
- * @homa:    Overall data about the Homa protocol implementation.
+ * @link:    Egress link whose throttle lock is needed.
  */
-void homa_throttle_lock_slow(struct homa *homa)
+void homa_throttle_lock_slow(struct homa_link *link)
 {
 	__u64 start = get_cycles();
 	tt_record("beginning wait for throttle lock");
-	spin_lock_bh(&homa->throttle_lock);
+	spin_lock_bh(&link->throttle_lock);
 	tt_record("ending wait for throttle lock");
 	INC_METRIC(throttle_lock_misses, 1);
 	INC_METRIC(throttle_lock_miss_cycles, get_cycles() - start);
@@ -0,0 +1,313 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Microbenchmarks for Homa's hot functions, built on the same mocking
+ * layer as the unit tests (see mock.c), so they run entirely in user
+ * space ("make bench"). The absolute cycle counts don't match a real
+ * kernel (mocked functions are cheaper than the real thing), but they
+ * are stable enough to catch relative regressions at commit time,
+ * before changes reach a cluster.
+ */
+
+#include <stdio.h>
+
+#include "homa_impl.h"
+#include "kselftest_harness.h"
+#include "ccutils.h"
+#include "mock.h"
+#include "utils.h"
+
+extern struct homa *homa;
+
+/* Dummy test metadata, so that FAIL invocations from mock.c (e.g. leak
+ * checks in unit_teardown) have something to record failures in.
+ */
+static struct __test_metadata bench_test;
+
+static struct homa bench_homa;
+static struct homa_sock bench_hsk;
+static __be32 client_ip;
+static __be32 server_ip;
+
+/* Simple deterministic generator, so runs are repeatable. */
+static __u32 bench_seed = 12345;
+static __u32 bench_rand(void)
+{
+	bench_seed = bench_seed*1664525 + 1013904223;
+	return bench_seed >> 8;
+}
+
+static void bench_setup(void)
+{
+	client_ip = unit_get_in_addr("196.168.0.1");
+	server_ip = unit_get_in_addr("1.2.3.4");
+	homa = &bench_homa;
+	homa_init(&bench_homa);
+	mock_sock_init(&bench_hsk, &bench_homa, 0, 0);
+	homa_sock_bind(&bench_homa.port_map, &bench_hsk, 99);
+	unit_log_clear();
+}
+
+static void bench_teardown(void)
+{
+	homa_destroy(&bench_homa);
+	unit_teardown();
+	homa = NULL;
+}
+
+/**
+ * bench_report() - Print the result of one benchmark in a uniform format.
+ * @name:    Name of the benchmark.
+ * @cycles:  Total cycles spent in the timed region.
+ * @count:   Number of operations performed in the timed region.
+ */
+static void bench_report(const char *name, __u64 cycles, int count)
+{
+	printf("%-40s %10.1f cycles/op  (%d ops)\n", name,
+			((double) cycles)/count, count);
+}
+
+/**
+ * bench_pkt_dispatch() - Measure homa_pkt_dispatch for DATA packets
+ * arriving (in order) for existing server RPCs.
+ */
+static void bench_pkt_dispatch(void)
+{
+	#define DISPATCH_MSGS 200
+	#define DISPATCH_MSG_LENGTH 98000
+	struct data_header h;
+	struct homa_rpc *srpc;
+	__u64 id, start, total = 0;
+	int offset, count = 0;
+
+	bench_setup();
+	for (id = 1; id <= DISPATCH_MSGS; id++) {
+		srpc = unit_server_rpc(&bench_hsk, RPC_INCOMING, client_ip,
+				server_ip, 40000, id, DISPATCH_MSG_LENGTH,
+				100);
+		if (srpc == NULL) {
+			printf("bench_pkt_dispatch couldn't create rpc\n");
+			return;
+		}
+		h = (struct data_header) {.common = {
+				.sport = htons(40000), .dport = htons(99),
+				.type = DATA, .id = id},
+				.message_length = htonl(DISPATCH_MSG_LENGTH),
+				.incoming = htonl(DISPATCH_MSG_LENGTH),
+				.cutoff_version = bench_homa.cutoff_version,
+				.retransmit = 0};
+		for (offset = 1400; offset < DISPATCH_MSG_LENGTH;
+				offset += 1400) {
+			struct sk_buff *skb;
+			h.seg.offset = htonl(offset);
+			skb = mock_skb_new(client_ip, &h.common, 1400, 0);
+			start = get_cycles();
+			homa_pkt_dispatch(skb, &bench_hsk);
+			total += get_cycles() - start;
+			count++;
+		}
+		unit_log_clear();
+
+		/* Clean up the completed message (untimed), so memory
+		 * usage stays bounded.
+		 */
+		srpc = homa_find_server_rpc(&bench_hsk, client_ip, 40000, id);
+		if (srpc != NULL) {
+			homa_rpc_free(srpc);
+			homa_rpc_unlock(srpc);
+		}
+		homa_sock_lock(&bench_hsk, "bench_pkt_dispatch");
+		while (homa_rpc_reap(&bench_hsk) > 0) {}
+		homa_sock_unlock(&bench_hsk);
+	}
+	bench_report("homa_pkt_dispatch (data, in order)", total, count);
+	bench_teardown();
+}
+
+/**
+ * bench_fill_packets() - Measure homa_fill_packets for several message
+ * sizes.
+ */
+static void bench_fill_packets(void)
+{
+	#define FILL_REPS 2000
+	static const int sizes[] = {1400, 14000, 140000};
+	struct homa_peer *peer;
+	char name[100];
+	size_t i;
+	int rep;
+
+	bench_setup();
+	peer = homa_peer_find(&bench_homa.peers, server_ip, &bench_hsk.inet);
+	if (IS_ERR(peer)) {
+		printf("bench_fill_packets couldn't find peer\n");
+		return;
+	}
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		__u64 start, total = 0;
+		for (rep = 0; rep < FILL_REPS; rep++) {
+			struct sk_buff *skbs;
+			start = get_cycles();
+			skbs = homa_fill_packets(&bench_homa, peer,
+					(char *) 1000, sizes[i]);
+			total += get_cycles() - start;
+			if (IS_ERR(skbs)) {
+				printf("bench_fill_packets error %ld\n",
+						PTR_ERR(skbs));
+				return;
+			}
+			homa_free_skbs(skbs);
+			unit_log_clear();
+		}
+		snprintf(name, sizeof(name),
+				"homa_fill_packets (%d bytes)", sizes[i]);
+		bench_report(name, total, FILL_REPS);
+	}
+	bench_teardown();
+}
+
+/**
+ * bench_add_packet() - Measure homa_add_packet while receiving entire
+ * messages whose packets arrive with varying fractions of out-of-order
+ * pairs.
+ */
+static void bench_add_packet(void)
+{
+	#define ADD_MSGS 200
+	#define ADD_PKTS_PER_MSG 70
+	static const int ooo_percent[] = {0, 10, 50};
+	struct homa_message_in msgin;
+	struct data_header h;
+	char name[100];
+	size_t i;
+	int msg, pkt;
+
+	bench_setup();
+	for (i = 0; i < sizeof(ooo_percent)/sizeof(ooo_percent[0]); i++) {
+		__u64 start, total = 0;
+		int count = 0;
+		for (msg = 0; msg < ADD_MSGS; msg++) {
+			int offsets[ADD_PKTS_PER_MSG];
+
+			/* Compute the arrival order: swap adjacent pairs
+			 * of packets with the requested probability.
+			 */
+			for (pkt = 0; pkt < ADD_PKTS_PER_MSG; pkt++)
+				offsets[pkt] = pkt*1400;
+			for (pkt = 0; pkt+1 < ADD_PKTS_PER_MSG; pkt += 2) {
+				if ((bench_rand() % 100)
+						< (__u32) ooo_percent[i]) {
+					int tmp = offsets[pkt];
+					offsets[pkt] = offsets[pkt+1];
+					offsets[pkt+1] = tmp;
+				}
+			}
+
+			homa_message_in_init(&msgin, ADD_PKTS_PER_MSG*1400,
+					ADD_PKTS_PER_MSG*1400);
+			h = (struct data_header) {.common = {
+					.sport = htons(40000),
+					.dport = htons(99),
+					.type = DATA, .id = 1000},
+					.message_length = htonl(
+					ADD_PKTS_PER_MSG*1400),
+					.incoming = htonl(
+					ADD_PKTS_PER_MSG*1400),
+					.retransmit = 0};
+			for (pkt = 0; pkt < ADD_PKTS_PER_MSG; pkt++) {
+				struct sk_buff *skb;
+				h.seg.offset = htonl(offsets[pkt]);
+				h.seg.segment_length = htonl(1400);
+				skb = mock_skb_new(client_ip, &h.common,
+						1400, 0);
+				start = get_cycles();
+				homa_add_packet(&msgin, skb);
+				total += get_cycles() - start;
+				count++;
+			}
+			homa_message_in_destroy(&msgin);
+		}
+		snprintf(name, sizeof(name),
+				"homa_add_packet (%d%% out of order)",
+				ooo_percent[i]);
+		bench_report(name, total, count);
+	}
+	bench_teardown();
+}
+
+/**
+ * bench_manage_grants() - Measure homa_manage_grants with varying numbers
+ * of RPCs on the grantable list.
+ */
+static void bench_manage_grants(void)
+{
+	#define GRANT_REPS 20000
+	static const int list_lengths[] = {1, 4, 16, 64};
+	char name[100];
+	size_t i;
+
+	for (i = 0; i < sizeof(list_lengths)/sizeof(list_lengths[0]); i++) {
+		struct homa_rpc *srpc = NULL;
+		__u64 start, total = 0;
+		int rpc, rep;
+
+		bench_setup();
+		for (rpc = 0; rpc < list_lengths[i]; rpc++) {
+			/* Each RPC comes from a different peer, so each
+			 * creates its own grantable-list entry.
+			 */
+			struct homa_rpc *new_rpc = unit_server_rpc(&bench_hsk,
+					RPC_INCOMING, client_ip + htonl(rpc),
+					server_ip, 40000, 1000 + rpc,
+					HOMA_MAX_MESSAGE_LENGTH, 100);
+			if (new_rpc == NULL) {
+				printf("bench_manage_grants couldn't "
+						"create rpc\n");
+				return;
+			}
+			if (srpc == NULL)
+				srpc = new_rpc;
+		}
+		for (rep = 0; rep < GRANT_REPS; rep++) {
+			start = get_cycles();
+			homa_manage_grants(&bench_homa, srpc);
+			total += get_cycles() - start;
+			unit_log_clear();
+		}
+		snprintf(name, sizeof(name),
+				"homa_manage_grants (%d grantable)",
+				list_lengths[i]);
+		bench_report(name, total, GRANT_REPS);
+		bench_teardown();
+	}
+}
+
+int main(int argc, char **argv)
+{
+	bench_test.name = "bench";
+	bench_test.passed = 1;
+	__current_test = &bench_test;
+
+	/* Use the processor's cycle counter for timing, rather than the
+	 * mocked (deterministic) clock used by the unit tests.
+	 */
+	mock_cycles = ~0;
+
+	bench_pkt_dispatch();
+	bench_fill_packets();
+	bench_add_packet();
+	bench_manage_grants();
+	return 0;
+}
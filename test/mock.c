@@ -46,10 +46,14 @@ int mock_alloc_skb_errors = 0;
 int mock_copy_data_errors = 0;
 int mock_copy_to_iter_errors = 0;
 int mock_copy_to_user_errors = 0;
+int mock_get_user_pages_errors = 0;
 int mock_import_single_range_errors = 0;
 int mock_ip_queue_xmit_errors = 0;
 int mock_kmalloc_errors = 0;
 int mock_route_errors = 0;
+
+/* Number of times eventfd_signal has been invoked. */
+int mock_eventfd_signals = 0;
 int mock_spin_lock_held = 0;
 int mock_trylock_errors = 0;
 int mock_vmalloc_errors = 0;
@@ -104,11 +108,16 @@ static struct unit_hash *routes_in_use = NULL;
  */
 static struct unit_hash *vmallocs_in_use = NULL;
 
-/* The number of locks that have been acquired but not yet released. 
+/* The number of locks that have been acquired but not yet released.
  * Should be 0 at the end of each test.
  */
 static int mock_active_locks = 0;
 
+/* The number of user pages that have been pinned by get_user_pages_fast
+ * but not yet released. Should be 0 at the end of each test.
+ */
+static int mock_pages_pinned = 0;
+
 /* The number of times rcu_read_lock has been called minus the number
  * of times rcu_read_unlock has been called. 
  * Should be 0 at the end of each test.
@@ -120,6 +129,11 @@ static int mock_active_rcu_locks = 0;
  */
 cycles_t mock_cycles = 0;
 
+/* Each call to mock_get_cycles adds this to mock_cycles before returning
+ * it; used by tests that need time to advance (e.g. for busy-wait loops).
+ */
+cycles_t mock_cycles_delta = 0;
+
 /* Linux's idea of the current CPU number. */
 int cpu_number = 1;
 
@@ -131,7 +145,13 @@ int cpu_number = 1;
 		+ sizeof(struct data_header))
 int mock_mtu = MOCK_MTU;
 
-struct dst_ops mock_dst_ops = {.mtu = mock_get_mtu};
+/* If a test sets this variable to nonzero, the check function of
+ * mock_dst_ops will claim that the route is no longer valid.
+ */
+int mock_dst_invalid = 0;
+
+struct dst_ops mock_dst_ops = {.mtu = mock_get_mtu,
+		.check = mock_dst_check};
 struct net_device mock_net_device = {
 		.gso_max_segs = 1000,
 		.gso_max_size = MOCK_MTU};
@@ -183,6 +203,14 @@ struct sk_buff *__alloc_skb(unsigned int size, gfp_t priority, int flags,
 	return skb;
 }
 
+struct workqueue_struct *__alloc_workqueue_key(const char *fmt,
+		unsigned int flags, int max_active,
+		struct lock_class_key *key, const char *lock_name, ...)
+{
+	static int dummy_workqueue;
+	return (struct workqueue_struct *) &dummy_workqueue;
+}
+
 void call_rcu_sched(struct rcu_head *head, rcu_callback_t func)
 {
 	if (mock_log_rcu_sched)
@@ -192,6 +220,11 @@ void call_rcu_sched(struct rcu_head *head, rcu_callback_t func)
 
 void __check_object_size(const void *ptr, unsigned long n, bool to_user) {}
 
+void complete(struct completion *x)
+{
+	x->done++;
+}
+
 size_t _copy_from_iter(void *addr, size_t bytes, struct iov_iter *i)
 {
 	if (mock_check_error(&mock_copy_data_errors))
@@ -258,6 +291,8 @@ unsigned long _copy_from_user(void *to, const void __user *from,
 	return 0;
 }
 
+void destroy_workqueue(struct workqueue_struct *wq) {}
+
 void do_exit(long error_code)
 {
 	while(1) {}
@@ -278,11 +313,43 @@ void dst_release(struct dst_entry *dst)
 	free(dst);
 }
 
+struct eventfd_ctx *eventfd_ctx_fdget(int fd)
+{
+	static struct eventfd_ctx *dummy_ctx = (struct eventfd_ctx *) 0x1000;
+	if (fd < 0)
+		return (struct eventfd_ctx *) ERR_PTR(-EBADF);
+	return dummy_ctx;
+}
+
+void eventfd_ctx_put(struct eventfd_ctx *ctx) {}
+
+__u64 eventfd_signal(struct eventfd_ctx *ctx, __u64 n)
+{
+	mock_eventfd_signals++;
+	return n;
+}
+
 void get_random_bytes(void *buf, int nbytes)
 {
 	memset(buf, 0, nbytes);
 }
 
+int get_user_pages_fast(unsigned long start, int nr_pages,
+		int write, struct page **pages)
+{
+	/* A "page" here is just the user-space address of the start of the
+	 * page; mock versions of functions that read frags (such as
+	 * skb_copy_bits) understand this encoding.
+	 */
+	int i;
+	if (mock_check_error(&mock_get_user_pages_errors))
+		return -EFAULT;
+	for (i = 0; i < nr_pages; i++)
+		pages[i] = (struct page *) (start + i*PAGE_SIZE);
+	mock_pages_pinned += nr_pages;
+	return nr_pages;
+}
+
 int hrtimer_cancel(struct hrtimer *timer)
 {
 	return 0;
@@ -374,6 +441,9 @@ int inet_sendmsg(struct socket *sock, struct msghdr *msg, size_t size)
 
 void inet_unregister_protosw(struct inet_protosw *p) {}
 
+void __init_waitqueue_head(struct wait_queue_head *wq_head, const char *name,
+		struct lock_class_key *key) {}
+
 void iov_iter_revert(struct iov_iter *i, size_t bytes)
 {
 	unit_log_printf("; ", "iov_iter_revert %lu", bytes);
@@ -412,6 +482,7 @@ struct rtable *ip_route_output_flow(struct net *net, struct flowi4 *flp4,
 	route->dst.__refcnt.counter = 1;
 	route->dst.ops = &mock_dst_ops;
 	route->dst.dev = &mock_net_device;
+	route->dst.obsolete = DST_OBSOLETE_FORCE_CHK;
 	if (!routes_in_use)
 		routes_in_use = unit_hash_new();
 	unit_hash_set(routes_in_use, route, "used");
@@ -449,6 +520,7 @@ void kfree_skb(struct sk_buff *skb)
 		return;
 	}
 	unit_hash_erase(buffs_in_use, skb);
+	mock_pages_pinned -= skb_shinfo(skb)->nr_frags;
 	while (skb_shinfo(skb)->frag_list) {
 		struct sk_buff *next = skb_shinfo(skb)->frag_list->next;
 		kfree_skb(skb_shinfo(skb)->frag_list);
@@ -473,6 +545,37 @@ void *__kmalloc(size_t size, gfp_t flags)
 	return block;
 }
 
+void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags)
+{
+	return __kmalloc(*(unsigned int *) cache, flags);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+		unsigned int align, slab_flags_t flags,
+		void (*ctor)(void *))
+{
+	/* The "cache" is just the object size; kmem_cache_alloc uses
+	 * plain malloc under the covers.
+	 */
+	unsigned int *cache = malloc(sizeof(unsigned int));
+	if (!cache) {
+		FAIL("malloc failed");
+		return NULL;
+	}
+	*cache = size;
+	return (struct kmem_cache *) cache;
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	free(cache);
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *block)
+{
+	kfree(block);
+}
+
 struct task_struct *kthread_create_on_node(int (*threadfn)(void *data),
 					   void *data, int node,
 					   const char namefmt[],
@@ -486,6 +589,14 @@ int kthread_stop(struct task_struct *k)
 	return 0;
 }
 
+bool llist_add_batch(struct llist_node *new_first, struct llist_node *new_last,
+		struct llist_head *head)
+{
+	new_last->next = head->first;
+	head->first = new_first;
+	return new_last->next == NULL;
+}
+
 void __local_bh_enable_ip(unsigned long ip, unsigned int cnt) {}
 
 void lock_sock_nested(struct sock *sk, int subclass)
@@ -561,11 +672,43 @@ int proto_register(struct proto *prot, int alloc_slab)
 
 void proto_unregister(struct proto *prot) {}
 
+int put_cmsg(struct msghdr *msg, int level, int type, int len, void *data)
+{
+	/* Behaves like the real put_cmsg, except that the control buffer
+	 * is treated as kernel memory, so tests can inspect the returned
+	 * control message directly.
+	 */
+	struct cmsghdr *cm = (struct cmsghdr *) msg->msg_control;
+	if (mock_check_error(&mock_copy_to_user_errors))
+		return -EFAULT;
+	if ((cm == NULL) || (msg->msg_controllen < CMSG_LEN(len))) {
+		msg->msg_flags |= MSG_CTRUNC;
+		return 0;
+	}
+	cm->cmsg_level = level;
+	cm->cmsg_type = type;
+	cm->cmsg_len = CMSG_LEN(len);
+	memcpy(CMSG_DATA(cm), data, len);
+	msg->msg_control = ((char *) msg->msg_control) + CMSG_SPACE(len);
+	msg->msg_controllen -= CMSG_SPACE(len);
+	return 0;
+}
+
+void __put_page(struct page *page) {}
+
 void *__pskb_pull_tail(struct sk_buff *skb, int delta)
 {
 	return NULL;
 }
 
+bool queue_work_on(int cpu, struct workqueue_struct *wq,
+		struct work_struct *work)
+{
+	/* Run the work synchronously, so that tests are deterministic. */
+	work->func(work);
+	return true;
+}
+
 void _raw_spin_lock(raw_spinlock_t *lock)
 {
 	mock_active_locks++;
@@ -603,6 +746,11 @@ int __lockfunc _raw_spin_trylock(raw_spinlock_t *lock)
 	return 1;
 }
 
+#ifdef CONFIG_RPS
+struct rps_sock_flow_table __rcu *rps_sock_flow_table;
+u32 rps_cpu_mask;
+#endif /* CONFIG_RPS */
+
 struct ctl_table_header *register_net_sysctl(struct net *net,
 	const char *path, struct ctl_table *table)
 {
@@ -635,6 +783,44 @@ int sk_set_peek_off(struct sock *sk, int val)
 	return 0;
 }
 
+int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len)
+{
+	/* Copy from the linear part first, then from frags. A frag's
+	 * "page" is just a user-space address (see get_user_pages_fast
+	 * above).
+	 */
+	char *dst = to;
+	int headlen = skb_headlen(skb);
+	int i, chunk;
+	if (offset < headlen) {
+		chunk = headlen - offset;
+		if (chunk > len)
+			chunk = len;
+		memcpy(dst, skb->data + offset, chunk);
+		dst += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+	offset -= headlen;
+	for (i = 0; (i < skb_shinfo(skb)->nr_frags) && (len > 0); i++) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		int size = skb_frag_size(frag);
+		if (offset >= size) {
+			offset -= size;
+			continue;
+		}
+		chunk = size - offset;
+		if (chunk > len)
+			chunk = len;
+		memcpy(dst, ((char *) skb_frag_page(frag))
+				+ frag->page_offset + offset, chunk);
+		dst += chunk;
+		len -= chunk;
+		offset = 0;
+	}
+	return (len == 0) ? 0 : -EFAULT;
+}
+
 int skb_copy_datagram_iter(const struct sk_buff *from, int offset,
 		struct iov_iter *to, int size)
 {
@@ -720,6 +906,10 @@ void tasklet_kill(struct tasklet_struct *t) {}
 
 void unregister_net_sysctl_table(struct ctl_table_header *header) {}
 
+void unuse_mm(struct mm_struct *mm) {}
+
+void use_mm(struct mm_struct *mm) {}
+
 void vfree(const void *block)
 {
 	if (!vmallocs_in_use || unit_hash_get(vmallocs_in_use, block) == NULL) {
@@ -745,6 +935,13 @@ void *vmalloc(size_t size)
 	return block;
 }
 
+void wait_for_completion(struct completion *x)
+{
+	if (x->done == 0)
+		FAIL("wait_for_completion invoked on incomplete completion");
+	x->done--;
+}
+
 long wait_woken(struct wait_queue_entry *wq_entry, unsigned mode,
 		long timeout)
 {
@@ -801,7 +998,8 @@ cycles_t mock_get_cycles(void)
 		uint32_t lo, hi;
 		__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
 		return (((uint64_t)hi << 32) | lo);
-	} 
+	}
+	mock_cycles += mock_cycles_delta;
 	return mock_cycles;
 }
 
@@ -815,6 +1013,19 @@ unsigned int mock_get_mtu(const struct dst_entry *dst)
 	return mock_mtu;
 }
 
+/**
+ * This function is invoked through dst->dst_ops.check to see whether a
+ * route is still valid.
+ * @dst:      The route to check.
+ * @cookie:   Not used.
+ */
+struct dst_entry *mock_dst_check(struct dst_entry *dst, __u32 cookie)
+{
+	if (mock_dst_invalid)
+		return NULL;
+	return dst;
+}
+
 /**
  * mock_rcu_read_lock() - Called instead of rcu_read_lock when Homa is compiled
  * for unit testing.
@@ -892,6 +1103,9 @@ struct sk_buff *mock_skb_new(__be32 saddr, struct common_header *h,
 	case DCACP_GRANT:
 		header_size = sizeof(struct dcacp_grant_header );
 		break;
+	case ACK:
+		header_size = sizeof(struct ack_header);
+		break;
 	default:
 		header_size = sizeof(struct common_header);
 		break;
@@ -922,6 +1136,14 @@ struct sk_buff *mock_skb_new(__be32 saddr, struct common_header *h,
 	return skb;
 }
 
+/**
+ * Returns the number of user pages currently pinned by get_user_pages_fast.
+ */
+int mock_page_count(void)
+{
+	return mock_pages_pinned;
+}
+
 /**
  * Returns the number of sk_buffs currently in use.
  */
@@ -981,10 +1203,14 @@ void mock_teardown(void)
 	mock_copy_to_iter_errors = 0;
 	mock_copy_to_user_errors = 0;
 	mock_cycles = 0;
+	mock_cycles_delta = 0;
+	mock_dst_invalid = 0;
+	mock_get_user_pages_errors = 0;
 	mock_import_single_range_errors = 0;
 	mock_kmalloc_errors = 0;
 	mock_log_rcu_sched = 0;
 	mock_route_errors = 0;
+	mock_eventfd_signals = 0;
 	mock_trylock_errors = 0;
 	mock_vmalloc_errors = 0;
 	memset(&mock_task, 0, sizeof(mock_task));
@@ -1028,6 +1254,11 @@ void mock_teardown(void)
 	if (mock_active_locks != 0)
 		FAIL(" %d locks still locked after test", mock_active_locks);
 	mock_active_locks = 0;
+
+	if (mock_pages_pinned != 0)
+		FAIL(" %d user page(s) still pinned after test",
+				mock_pages_pinned);
+	mock_pages_pinned = 0;
 	
 	if (mock_active_rcu_locks != 0)
 		FAIL(" %d rcu_read_locks still active after test",
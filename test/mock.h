@@ -20,6 +20,10 @@ extern int         mock_alloc_skb_errors;
 extern int         mock_copy_data_errors;
 extern int         mock_copy_to_user_errors;
 extern cycles_t    mock_cycles;
+extern cycles_t    mock_cycles_delta;
+extern int         mock_dst_invalid;
+extern int         mock_eventfd_signals;
+extern int         mock_get_user_pages_errors;
 extern int         mock_import_single_range_errors;
 extern int         mock_ip_queue_xmit_errors;
 extern int         mock_kmalloc_errors;
@@ -39,9 +43,12 @@ extern int         mock_xmit_log_verbose;
 
 extern int         mock_check_error(int *errorMask);
 extern void        mock_data_ready(struct sock *sk);
+extern struct dst_entry
+		  *mock_dst_check(struct dst_entry *dst, __u32 cookie);
 extern cycles_t    mock_get_cycles(void);
 extern unsigned int
 		   mock_get_mtu(const struct dst_entry *dst);
+extern int         mock_page_count(void);
 extern void        mock_rcu_read_lock(void);
 extern void        mock_rcu_read_unlock(void);
 extern void        mock_spin_lock(spinlock_t *lock);
@@ -32,8 +32,8 @@ void ready_hook(void)
 	unit_log_printf("; ",
 			"%d in ready_requests, %d in ready_responses, "
 			"%d in request_interests, %d in response_interests",
-			unit_list_length(&hook_rpc->hsk->ready_requests),
-			unit_list_length(&hook_rpc->hsk->ready_responses),
+			unit_list_length(&hook_rpc->hsk->ready_shards[1].ready_requests),
+			unit_list_length(&hook_rpc->hsk->ready_shards[1].ready_responses),
 			unit_list_length(&hook_rpc->hsk->request_interests),
 			unit_list_length(&hook_rpc->hsk->response_interests));
 }
@@ -56,6 +56,16 @@ void shutdown_hook(void)
 	homa_sock_shutdown(hook_hsk);
 }
 
+/* The following function is used via mock_schedule_hook to hand off an RPC
+ * and then immediately mark the socket as shut down, so the woken thread
+ * returns without claiming the RPC.
+ */
+void ready_shutdown_hook(void)
+{
+	homa_rpc_ready(hook_rpc);
+	hook_hsk->shutdown = true;
+}
+
 FIXTURE(homa_incoming) {
 	__be32 client_ip;
 	int client_port;
@@ -80,6 +90,7 @@ FIXTURE_SETUP(homa_incoming)
 	self->server_addr.sin_port =  htons(self->server_port);
 	homa_init(&self->homa);
 	self->homa.num_priorities = 1;
+	self->homa.grant_coalesce_bytes = 0;
 	self->homa.flags |= HOMA_FLAG_DONT_THROTTLE;
 	mock_sock_init(&self->hsk, &self->homa, 0, 0);
 	self->data = (struct data_header){.common = {
@@ -199,6 +210,20 @@ TEST_F(homa_incoming, homa_add_packet__overlapping_ranges)
 	EXPECT_EQ(2, self->message.num_skbs);
 	EXPECT_EQ(8000, self->message.bytes_remaining);
 }
+TEST_F(homa_incoming, homa_add_packet__cant_split_gap)
+{
+	self->data.seg.offset = htonl(1400);
+	mock_kmalloc_errors = 1;
+	homa_add_packet(&self->message, mock_skb_new(self->client_ip,
+			&self->data.common, 1400, 1400));
+	EXPECT_EQ(0, self->message.num_skbs);
+	EXPECT_EQ(10000, self->message.bytes_remaining);
+
+	homa_add_packet(&self->message, mock_skb_new(self->client_ip,
+			&self->data.common, 1400, 1400));
+	EXPECT_EQ(1, self->message.num_skbs);
+	EXPECT_EQ(8600, self->message.bytes_remaining);
+}
 
 TEST_F(homa_incoming, homa_message_in_copy_data)
 {
@@ -232,6 +257,79 @@ TEST_F(homa_incoming, homa_message_in_copy_data)
 	EXPECT_EQ(200, count);
 }
 
+TEST_F(homa_incoming, homa_message_in_copy_partial)
+{
+	int count;
+	homa_add_packet(&self->message, mock_skb_new(self->client_ip,
+			&self->data.common, 1400, 0));
+	self->data.seg.offset = htonl(1400);
+	homa_add_packet(&self->message, mock_skb_new(self->client_ip,
+			&self->data.common, 1400, 1400));
+	unit_log_clear();
+	count = homa_message_in_copy_partial(&self->message, NULL,
+			1000, 2800);
+	EXPECT_STREQ("skb_copy_datagram_iter 1000-1399; "
+			"skb_copy_datagram_iter 1400-2799", unit_log_get());
+	EXPECT_EQ(1800, count);
+
+	/* Range ends in the middle of a packet. */
+	unit_log_clear();
+	count = homa_message_in_copy_partial(&self->message, NULL, 0, 2000);
+	EXPECT_STREQ("skb_copy_datagram_iter 0-1399; "
+			"skb_copy_datagram_iter 1400-1999", unit_log_get());
+	EXPECT_EQ(2000, count);
+}
+
+TEST_F(homa_incoming, homa_message_in_copy_parallel__basics)
+{
+	int i, count;
+	for (i = 0; i < 10000; i += 1400) {
+		self->data.seg.offset = htonl(i);
+		homa_add_packet(&self->message, mock_skb_new(self->client_ip,
+				&self->data.common,
+				(10000 - i) > 1400 ? 1400 : (10000 - i), i));
+	}
+	self->homa.parallel_copy_bytes = 5000;
+	unit_log_clear();
+	count = homa_message_in_copy_parallel(&self->homa, &self->message,
+			NULL, 10000);
+
+	/* The mock workqueue runs each chunk synchronously when it is
+	 * queued, so the second chunk's bytes are logged before the
+	 * first chunk's (which is copied by this thread, after queueing).
+	 */
+	EXPECT_STREQ("skb_copy_datagram_iter 5000-5599; "
+			"skb_copy_datagram_iter 5600-6999; "
+			"skb_copy_datagram_iter 7000-8399; "
+			"skb_copy_datagram_iter 8400-9799; "
+			"skb_copy_datagram_iter 9800-9999; "
+			"skb_copy_datagram_iter 0-1399; "
+			"skb_copy_datagram_iter 1400-2799; "
+			"skb_copy_datagram_iter 2800-4199; "
+			"skb_copy_datagram_iter 4200-4999", unit_log_get());
+	EXPECT_EQ(10000, count);
+	EXPECT_EQ(1, unit_get_metrics()->parallel_copy_chunks);
+}
+TEST_F(homa_incoming, homa_message_in_copy_parallel__buffer_too_small)
+{
+	int i, count;
+	for (i = 0; i < 10000; i += 1400) {
+		self->data.seg.offset = htonl(i);
+		homa_add_packet(&self->message, mock_skb_new(self->client_ip,
+				&self->data.common,
+				(10000 - i) > 1400 ? 1400 : (10000 - i), i));
+	}
+	self->homa.parallel_copy_bytes = 3000;
+	unit_log_clear();
+	count = homa_message_in_copy_parallel(&self->homa, &self->message,
+			NULL, 4000);
+	EXPECT_STREQ("skb_copy_datagram_iter 2000-2799; "
+			"skb_copy_datagram_iter 2800-3999; "
+			"skb_copy_datagram_iter 0-1399; "
+			"skb_copy_datagram_iter 1400-1999", unit_log_get());
+	EXPECT_EQ(4000, count);
+}
+
 TEST_F(homa_incoming, homa_get_resend_range__uninitialized_rpc)
 {
 	struct homa_message_in msgin;
@@ -304,6 +402,17 @@ TEST_F(homa_incoming, homa_get_resend_range__gap_at_beginning)
 	EXPECT_EQ(0, ntohl(resend.offset));
 	EXPECT_EQ(6200, ntohl(resend.length));
 }
+TEST_F(homa_incoming, homa_get_resend_range__no_granted_data_missing)
+{
+	struct resend_header resend;
+
+	homa_add_packet(&self->message, mock_skb_new(self->client_ip,
+			&self->data.common, 1400, 0));
+	self->message.incoming = 1400;
+	homa_get_resend_range(&self->message, &resend);
+	EXPECT_EQ(1400, ntohl(resend.offset));
+	EXPECT_EQ(0, ntohl(resend.length));
+}
 
 TEST_F(homa_incoming, homa_pkt_dispatch__new_server_rpc)
 {
@@ -367,7 +476,7 @@ TEST_F(homa_incoming, homa_pkt_dispatch__existing_client_rpc)
 			RPC_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, self->rpcid, 20000, 1600);
 	EXPECT_NE(NULL, crpc);
-	EXPECT_EQ(10000, crpc->msgout.granted);
+	EXPECT_EQ(11200, crpc->msgout.granted);
 	unit_log_clear();
 	
 	struct grant_header h = {{.sport = htons(self->server_port),
@@ -413,7 +522,7 @@ TEST_F(homa_incoming, homa_pkt_dispatch__unknown_type)
 			RPC_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, self->rpcid, 20000, 1600);
 	EXPECT_NE(NULL, crpc);
-	EXPECT_EQ(10000, crpc->msgout.granted);
+	EXPECT_EQ(11200, crpc->msgout.granted);
 	unit_log_clear();
 	
 	struct common_header h = {.sport = htons(self->server_port),
@@ -430,6 +539,36 @@ TEST_F(homa_incoming, homa_pkt_dispatch__new_server_rpc_but_socket_shutdown)
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	self->hsk.shutdown = 0;
 }
+TEST_F(homa_incoming, homa_pkt_dispatch__cycle_metrics)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->rpcid, 10000, 100);
+	EXPECT_NE(NULL, srpc);
+	self->homa.cycle_metrics = 1;
+	mock_cycles = 1000;
+	mock_cycles_delta = 10;
+	self->data.seg.offset = htonl(1400);
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &self->data.common,
+			1400, 0), &self->hsk);
+	EXPECT_NE(0, unit_get_metrics()->dispatch_lookup_cycles);
+	EXPECT_NE(0, unit_get_metrics()->dispatch_data_cycles);
+	EXPECT_EQ(0, unit_get_metrics()->dispatch_grant_cycles);
+}
+TEST_F(homa_incoming, homa_pkt_dispatch__no_cycle_metrics_by_default)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->rpcid, 10000, 100);
+	EXPECT_NE(NULL, srpc);
+	mock_cycles = 1000;
+	mock_cycles_delta = 10;
+	self->data.seg.offset = htonl(1400);
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &self->data.common,
+			1400, 0), &self->hsk);
+	EXPECT_EQ(0, unit_get_metrics()->dispatch_lookup_cycles);
+	EXPECT_EQ(0, unit_get_metrics()->dispatch_data_cycles);
+}
 
 TEST_F(homa_incoming, homa_data_pkt__basics)
 {
@@ -442,7 +581,7 @@ TEST_F(homa_incoming, homa_data_pkt__basics)
 	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
 			1400, 0), crpc);
 	EXPECT_EQ(RPC_INCOMING, crpc->state);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_shards[1].ready_responses));
 	EXPECT_STREQ("", unit_log_get());
 	EXPECT_EQ(200, crpc->msgin.bytes_remaining);
 	EXPECT_EQ(1, crpc->msgin.num_skbs);
@@ -452,7 +591,7 @@ TEST_F(homa_incoming, homa_data_pkt__basics)
 	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
 			200, 1400), crpc);
 	EXPECT_EQ(RPC_READY, crpc->state);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[1].ready_responses));
 	EXPECT_EQ(0, crpc->msgin.bytes_remaining);
 	EXPECT_EQ(2, crpc->msgin.num_skbs);
 }
@@ -535,7 +674,7 @@ TEST_F(homa_incoming, homa_data_pkt__short_server_rpc_ready)
 	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
 			100, 0), srpc);
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
-	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[1].ready_requests));
 	homa_rpc_unlock(srpc);
 }
 TEST_F(homa_incoming, homa_data_pkt__long_server_rpc_ready)
@@ -544,7 +683,7 @@ TEST_F(homa_incoming, homa_data_pkt__long_server_rpc_ready)
 			self->client_ip, self->server_ip, self->client_port,
 			self->rpcid, 2000, 1000);
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_shards[1].ready_requests));
 	self->data.message_length = htonl(2000);
 	self->data.incoming = htonl(600);
 	self->data.seg.offset = htonl(1400);
@@ -552,7 +691,58 @@ TEST_F(homa_incoming, homa_data_pkt__long_server_rpc_ready)
 	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
 			1400, 1400), srpc);
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
-	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[1].ready_requests));
+}
+TEST_F(homa_incoming, homa_data_pkt__notify_partial_interest)
+{
+	struct homa_interest interest;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 1000, 5000);
+	EXPECT_NE(NULL, crpc);
+	atomic_long_set(&interest.id, 0);
+	interest.flags = HOMA_RECV_RESPONSE|HOMA_RECV_PARTIAL;
+	interest.reg_rpc = crpc;
+	interest.request_links.next = LIST_POISON1;
+	interest.response_links.next = LIST_POISON1;
+	crpc->interest = &interest;
+	crpc->msgin.delivered = 1400;
+	unit_log_clear();
+
+	self->data.message_length = htonl(5000);
+	self->data.seg.offset = htonl(1400);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 1400), crpc);
+	EXPECT_EQ(crpc->id, atomic_long_read(&interest.id));
+	EXPECT_EQ(crpc, interest.rpc);
+	EXPECT_EQ(NULL, crpc->interest);
+	EXPECT_SUBSTR("wake_up_process", unit_log_get());
+	atomic_dec(&self->hsk.reap_disable);
+}
+TEST_F(homa_incoming, homa_data_pkt__no_partial_notify_without_new_prefix_bytes)
+{
+	struct homa_interest interest;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 1000, 5000);
+	EXPECT_NE(NULL, crpc);
+	atomic_long_set(&interest.id, 0);
+	interest.flags = HOMA_RECV_RESPONSE|HOMA_RECV_PARTIAL;
+	interest.reg_rpc = crpc;
+	interest.request_links.next = LIST_POISON1;
+	interest.response_links.next = LIST_POISON1;
+	crpc->interest = &interest;
+	crpc->msgin.delivered = 1400;
+	unit_log_clear();
+
+	/* Out-of-order packet: doesn't extend the contiguous prefix. */
+	self->data.message_length = htonl(5000);
+	self->data.seg.offset = htonl(2800);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 2800), crpc);
+	EXPECT_EQ(0, atomic_long_read(&interest.id));
+	EXPECT_EQ(&interest, crpc->interest);
+	crpc->interest = NULL;
 }
 TEST_F(homa_incoming, homa_data_pkt__socket_shutdown)
 {
@@ -567,7 +757,7 @@ TEST_F(homa_incoming, homa_data_pkt__socket_shutdown)
 	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
 			100, 0), srpc);
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_shards[1].ready_requests));
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	homa_rpc_unlock(srpc);
 	self->hsk.shutdown = 0;
@@ -608,6 +798,103 @@ TEST_F(homa_incoming, homa_data_pkt__cutoffs_up_to_date)
 			1400, 0), &self->hsk);
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_incoming, homa_data_pkt__no_standalone_cutoffs_for_scheduled)
+{
+	self->homa.cutoff_version = 2;
+	self->data.message_length = htonl(100000);
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &self->data.common,
+			1400, 0), &self->hsk);
+
+	/* The message is scheduled, so the cutoff update piggybacks on
+	 * its grants; no standalone CUTOFFS packet.
+	 */
+	EXPECT_STREQ("xmit GRANT 11400@0", unit_log_get());
+}
+
+TEST_F(homa_incoming, homa_data_pkt_single__new_server_rpc)
+{
+	self->data.message_length = htonl(100);
+	self->data.incoming = htonl(100);
+	self->data.seg.segment_length = htonl(100);
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &self->data.common,
+			100, 0), &self->hsk);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[1].ready_requests));
+	EXPECT_EQ(1, unit_get_metrics()->single_pkt_msgs);
+	EXPECT_EQ(0, self->homa.num_grantable);
+}
+TEST_F(homa_incoming, homa_data_pkt_single__client_response)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 1000, 100);
+	EXPECT_NE(NULL, crpc);
+	unit_log_clear();
+	self->data.message_length = htonl(100);
+	self->data.incoming = htonl(100);
+	self->data.seg.segment_length = htonl(100);
+	homa_data_pkt_single(mock_skb_new(self->server_ip, &self->data.common,
+			100, 0), crpc);
+	EXPECT_EQ(RPC_READY, crpc->state);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[1].ready_responses));
+	EXPECT_EQ(100, crpc->msgin.total_length);
+	EXPECT_EQ(0, crpc->msgin.bytes_remaining);
+	EXPECT_EQ(1, crpc->msgin.num_skbs);
+}
+TEST_F(homa_incoming, homa_data_pkt_single__wrong_rpc_state)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->rpcid, 1400, 5000);
+	EXPECT_NE(NULL, srpc);
+	self->data.message_length = htonl(100);
+	self->data.seg.segment_length = htonl(100);
+	homa_data_pkt_single(mock_skb_new(self->client_ip, &self->data.common,
+			100, 0), srpc);
+	EXPECT_EQ(RPC_OUTGOING, srpc->state);
+	EXPECT_EQ(5, mock_skb_count());
+}
+TEST_F(homa_incoming, homa_data_pkt_single__duplicate_packet)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->rpcid, 10000, 100);
+	EXPECT_NE(NULL, srpc);
+	EXPECT_EQ(8600, srpc->msgin.bytes_remaining);
+	homa_data_pkt_single(mock_skb_new(self->client_ip, &self->data.common,
+			1400, 0), srpc);
+	EXPECT_EQ(8600, srpc->msgin.bytes_remaining);
+	EXPECT_EQ(1, srpc->msgin.num_skbs);
+}
+TEST_F(homa_incoming, homa_data_pkt_single__socket_shutdown)
+{
+	self->data.message_length = htonl(100);
+	self->data.incoming = htonl(100);
+	self->data.seg.segment_length = htonl(100);
+	struct homa_rpc *srpc = homa_rpc_new_server(&self->hsk,
+			self->client_ip, &self->data);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	homa_rpc_lock(srpc);
+	self->hsk.shutdown = 1;
+	homa_data_pkt_single(mock_skb_new(self->server_ip, &self->data.common,
+			100, 0), srpc);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_shards[1].ready_requests));
+	homa_rpc_unlock(srpc);
+	self->hsk.shutdown = 0;
+}
+TEST_F(homa_incoming, homa_data_pkt_single__stale_cutoffs_use_slow_path)
+{
+	self->homa.cutoff_version = 2;
+	self->data.message_length = htonl(100);
+	self->data.incoming = htonl(100);
+	self->data.seg.segment_length = htonl(100);
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &self->data.common,
+			100, 0), &self->hsk);
+	EXPECT_EQ(0, unit_get_metrics()->single_pkt_msgs);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[1].ready_requests));
+	EXPECT_SUBSTR("xmit CUTOFFS", unit_log_get());
+}
 
 TEST_F(homa_incoming, homa_grant_pkt__basics)
 {
@@ -665,6 +952,35 @@ TEST_F(homa_incoming, homa_grant_pkt__grant_past_end_of_message)
 			&self->hsk);
 	EXPECT_EQ(20000, crpc->msgout.granted);
 }
+TEST_F(homa_incoming, homa_grant_pkt__update_peer_rtt)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 20000, 1600);
+	EXPECT_NE(NULL, crpc);
+	EXPECT_EQ(0, crpc->peer->rtt_bytes);
+	self->homa.cycles_per_kbyte = 1000;
+	mock_cycles = 8000;
+	unit_log_clear();
+
+	struct grant_header h = {{.sport = htons(self->server_port),
+	                .dport = htons(self->client_port),
+			.id = crpc->id, .type = GRANT},
+		        .offset = htonl(16000),
+			.priority = 3};
+	homa_pkt_dispatch(mock_skb_new(self->server_ip, &h.common, 0, 0),
+			&self->hsk);
+	EXPECT_EQ(16000, crpc->msgout.granted);
+	EXPECT_EQ(8000, crpc->peer->rtt_bytes);
+
+	/* Only the first grant for a message updates the estimate. */
+	mock_cycles = 100000;
+	h.offset = htonl(18000);
+	homa_pkt_dispatch(mock_skb_new(self->server_ip, &h.common, 0, 0),
+			&self->hsk);
+	EXPECT_EQ(18000, crpc->msgout.granted);
+	EXPECT_EQ(8000, crpc->peer->rtt_bytes);
+}
 TEST_F(homa_incoming, homa_grant_pkt__delete_server_rpc)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_OUTGOING,
@@ -682,6 +998,57 @@ TEST_F(homa_incoming, homa_grant_pkt__delete_server_rpc)
 			&self->hsk);
 	EXPECT_TRUE(list_empty(&self->hsk.active_rpcs));
 }
+TEST_F(homa_incoming, homa_grant_pkt__apply_piggybacked_cutoffs)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 20000, 1600);
+	EXPECT_NE(NULL, crpc);
+	unit_log_clear();
+
+	struct grant_header h = {{.sport = htons(self->server_port),
+	                .dport = htons(self->client_port),
+			.id = crpc->id, .type = GRANT},
+		        .offset = htonl(12000),
+			.priority = 3,
+			.unsched_cutoffs = {htonl(10), htonl(9), htonl(8),
+			htonl(7), htonl(6), htonl(5), htonl(4), htonl(3)},
+			.cutoff_version = 400};
+	homa_pkt_dispatch(mock_skb_new(self->server_ip, &h.common, 0, 0),
+			&self->hsk);
+	EXPECT_EQ(400, crpc->peer->cutoff_version);
+	EXPECT_EQ(INT_MAX, crpc->peer->unsched_cutoffs[0]);
+	EXPECT_EQ(9, crpc->peer->unsched_cutoffs[1]);
+	EXPECT_EQ(3, crpc->peer->unsched_cutoffs[7]);
+	EXPECT_EQ(12000, crpc->msgout.granted);
+}
+TEST_F(homa_incoming, homa_grant_pkt__piggybacked_ack)
+{
+	homa_sock_bind(&self->homa.port_map, &self->hsk, self->server_port);
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 20000, 1600);
+	EXPECT_NE(NULL, crpc);
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_OUTGOING,
+			self->server_ip, self->client_ip, self->client_port,
+			3333, 100, 100);
+	EXPECT_NE(NULL, srpc);
+	EXPECT_EQ(2, unit_list_length(&self->hsk.active_rpcs));
+	unit_log_clear();
+
+	struct grant_header h = {{.sport = htons(self->server_port),
+	                .dport = htons(self->client_port),
+			.id = crpc->id, .type = GRANT},
+		        .offset = htonl(12000),
+			.priority = 3,
+			.ack = {.id = 3333,
+			.client_port = htons(self->client_port),
+			.server_port = htons(self->server_port)}};
+	homa_pkt_dispatch(mock_skb_new(self->server_ip, &h.common, 0, 0),
+			&self->hsk);
+	EXPECT_EQ(12000, crpc->msgout.granted);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
 
 TEST_F(homa_incoming, homa_resend_pkt__unknown_rpc_from_client)
 {
@@ -747,7 +1114,7 @@ TEST_F(homa_incoming, homa_resend_pkt__client_not_outgoing)
 			&self->hsk);
 	EXPECT_STREQ("", unit_log_get());
 }
-TEST_F(homa_incoming, homa_resend_pkt__send_busy_instead_of_data)
+TEST_F(homa_incoming, homa_resend_pkt__defer_busy_instead_of_data)
 {
 	struct resend_header h = {{.sport = htons(self->server_port),
 	                .dport = htons(self->client_port),
@@ -763,7 +1130,8 @@ TEST_F(homa_incoming, homa_resend_pkt__send_busy_instead_of_data)
 	
 	homa_pkt_dispatch(mock_skb_new(self->server_ip, &h.common, 0, 0),
 			&self->hsk);
-	EXPECT_STREQ("xmit BUSY", unit_log_get());
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, crpc->msgout.busy_pending);
 }
 TEST_F(homa_incoming, homa_resend_pkt__client_send_data)
 {
@@ -866,7 +1234,7 @@ TEST_F(homa_incoming, homa_cutoffs_pkt_basics)
 			RPC_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, self->rpcid, 20000, 1600);
 	EXPECT_NE(NULL, crpc);
-	EXPECT_EQ(10000, crpc->msgout.granted);
+	EXPECT_EQ(11200, crpc->msgout.granted);
 	unit_log_clear();
 	
 	struct cutoffs_header h = {{.sport = htons(self->server_port),
@@ -900,29 +1268,193 @@ TEST_F(homa_incoming, homa_cutoffs__cant_find_peer)
 	EXPECT_EQ(0, peer->cutoff_version);
 }
 
-TEST_F(homa_incoming, homa_manage_grants__stop_tracking_when_fully_granted)
+TEST_F(homa_incoming, homa_ack_pkt__basics)
 {
-	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+	homa_sock_bind(&self->homa.port_map, &self->hsk, self->server_port);
+	struct homa_rpc *srpc1 = unit_server_rpc(&self->hsk, RPC_OUTGOING,
 			self->client_ip, self->server_ip, self->client_port,
-			self->rpcid, 20000, 100);
+			self->rpcid, 100, 100);
+	EXPECT_NE(NULL, srpc1);
+	struct homa_rpc *srpc2 = unit_server_rpc(&self->hsk, RPC_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->rpcid+1, 100, 100);
+	EXPECT_NE(NULL, srpc2);
+	EXPECT_EQ(2, unit_list_length(&self->hsk.active_rpcs));
+
+	/* The id in the packet's common header acks srpc1 implicitly;
+	 * srpc2 is acked explicitly.
+	 */
+	struct ack_header h = {.common = {.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.id = self->rpcid, .type = ACK},
+			.num_acks = htons(1),
+			.acks = {{.id = self->rpcid+1,
+			.client_port = htons(self->client_port),
+			.server_port = htons(self->server_port)}}};
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->hsk);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_incoming, homa_ack_pkt__ignore_unknown_rpcs)
+{
+	homa_sock_bind(&self->homa.port_map, &self->hsk, self->server_port);
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->rpcid, 100, 100);
 	EXPECT_NE(NULL, srpc);
-	EXPECT_TRUE(srpc->msgin.possibly_in_grant_queue);
-	unit_log_clear();
-	unit_log_grantables(&self->homa);
-	EXPECT_STREQ("request 12345, remaining 18600", unit_log_get());
-	
-	srpc->msgin.incoming = 20000;
-	homa_manage_grants(&self->homa, srpc);
-	EXPECT_FALSE(srpc->msgin.possibly_in_grant_queue);
 	unit_log_clear();
-	unit_log_grantables(&self->homa);
+
+	/* The common header doesn't match any RPC; the first ack refers
+	 * to an unknown RPC, and the second to a port with no socket.
+	 */
+	struct ack_header h = {.common = {.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.id = 99999, .type = ACK},
+			.num_acks = htons(2),
+			.acks = {{.id = self->rpcid+10,
+			.client_port = htons(self->client_port),
+			.server_port = htons(self->server_port)},
+			{.id = self->rpcid,
+			.client_port = htons(self->client_port),
+			.server_port = htons(self->server_port+1)}}};
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->hsk);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_STREQ("", unit_log_get());
 }
-TEST_F(homa_incoming, homa_manage_grants__insert_in_order)
+
+TEST_F(homa_incoming, dcacp_rts_pkt__queues_candidate)
+{
+	struct rts_header h = {{.sport = htons(self->client_port),
+			.dport = htons(self->server_port),
+			.id = 0, .type = RTS},
+			.message_size = cpu_to_be64(5000), .priority = 0};
+	self->homa.epoch.iter = 3;
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->hsk);
+	EXPECT_EQ(1, dcacp_cores[cpu_number].rts_size);
+	EXPECT_EQ(3, dcacp_cores[cpu_number].rts_q[0].iter);
+	EXPECT_EQ(self->client_ip, dcacp_cores[cpu_number].rts_q[0].src_addr);
+	EXPECT_EQ(self->client_port, dcacp_cores[cpu_number].rts_q[0].sport);
+	EXPECT_EQ(5000, dcacp_cores[cpu_number].rts_q[0].remaining_sz);
+}
+TEST_F(homa_incoming, dcacp_notification_pkt__queues_candidate)
+{
+	struct notification_header h = {{.sport = htons(self->client_port),
+			.dport = htons(self->server_port),
+			.id = 0, .type = NOTIFICATION},
+			.message_id = htonl(44),
+			.message_size = cpu_to_be64(20000), .priority = 0};
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->hsk);
+	EXPECT_EQ(1, dcacp_cores[cpu_number].rts_size);
+	EXPECT_EQ(20000, dcacp_cores[cpu_number].rts_q[0].remaining_sz);
+}
+TEST_F(homa_incoming, dcacp_grant_pkt__queues_offer)
+{
+	struct dcacp_grant_header h = {{.sport = htons(self->client_port),
+			.dport = htons(self->server_port),
+			.id = 0, .type = DCACP_GRANT},
+			.message_size = cpu_to_be64(8000), .priority = 0};
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->hsk);
+	EXPECT_EQ(1, dcacp_cores[cpu_number].grant_size);
+	EXPECT_EQ(self->client_ip,
+			dcacp_cores[cpu_number].grants_q[0].dst_addr);
+	EXPECT_EQ(8000, dcacp_cores[cpu_number].grants_q[0].remaining_sz);
+}
+TEST_F(homa_incoming, dcacp_accept_pkt__matches_receiver)
+{
+	struct accept_header h = {{.sport = htons(self->client_port),
+			.dport = htons(self->server_port),
+			.id = 0, .type = ACCEPT}, .priority = 0};
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->hsk);
+	EXPECT_EQ(self->client_ip, self->homa.epoch.match_src_addr);
+
+	/* A second ACCEPT doesn't overwrite the match. */
+	homa_pkt_dispatch(mock_skb_new(self->server_ip, &h.common, 0, 0),
+			&self->hsk);
+	EXPECT_EQ(self->client_ip, self->homa.epoch.match_src_addr);
+}
+TEST_F(homa_incoming, dcacp_run_iteration__grant_smallest_rts)
+{
+	struct dcacp_core *core = &dcacp_cores[2];
+	core->rts_q[0] = (struct dcacp_rts) {.iter = 0,
+			.src_addr = self->client_ip, .sport = 500,
+			.remaining_sz = 9000};
+	core->rts_q[1] = (struct dcacp_rts) {.iter = 0,
+			.src_addr = self->server_ip, .sport = 600,
+			.remaining_sz = 4000};
+	core->rts_size = 2;
+	unit_log_clear();
+	dcacp_run_iteration(&self->homa);
+	EXPECT_STREQ("xmit DCACP_GRANT", unit_log_get());
+	EXPECT_EQ(0, core->rts_size);
+	EXPECT_EQ(0, self->homa.epoch.rts_size);
+	EXPECT_EQ(1, self->homa.epoch.iter);
+	EXPECT_EQ(0, self->homa.epoch.match_src_addr);
+}
+TEST_F(homa_incoming, dcacp_run_iteration__accept_best_grant)
+{
+	struct dcacp_core *core = &dcacp_cores[2];
+	core->grants_q[0] = (struct dcacp_grant) {.prompt = false,
+			.dst_addr = self->client_ip, .sport = 500,
+			.remaining_sz = 9000};
+	core->grants_q[1] = (struct dcacp_grant) {.prompt = false,
+			.dst_addr = self->server_ip, .sport = 600,
+			.remaining_sz = 4000};
+	core->grant_size = 2;
+	unit_log_clear();
+	dcacp_run_iteration(&self->homa);
+	EXPECT_STREQ("xmit ACCEPT", unit_log_get());
+	EXPECT_EQ(self->server_ip, self->homa.epoch.match_dst_addr);
+
+	/* A later grant is ignored: we are already matched. */
+	core->grants_q[0] = (struct dcacp_grant) {.prompt = false,
+			.dst_addr = self->client_ip, .sport = 500,
+			.remaining_sz = 100};
+	core->grant_size = 1;
+	unit_log_clear();
+	dcacp_run_iteration(&self->homa);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(self->server_ip, self->homa.epoch.match_dst_addr);
+}
+TEST_F(homa_incoming, dcacp_run_iteration__new_epoch_clears_matches)
+{
+	self->homa.epoch.iter = DCACP_EPOCH_ITERS - 1;
+	self->homa.epoch.match_src_addr = self->client_ip;
+	self->homa.epoch.match_dst_addr = self->server_ip;
+	dcacp_run_iteration(&self->homa);
+	EXPECT_EQ(1, self->homa.epoch.epoch);
+	EXPECT_EQ(0, self->homa.epoch.iter);
+	EXPECT_EQ(0, self->homa.epoch.match_src_addr);
+	EXPECT_EQ(0, self->homa.epoch.match_dst_addr);
+}
+
+TEST_F(homa_incoming, homa_manage_grants__stop_tracking_when_fully_granted)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->rpcid, 20000, 100);
+	EXPECT_NE(NULL, srpc);
+	EXPECT_TRUE(srpc->msgin.possibly_in_grant_queue);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("request 12345, remaining 18600", unit_log_get());
+	
+	srpc->msgin.incoming = 20000;
+	homa_manage_grants(&self->homa, srpc);
+	EXPECT_FALSE(srpc->msgin.possibly_in_grant_queue);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("", unit_log_get());
+}
+TEST_F(homa_incoming, homa_manage_grants__insert_in_order)
 {
 	unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
-			self->server_ip, self->client_port, 1, 100000, 100);
-	unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+			self->server_ip, self->client_port, 1, 100000, 100);
+	unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
 			self->server_ip, self->client_port, 2, 50000, 100);
 	unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
 			self->server_ip, self->client_port, 3, 120000, 100);
@@ -987,6 +1519,51 @@ TEST_F(homa_incoming, homa_manage_grants__adjust_priority_order)
 			"request 3, remaining 28599; "
 			"request 2, remaining 28600", unit_log_get());
 }
+TEST_F(homa_incoming, homa_manage_grants__bucket_index)
+{
+	struct homa_rpc *srpc;
+
+	/* Message sizes chosen to span several entries in
+	 * homa->grantable_tails, with three messages sharing the
+	 * largest bucket.
+	 */
+	unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+			self->server_ip, self->client_port, 1, 400000, 100);
+	unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+			self->server_ip, self->client_port, 2, 3000, 100);
+	unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+			self->server_ip, self->client_port, 3, 500000, 100);
+	unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+			self->server_ip, self->client_port, 4, 60000, 100);
+	unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+			self->server_ip, self->client_port, 5, 450000, 100);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("request 2, remaining 1600; "
+			"request 4, remaining 58600; "
+			"request 1, remaining 398600; "
+			"request 5, remaining 448600; "
+			"request 3, remaining 498600", unit_log_get());
+
+	/* Delete the tail of the largest bucket, then add another message
+	 * to that bucket to make sure the index was updated by the
+	 * deletion.
+	 */
+	srpc = homa_find_server_rpc(&self->hsk, self->client_ip,
+			self->client_port, 3);
+	ASSERT_NE(NULL, srpc);
+	homa_rpc_free(srpc);
+	homa_rpc_unlock(srpc);
+	unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+			self->server_ip, self->client_port, 6, 470000, 100);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("request 2, remaining 1600; "
+			"request 4, remaining 58600; "
+			"request 1, remaining 398600; "
+			"request 5, remaining 448600; "
+			"request 6, remaining 468600", unit_log_get());
+}
 TEST_F(homa_incoming, homa_manage_grants__pick_message_to_grant)
 {
 	struct homa_rpc *srpc;
@@ -1054,6 +1631,112 @@ TEST_F(homa_incoming, homa_manage_grants__choose_grant_offset)
 	homa_manage_grants(&self->homa, srpc);
 	EXPECT_STREQ("xmit GRANT 40000@0", unit_log_get());
 }
+TEST_F(homa_incoming, homa_manage_grants__piggyback_cutoffs)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			1, 40000, 100);
+	EXPECT_NE(NULL, srpc);
+
+	self->homa.cutoff_version = 7;
+	srpc->msgin.bytes_remaining -= 1400;
+	unit_log_clear();
+	mock_xmit_log_verbose = 1;
+	homa_manage_grants(&self->homa, srpc);
+	EXPECT_SUBSTR("cutoff_version 7", unit_log_get());
+}
+TEST_F(homa_incoming, homa_manage_grants__piggyback_ack)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			1, 40000, 100);
+	EXPECT_NE(NULL, srpc);
+
+	srpc->peer->acks[0].id = 12345;
+	srpc->peer->acks[0].client_port = htons(self->client_port);
+	srpc->peer->acks[0].server_port = htons(self->server_port);
+	srpc->peer->num_acks = 1;
+	srpc->msgin.bytes_remaining -= 1400;
+	unit_log_clear();
+	mock_xmit_log_verbose = 1;
+	homa_manage_grants(&self->homa, srpc);
+	EXPECT_SUBSTR("ack [cp 40000, sp 99, id 12345]", unit_log_get());
+	EXPECT_EQ(0, srpc->peer->num_acks);
+}
+TEST_F(homa_incoming, homa_manage_grants__coalesce)
+{
+	struct homa_metrics metrics;
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			1, 40000, 100);
+
+	self->homa.rtt_bytes = 10000;
+	self->homa.grant_increment = 4000;
+	self->homa.grant_coalesce_bytes = 5000;
+
+	/* Small advance: grant is accumulated, not sent. */
+	srpc->msgin.bytes_remaining = 35000;
+	srpc->msgin.incoming = 14000;
+	srpc->msgin.incoming_sent = 14000;
+	unit_log_clear();
+	homa_manage_grants(&self->homa, srpc);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(18000, srpc->msgin.incoming);
+	EXPECT_EQ(14000, srpc->msgin.incoming_sent);
+	homa_compile_metrics(&metrics);
+	EXPECT_EQ(1, metrics.grants_coalesced);
+
+	/* Accumulated advance now exceeds the threshold: one grant
+	 * covers both increments.
+	 */
+	srpc->msgin.bytes_remaining = 31000;
+	unit_log_clear();
+	homa_manage_grants(&self->homa, srpc);
+	EXPECT_STREQ("xmit GRANT 22000@0", unit_log_get());
+	EXPECT_EQ(22000, srpc->msgin.incoming_sent);
+}
+TEST_F(homa_incoming, homa_manage_grants__coalesce_send_final_grant)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			1, 40000, 100);
+
+	self->homa.rtt_bytes = 10000;
+	self->homa.grant_increment = 4000;
+	self->homa.grant_coalesce_bytes = 5000;
+
+	/* Advance is below the threshold, but the grant covers the end
+	 * of the message, so it must be sent.
+	 */
+	srpc->msgin.bytes_remaining = 8000;
+	srpc->msgin.incoming = 38000;
+	srpc->msgin.incoming_sent = 38000;
+	unit_log_clear();
+	homa_manage_grants(&self->homa, srpc);
+	EXPECT_STREQ("xmit GRANT 40000@0", unit_log_get());
+}
+TEST_F(homa_incoming, homa_manage_grants__coalesce_send_if_priority_changed)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			1, 40000, 100);
+
+	self->homa.rtt_bytes = 10000;
+	self->homa.grant_increment = 4000;
+	self->homa.grant_coalesce_bytes = 5000;
+
+	/* Advance is below the threshold, but the priority has changed
+	 * since the last grant, so a new grant must be sent.
+	 */
+	srpc->msgin.bytes_remaining = 35000;
+	srpc->msgin.incoming = 14000;
+	srpc->msgin.incoming_sent = 14000;
+	srpc->msgin.priority = 3;
+	unit_log_clear();
+	homa_manage_grants(&self->homa, srpc);
+	EXPECT_STREQ("xmit GRANT 18000@0", unit_log_get());
+	EXPECT_EQ(0, srpc->msgin.priority);
+}
 TEST_F(homa_incoming, homa_manage_grants__choose_priority_level)
 {
 	unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
@@ -1097,6 +1780,22 @@ TEST_F(homa_incoming, homa_manage_grants__many_messages_of_same_size)
 			self->server_ip, self->client_port, 4, 20000, 100);
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_incoming, homa_manage_grants__skip_if_grant_pass_active)
+{
+	struct homa_metrics metrics;
+	atomic_set(&self->homa.grant_active, 1);
+	unit_log_clear();
+	unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+			self->server_ip, self->client_port, 1, 20000, 100);
+	EXPECT_STREQ("", unit_log_get());
+	homa_compile_metrics(&metrics);
+	EXPECT_EQ(1, metrics.grant_skips);
+
+	/* The message was still added to the grantable list. */
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("request 1, remaining 18600", unit_log_get());
+	atomic_set(&self->homa.grant_active, 0);
+}
 TEST_F(homa_incoming, homa_manage_grants__grant_after_rpc_deleted)
 {
 	self->homa.max_overcommit = 2;
@@ -1175,7 +1874,7 @@ TEST_F(homa_incoming, homa_rpc_abort)
 			self->server_port, self->rpcid, 20000, 1600);
 	unit_log_clear();
 	homa_rpc_abort(crpc, -EFAULT);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[1].ready_responses));
 	EXPECT_EQ(RPC_READY, crpc->state);
 	EXPECT_EQ(EFAULT, -crpc->error);
 	EXPECT_STREQ("homa_remove_from_grantable invoked; "
@@ -1195,7 +1894,7 @@ TEST_F(homa_incoming, homa_peer_abort__basics)
 			self->server_port, self->rpcid+2, 5000, 1600);
 	unit_log_clear();
 	homa_peer_abort(&self->homa, self->server_ip, -EPROTONOSUPPORT);
-	EXPECT_EQ(2, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_EQ(2, unit_list_length(&self->hsk.ready_shards[1].ready_responses));
 	EXPECT_EQ(RPC_READY, crpc1->state);
 	EXPECT_EQ(EPROTONOSUPPORT, -crpc1->error);
 	EXPECT_EQ(0, -crpc2->error);
@@ -1220,14 +1919,40 @@ TEST_F(homa_incoming, homa_peer_abort__multiple_sockets)
 			5000, 1600);
 	unit_log_clear();
 	homa_peer_abort(&self->homa, self->server_ip, -EPROTONOSUPPORT);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[1].ready_responses));
 	EXPECT_EQ(RPC_READY, crpc1->state);
 	EXPECT_EQ(EPROTONOSUPPORT, -crpc1->error);
 	EXPECT_EQ(RPC_READY, crpc2->state);
 	EXPECT_EQ(EPROTONOSUPPORT, -crpc2->error);
 	EXPECT_EQ(RPC_READY, crpc3->state);
 	EXPECT_EQ(2, unit_list_length(&hsk1.active_rpcs));
-	EXPECT_EQ(2, unit_list_length(&hsk1.ready_responses));
+	EXPECT_EQ(2, unit_list_length(&hsk1.ready_shards[1].ready_responses));
+}
+TEST_F(homa_incoming, homa_peer_abort__rpc_busy)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 5000, 1600);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid+1, 5000, 1600);
+	unit_log_clear();
+	mock_trylock_errors = 1;
+	homa_peer_abort(&self->homa, self->server_ip, -EPROTONOSUPPORT);
+	EXPECT_EQ(RPC_OUTGOING, crpc1->state);
+	EXPECT_EQ(0, -crpc1->error);
+	EXPECT_EQ(RPC_READY, crpc2->state);
+	EXPECT_EQ(EPROTONOSUPPORT, -crpc2->error);
+}
+TEST_F(homa_incoming, homa_peer_abort__no_such_peer)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 5000, 1600);
+	unit_log_clear();
+	homa_peer_abort(&self->homa, self->server_ip+1, -EPROTONOSUPPORT);
+	EXPECT_EQ(RPC_OUTGOING, crpc1->state);
+	EXPECT_EQ(0, -crpc1->error);
 }
 TEST_F(homa_incoming, homa_peer_abort__log_timeout_stats)
 {
@@ -1291,6 +2016,30 @@ TEST_F(homa_incoming, homa_wait_for_message__return_specific_id)
 	EXPECT_EQ(crpc, rpc);
 	homa_rpc_unlock(rpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__partial_data_available)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 1000, 20000);
+	EXPECT_NE(NULL, crpc);
+
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECV_RESPONSE|HOMA_RECV_PARTIAL
+			|HOMA_RECV_NONBLOCKING, self->rpcid);
+	EXPECT_EQ(crpc, rpc);
+	homa_rpc_unlock(rpc);
+
+	/* Once all contiguous bytes have been delivered, the caller
+	 * must wait for more to arrive.
+	 */
+	crpc->msgin.delivered = homa_prefix_end(&crpc->msgin);
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECV_RESPONSE|HOMA_RECV_PARTIAL
+			|HOMA_RECV_NONBLOCKING, self->rpcid);
+	EXPECT_EQ(EAGAIN, -PTR_ERR(rpc));
+	EXPECT_EQ(NULL, crpc->interest);
+}
 TEST_F(homa_incoming, homa_wait_for_message__return_from_ready_responses)
 {
 	struct homa_rpc *rpc;
@@ -1304,6 +2053,23 @@ TEST_F(homa_incoming, homa_wait_for_message__return_from_ready_responses)
 	EXPECT_EQ(crpc, rpc);
 	homa_rpc_unlock(rpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__cycle_metrics)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_READY, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 20000, 1600);
+	EXPECT_NE(NULL, crpc);
+	self->homa.cycle_metrics = 1;
+	mock_cycles = 1000;
+	mock_cycles_delta = 10;
+
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECV_RESPONSE|HOMA_RECV_NONBLOCKING, 0);
+	EXPECT_EQ(crpc, rpc);
+	homa_rpc_unlock(rpc);
+	EXPECT_NE(0, unit_get_metrics()->wait_find_cycles);
+}
 TEST_F(homa_incoming, homa_wait_for_message__return_from_ready_requests)
 {
 	struct homa_rpc *rpc;
@@ -1317,6 +2083,28 @@ TEST_F(homa_incoming, homa_wait_for_message__return_from_ready_requests)
 	EXPECT_EQ(srpc, rpc);
 	homa_rpc_unlock(rpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__steal_from_other_shard)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc;
+
+	/* Make the RPC ready on core 3's shard, then receive on core 1. */
+	cpu_number = 3;
+	crpc = unit_client_rpc(&self->hsk, RPC_READY, self->client_ip,
+			self->server_ip, self->server_port, self->rpcid,
+			20000, 1600);
+	cpu_number = 1;
+	EXPECT_NE(NULL, crpc);
+	EXPECT_EQ(1, unit_list_length(
+			&self->hsk.ready_shards[3].ready_responses));
+
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECV_RESPONSE|HOMA_RECV_NONBLOCKING, 0);
+	EXPECT_EQ(crpc, rpc);
+	EXPECT_EQ(0, unit_list_length(
+			&self->hsk.ready_shards[3].ready_responses));
+	homa_rpc_unlock(rpc);
+}
 TEST_F(homa_incoming, homa_wait_for_message__id_not_ready)
 {
 	struct homa_rpc *rpc;
@@ -1392,6 +2180,51 @@ TEST_F(homa_incoming, homa_wait_for_message__response_arrives_while_sleeping)
 	EXPECT_EQ(0, unit_list_length(&self->hsk.response_interests));
 	homa_rpc_unlock(rpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__poll_before_sleeping)
+{
+	struct homa_metrics metrics;
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 20000, 1600);
+	EXPECT_NE(NULL, crpc);
+	unit_log_clear();
+
+	self->hsk.poll_mode = 1;
+	self->homa.poll_cycles = 500;
+	mock_cycles = 10000;
+	mock_cycles_delta = 100;
+	hook_rpc = crpc;
+	mock_schedule_hook = ready_hook;
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECV_RESPONSE|HOMA_RECV_REQUEST, 0);
+	EXPECT_EQ(crpc, rpc);
+	homa_compile_metrics(&metrics);
+	EXPECT_NE(0, metrics.poll_cycles);
+	homa_rpc_unlock(rpc);
+}
+TEST_F(homa_incoming, homa_wait_for_message__no_poll_unless_socket_opted_in)
+{
+	struct homa_metrics metrics;
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 20000, 1600);
+	EXPECT_NE(NULL, crpc);
+	unit_log_clear();
+
+	self->homa.poll_cycles = 500;
+	mock_cycles = 10000;
+	mock_cycles_delta = 100;
+	hook_rpc = crpc;
+	mock_schedule_hook = ready_hook;
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECV_RESPONSE|HOMA_RECV_REQUEST, 0);
+	EXPECT_EQ(crpc, rpc);
+	homa_compile_metrics(&metrics);
+	EXPECT_EQ(0, metrics.poll_cycles);
+	homa_rpc_unlock(rpc);
+}
 TEST_F(homa_incoming, homa_wait_for_message__request_arrives_while_sleeping)
 {
 	struct homa_rpc *rpc;
@@ -1472,6 +2305,45 @@ TEST_F(homa_incoming, homa_wait_for_message__rpc_deleted_after_matching)
 			unit_log_get());
 	homa_rpc_unlock(rpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__release_handoff_reference)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 20000, 1600);
+	EXPECT_NE(NULL, crpc);
+	unit_log_clear();
+
+	hook_rpc = crpc;
+	mock_schedule_hook = ready_hook;
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECV_RESPONSE|HOMA_RECV_REQUEST, 0);
+	EXPECT_EQ(crpc, rpc);
+	EXPECT_EQ(0, atomic_read(&self->hsk.reap_disable));
+	homa_rpc_unlock(rpc);
+}
+TEST_F(homa_incoming, homa_wait_for_message__release_unclaimed_handoff)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 20000, 1600);
+	EXPECT_NE(NULL, crpc);
+	unit_log_clear();
+
+	/* An RPC is handed to this thread just as the socket shuts down;
+	 * the wait must return ESHUTDOWN and release the reap_disable
+	 * reference that came with the handoff.
+	 */
+	hook_rpc = crpc;
+	hook_hsk = &self->hsk;
+	mock_schedule_hook = ready_shutdown_hook;
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECV_RESPONSE|HOMA_RECV_REQUEST, 0);
+	EXPECT_EQ(ESHUTDOWN, -PTR_ERR(rpc));
+	EXPECT_EQ(0, atomic_read(&self->hsk.reap_disable));
+	self->hsk.shutdown = false;
+}
 
 TEST_F(homa_incoming, homa_rpc_ready__interest_on_rpc)
 {
@@ -1489,11 +2361,11 @@ TEST_F(homa_incoming, homa_rpc_ready__interest_on_rpc)
 	interest.response_links.next = LIST_POISON1;
 	crpc->interest = &interest;
 	homa_rpc_ready(crpc);
-	crpc->interest = NULL;
 	EXPECT_EQ(crpc->id, atomic_long_read(&interest.id));
-	EXPECT_EQ(NULL, interest.reg_rpc);
+	EXPECT_EQ(crpc, interest.rpc);
 	EXPECT_EQ(NULL, crpc->interest);
 	EXPECT_STREQ("wake_up_process", unit_log_get());
+	atomic_dec(&self->hsk.reap_disable);
 }
 TEST_F(homa_incoming, homa_rpc_ready__response_interests)
 {
@@ -1512,8 +2384,10 @@ TEST_F(homa_incoming, homa_rpc_ready__response_interests)
 	list_add_tail(&interest.response_links, &self->hsk.response_interests);
 	homa_rpc_ready(crpc);
 	EXPECT_EQ(crpc->id, atomic_long_read(&interest.id));
+	EXPECT_EQ(crpc, interest.rpc);
 	EXPECT_EQ(0, unit_list_length(&self->hsk.response_interests));
 	EXPECT_STREQ("wake_up_process", unit_log_get());
+	atomic_dec(&self->hsk.reap_disable);
 }
 TEST_F(homa_incoming, homa_rpc_ready__queue_on_ready_responses)
 {
@@ -1525,7 +2399,20 @@ TEST_F(homa_incoming, homa_rpc_ready__queue_on_ready_responses)
 	
 	homa_rpc_ready(crpc);
 	EXPECT_STREQ("sk->sk_data_ready invoked", unit_log_get());
-	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[1].ready_responses));
+}
+TEST_F(homa_incoming, homa_rpc_ready__signal_eventfd)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 20000, 1600);
+	EXPECT_NE(NULL, crpc);
+	unit_log_clear();
+
+	self->hsk.event_ctx = (struct eventfd_ctx *) 0x1000;
+	homa_rpc_ready(crpc);
+	EXPECT_EQ(1, mock_eventfd_signals);
+	self->hsk.event_ctx = NULL;
 }
 TEST_F(homa_incoming, homa_rpc_ready__request_interests)
 {
@@ -1543,8 +2430,10 @@ TEST_F(homa_incoming, homa_rpc_ready__request_interests)
 	list_add_tail(&interest.request_links, &self->hsk.request_interests);
 	homa_rpc_ready(srpc);
 	EXPECT_EQ(srpc->id, atomic_long_read(&interest.id));
+	EXPECT_EQ(srpc, interest.rpc);
 	EXPECT_EQ(0, unit_list_length(&self->hsk.request_interests));
 	EXPECT_STREQ("wake_up_process", unit_log_get());
+	atomic_dec(&self->hsk.reap_disable);
 }
 TEST_F(homa_incoming, homa_rpc_ready__queue_on_ready_requests)
 {
@@ -1556,5 +2445,43 @@ TEST_F(homa_incoming, homa_rpc_ready__queue_on_ready_requests)
 	
 	homa_rpc_ready(srpc);
 	EXPECT_STREQ("sk->sk_data_ready invoked", unit_log_get());
-	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[1].ready_requests));
+}
+TEST_F(homa_incoming, homa_rpc_ready__queue_on_current_cores_shard)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 20000, 1600);
+	EXPECT_NE(NULL, crpc);
+	unit_log_clear();
+
+	cpu_number = 3;
+	homa_rpc_ready(crpc);
+	cpu_number = 1;
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_shards[1].ready_responses));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[3].ready_responses));
+	EXPECT_EQ(3, crpc->ready_shard);
+}
+TEST_F(homa_incoming, homa_rpc_ready__skip_stale_interest)
+{
+	struct homa_interest interest;
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->rpcid, 20000, 100);
+	EXPECT_NE(NULL, srpc);
+	unit_log_clear();
+
+	/* The interest has already been given an RPC, but its owner
+	 * hasn't yet gotten around to unregistering it.
+	 */
+	atomic_long_set(&interest.id, 444);
+	interest.reg_rpc = NULL;
+	interest.request_links.next = LIST_POISON1;
+	interest.response_links.next = LIST_POISON1;
+	list_add_tail(&interest.request_links, &self->hsk.request_interests);
+	homa_rpc_ready(srpc);
+	EXPECT_EQ(444, atomic_long_read(&interest.id));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.request_interests));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[1].ready_requests));
+	EXPECT_STREQ("sk->sk_data_ready invoked", unit_log_get());
 }
\ No newline at end of file
@@ -172,3 +172,30 @@ TEST_F(homa_offload, homa_gro_receive__max_gro_skbs)
 	same_flow = NAPI_GRO_CB(skb3)->same_flow;
 	EXPECT_EQ(1, same_flow);
 }
+
+TEST_F(homa_offload, homa_gro_complete__same_hash_for_all_packets_of_rpc)
+{
+	struct sk_buff *skb, *skb2;
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(self->ip, &self->header.common, 1400, 0);
+	self->header.seg.offset = htonl(7400);
+	skb2 = mock_skb_new(self->ip, &self->header.common, 1400, 0);
+	homa_gro_complete(skb, 0);
+	homa_gro_complete(skb2, 0);
+	EXPECT_EQ(skb->hash, skb2->hash);
+	EXPECT_EQ(1, skb->sw_hash);
+	kfree_skb(skb);
+	kfree_skb(skb2);
+}
+TEST_F(homa_offload, homa_gro_complete__different_hash_for_different_rpcs)
+{
+	struct sk_buff *skb, *skb2;
+	skb = mock_skb_new(self->ip, &self->header.common, 1400, 0);
+	self->header.common.id = 1002;
+	skb2 = mock_skb_new(self->ip, &self->header.common, 1400, 0);
+	homa_gro_complete(skb, 0);
+	homa_gro_complete(skb2, 0);
+	EXPECT_NE(skb->hash, skb2->hash);
+	kfree_skb(skb);
+	kfree_skb(skb2);
+}
@@ -40,7 +40,7 @@ FIXTURE_SETUP(homa_outgoing)
 	self->rpcid = 12345;
 	homa_init(&self->homa);
 	mock_cycles = 10000;
-	atomic64_set(&self->homa.link_idle_time, 10000);
+	atomic64_set(&self->homa.links[0].link_idle_time[1], 10000);
 	self->homa.cycles_per_kbyte = 1000;
 	self->homa.flags |= HOMA_FLAG_DONT_THROTTLE;
 	mock_sock_init(&self->hsk, &self->homa, self->client_port,
@@ -58,6 +58,64 @@ FIXTURE_TEARDOWN(homa_outgoing)
 	unit_teardown();
 }
 
+TEST_F(homa_outgoing, homa_data_skb_alloc__reuse_recycled_skb)
+{
+	struct homa_metrics metrics;
+	struct sk_buff *skb, *skb2;
+
+	skb = homa_data_skb_alloc(2000);
+	ASSERT_NE(NULL, skb);
+	skb_put(skb, 100);
+	skb_shinfo(skb)->gso_size = 1408;
+	EXPECT_EQ(1, homa_data_skb_recycle(skb));
+	skb2 = homa_data_skb_alloc(2000);
+	EXPECT_EQ(skb, skb2);
+	EXPECT_EQ(0, skb2->len);
+	EXPECT_EQ(0, skb_shinfo(skb2)->gso_size);
+	homa_compile_metrics(&metrics);
+	EXPECT_EQ(1, metrics.data_skbs_reused);
+	kfree_skb(skb2);
+}
+TEST_F(homa_outgoing, homa_data_skb_recycle__size_mismatch)
+{
+	struct sk_buff *skb, *skb2;
+
+	skb = homa_data_skb_alloc(2000);
+	ASSERT_NE(NULL, skb);
+	EXPECT_EQ(1, homa_data_skb_recycle(skb));
+
+	/* The pool has adopted the first buffer's size, so a buffer of
+	 * a different size can't be cached.
+	 */
+	skb2 = homa_data_skb_alloc(3000);
+	ASSERT_NE(NULL, skb2);
+	EXPECT_NE(skb, skb2);
+	EXPECT_EQ(0, homa_data_skb_recycle(skb2));
+	kfree_skb(skb2);
+}
+TEST_F(homa_outgoing, homa_fill_packets__reuse_recycled_skbs)
+{
+	struct homa_metrics metrics;
+	struct homa_rpc *crpc;
+	int count;
+
+	crpc = homa_rpc_new_client(&self->hsk, &self->server_addr,
+			(char *) 1000, 4000);
+	ASSERT_FALSE(IS_ERR(crpc));
+	homa_rpc_unlock(crpc);
+	homa_rpc_free(crpc);
+	EXPECT_EQ(1, homa_rpc_reap(&self->hsk));
+	count = mock_skb_count();
+
+	/* The second message's buffers all come from the pool. */
+	crpc = homa_rpc_new_client(&self->hsk, &self->server_addr,
+			(char *) 1000, 4000);
+	ASSERT_FALSE(IS_ERR(crpc));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(count, mock_skb_count());
+	homa_compile_metrics(&metrics);
+	EXPECT_EQ(3, metrics.data_skbs_reused);
+}
 TEST_F(homa_outgoing, homa_fill_packets__message_too_long)
 {
 	struct sk_buff *skb = homa_fill_packets(&self->homa, self->peer,
@@ -223,6 +281,46 @@ TEST_F(homa_outgoing, homa_fill_packets__set_incoming)
 	h = (struct data_header *) skb_transport_header(skb);
 	EXPECT_EQ(10000, ntohl(h->incoming));
 }
+TEST_F(homa_outgoing, homa_fill_packets__peer_rtt_estimate)
+{
+	struct homa_rpc *crpc, *crpc2;
+	mock_net_device.gso_max_size = 6000;
+	self->homa.max_gso_size = 4000;
+	self->homa.rtt_bytes = 5000;
+	self->peer->rtt_bytes = 8000;
+	crpc = homa_rpc_new_client(&self->hsk, &self->server_addr,
+			(void *) 1000, 10000);
+	EXPECT_NE(NULL, crpc);
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(8400, crpc->msgout.unscheduled);
+	EXPECT_EQ(8400, crpc->msgout.granted);
+
+	/* With adaptation disabled, the global value is used instead. */
+	self->homa.peer_rtt_adapt = 0;
+	crpc2 = homa_rpc_new_client(&self->hsk, &self->server_addr,
+			(void *) 1000, 10000);
+	EXPECT_NE(NULL, crpc2);
+	homa_rpc_unlock(crpc2);
+	EXPECT_EQ(5600, crpc2->msgout.unscheduled);
+}
+TEST_F(homa_outgoing, homa_fill_packets__jumbo_mtu)
+{
+	mock_mtu = 9000;
+	mock_net_device.gso_max_size = 9000;
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, (void *) 1000, 30000);
+	EXPECT_NE(NULL, crpc);
+	homa_rpc_unlock(crpc);
+	unit_log_clear();
+	unit_log_message_out_packets(&crpc->msgout, 0);
+	EXPECT_STREQ("DATA P0 8932@0; "
+			"DATA P0 8932@8932; "
+			"DATA P0 8932@17864; "
+			"DATA P0 3204@26796",
+			unit_log_get());
+	EXPECT_EQ(17864, crpc->msgout.unscheduled);
+	EXPECT_EQ(17864, crpc->msgout.granted);
+}
 TEST_F(homa_outgoing, homa_fill_packets__expand_last_segment)
 {
 	mock_net_device.gso_max_size = 5000;
@@ -236,6 +334,57 @@ TEST_F(homa_outgoing, homa_fill_packets__expand_last_segment)
 			- sizeof32(struct data_segment));
 	homa_free_skbs(skb);
 }
+TEST_F(homa_outgoing, homa_fill_packets__zero_copy)
+{
+	mock_net_device.gso_max_size = 5000;
+	self->homa.zerocopy_min_bytes = 1000;
+	struct sk_buff *skb = homa_fill_packets(&self->homa, self->peer,
+			(char *) 0x100000, 4000);
+	EXPECT_NE(NULL, skb);
+	EXPECT_STREQ("", unit_log_get());
+	unit_log_clear();
+	unit_log_filled_skbs(skb, 0);
+	EXPECT_STREQ("DATA P0 1400@0; DATA P0 1400@1400; DATA P0 1200@2800",
+			unit_log_get());
+	EXPECT_EQ(1400, skb->data_len);
+	EXPECT_EQ(3, mock_page_count());
+	homa_free_skbs(skb);
+	EXPECT_EQ(0, mock_page_count());
+}
+TEST_F(homa_outgoing, homa_fill_packets__zero_copy_below_threshold)
+{
+	mock_net_device.gso_max_size = 5000;
+	self->homa.zerocopy_min_bytes = 5000;
+	struct sk_buff *skb = homa_fill_packets(&self->homa, self->peer,
+			(char *) 0x100000, 4000);
+	EXPECT_NE(NULL, skb);
+	EXPECT_EQ(0, skb->data_len);
+	EXPECT_EQ(0, mock_page_count());
+	homa_free_skbs(skb);
+}
+TEST_F(homa_outgoing, homa_fill_packets__zero_copy_short_final_segment)
+{
+	mock_net_device.gso_max_size = 5000;
+	self->homa.zerocopy_min_bytes = 1000;
+	struct sk_buff *skb = homa_fill_packets(&self->homa, self->peer,
+			(char *) 0x100000, 2810);
+	EXPECT_NE(NULL, skb);
+	EXPECT_STREQ("_copy_from_user 10 bytes at 1051376", unit_log_get());
+	EXPECT_EQ(2, mock_page_count());
+	homa_free_skbs(skb);
+	EXPECT_EQ(0, mock_page_count());
+}
+TEST_F(homa_outgoing, homa_fill_packets__cant_pin_user_pages)
+{
+	mock_net_device.gso_max_size = 5000;
+	self->homa.zerocopy_min_bytes = 1000;
+	mock_get_user_pages_errors = 2;
+	struct sk_buff *skb = homa_fill_packets(&self->homa, self->peer,
+			(char *) 0x100000, 4000);
+	EXPECT_TRUE(IS_ERR(skb));
+	EXPECT_EQ(EFAULT, -PTR_ERR(skb));
+	EXPECT_EQ(0, mock_page_count());
+}
 
 TEST_F(homa_outgoing, homa_message_out_init__basics)
 {
@@ -294,6 +443,23 @@ TEST_F(homa_outgoing, homa_message_out_reset__cant_allocate_skb)
 	unit_log_message_out_packets(&crpc->msgout, 0);
 	EXPECT_STREQ("DATA P0 1400@0; DATA P0 200@2800", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_message_out_reset__zero_copy)
+{
+	static char buffer[5000];
+	self->homa.zerocopy_min_bytes = 1000;
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, buffer, 3000);
+	EXPECT_NE(NULL, crpc);
+	homa_rpc_unlock(crpc);
+	EXPECT_NE(0, crpc->msgout.packets->data_len);
+	EXPECT_EQ(0, homa_message_out_reset(crpc));
+	EXPECT_EQ(0, crpc->msgout.packets->data_len);
+	EXPECT_EQ(0, mock_page_count());
+	unit_log_clear();
+	unit_log_message_out_packets(&crpc->msgout, 0);
+	EXPECT_STREQ("DATA P0 1400@0; DATA P0 1400@1400; DATA P0 200@2800",
+			unit_log_get());
+}
 
 TEST_F(homa_outgoing, homa_xmit_control__server_request)
 {
@@ -306,10 +472,12 @@ TEST_F(homa_outgoing, homa_xmit_control__server_request)
 	
 	h.offset = htonl(12345);
 	h.priority = 4;
+	h.cutoff_version = 0;
+	h.ack.id = 0;
 	mock_xmit_log_verbose = 1;
 	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), srpc));
 	EXPECT_STREQ("xmit GRANT from 0.0.0.0:99, dport 40000, id 1111, "
-			"prio 8, offset 12345, grant_prio 4",
+			"prio 8, offset 12345, grant_prio 4, cutoff_version 0",
 			unit_log_get());
 }
 TEST_F(homa_outgoing, homa_xmit_control__client_response)
@@ -324,10 +492,12 @@ TEST_F(homa_outgoing, homa_xmit_control__client_response)
 	
 	h.offset = htonl(12345);
 	h.priority = 4;
+	h.cutoff_version = 0;
+	h.ack.id = 0;
 	mock_xmit_log_verbose = 1;
 	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), crpc));
 	EXPECT_STREQ("xmit GRANT from 0.0.0.0:40000, dport 99, id 1111, "
-			"prio 8, offset 12345, grant_prio 4",
+			"prio 8, offset 12345, grant_prio 4, cutoff_version 0",
 			unit_log_get());
 }
 
@@ -349,6 +519,30 @@ TEST_F(homa_outgoing, __homa_xmit_control__cant_alloc_skb)
 			&self->hsk));
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_outgoing, __homa_xmit_control__recycle_skbs)
+{
+	struct homa_metrics metrics;
+	struct homa_rpc *srpc;
+	struct grant_header h;
+	int count;
+
+	srpc = unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+		self->server_ip, self->client_port, 1111, 10000, 10000);
+	EXPECT_NE(NULL, srpc);
+
+	h.offset = htonl(12345);
+	h.priority = 4;
+	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), srpc));
+
+	/* The second packet reuses the first packet's sk_buff, which was
+	 * left in the per-core pool.
+	 */
+	count = mock_skb_count();
+	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), srpc));
+	EXPECT_EQ(count, mock_skb_count());
+	homa_compile_metrics(&metrics);
+	EXPECT_EQ(1, metrics.control_skbs_reused);
+}
 TEST_F(homa_outgoing, __homa_xmit_control__pad_packet)
 {
 	struct homa_rpc *srpc;
@@ -408,7 +602,7 @@ TEST_F(homa_outgoing, homa_xmit_data__below_throttle_min)
 	EXPECT_NE(NULL, crpc);
 	homa_rpc_unlock(crpc);
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 11000);
+	atomic64_set(&self->homa.links[0].link_idle_time[1], 11000);
 	self->homa.max_nic_queue_cycles = 500;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	homa_xmit_data(crpc, false);
@@ -439,7 +633,7 @@ TEST_F(homa_outgoing, homa_xmit_data__throttle)
 	EXPECT_NE(NULL, crpc1);
 	homa_rpc_unlock(crpc1);
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 11000);
+	atomic64_set(&self->homa.links[0].link_idle_time[1], 11000);
 	self->homa.max_nic_queue_cycles = 3000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	
@@ -463,7 +657,7 @@ TEST_F(homa_outgoing, homa_xmit_data__force)
 	homa_rpc_unlock(crpc2);
 	
 	/* First, get an RPC on the throttled list. */
-	atomic64_set(&self->homa.link_idle_time, 11000);
+	atomic64_set(&self->homa.links[0].link_idle_time[1], 11000);
 	self->homa.max_nic_queue_cycles = 3000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	homa_xmit_data(crpc1, false);
@@ -494,6 +688,20 @@ TEST_F(homa_outgoing, __homa_xmit_data__update_cutoff_version)
 	__homa_xmit_data(crpc->msgout.packets, crpc, 4);
 	EXPECT_SUBSTR("cutoff_version 123", unit_log_get());
 }
+TEST_F(homa_outgoing, __homa_xmit_data__deliver_pending_busy)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, (void *) 100, 1000);
+	EXPECT_NE(NULL, crpc);
+	homa_rpc_unlock(crpc);
+	crpc->msgout.busy_pending = 1;
+	mock_xmit_log_verbose = 1;
+	unit_log_clear();
+	skb_get(crpc->msgout.packets);
+	__homa_xmit_data(crpc->msgout.packets, crpc, 4);
+	EXPECT_SUBSTR(", BUSY", unit_log_get());
+	EXPECT_EQ(0, crpc->msgout.busy_pending);
+}
 TEST_F(homa_outgoing, __homa_xmit_data__fill_dst)
 {
 	int old_refcount;
@@ -562,6 +770,19 @@ TEST_F(homa_outgoing, homa_resend_data)
 	homa_resend_data(crpc, 16000, 17000, 7);
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_resend_data__zero_copy)
+{
+	static char buffer[5000];
+	self->homa.zerocopy_min_bytes = 1000;
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, buffer, 4200);
+	EXPECT_NE(NULL, crpc);
+	homa_rpc_unlock(crpc);
+	EXPECT_NE(0, crpc->msgout.packets->data_len);
+	unit_log_clear();
+	homa_resend_data(crpc, 1400, 2800, 2);
+	EXPECT_STREQ("xmit DATA retrans P3 1400@1400", unit_log_get());
+}
 
 TEST_F(homa_outgoing, homa_outgoing_sysctl_changed)
 {
@@ -593,13 +814,13 @@ TEST_F(homa_outgoing, homa_check_nic_queue__basics)
 	EXPECT_NE(NULL, crpc);
 	homa_rpc_unlock(crpc);
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
+	atomic64_set(&self->homa.links[0].link_idle_time[1], 9000);
 	mock_cycles = 8000;
 	self->homa.max_nic_queue_cycles = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
+	EXPECT_EQ(1, homa_check_nic_queue(&self->homa.links[0], crpc->msgout.packets,
 			false));
-	EXPECT_EQ(9500, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(9500, atomic64_read(&self->homa.links[0].link_idle_time[1]));
 }
 TEST_F(homa_outgoing, homa_check_nic_queue__multiple_packets_gso)
 {
@@ -614,13 +835,13 @@ TEST_F(homa_outgoing, homa_check_nic_queue__multiple_packets_gso)
 	EXPECT_NE(NULL, crpc);
 	homa_rpc_unlock(crpc);
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
+	atomic64_set(&self->homa.links[0].link_idle_time[1], 9000);
 	self->homa.max_nic_queue_cycles = 100000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	mock_cycles = 0;
-	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
+	EXPECT_EQ(1, homa_check_nic_queue(&self->homa.links[0], crpc->msgout.packets,
 			false));
-	EXPECT_EQ(10200, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(10200, atomic64_read(&self->homa.links[0].link_idle_time[1]));
 }
 TEST_F(homa_outgoing, homa_check_nic_queue__queue_full)
 {
@@ -632,13 +853,13 @@ TEST_F(homa_outgoing, homa_check_nic_queue__queue_full)
 	EXPECT_NE(NULL, crpc);
 	homa_rpc_unlock(crpc);
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
+	atomic64_set(&self->homa.links[0].link_idle_time[1], 9000);
 	mock_cycles = 7999;
 	self->homa.max_nic_queue_cycles = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(0, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
+	EXPECT_EQ(0, homa_check_nic_queue(&self->homa.links[0], crpc->msgout.packets,
 			false));
-	EXPECT_EQ(9000, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(9000, atomic64_read(&self->homa.links[0].link_idle_time[1]));
 }
 TEST_F(homa_outgoing, homa_check_nic_queue__queue_full_but_force)
 {
@@ -650,13 +871,13 @@ TEST_F(homa_outgoing, homa_check_nic_queue__queue_full_but_force)
 	EXPECT_NE(NULL, crpc);
 	homa_rpc_unlock(crpc);
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
+	atomic64_set(&self->homa.links[0].link_idle_time[1], 9000);
 	mock_cycles = 7999;
 	self->homa.max_nic_queue_cycles = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
+	EXPECT_EQ(1, homa_check_nic_queue(&self->homa.links[0], crpc->msgout.packets,
 			true));
-	EXPECT_EQ(9500, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(9500, atomic64_read(&self->homa.links[0].link_idle_time[1]));
 }
 TEST_F(homa_outgoing, homa_check_nic_queue__queue_empty)
 {
@@ -668,13 +889,37 @@ TEST_F(homa_outgoing, homa_check_nic_queue__queue_empty)
 	EXPECT_NE(NULL, crpc);
 	homa_rpc_unlock(crpc);
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
+	atomic64_set(&self->homa.links[0].link_idle_time[1], 9000);
 	mock_cycles = 10000;
 	self->homa.max_nic_queue_cycles = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
+	EXPECT_EQ(1, homa_check_nic_queue(&self->homa.links[0], crpc->msgout.packets,
 			true));
-	EXPECT_EQ(10500, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(10500, atomic64_read(&self->homa.links[0].link_idle_time[1]));
+}
+TEST_F(homa_outgoing, homa_check_nic_queue__independent_queues)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, (void *) 1000,
+		        500 - sizeof(struct data_header)
+			- HOMA_IPV4_HEADER_LENGTH - HOMA_VLAN_HEADER
+			- HOMA_ETH_OVERHEAD);
+	EXPECT_NE(NULL, crpc);
+	homa_rpc_unlock(crpc);
+	unit_log_clear();
+	atomic64_set(&self->homa.links[0].link_idle_time[1], 9000);
+	atomic64_set(&self->homa.links[0].link_idle_time[2], 9000);
+	mock_cycles = 7999;
+	self->homa.max_nic_queue_cycles = 1000;
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	EXPECT_EQ(0, homa_check_nic_queue(&self->homa.links[0], crpc->msgout.packets,
+			false));
+	cpu_number = 2;
+	atomic64_set(&self->homa.links[0].link_idle_time[2], 7000);
+	EXPECT_EQ(1, homa_check_nic_queue(&self->homa.links[0], crpc->msgout.packets,
+			false));
+	EXPECT_EQ(9000, atomic64_read(&self->homa.links[0].link_idle_time[1]));
+	EXPECT_EQ(8499, atomic64_read(&self->homa.links[0].link_idle_time[2]));
 }
 
 /* Don't know how to unit test homa_pacer_main... */
@@ -699,7 +944,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__basics)
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.links[0]);
 	EXPECT_STREQ("xmit DATA P7 1400@0; xmit DATA P7 1400@1400",
 		unit_log_get());
 	unit_log_clear();
@@ -717,9 +962,9 @@ TEST_F(homa_outgoing, homa_pacer_xmit__pacer_busy)
 	homa_add_to_throttled(crpc1);
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	atomic_set(&self->homa.pacer_active, 1);
+	atomic_set(&self->homa.links[0].pacer_active, 1);
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.links[0]);
 	EXPECT_STREQ("", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
@@ -730,7 +975,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__queue_empty)
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.links[0]);
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("", unit_log_get());
 }
@@ -743,10 +988,10 @@ TEST_F(homa_outgoing, homa_pacer_xmit__nic_queue_fills)
 	homa_add_to_throttled(crpc1);
 	self->homa.max_nic_queue_cycles = 2001;
 	mock_cycles = 10000;
-	atomic64_set(&self->homa.link_idle_time, 12000);
+	atomic64_set(&self->homa.links[0].link_idle_time[1], 12000);
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.links[0]);
 	EXPECT_STREQ("xmit DATA P7 1400@0", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
@@ -763,12 +1008,12 @@ TEST_F(homa_outgoing, homa_pacer_xmit__rpc_locked)
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
 	mock_trylock_errors = -1;
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.links[0]);
 	EXPECT_STREQ("", unit_log_get());
 	EXPECT_EQ(1, unit_get_metrics()->pacer_skipped_rpcs);
 	unit_log_clear();
 	mock_trylock_errors = 0;
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.links[0]);
 	EXPECT_STREQ("xmit DATA P7 1400@0; xmit DATA P7 1400@1400",
 		unit_log_get());
 }
@@ -787,7 +1032,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__remove_from_queue)
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.links[0]);
 	EXPECT_STREQ("xmit DATA P7 1000@0; xmit DATA P7 1400@0",
 			unit_log_get());
 	unit_log_clear();
@@ -806,7 +1051,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__delete_rpc)
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.links[0]);
 	EXPECT_STREQ("xmit DATA P7 1000@0; homa_remove_from_grantable invoked",
 			unit_log_get());
 	unit_log_clear();
@@ -865,4 +1110,46 @@ TEST_F(homa_outgoing, homa_add_to_throttled__basics)
 		"request 5, next_offset 0; "
 		"request 4, next_offset 0; "
 		"request 3, next_offset 0", unit_log_get());
+}
+TEST_F(homa_outgoing, homa_add_to_throttled__stage_without_throttle_lock)
+{
+	struct homa_rpc *crpc1 = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, (void *) 1000, 10000);
+	EXPECT_NE(NULL, crpc1);
+	homa_rpc_unlock(crpc1);
+	homa_add_to_throttled(crpc1);
+	EXPECT_EQ(0, unit_list_length(&self->homa.links[0].throttled_rpcs));
+	EXPECT_FALSE(llist_empty(&self->homa.links[0].throttled_staging));
+
+	/* Staging the RPC a second time is a no-op. */
+	homa_add_to_throttled(crpc1);
+	homa_throttle_lock(&self->homa.links[0]);
+	homa_throttle_drain_staging(&self->homa.links[0]);
+	homa_throttle_unlock(&self->homa.links[0]);
+	EXPECT_EQ(1, unit_list_length(&self->homa.links[0].throttled_rpcs));
+	EXPECT_TRUE(llist_empty(&self->homa.links[0].throttled_staging));
+	EXPECT_EQ(0, atomic_read(&crpc1->stage_pending));
+}
+TEST_F(homa_outgoing, homa_throttle_drain_staging__rpc_already_in_list)
+{
+	struct homa_rpc *crpc1 = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, (void *) 1000, 10000);
+	EXPECT_NE(NULL, crpc1);
+	homa_rpc_unlock(crpc1);
+	homa_add_to_throttled(crpc1);
+	homa_throttle_lock(&self->homa.links[0]);
+	homa_throttle_drain_staging(&self->homa.links[0]);
+	homa_throttle_unlock(&self->homa.links[0]);
+	EXPECT_EQ(1, unit_list_length(&self->homa.links[0].throttled_rpcs));
+
+	/* Simulate the race where an RPC gets staged while it is already
+	 * in the throttled list: the drain must not insert it again.
+	 */
+	atomic_set(&crpc1->stage_pending, 1);
+	llist_add(&crpc1->throttled_stage, &self->homa.links[0].throttled_staging);
+	homa_throttle_lock(&self->homa.links[0]);
+	homa_throttle_drain_staging(&self->homa.links[0]);
+	homa_throttle_unlock(&self->homa.links[0]);
+	EXPECT_EQ(1, unit_list_length(&self->homa.links[0].throttled_rpcs));
+	EXPECT_EQ(0, atomic_read(&crpc1->stage_pending));
 }
\ No newline at end of file
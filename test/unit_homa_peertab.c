@@ -46,6 +46,7 @@ TEST_F(homa_peertab, homa_peer_find__basics)
 	peer = homa_peer_find(&self->peertab, 11111, &self->hsk.inet);
 	ASSERT_NE(NULL, peer);
 	EXPECT_EQ(11111, peer->addr);
+	EXPECT_EQ(0, peer->rtt_bytes);
 	EXPECT_EQ(INT_MAX, peer->unsched_cutoffs[HOMA_MAX_PRIORITIES-2]);
 	EXPECT_EQ(0, peer->cutoff_version);
 	
@@ -69,16 +70,75 @@ static void peer_lock_hook(void) {
 		&test_data->hsk.inet);
 }
 
-TEST_F(homa_peertab, homa_peertab_init__vmalloc_failed)
+TEST_F(homa_peertab, homa_peertab_init__kmalloc_failed)
 {
 	struct homa_peertab table;
-	mock_vmalloc_errors = 1;
+	mock_kmalloc_errors = 1;
 	EXPECT_EQ(ENOMEM, -homa_peertab_init(&table));
-	
+
 	/* Make sure destroy is safe after failed init. */
 	homa_peertab_destroy(&table);
 }
 
+TEST_F(homa_peertab, homa_peertab_grow)
+{
+	struct homa_peertab_buckets *table;
+	struct homa_peer *peers[6];
+	int i;
+
+	table = rcu_dereference(self->peertab.table);
+	EXPECT_EQ(HOMA_PEERTAB_MIN_BITS, table->bucket_bits);
+	for (i = 0; i < 6; i++) {
+		peers[i] = homa_peer_find(&self->peertab, i+1,
+				&self->hsk.inet);
+		ASSERT_FALSE(IS_ERR(peers[i]));
+	}
+	table = rcu_dereference(self->peertab.table);
+	EXPECT_EQ(HOMA_PEERTAB_MIN_BITS+1, table->bucket_bits);
+
+	/* Make sure all of the old peers can still be found. */
+	for (i = 0; i < 6; i++) {
+		EXPECT_EQ(peers[i], homa_peer_find(&self->peertab, i+1,
+				&self->hsk.inet));
+	}
+}
+
+TEST_F(homa_peertab, homa_peertab_grow__kmalloc_error)
+{
+	struct homa_peertab_buckets *table;
+	struct homa_peer *peer;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		homa_peer_find(&self->peertab, i+1, &self->hsk.inet);
+	}
+
+	/* First kmalloc is the new peer; second is the larger table. */
+	mock_kmalloc_errors = 2;
+	peer = homa_peer_find(&self->peertab, 5, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	table = rcu_dereference(self->peertab.table);
+	EXPECT_EQ(HOMA_PEERTAB_MIN_BITS, table->bucket_bits);
+	EXPECT_EQ(peer, homa_peer_find(&self->peertab, 5, &self->hsk.inet));
+}
+
+TEST_F(homa_peertab, homa_peer_find__assigns_links_round_robin)
+{
+	struct homa_peer *peers[3];
+	int i;
+
+	self->homa.num_links = 2;
+	for (i = 0; i < 3; i++) {
+		peers[i] = homa_peer_find(&self->peertab, i+1,
+				&self->hsk.inet);
+		ASSERT_FALSE(IS_ERR(peers[i]));
+		EXPECT_EQ(i, peers[i]->link_idx);
+	}
+	EXPECT_EQ(&self->homa.links[0], homa_peer_link(&self->homa, peers[0]));
+	EXPECT_EQ(&self->homa.links[1], homa_peer_link(&self->homa, peers[1]));
+	EXPECT_EQ(&self->homa.links[0], homa_peer_link(&self->homa, peers[2]));
+}
+
 TEST_F(homa_peertab, homa_peer_find__conflicting_creates)
 {
 	struct homa_peer *peer;
@@ -116,6 +176,126 @@ TEST_F(homa_peertab, homa_peer_find__route_error)
 	EXPECT_EQ(1, metrics.peer_route_errors);
 }
 
+TEST_F(homa_peertab, homa_peer_lookup)
+{
+	struct homa_peer *peer;
+
+	EXPECT_EQ(NULL, homa_peer_lookup(&self->peertab, 11111));
+	peer = homa_peer_find(&self->peertab, 11111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	EXPECT_EQ(peer, homa_peer_lookup(&self->peertab, 11111));
+	EXPECT_EQ(NULL, homa_peer_lookup(&self->peertab, 22222));
+}
+
+TEST_F(homa_peertab, homa_dst_check__replace_stale_route)
+{
+	struct homa_peer *peer;
+	struct dst_entry *old_dst;
+
+	peer = homa_peer_find(&self->peertab, 11111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	old_dst = peer->dst;
+	peer->dst_check_jiffies = 0;
+	mock_dst_invalid = 1;
+	homa_dst_check(&self->peertab, peer, &self->hsk.inet);
+	EXPECT_NE(old_dst, peer->dst);
+	EXPECT_EQ(jiffies, peer->dst_check_jiffies);
+
+	/* The old route's reference is parked, not dropped: a concurrent
+	 * sender could still be acquiring its own reference to it.
+	 */
+	EXPECT_EQ(1, unit_list_length(&self->peertab.dead_dsts));
+}
+
+TEST_F(homa_peertab, homa_dst_check__release_old_route_after_delay)
+{
+	struct homa_peer *peer;
+	struct dst_entry *old_dst;
+
+	peer = homa_peer_find(&self->peertab, 11111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	old_dst = peer->dst;
+	peer->dst_check_jiffies = 0;
+	mock_dst_invalid = 1;
+	homa_dst_check(&self->peertab, peer, &self->hsk.inet);
+	EXPECT_NE(old_dst, peer->dst);
+	EXPECT_EQ(1, unit_list_length(&self->peertab.dead_dsts));
+
+	/* Not yet due: nothing is released. */
+	homa_peertab_gc_dsts(&self->peertab, jiffies);
+	EXPECT_EQ(1, unit_list_length(&self->peertab.dead_dsts));
+
+	/* Once enough time has passed, the reference is released. */
+	homa_peertab_gc_dsts(&self->peertab, jiffies + HZ/10);
+	EXPECT_EQ(0, unit_list_length(&self->peertab.dead_dsts));
+}
+
+TEST_F(homa_peertab, homa_dst_check__cant_park_old_route)
+{
+	struct homa_peer *peer;
+	struct dst_entry *old_dst;
+
+	peer = homa_peer_find(&self->peertab, 11111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	old_dst = peer->dst;
+	peer->dst_check_jiffies = 0;
+	mock_dst_invalid = 1;
+	mock_kmalloc_errors = 1;
+
+	/* If there's no memory to park the old route, keep using it
+	 * (it will be checked again in a second).
+	 */
+	homa_dst_check(&self->peertab, peer, &self->hsk.inet);
+	EXPECT_EQ(old_dst, peer->dst);
+	EXPECT_EQ(0, unit_list_length(&self->peertab.dead_dsts));
+}
+
+TEST_F(homa_peertab, homa_dst_check__checked_recently)
+{
+	struct homa_peer *peer;
+	struct dst_entry *old_dst;
+
+	peer = homa_peer_find(&self->peertab, 11111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	old_dst = peer->dst;
+	mock_dst_invalid = 1;
+	homa_dst_check(&self->peertab, peer, &self->hsk.inet);
+	EXPECT_EQ(old_dst, peer->dst);
+}
+
+TEST_F(homa_peertab, homa_dst_check__route_still_valid)
+{
+	struct homa_peer *peer;
+	struct dst_entry *old_dst;
+
+	peer = homa_peer_find(&self->peertab, 11111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	old_dst = peer->dst;
+	peer->dst_check_jiffies = 0;
+	homa_dst_check(&self->peertab, peer, &self->hsk.inet);
+	EXPECT_EQ(old_dst, peer->dst);
+	EXPECT_EQ(jiffies, peer->dst_check_jiffies);
+}
+
+TEST_F(homa_peertab, homa_dst_check__route_error)
+{
+	struct homa_peer *peer;
+	struct dst_entry *old_dst;
+	struct homa_metrics metrics;
+
+	peer = homa_peer_find(&self->peertab, 11111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	old_dst = peer->dst;
+	peer->dst_check_jiffies = 0;
+	mock_dst_invalid = 1;
+	mock_route_errors = 1;
+	homa_dst_check(&self->peertab, peer, &self->hsk.inet);
+	EXPECT_EQ(old_dst, peer->dst);
+
+	homa_compile_metrics(&metrics);
+	EXPECT_EQ(1, metrics.peer_route_errors);
+}
+
 TEST_F(homa_peertab, homa_unsched_priority)
 {
 	struct homa_peer peer;
@@ -124,4 +304,120 @@ TEST_F(homa_peertab, homa_unsched_priority)
 	EXPECT_EQ(5, homa_unsched_priority(&self->homa, &peer, 10));
 	EXPECT_EQ(4, homa_unsched_priority(&self->homa, &peer, 200));
 	EXPECT_EQ(3, homa_unsched_priority(&self->homa, &peer, 201));
+}
+
+TEST_F(homa_peertab, homa_peer_update_rtt__basics)
+{
+	struct homa_peer *peer;
+
+	peer = homa_peer_find(&self->peertab, 11111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	self->homa.cycles_per_kbyte = 1000;
+
+	/* First observation becomes the estimate. */
+	homa_peer_update_rtt(&self->homa, peer, 8000);
+	EXPECT_EQ(8000, peer->rtt_bytes);
+
+	/* Later observations move the estimate 1/8 of the difference. */
+	homa_peer_update_rtt(&self->homa, peer, 16000);
+	EXPECT_EQ(9000, peer->rtt_bytes);
+}
+
+TEST_F(homa_peertab, homa_peer_update_rtt__clamp_observations)
+{
+	struct homa_peer *peer;
+
+	peer = homa_peer_find(&self->peertab, 11111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	self->homa.cycles_per_kbyte = 1000;
+
+	/* A grant delayed by receiver scheduling mustn't blow up the
+	 * estimate: observations cap at 2x the global value.
+	 */
+	homa_peer_update_rtt(&self->homa, peer, 1000000);
+	EXPECT_EQ(2*self->homa.rtt_bytes, peer->rtt_bytes);
+
+	/* Observations can't drop below 1/4 of the global value either. */
+	peer->rtt_bytes = 0;
+	homa_peer_update_rtt(&self->homa, peer, 100);
+	EXPECT_EQ(self->homa.rtt_bytes/4, peer->rtt_bytes);
+}
+
+TEST_F(homa_peertab, homa_peer_update_rtt__disabled)
+{
+	struct homa_peer *peer;
+
+	peer = homa_peer_find(&self->peertab, 11111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	self->homa.cycles_per_kbyte = 1000;
+	self->homa.peer_rtt_adapt = 0;
+	homa_peer_update_rtt(&self->homa, peer, 8000);
+	EXPECT_EQ(0, peer->rtt_bytes);
+
+	/* No update if cycles_per_kbyte hasn't been computed yet. */
+	self->homa.peer_rtt_adapt = 1;
+	self->homa.cycles_per_kbyte = 0;
+	homa_peer_update_rtt(&self->homa, peer, 8000);
+	EXPECT_EQ(0, peer->rtt_bytes);
+}
+
+TEST_F(homa_peertab, homa_peer_add_ack)
+{
+	struct homa_rpc *rpcs[HOMA_MAX_ACKS+1];
+	struct homa_peer *peer;
+	int i;
+
+	for (i = 0; i <= HOMA_MAX_ACKS; i++) {
+		rpcs[i] = unit_client_rpc(&self->hsk, RPC_READY,
+				unit_get_in_addr("196.168.0.1"),
+				unit_get_in_addr("1.2.3.4"), 99,
+				1000+i, 100, 100);
+		ASSERT_NE(NULL, rpcs[i]);
+	}
+	peer = rpcs[0]->peer;
+	unit_log_clear();
+
+	/* The first HOMA_MAX_ACKS acks are just buffered in the peer. */
+	for (i = 0; i < HOMA_MAX_ACKS; i++)
+		homa_peer_add_ack(rpcs[i]);
+	EXPECT_EQ(HOMA_MAX_ACKS, peer->num_acks);
+	EXPECT_EQ(1000, peer->acks[0].id);
+	EXPECT_EQ(1003, peer->acks[HOMA_MAX_ACKS-1].id);
+	EXPECT_EQ(htons(99), peer->acks[0].server_port);
+	EXPECT_STREQ("", unit_log_get());
+
+	/* The next ack overflows the buffer, which flushes everything
+	 * in an explicit ACK packet.
+	 */
+	homa_peer_add_ack(rpcs[HOMA_MAX_ACKS]);
+	EXPECT_EQ(0, peer->num_acks);
+	EXPECT_STREQ("xmit ACK 4", unit_log_get());
+}
+
+TEST_F(homa_peertab, homa_peer_get_acks)
+{
+	struct homa_peer *peer;
+	struct homa_ack acks[2];
+	int i;
+
+	peer = homa_peer_find(&self->peertab, 11111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	EXPECT_EQ(0, homa_peer_get_acks(peer, 2, acks));
+
+	for (i = 0; i < 3; i++) {
+		peer->acks[i].id = 100+i;
+		peer->acks[i].client_port = htons(40000);
+		peer->acks[i].server_port = htons(99);
+	}
+	peer->num_acks = 3;
+
+	/* Acks are removed from the end of the buffer. */
+	EXPECT_EQ(2, homa_peer_get_acks(peer, 2, acks));
+	EXPECT_EQ(101, acks[0].id);
+	EXPECT_EQ(102, acks[1].id);
+	EXPECT_EQ(1, peer->num_acks);
+
+	EXPECT_EQ(1, homa_peer_get_acks(peer, 2, acks));
+	EXPECT_EQ(100, acks[0].id);
+	EXPECT_EQ(0, peer->num_acks);
 }
\ No newline at end of file
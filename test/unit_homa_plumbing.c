@@ -37,6 +37,12 @@ FIXTURE(homa_plumbing) {
 	struct homa_args_recv_ipv4 recv_args;
 	struct homa_args_reply_ipv4 reply_args;
 	struct homa_args_send_ipv4 send_args;
+	struct iovec iovec;
+	struct msghdr sendmsg_hdr;
+	struct msghdr recvmsg_hdr;
+	char cmsg_buf[CMSG_SPACE(sizeof(struct homa_rpc_cmsg))];
+	struct sockaddr_in sender_addr;
+	int sender_addr_len;
 	char buffer[2000];
 };
 FIXTURE_SETUP(homa_plumbing)
@@ -75,6 +81,27 @@ FIXTURE_SETUP(homa_plumbing)
 	self->send_args.reqlen = 200;
 	self->send_args.dest_addr = self->server_addr;
 	self->send_args.id = 0;
+	self->iovec.iov_base = self->buffer;
+	self->iovec.iov_len = sizeof(self->buffer);
+	memset(&self->sendmsg_hdr, 0, sizeof(self->sendmsg_hdr));
+	self->sendmsg_hdr.msg_name = &self->server_addr;
+	self->sendmsg_hdr.msg_namelen = sizeof(self->server_addr);
+	self->sendmsg_hdr.msg_iter.type = ITER_IOVEC;
+	self->sendmsg_hdr.msg_iter.iov = &self->iovec;
+	self->sendmsg_hdr.msg_iter.nr_segs = 1;
+	memset(&self->recvmsg_hdr, 0, sizeof(self->recvmsg_hdr));
+	self->recvmsg_hdr.msg_name = &self->sender_addr;
+	self->recvmsg_hdr.msg_namelen = sizeof(self->sender_addr);
+	self->recvmsg_hdr.msg_iter.type = ITER_IOVEC;
+	self->recvmsg_hdr.msg_iter.iov = &self->iovec;
+	self->recvmsg_hdr.msg_iter.nr_segs = 1;
+	self->recvmsg_hdr.msg_control = self->cmsg_buf;
+	self->recvmsg_hdr.msg_controllen = sizeof(self->cmsg_buf);
+	memset(self->cmsg_buf, 0, sizeof(self->cmsg_buf));
+	((struct cmsghdr *) self->cmsg_buf)->cmsg_level = IPPROTO_HOMA;
+	((struct cmsghdr *) self->cmsg_buf)->cmsg_type = HOMA_CMSG_RPC;
+	((struct cmsghdr *) self->cmsg_buf)->cmsg_len =
+			CMSG_LEN(sizeof(struct homa_rpc_cmsg));
 	unit_log_clear();
 }
 FIXTURE_TEARDOWN(homa_plumbing)
@@ -150,6 +177,150 @@ TEST_F(homa_plumbing, homa_ioc_recv__server_normal_completion)
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
 }
+TEST_F(homa_plumbing, homa_ioc_recv__partial_delivery)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->server_port,
+			self->rpcid, 100, 20000);
+	EXPECT_NE(NULL, crpc);
+	self->recv_args.flags = HOMA_RECV_NONBLOCKING|HOMA_RECV_RESPONSE
+			|HOMA_RECV_PARTIAL;
+	self->recv_args.id = self->rpcid;
+
+	/* First call: deliver the bytes that have arrived so far. */
+	EXPECT_EQ(1400, homa_ioc_recv((struct sock *) &self->hsk,
+		(unsigned long) &self->recv_args));
+	EXPECT_EQ(1400, crpc->msgin.delivered);
+	EXPECT_EQ(20000, self->recv_args.len);
+	EXPECT_EQ(RPC_INCOMING, crpc->state);
+
+	/* Second call: nothing new has arrived. */
+	self->recv_args.id = self->rpcid;
+	EXPECT_EQ(EAGAIN, -homa_ioc_recv((struct sock *) &self->hsk,
+		(unsigned long) &self->recv_args));
+}
+TEST_F(homa_plumbing, homa_ioc_recv__partial_without_id)
+{
+	self->recv_args.flags = HOMA_RECV_NONBLOCKING|HOMA_RECV_RESPONSE
+			|HOMA_RECV_PARTIAL;
+	EXPECT_EQ(EINVAL, -homa_ioc_recv((struct sock *) &self->hsk,
+		(unsigned long) &self->recv_args));
+}
+TEST_F(homa_plumbing, homa_ioc_recv__region_mode)
+{
+	unit_client_rpc(&self->hsk, RPC_READY, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 100, 200);
+	self->hsk.region_start = self->buffer;
+	self->hsk.region_slots = 2;
+	self->recv_args.buf = NULL;
+	self->recv_args.flags = HOMA_RECV_NONBLOCKING|HOMA_RECV_RESPONSE
+			|HOMA_RECV_REGION;
+	EXPECT_EQ(200, homa_ioc_recv((struct sock *) &self->hsk,
+		(unsigned long) &self->recv_args));
+	EXPECT_EQ(self->buffer, self->recv_args.buf);
+	EXPECT_EQ(1, self->hsk.region_in_use);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_recv__region_not_registered)
+{
+	unit_client_rpc(&self->hsk, RPC_READY, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 100, 200);
+	self->recv_args.flags = HOMA_RECV_NONBLOCKING|HOMA_RECV_RESPONSE
+			|HOMA_RECV_REGION;
+	EXPECT_EQ(EINVAL, -homa_ioc_recv((struct sock *) &self->hsk,
+		(unsigned long) &self->recv_args));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_recv__region_out_of_slots)
+{
+	unit_client_rpc(&self->hsk, RPC_READY, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 100, 200);
+	self->hsk.region_start = self->buffer;
+	self->hsk.region_slots = 1;
+	self->hsk.region_in_use = 1;
+	self->recv_args.flags = HOMA_RECV_NONBLOCKING|HOMA_RECV_RESPONSE
+			|HOMA_RECV_REGION;
+	EXPECT_EQ(ENOSPC, -homa_ioc_recv((struct sock *) &self->hsk,
+		(unsigned long) &self->recv_args));
+	EXPECT_EQ(1, self->hsk.region_in_use);
+}
+
+TEST_F(homa_plumbing, homa_ioc_recvmany__basics)
+{
+	struct homa_args_recv_ipv4 entries[2];
+	struct homa_args_recvmany_ipv4 many = {entries, 2};
+	unit_client_rpc(&self->hsk, RPC_READY, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 100, 200);
+	unit_client_rpc(&self->hsk, RPC_READY, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid+1, 100, 300);
+	entries[0] = self->recv_args;
+	entries[1] = self->recv_args;
+	entries[0].flags = HOMA_RECV_NONBLOCKING|HOMA_RECV_RESPONSE;
+	entries[1].flags = HOMA_RECV_NONBLOCKING|HOMA_RECV_RESPONSE;
+	EXPECT_EQ(2, homa_ioc_recvmany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+	EXPECT_EQ(12345, entries[0].id);
+	EXPECT_EQ(200, entries[0].len);
+	EXPECT_EQ(12346, entries[1].id);
+	EXPECT_EQ(300, entries[1].len);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_recvmany__stop_when_no_message_ready)
+{
+	struct homa_args_recv_ipv4 entries[2];
+	struct homa_args_recvmany_ipv4 many = {entries, 2};
+	unit_client_rpc(&self->hsk, RPC_READY, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 100, 200);
+	entries[0] = self->recv_args;
+	entries[1] = self->recv_args;
+	EXPECT_EQ(1, homa_ioc_recvmany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+	EXPECT_EQ(12345, entries[0].id);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_recvmany__error_on_first_message)
+{
+	struct homa_args_recv_ipv4 entries[1];
+	struct homa_args_recvmany_ipv4 many = {entries, 1};
+	entries[0] = self->recv_args;
+	entries[0].flags = HOMA_RECV_NONBLOCKING|HOMA_RECV_RESPONSE;
+	EXPECT_EQ(EAGAIN, -homa_ioc_recvmany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+}
+TEST_F(homa_plumbing, homa_ioc_recvmany__bad_count)
+{
+	struct homa_args_recv_ipv4 entries[1];
+	struct homa_args_recvmany_ipv4 many = {entries, 0};
+	EXPECT_EQ(EINVAL, -homa_ioc_recvmany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+}
+TEST_F(homa_plumbing, homa_ioc_recvmany__cant_read_user_args)
+{
+	struct homa_args_recv_ipv4 entries[1];
+	struct homa_args_recvmany_ipv4 many = {entries, 1};
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_ioc_recvmany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+}
+
+TEST_F(homa_plumbing, homa_ioc_release__basics)
+{
+	self->hsk.region_start = self->buffer;
+	self->hsk.region_slots = 2;
+	self->hsk.region_in_use = 3;
+	EXPECT_EQ(0, homa_ioc_release((struct sock *) &self->hsk,
+		(unsigned long) (self->buffer + HOMA_MAX_MESSAGE_LENGTH)));
+	EXPECT_EQ(1, self->hsk.region_in_use);
+}
+TEST_F(homa_plumbing, homa_ioc_release__bad_address)
+{
+	self->hsk.region_start = self->buffer;
+	self->hsk.region_slots = 2;
+	self->hsk.region_in_use = 3;
+	EXPECT_EQ(EINVAL, -homa_ioc_release((struct sock *) &self->hsk,
+		(unsigned long) (self->buffer + 100)));
+	EXPECT_EQ(3, self->hsk.region_in_use);
+}
 
 TEST_F(homa_plumbing, homa_ioc_reply__basics)
 {
@@ -230,6 +401,73 @@ TEST_F(homa_plumbing, homa_ioc_reply__dont_free_rpc)
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
 }
 
+TEST_F(homa_plumbing, homa_ioc_replymany__basics)
+{
+	struct homa_args_reply_ipv4 entries[2];
+	struct homa_args_replymany_ipv4 many = {entries, 2};
+	unit_server_rpc(&self->hsk, RPC_IN_SERVICE,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->rpcid, 2000, 100);
+	unit_server_rpc(&self->hsk, RPC_IN_SERVICE,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->rpcid+1, 2000, 100);
+	entries[0] = self->reply_args;
+	entries[1] = self->reply_args;
+	entries[1].id = self->rpcid+1;
+	entries[1].resplen = 200;
+	unit_log_clear();
+	EXPECT_EQ(2, homa_ioc_replymany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+	EXPECT_SUBSTR("xmit DATA P7 1000@0", unit_log_get());
+	EXPECT_SUBSTR("xmit DATA P7 200@0", unit_log_get());
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_replymany__error_after_partial_progress)
+{
+	struct homa_args_reply_ipv4 entries[2];
+	struct homa_args_replymany_ipv4 many = {entries, 2};
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_IN_SERVICE,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->rpcid, 2000, 100);
+	entries[0] = self->reply_args;
+	entries[1] = self->reply_args;
+	entries[1].id = self->rpcid+1;
+	unit_log_clear();
+	EXPECT_EQ(1, homa_ioc_replymany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+	EXPECT_SUBSTR("xmit DATA P7 1000@0", unit_log_get());
+	EXPECT_NE(RPC_IN_SERVICE, srpc->state);
+}
+TEST_F(homa_plumbing, homa_ioc_replymany__error_on_first_response)
+{
+	struct homa_args_reply_ipv4 entries[1];
+	struct homa_args_replymany_ipv4 many = {entries, 1};
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_IN_SERVICE,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->rpcid, 2000, 100);
+	entries[0] = self->reply_args;
+	entries[0].id = self->rpcid+1;
+	unit_log_clear();
+	EXPECT_EQ(EINVAL, -homa_ioc_replymany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
+}
+TEST_F(homa_plumbing, homa_ioc_replymany__bad_count)
+{
+	struct homa_args_reply_ipv4 entries[1];
+	struct homa_args_replymany_ipv4 many = {entries, 0};
+	EXPECT_EQ(EINVAL, -homa_ioc_replymany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+}
+TEST_F(homa_plumbing, homa_ioc_replymany__cant_read_user_args)
+{
+	struct homa_args_reply_ipv4 entries[1];
+	struct homa_args_replymany_ipv4 many = {entries, 1};
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_ioc_replymany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+}
+
 TEST_F(homa_plumbing, homa_ioc_send__cant_read_user_args)
 {
 	mock_copy_data_errors = 1;
@@ -269,6 +507,204 @@ TEST_F(homa_plumbing, homa_ioc_send__successful_send)
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
 }
 
+TEST_F(homa_plumbing, homa_ioc_sendmany__basics)
+{
+	struct homa_args_send_ipv4 entries[2];
+	struct homa_args_sendmany_ipv4 many = {entries, 2};
+	entries[0] = self->send_args;
+	entries[1] = self->send_args;
+	entries[1].reqlen = 500;
+	atomic64_set(&self->hsk.next_outgoing_id, 1234);
+	unit_log_clear();
+	EXPECT_EQ(2, homa_ioc_sendmany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+	EXPECT_SUBSTR("xmit DATA P7 200@0", unit_log_get());
+	EXPECT_SUBSTR("xmit DATA P7 500@0", unit_log_get());
+	EXPECT_EQ(1234L, entries[0].id);
+	EXPECT_EQ(1235L, entries[1].id);
+	EXPECT_EQ(2, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_sendmany__error_after_partial_progress)
+{
+	struct homa_args_send_ipv4 entries[2];
+	struct homa_args_sendmany_ipv4 many = {entries, 2};
+	entries[0] = self->send_args;
+	entries[1] = self->send_args;
+	entries[1].dest_addr.sin_family = AF_INET + 1;
+	unit_log_clear();
+	EXPECT_EQ(1, homa_ioc_sendmany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_sendmany__error_on_first_request)
+{
+	struct homa_args_send_ipv4 entries[1];
+	struct homa_args_sendmany_ipv4 many = {entries, 1};
+	entries[0] = self->send_args;
+	entries[0].dest_addr.sin_family = AF_INET + 1;
+	EXPECT_EQ(EAFNOSUPPORT, -homa_ioc_sendmany(
+		(struct sock *) &self->hsk, (unsigned long) &many));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_sendmany__bad_count)
+{
+	struct homa_args_send_ipv4 entries[1];
+	struct homa_args_sendmany_ipv4 many = {entries, 0};
+	EXPECT_EQ(EINVAL, -homa_ioc_sendmany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+}
+TEST_F(homa_plumbing, homa_ioc_sendmany__cant_read_user_args)
+{
+	struct homa_args_send_ipv4 entries[1];
+	struct homa_args_sendmany_ipv4 many = {entries, 1};
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_ioc_sendmany((struct sock *) &self->hsk,
+		(unsigned long) &many));
+}
+
+TEST_F(homa_plumbing, homa_sendmsg__no_destination)
+{
+	self->sendmsg_hdr.msg_name = NULL;
+	EXPECT_EQ(EINVAL, -homa_sendmsg((struct sock *) &self->hsk,
+		&self->sendmsg_hdr, 200));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_sendmsg__bad_address_family)
+{
+	self->server_addr.sin_family = AF_INET + 1;
+	EXPECT_EQ(EAFNOSUPPORT, -homa_sendmsg((struct sock *) &self->hsk,
+		&self->sendmsg_hdr, 200));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_sendmsg__bad_cmsg)
+{
+	((struct cmsghdr *) self->cmsg_buf)->cmsg_len = CMSG_LEN(4);
+	self->sendmsg_hdr.msg_control = self->cmsg_buf;
+	self->sendmsg_hdr.msg_controllen = sizeof(self->cmsg_buf);
+	EXPECT_EQ(EINVAL, -homa_sendmsg((struct sock *) &self->hsk,
+		&self->sendmsg_hdr, 200));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_sendmsg__multiple_segments)
+{
+	self->sendmsg_hdr.msg_iter.nr_segs = 2;
+	EXPECT_EQ(EINVAL, -homa_sendmsg((struct sock *) &self->hsk,
+		&self->sendmsg_hdr, 200));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_sendmsg__new_request)
+{
+	atomic64_set(&self->hsk.next_outgoing_id, 1234);
+	EXPECT_EQ(200, homa_sendmsg((struct sock *) &self->hsk,
+		&self->sendmsg_hdr, 200));
+	EXPECT_SUBSTR("xmit DATA P7 200@0", unit_log_get());
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_sendmsg__return_id_for_new_request)
+{
+	struct homa_rpc_cmsg *rinfo = (struct homa_rpc_cmsg *)
+			CMSG_DATA((struct cmsghdr *) self->cmsg_buf);
+	__u64 id = 0;
+	rinfo->id_addr = (__u64) &id;
+	self->sendmsg_hdr.msg_control = self->cmsg_buf;
+	self->sendmsg_hdr.msg_controllen = sizeof(self->cmsg_buf);
+	atomic64_set(&self->hsk.next_outgoing_id, 1234);
+	EXPECT_EQ(200, homa_sendmsg((struct sock *) &self->hsk,
+		&self->sendmsg_hdr, 200));
+	EXPECT_EQ(1234L, id);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_sendmsg__cant_update_id)
+{
+	struct homa_rpc_cmsg *rinfo = (struct homa_rpc_cmsg *)
+			CMSG_DATA((struct cmsghdr *) self->cmsg_buf);
+	__u64 id = 0;
+	rinfo->id_addr = (__u64) &id;
+	self->sendmsg_hdr.msg_control = self->cmsg_buf;
+	self->sendmsg_hdr.msg_controllen = sizeof(self->cmsg_buf);
+	mock_copy_to_user_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_sendmsg((struct sock *) &self->hsk,
+		&self->sendmsg_hdr, 200));
+	EXPECT_SUBSTR("xmit DATA P7 200@0", unit_log_get());
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_sendmsg__response)
+{
+	struct homa_rpc_cmsg *rinfo = (struct homa_rpc_cmsg *)
+			CMSG_DATA((struct cmsghdr *) self->cmsg_buf);
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_IN_SERVICE,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->rpcid, 2000, 100);
+	unit_log_clear();
+	rinfo->id = self->rpcid;
+	self->sendmsg_hdr.msg_name = &self->client_addr;
+	self->sendmsg_hdr.msg_control = self->cmsg_buf;
+	self->sendmsg_hdr.msg_controllen = sizeof(self->cmsg_buf);
+	EXPECT_EQ(1000, homa_sendmsg((struct sock *) &self->hsk,
+		&self->sendmsg_hdr, 1000));
+	EXPECT_NE(RPC_IN_SERVICE, srpc->state);
+	EXPECT_SUBSTR("xmit DATA P7 1000@0", unit_log_get());
+}
+TEST_F(homa_plumbing, homa_recvmsg__client_normal_completion)
+{
+	struct homa_rpc_cmsg *rinfo = (struct homa_rpc_cmsg *)
+			CMSG_DATA((struct cmsghdr *) self->cmsg_buf);
+	unit_client_rpc(&self->hsk, RPC_READY, self->client_ip,
+			self->server_ip, self->server_port, self->rpcid,
+			100, 200);
+	rinfo->flags = HOMA_RECV_RESPONSE;
+	EXPECT_EQ(200, homa_recvmsg((struct sock *) &self->hsk,
+		&self->recvmsg_hdr, sizeof(self->buffer), 1, 0,
+		&self->sender_addr_len));
+	EXPECT_EQ(12345, rinfo->id);
+	EXPECT_EQ(self->server_ip, self->sender_addr.sin_addr.s_addr);
+	EXPECT_EQ(sizeof(struct sockaddr_in), self->sender_addr_len);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_recvmsg__no_control_info)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_READY,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->rpcid, 100, 200);
+	self->recvmsg_hdr.msg_controllen = 0;
+	EXPECT_EQ(100, homa_recvmsg((struct sock *) &self->hsk,
+		&self->recvmsg_hdr, sizeof(self->buffer), 1, 0,
+		&self->sender_addr_len));
+	EXPECT_EQ(self->client_ip, self->sender_addr.sin_addr.s_addr);
+	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
+}
+TEST_F(homa_plumbing, homa_recvmsg__bad_control_info)
+{
+	((struct cmsghdr *) self->cmsg_buf)->cmsg_type = HOMA_CMSG_RPC + 1;
+	EXPECT_EQ(EINVAL, -homa_recvmsg((struct sock *) &self->hsk,
+		&self->recvmsg_hdr, sizeof(self->buffer), 1, 0,
+		&self->sender_addr_len));
+}
+TEST_F(homa_plumbing, homa_recvmsg__region_not_supported)
+{
+	struct homa_rpc_cmsg *rinfo = (struct homa_rpc_cmsg *)
+			CMSG_DATA((struct cmsghdr *) self->cmsg_buf);
+	rinfo->flags = HOMA_RECV_RESPONSE|HOMA_RECV_REGION;
+	EXPECT_EQ(EINVAL, -homa_recvmsg((struct sock *) &self->hsk,
+		&self->recvmsg_hdr, sizeof(self->buffer), 1, 0,
+		&self->sender_addr_len));
+}
+TEST_F(homa_plumbing, homa_recvmsg__rpc_has_error)
+{
+	struct homa_rpc_cmsg *rinfo = (struct homa_rpc_cmsg *)
+			CMSG_DATA((struct cmsghdr *) self->cmsg_buf);
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_READY, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 100, 200);
+	crpc->error = -ETIMEDOUT;
+	rinfo->flags = HOMA_RECV_RESPONSE;
+	EXPECT_EQ(ETIMEDOUT, -homa_recvmsg((struct sock *) &self->hsk,
+		&self->recvmsg_hdr, sizeof(self->buffer), 1, 0,
+		&self->sender_addr_len));
+	EXPECT_EQ(12345, rinfo->id);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+
 TEST_F(homa_plumbing, homa_pkt_recv__basics)
 {
 	struct sk_buff *skb;
@@ -336,7 +772,100 @@ TEST_F(homa_plumbing, homa_pkt_recv__multiple_packets_same_socket)
 	homa_pkt_recv(skb);
 	EXPECT_EQ(2, unit_list_length(&self->hsk.active_rpcs));
 }
+TEST_F(homa_plumbing, homa_pkt_recv__batch_same_rpc)
+{
+	struct sk_buff *skb, *skb2;
+	self->data.seg.segment_length = htonl(1400);
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.seg.offset = htonl(1400);
+	skb2 = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
+	skb_shinfo(skb)->frag_list = skb2;
+	skb2->next = NULL;
+	homa_pkt_recv(skb);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	struct homa_rpc *srpc = homa_find_server_rpc(&self->hsk,
+			self->client_ip, self->client_port, self->rpcid);
+	EXPECT_NE(NULL, srpc);
+	homa_rpc_unlock(srpc);
+	EXPECT_EQ(7200, srpc->msgin.bytes_remaining);
+	EXPECT_EQ(1, unit_get_metrics()->gro_batched_packets);
+}
+TEST_F(homa_plumbing, homa_pkt_recv__batch_single_grant_evaluation)
+{
+	struct sk_buff *skb, *skb2;
+	self->homa.grant_coalesce_bytes = 0;
+	self->data.message_length = htonl(100000);
+	self->data.incoming = htonl(10000);
+	self->data.seg.segment_length = htonl(1400);
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.seg.offset = htonl(1400);
+	skb2 = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
+	skb_shinfo(skb)->frag_list = skb2;
+	skb2->next = NULL;
+	unit_log_clear();
+	homa_pkt_recv(skb);
+	EXPECT_STREQ("xmit GRANT 12800@0", unit_log_get());
+}
 
+TEST_F(homa_plumbing, homa_setsockopt__poll_mode)
+{
+	int val = 1;
+	EXPECT_EQ(0, homa_setsockopt(&self->hsk.inet.sk, IPPROTO_HOMA,
+			HOMA_SO_POLL, (char *) &val, sizeof(val)));
+	EXPECT_EQ(1, self->hsk.poll_mode);
+	val = 0;
+	EXPECT_EQ(0, homa_setsockopt(&self->hsk.inet.sk, IPPROTO_HOMA,
+			HOMA_SO_POLL, (char *) &val, sizeof(val)));
+	EXPECT_EQ(0, self->hsk.poll_mode);
+}
+TEST_F(homa_plumbing, homa_setsockopt__unsupported_option)
+{
+	int val = 1;
+	EXPECT_EQ(ENOPROTOOPT, -homa_setsockopt(&self->hsk.inet.sk,
+			IPPROTO_HOMA, 99, (char *) &val, sizeof(val)));
+}
+TEST_F(homa_plumbing, homa_setsockopt__bad_length)
+{
+	int val = 1;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.inet.sk, IPPROTO_HOMA,
+			HOMA_SO_POLL, (char *) &val, sizeof(val)-1));
+}
+TEST_F(homa_plumbing, homa_setsockopt__copy_from_user_fails)
+{
+	int val = 1;
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_setsockopt(&self->hsk.inet.sk, IPPROTO_HOMA,
+			HOMA_SO_POLL, (char *) &val, sizeof(val)));
+}
+TEST_F(homa_plumbing, homa_setsockopt__reuseport)
+{
+	int val = 1;
+	EXPECT_EQ(0, homa_setsockopt(&self->hsk.inet.sk, IPPROTO_HOMA,
+			HOMA_SO_REUSEPORT, (char *) &val, sizeof(val)));
+	EXPECT_EQ(1, self->hsk.reuseport);
+	val = 0;
+	EXPECT_EQ(0, homa_setsockopt(&self->hsk.inet.sk, IPPROTO_HOMA,
+			HOMA_SO_REUSEPORT, (char *) &val, sizeof(val)));
+	EXPECT_EQ(0, self->hsk.reuseport);
+}
+TEST_F(homa_plumbing, homa_setsockopt__rcvbuf)
+{
+	struct homa_rcvbuf_args args = {self->buffer,
+			3*HOMA_MAX_MESSAGE_LENGTH};
+	EXPECT_EQ(0, homa_setsockopt(&self->hsk.inet.sk, IPPROTO_HOMA,
+			HOMA_SO_RCVBUF, (char *) &args, sizeof(args)));
+	EXPECT_EQ(self->buffer, self->hsk.region_start);
+	EXPECT_EQ(3, self->hsk.region_slots);
+	EXPECT_EQ(0, self->hsk.region_in_use);
+}
+TEST_F(homa_plumbing, homa_setsockopt__rcvbuf_region_too_small)
+{
+	struct homa_rcvbuf_args args = {self->buffer,
+			HOMA_MAX_MESSAGE_LENGTH - 1};
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.inet.sk, IPPROTO_HOMA,
+			HOMA_SO_RCVBUF, (char *) &args, sizeof(args)));
+	EXPECT_EQ(NULL, self->hsk.region_start);
+}
 TEST_F(homa_plumbing, homa_metrics_open)
 {
 	EXPECT_EQ(0, homa_metrics_open(NULL, NULL));
@@ -383,6 +912,60 @@ TEST_F(homa_plumbing, homa_metrics_read__error_copying_to_user)
 	EXPECT_EQ(EFAULT, -homa_metrics_read(NULL, buffer, 5, &offset));
 }
 
+TEST_F(homa_plumbing, homa_metrics_bin_read__header)
+{
+	char buffer[1000];
+	struct homa_metrics_bin_header *header;
+	loff_t offset = 0;
+	EXPECT_EQ(sizeof(*header), homa_metrics_bin_read(NULL, buffer,
+			sizeof(*header), &offset));
+	EXPECT_EQ(sizeof(*header), offset);
+	header = (struct homa_metrics_bin_header *) buffer;
+	EXPECT_EQ(HOMA_METRICS_BIN_MAGIC, header->magic);
+	EXPECT_EQ(HOMA_METRICS_BIN_VERSION, header->version);
+	EXPECT_EQ(NR_CPUS, header->num_cores);
+	EXPECT_EQ(sizeof(struct homa_metrics), header->record_size);
+	EXPECT_EQ(cpu_khz, header->cpu_khz);
+}
+TEST_F(homa_plumbing, homa_metrics_bin_read__records_and_eof)
+{
+	size_t total = sizeof(struct homa_metrics_bin_header)
+			+ NR_CPUS * sizeof(struct homa_metrics);
+	char *buffer = kmalloc(total + 1, GFP_KERNEL);
+	struct homa_metrics *record;
+	loff_t offset = 0;
+	homa_metrics[2]->requests_received = 444;
+	EXPECT_EQ(total, homa_metrics_bin_read(NULL, buffer, total + 1,
+			&offset));
+	EXPECT_EQ(total, offset);
+	record = (struct homa_metrics *) (buffer
+			+ sizeof(struct homa_metrics_bin_header)
+			+ 2*sizeof(struct homa_metrics));
+	EXPECT_EQ(444, record->requests_received);
+
+	unit_log_clear();
+	EXPECT_EQ(0, homa_metrics_bin_read(NULL, buffer, total + 1, &offset));
+	EXPECT_STREQ("", unit_log_get());
+	kfree(buffer);
+}
+TEST_F(homa_plumbing, homa_metrics_bin_read__copy_in_pieces)
+{
+	char buffer[1000];
+	loff_t offset = sizeof(struct homa_metrics_bin_header) - 4;
+	EXPECT_EQ(12, homa_metrics_bin_read(NULL, buffer, 12, &offset));
+	EXPECT_STREQ("_copy_to_user copied 4 bytes; "
+			"_copy_to_user copied 8 bytes", unit_log_get());
+	EXPECT_EQ(sizeof(struct homa_metrics_bin_header) + 8, offset);
+}
+TEST_F(homa_plumbing, homa_metrics_bin_read__error_copying_to_user)
+{
+	char buffer[1000];
+	loff_t offset = 0;
+	mock_copy_to_user_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_metrics_bin_read(NULL, buffer, 100, &offset));
+	EXPECT_EQ(0, offset);
+}
+
 TEST_F(homa_plumbing, homa_metrics_release)
 {
 	self->homa.metrics_active_opens = 2;
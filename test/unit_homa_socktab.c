@@ -189,6 +189,33 @@ TEST_F(homa_socktab, homa_sock_bind)
 	EXPECT_EQ(&self->hsk, homa_sock_find(&self->homa.port_map, 120));
 	homa_sock_destroy(&hsk2);
 }
+TEST_F(homa_socktab, homa_sock_bind__reuseport)
+{
+	struct homa_sock hsk2, hsk3, hsk4;
+	mock_sock_init(&hsk2, &self->homa, 0, 0);
+	mock_sock_init(&hsk3, &self->homa, 0, 0);
+	mock_sock_init(&hsk4, &self->homa, 0, 0);
+	hsk2.reuseport = 1;
+	hsk3.reuseport = 1;
+
+	EXPECT_EQ(0, homa_sock_bind(&self->homa.port_map, &hsk2, 100));
+	EXPECT_EQ(0, homa_sock_bind(&self->homa.port_map, &hsk3, 100));
+	EXPECT_EQ(100, hsk2.server_port);
+	EXPECT_EQ(100, hsk3.server_port);
+
+	/* A socket that didn't opt in can't join the group. */
+	EXPECT_EQ(EADDRINUSE, -homa_sock_bind(&self->homa.port_map,
+			&hsk4, 100));
+
+	/* An opted-in socket can't share a port whose owner didn't opt in. */
+	EXPECT_EQ(0, homa_sock_bind(&self->homa.port_map, &hsk4, 110));
+	EXPECT_EQ(EADDRINUSE, -homa_sock_bind(&self->homa.port_map,
+			&hsk2, 110));
+
+	homa_sock_destroy(&hsk2);
+	homa_sock_destroy(&hsk3);
+	homa_sock_destroy(&hsk4);
+}
 
 TEST_F(homa_socktab, homa_sock_find__basics)
 {
@@ -234,6 +261,55 @@ TEST_F(homa_socktab, homa_sock_find__long_hash_chain)
 	homa_sock_destroy(&hsk4);
 }
 
+TEST_F(homa_socktab, homa_sock_find_dispatch__port_not_shared)
+{
+	struct homa_sock hsk2;
+	mock_sock_init(&hsk2, &self->homa, 0, 100);
+	EXPECT_EQ(&hsk2, homa_sock_find_dispatch(&self->homa.port_map,
+			100, N(0x01020304), 12345));
+	EXPECT_EQ(&self->hsk, homa_sock_find_dispatch(&self->homa.port_map,
+			self->hsk.client_port, N(0x01020304), 12345));
+	EXPECT_EQ(NULL, homa_sock_find_dispatch(&self->homa.port_map,
+			101, N(0x01020304), 12345));
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_socktab, homa_sock_find_dispatch__spread_across_group)
+{
+	struct homa_sock hsk2, hsk3;
+	struct homa_sock *target;
+	int count2 = 0;
+	int count3 = 0;
+	__u64 id;
+	mock_sock_init(&hsk2, &self->homa, 0, 0);
+	mock_sock_init(&hsk3, &self->homa, 0, 0);
+	hsk2.reuseport = 1;
+	hsk3.reuseport = 1;
+	EXPECT_EQ(0, homa_sock_bind(&self->homa.port_map, &hsk2, 100));
+	EXPECT_EQ(0, homa_sock_bind(&self->homa.port_map, &hsk3, 100));
+
+	for (id = 1; id <= 32; id++) {
+		target = homa_sock_find_dispatch(&self->homa.port_map, 100,
+				N(0x01020304), id);
+
+		/* The choice is deterministic: all of an RPC's packets
+		 * reach the same socket.
+		 */
+		EXPECT_EQ(target, homa_sock_find_dispatch(
+				&self->homa.port_map, 100,
+				N(0x01020304), id));
+		if (target == &hsk2)
+			count2++;
+		else if (target == &hsk3)
+			count3++;
+	}
+	EXPECT_EQ(32, count2 + count3);
+	EXPECT_NE(0, count2);
+	EXPECT_NE(0, count3);
+
+	homa_sock_destroy(&hsk2);
+	homa_sock_destroy(&hsk3);
+}
+
 TEST_F(homa_socktab, homa_sock_lock_slow)
 {
 	mock_cycles = ~0;
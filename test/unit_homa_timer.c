@@ -139,13 +139,16 @@ TEST_F(homa_timer, homa_check_timeout__too_soon_for_resend)
 
 TEST_F(homa_timer, homa_timer__basics)
 {
+	int i;
 	self->homa.abort_resends = 2;
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			RPC_INCOMING, self->client_ip, self->server_ip,
 			self->server_port, self->rpcid, 200, 5000);
 	unit_log_clear();
+
+	/* First tick: the RPC's check isn't due yet, so it isn't visited. */
 	homa_timer(&self->homa);
-	EXPECT_EQ(1, crpc->silent_ticks);
+	EXPECT_EQ(0, crpc->silent_ticks);
 	EXPECT_STREQ("", unit_log_get());
 
 	/* Send RESEND. */
@@ -154,21 +157,65 @@ TEST_F(homa_timer, homa_timer__basics)
 	EXPECT_EQ(2, crpc->silent_ticks);
 	EXPECT_STREQ("xmit RESEND 1400-4999@7", unit_log_get());
 
+	/* No RESENDs until resend_interval ticks have elapsed. */
+	unit_log_clear();
+	for (i = 0; i < 4; i++)
+		homa_timer(&self->homa);
+	EXPECT_STREQ("", unit_log_get());
+
 	/* Send another RESEND. */
 	unit_log_clear();
-	self->homa.timer_ticks = 200;
 	homa_timer(&self->homa);
-	EXPECT_EQ(3, crpc->silent_ticks);
 	EXPECT_STREQ("xmit RESEND 1400-4999@7", unit_log_get());
-	
+
 	/* Abort RPC. */
 	unit_log_clear();
-	self->homa.timer_ticks = 300;
 	homa_timer(&self->homa);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[1].ready_responses));
 	EXPECT_EQ(1, unit_get_metrics()->client_rpc_timeouts);
 	EXPECT_EQ(RPC_READY, crpc->state);
 }
+TEST_F(homa_timer, homa_timer__recent_activity_defers_check)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 200, 5000);
+	unit_log_clear();
+	homa_timer(&self->homa);
+
+	/* Simulate a packet arriving (as homa_pkt_dispatch would). */
+	crpc->silent_ticks = 0;
+	crpc->timer_tick = self->homa.timer_ticks;
+
+	/* The RPC has only been silent one tick, so no RESEND yet. */
+	homa_timer(&self->homa);
+	EXPECT_EQ(1, crpc->silent_ticks);
+	EXPECT_STREQ("", unit_log_get());
+
+	/* Now the silence is long enough for a RESEND. */
+	homa_timer(&self->homa);
+	EXPECT_EQ(2, crpc->silent_ticks);
+	EXPECT_STREQ("xmit RESEND 1400-4999@7", unit_log_get());
+}
+TEST_F(homa_timer, homa_timer__rpc_locked)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 200, 5000);
+	unit_log_clear();
+	homa_timer(&self->homa);
+
+	/* RPC lock unavailable: check gets deferred to the next tick. */
+	mock_trylock_errors = 1;
+	homa_timer(&self->homa);
+	EXPECT_EQ(0, crpc->silent_ticks);
+	EXPECT_STREQ("", unit_log_get());
+
+	/* Next tick the check happens. */
+	homa_timer(&self->homa);
+	EXPECT_EQ(3, crpc->silent_ticks);
+	EXPECT_STREQ("xmit RESEND 1400-4999@7", unit_log_get());
+}
 TEST_F(homa_timer, homa_timer__rpc_ready)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -177,6 +224,7 @@ TEST_F(homa_timer, homa_timer__rpc_ready)
 	unit_log_clear();
 	crpc->silent_ticks = 2;
 	homa_timer(&self->homa);
+	homa_timer(&self->homa);
 	EXPECT_EQ(0, crpc->silent_ticks);
 	EXPECT_STREQ("", unit_log_get());
 }
@@ -187,6 +235,7 @@ TEST_F(homa_timer, homa_timer__rpc_in_service)
 			self->rpcid, 5000, 5000);
 	unit_log_clear();
 	homa_timer(&self->homa);
+	homa_timer(&self->homa);
 	EXPECT_EQ(0, srpc->silent_ticks);
 	EXPECT_STREQ("", unit_log_get());
 }
@@ -197,7 +246,7 @@ TEST_F(homa_timer, homa_timer__abort_server_rpc)
 			self->rpcid, 5000, 5000);
 	unit_log_clear();
 	srpc->num_resends = self->homa.abort_resends;
-	srpc->silent_ticks = self->homa.resend_ticks;
+	homa_timer(&self->homa);
 	homa_timer(&self->homa);
 	EXPECT_EQ(1, unit_get_metrics()->server_rpc_timeouts);
 	EXPECT_EQ(1, unit_list_length(&self->hsk.dead_rpcs));
@@ -103,6 +103,35 @@ static const char *dead_rpcs(struct homa_sock *hsk)
 	return unit_log_get();
 }
 
+TEST_F(homa_utils, homa_rpc_alloc__reuse_cached_struct)
+{
+	struct homa_rpc *rpc = homa_rpc_alloc();
+	ASSERT_NE(NULL, rpc);
+	homa_rpc_release(rpc);
+	EXPECT_EQ(1, homa_rpc_caches[cpu_number].num_rpcs);
+	EXPECT_EQ(rpc, homa_rpc_alloc());
+	EXPECT_EQ(0, homa_rpc_caches[cpu_number].num_rpcs);
+	homa_rpc_release(rpc);
+}
+TEST_F(homa_utils, homa_rpc_alloc__malloc_error)
+{
+	mock_kmalloc_errors = 1;
+	EXPECT_EQ(NULL, homa_rpc_alloc());
+}
+TEST_F(homa_utils, homa_rpc_release__cache_full)
+{
+	struct homa_rpc *rpcs[HOMA_RPC_CACHE_SIZE+1];
+	int i;
+	for (i = 0; i <= HOMA_RPC_CACHE_SIZE; i++) {
+		rpcs[i] = homa_rpc_alloc();
+		ASSERT_NE(NULL, rpcs[i]);
+	}
+	for (i = 0; i <= HOMA_RPC_CACHE_SIZE; i++)
+		homa_rpc_release(rpcs[i]);
+	EXPECT_EQ(HOMA_RPC_CACHE_SIZE,
+			homa_rpc_caches[cpu_number].num_rpcs);
+}
+
 TEST_F(homa_utils, homa_rpc_new_client__normal)
 {
 	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
@@ -203,6 +232,105 @@ TEST_F(homa_utils, homa_rpc_new_server__addr_error)
 	EXPECT_EQ(EHOSTUNREACH, -PTR_ERR(srpc));
 }
 
+TEST_F(homa_utils, homa_rpc_tt_filter__no_filters_trace_everything)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, (char *) 2000, 10000);
+	EXPECT_FALSE(IS_ERR(crpc));
+	EXPECT_TRUE(crpc->tt_traced);
+	homa_rpc_free(crpc);
+	homa_rpc_unlock(crpc);
+}
+TEST_F(homa_utils, homa_rpc_tt_filter__id)
+{
+	struct homa_rpc rpc = {.id = 12345, .dport = 0, .hsk = &self->hsk};
+	self->homa.tt_filter_id = 12345;
+	homa_rpc_tt_filter(&self->homa, &rpc, 0);
+	EXPECT_TRUE(rpc.tt_traced);
+	rpc.id = 999;
+	homa_rpc_tt_filter(&self->homa, &rpc, 0);
+	EXPECT_FALSE(rpc.tt_traced);
+}
+TEST_F(homa_utils, homa_rpc_tt_filter__port)
+{
+	struct homa_rpc rpc = {.id = 12345, .dport = 888, .hsk = &self->hsk};
+	self->homa.tt_filter_port = 888;
+	homa_rpc_tt_filter(&self->homa, &rpc, 0);
+	EXPECT_TRUE(rpc.tt_traced);
+	self->homa.tt_filter_port = self->hsk.client_port;
+	homa_rpc_tt_filter(&self->homa, &rpc, 0);
+	EXPECT_TRUE(rpc.tt_traced);
+	self->homa.tt_filter_port = 777;
+	homa_rpc_tt_filter(&self->homa, &rpc, 0);
+	EXPECT_FALSE(rpc.tt_traced);
+}
+TEST_F(homa_utils, homa_rpc_tt_filter__min_length)
+{
+	struct homa_rpc rpc = {.id = 12345, .dport = 0, .hsk = &self->hsk};
+	self->homa.tt_filter_min_length = 5000;
+	homa_rpc_tt_filter(&self->homa, &rpc, 5000);
+	EXPECT_TRUE(rpc.tt_traced);
+	homa_rpc_tt_filter(&self->homa, &rpc, 4999);
+	EXPECT_FALSE(rpc.tt_traced);
+}
+TEST_F(homa_utils, homa_rpc_tt_filter__sampling)
+{
+	struct homa_rpc rpc = {.id = 12345, .dport = 0, .hsk = &self->hsk};
+	self->homa.tt_filter_interval = 3;
+	atomic_set(&self->homa.tt_filter_count, 3);
+	homa_rpc_tt_filter(&self->homa, &rpc, 0);
+	EXPECT_FALSE(rpc.tt_traced);
+	homa_rpc_tt_filter(&self->homa, &rpc, 0);
+	EXPECT_FALSE(rpc.tt_traced);
+	homa_rpc_tt_filter(&self->homa, &rpc, 0);
+	EXPECT_TRUE(rpc.tt_traced);
+	homa_rpc_tt_filter(&self->homa, &rpc, 0);
+	EXPECT_FALSE(rpc.tt_traced);
+}
+
+TEST_F(homa_utils, homa_check_freeze_slo__violation)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, (char *) 2000, 10000);
+	EXPECT_FALSE(IS_ERR(crpc));
+	crpc->start_cycles = 0;
+	mock_cycles = 5000000;
+	self->homa.freeze_slo_usecs[0] = 4000;
+	unit_log_clear();
+	homa_check_freeze_slo(crpc);
+	EXPECT_TRUE(tt_frozen);
+	EXPECT_SUBSTR("xmit FREEZE", unit_log_get());
+	EXPECT_EQ(1, unit_get_metrics()->slo_freezes);
+
+	/* Undo the freeze (it is global state shared among tests). */
+	tt_frozen = false;
+	atomic_set(&tt_freeze_count, 1);
+	homa_rpc_free(crpc);
+	homa_rpc_unlock(crpc);
+}
+TEST_F(homa_utils, homa_check_freeze_slo__no_violation)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, (char *) 2000, 10000);
+	EXPECT_FALSE(IS_ERR(crpc));
+	crpc->start_cycles = 0;
+	mock_cycles = 5000000;
+	unit_log_clear();
+
+	/* First attempt: no SLO for this size class. */
+	homa_check_freeze_slo(crpc);
+	EXPECT_FALSE(tt_frozen);
+
+	/* Second attempt: SLO not exceeded. */
+	self->homa.freeze_slo_usecs[0] = 6000;
+	homa_check_freeze_slo(crpc);
+	EXPECT_FALSE(tt_frozen);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(0, unit_get_metrics()->slo_freezes);
+	homa_rpc_free(crpc);
+	homa_rpc_unlock(crpc);
+}
+
 TEST_F(homa_utils, homa_rpc_lock_slow)
 {
 	mock_cycles = ~0;
@@ -266,9 +394,9 @@ TEST_F(homa_utils, homa_rpc_free__state_ready)
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			RPC_READY, self->client_ip, self->server_ip,
 			self->server_port, self->rpcid, 1000, 100);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_shards[1].ready_responses));
 	homa_rpc_free(crpc);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_shards[1].ready_responses));
 }
 TEST_F(homa_utils, homa_rpc_free__wakeup_interest)
 {
@@ -292,10 +420,73 @@ TEST_F(homa_utils, homa_rpc_free__remove_from_throttled_list)
 	EXPECT_NE(NULL, crpc);
 	homa_rpc_unlock(crpc);
 	homa_add_to_throttled(crpc);
-	EXPECT_EQ(1, unit_list_length(&self->homa.throttled_rpcs));
+	EXPECT_FALSE(llist_empty(&self->homa.links[0].throttled_staging));
 	unit_log_clear();
 	homa_rpc_free(crpc);
-	EXPECT_EQ(0, unit_list_length(&self->homa.throttled_rpcs));
+	EXPECT_EQ(0, unit_list_length(&self->homa.links[0].throttled_rpcs));
+	EXPECT_TRUE(llist_empty(&self->homa.links[0].throttled_staging));
+}
+TEST_F(homa_utils, homa_rpc_free__records_server_latency)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->rpcid, 1000, 100);
+	EXPECT_NE(NULL, srpc);
+	srpc->start_cycles = 0;
+	mock_cycles = 5000000;                  /* 5000 us: bucket 12. */
+	homa_rpc_free(srpc);
+	EXPECT_EQ(1, unit_get_metrics()->server_rpc_latency[0][12]);
+
+	/* Second RPC isn't in RPC_OUTGOING, so nothing is recorded. */
+	srpc = unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+			self->server_ip, self->client_port, self->rpcid+1,
+			2000, 100);
+	EXPECT_NE(NULL, srpc);
+	homa_rpc_free(srpc);
+	EXPECT_EQ(0, unit_get_metrics()->server_rpc_latency[0][0]);
+}
+TEST_F(homa_utils, homa_rpc_free__ack_completed_response)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, RPC_READY,
+			self->client_ip, self->server_ip, self->server_port,
+			self->rpcid, 1000, 100);
+	EXPECT_NE(NULL, crpc);
+	struct homa_peer *peer = crpc->peer;
+	EXPECT_EQ(0, peer->num_acks);
+	homa_rpc_free(crpc);
+	EXPECT_EQ(1, peer->num_acks);
+	EXPECT_EQ(self->rpcid, peer->acks[0].id);
+	EXPECT_EQ(n(self->server_port), peer->acks[0].server_port);
+
+	/* Second RPC's response hasn't been fully received, so freeing
+	 * it must not generate an ack.
+	 */
+	crpc = unit_client_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+			self->server_ip, self->server_port, self->rpcid+1,
+			1000, 20000);
+	EXPECT_NE(NULL, crpc);
+	homa_rpc_free(crpc);
+	EXPECT_EQ(1, peer->num_acks);
+}
+
+TEST_F(homa_utils, homa_record_rpc_latency__size_classes_and_buckets)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, (char *) 2000, 10000);
+	EXPECT_FALSE(IS_ERR(crpc));
+	crpc->msgin.total_length = 3000;
+	crpc->start_cycles = 0;
+	mock_cycles = 10000;                    /* 10 us: bucket 3. */
+	homa_record_rpc_latency(crpc);
+	EXPECT_EQ(1, unit_get_metrics()->client_rpc_latency[0][3]);
+
+	crpc->msgin.total_length = 200000;
+	mock_cycles = 1000000000000ull;         /* Clamps to last bucket. */
+	homa_record_rpc_latency(crpc);
+	EXPECT_EQ(1, unit_get_metrics()->client_rpc_latency[2]
+			[HOMA_LATENCY_HIST_BUCKETS-1]);
+	homa_rpc_free(crpc);
+	homa_rpc_unlock(crpc);
 }
 
 TEST_F(homa_utils, homa_rpc_free_rcu)
@@ -379,6 +570,36 @@ TEST_F(homa_utils, homa_rpc_reap__hit_limit_in_msgin_packets)
 	EXPECT_STREQ("41", dead_rpcs(&self->hsk));
 	EXPECT_EQ(3, self->hsk.dead_skbs);
 }
+TEST_F(homa_utils, homa_rpc_reap__defer_skb_frees_to_workqueue)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 5000, 2000);
+	homa_rpc_free(crpc);
+	EXPECT_EQ(5, self->hsk.dead_skbs);
+	unit_log_clear();
+	EXPECT_EQ(1, homa_rpc_reap(&self->hsk));
+	EXPECT_STREQ("reaped 12345", unit_log_get());
+	EXPECT_EQ(0, self->hsk.dead_skbs);
+
+	/* The 4 outgoing-message buffers were recycled; only the received
+	 * buffer needed the workqueue.
+	 */
+	EXPECT_EQ(1, unit_get_metrics()->deferred_skb_frees);
+}
+TEST_F(homa_utils, homa_rpc_reap__cant_defer_skb_frees)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->rpcid, 5000, 2000);
+	homa_rpc_free(crpc);
+	unit_log_clear();
+	mock_kmalloc_errors = 1;
+	EXPECT_EQ(1, homa_rpc_reap(&self->hsk));
+	EXPECT_STREQ("reaped 12345", unit_log_get());
+	EXPECT_EQ(0, self->hsk.dead_skbs);
+	EXPECT_EQ(0, unit_get_metrics()->deferred_skb_frees);
+}
 TEST_F(homa_utils, homa_rpc_reap__nothing_to_reap)
 {
 	EXPECT_EQ(0, homa_rpc_reap(&self->hsk));
@@ -455,6 +676,60 @@ TEST_F(homa_utils, homa_find_server_rpc)
 			self->client_port, 3));
 }
 
+TEST_F(homa_utils, homa_rpc_acked__basics)
+{
+	homa_sock_bind(&self->homa.port_map, &self->hsk, self->server_port);
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->rpcid, 10000, 100);
+	EXPECT_NE(NULL, srpc);
+	struct homa_ack ack = {.id = self->rpcid,
+			.client_port = n(self->client_port),
+			.server_port = n(self->server_port)};
+	homa_rpc_acked(&self->hsk, self->client_ip, &ack);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_utils, homa_rpc_acked__lookup_socket)
+{
+	struct homa_sock hsk2;
+	mock_sock_init(&hsk2, &self->homa, 0, self->server_port+1);
+	struct homa_rpc *srpc = unit_server_rpc(&hsk2, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->rpcid, 10000, 100);
+	EXPECT_NE(NULL, srpc);
+	struct homa_ack ack = {.id = self->rpcid,
+			.client_port = n(self->client_port),
+			.server_port = n(self->server_port+1)};
+	homa_rpc_acked(&self->hsk, self->client_ip, &ack);
+	EXPECT_EQ(0, unit_list_length(&hsk2.active_rpcs));
+}
+TEST_F(homa_utils, homa_rpc_acked__no_such_socket)
+{
+	homa_sock_bind(&self->homa.port_map, &self->hsk, self->server_port);
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->rpcid, 10000, 100);
+	EXPECT_NE(NULL, srpc);
+	struct homa_ack ack = {.id = self->rpcid,
+			.client_port = n(self->client_port),
+			.server_port = n(self->server_port+5)};
+	homa_rpc_acked(&self->hsk, self->client_ip, &ack);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_utils, homa_rpc_acked__no_such_rpc)
+{
+	homa_sock_bind(&self->homa.port_map, &self->hsk, self->server_port);
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->rpcid, 10000, 100);
+	EXPECT_NE(NULL, srpc);
+	struct homa_ack ack = {.id = self->rpcid+1,
+			.client_port = n(self->client_port),
+			.server_port = n(self->server_port)};
+	homa_rpc_acked(&self->hsk, self->client_ip, &ack);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+
 TEST_F(homa_utils, homa_print_ipv4_addr)
 {
 	char *p1, *p2;
@@ -542,4 +817,130 @@ TEST_F(homa_utils, homa_prios_changed__share_lowest_priority)
 	EXPECT_EQ(80, self->homa.unsched_cutoffs[1]);
 	EXPECT_EQ(0x7fffffff, self->homa.unsched_cutoffs[0]);
 	EXPECT_EQ(0, self->homa.max_sched_prio);
+}
+
+TEST_F(homa_utils, homa_tune_cutoffs__basics)
+{
+	/* Four size classes, each generating the same unscheduled load
+	 * (bucket 13's midpoint of 12288 is clamped to rtt_bytes, 10000).
+	 */
+	homa_size_hists[1].counts[5] = 10000;
+	homa_size_hists[2].counts[7] = 2500;
+	homa_size_hists[1].counts[9] = 625;
+	homa_size_hists[1].counts[13] = 48;
+	homa_tune_cutoffs(&self->homa);
+	EXPECT_EQ(63, self->homa.unsched_cutoffs[7]);
+	EXPECT_EQ(255, self->homa.unsched_cutoffs[6]);
+	EXPECT_EQ(1023, self->homa.unsched_cutoffs[5]);
+	EXPECT_EQ(HOMA_MAX_MESSAGE_SIZE, self->homa.unsched_cutoffs[4]);
+	EXPECT_EQ(3, self->homa.max_sched_prio);
+	EXPECT_EQ(1, self->homa.cutoff_version);
+	EXPECT_EQ(1, unit_get_metrics()->cutoff_retunes);
+
+	/* Same distribution again: cutoffs don't change, so neither
+	 * does cutoff_version.
+	 */
+	homa_size_hists[1].counts[5] += 10000;
+	homa_size_hists[2].counts[7] += 2500;
+	homa_size_hists[1].counts[9] += 625;
+	homa_size_hists[1].counts[13] += 48;
+	homa_tune_cutoffs(&self->homa);
+	EXPECT_EQ(1, self->homa.cutoff_version);
+	EXPECT_EQ(1, unit_get_metrics()->cutoff_retunes);
+}
+TEST_F(homa_utils, homa_tune_cutoffs__too_few_samples)
+{
+	homa_size_hists[1].counts[5] = 999;
+	homa_tune_cutoffs(&self->homa);
+	EXPECT_EQ(200, self->homa.unsched_cutoffs[7]);
+	EXPECT_EQ(0, self->homa.cutoff_version);
+
+	/* The earlier samples weren't discarded; one more message
+	 * reaches the threshold.
+	 */
+	homa_size_hists[1].counts[5] = 1000;
+	homa_tune_cutoffs(&self->homa);
+	EXPECT_EQ(63, self->homa.unsched_cutoffs[7]);
+	EXPECT_EQ(1, self->homa.cutoff_version);
+}
+TEST_F(homa_utils, homa_tune_cutoffs__single_unsched_priority)
+{
+	self->homa.num_priorities = 5;
+	self->homa.max_sched_prio = 3;
+	homa_size_hists[1].counts[5] = 10000;
+	homa_tune_cutoffs(&self->homa);
+	EXPECT_EQ(200, self->homa.unsched_cutoffs[7]);
+	EXPECT_EQ(0, self->homa.cutoff_version);
+}
+
+TEST_F(homa_utils, homa_tune_overcommit__link_saturated)
+{
+	self->homa.rtt_bytes = 10000;
+	self->homa.cycles_per_kbyte = 10;
+	self->homa.last_tune_cycles = 1000;
+	mock_cycles = 2000;
+
+	/* Capacity over the interval is 100000 bytes. */
+	atomic64_set(&self->homa.sched_grant_bytes, 95000);
+	atomic64_set(&self->homa.sched_arrival_bytes, 95000);
+	homa_tune_overcommit(&self->homa);
+	EXPECT_EQ(7, self->homa.max_overcommit);
+	EXPECT_EQ(1, unit_get_metrics()->overcommit_retunes);
+	EXPECT_EQ(95000, self->homa.prev_grant_bytes);
+	EXPECT_EQ(2000, self->homa.last_tune_cycles);
+}
+TEST_F(homa_utils, homa_tune_overcommit__senders_stalled)
+{
+	self->homa.rtt_bytes = 10000;
+	self->homa.cycles_per_kbyte = 10;
+	self->homa.last_tune_cycles = 1000;
+	mock_cycles = 2000;
+
+	/* Plenty of headroom, but only 40000 of the 60000 granted bytes
+	 * arrived.
+	 */
+	atomic64_set(&self->homa.sched_grant_bytes, 60000);
+	atomic64_set(&self->homa.sched_arrival_bytes, 40000);
+	homa_tune_overcommit(&self->homa);
+	EXPECT_EQ(9, self->homa.max_overcommit);
+	EXPECT_EQ(1, unit_get_metrics()->overcommit_retunes);
+
+	/* Already at the limit: no further increases. */
+	self->homa.max_overcommit = HOMA_MAX_GRANTS;
+	mock_cycles = 3000;
+	atomic64_set(&self->homa.sched_grant_bytes, 120000);
+	atomic64_set(&self->homa.sched_arrival_bytes, 80000);
+	homa_tune_overcommit(&self->homa);
+	EXPECT_EQ(HOMA_MAX_GRANTS, self->homa.max_overcommit);
+	EXPECT_EQ(1, unit_get_metrics()->overcommit_retunes);
+}
+TEST_F(homa_utils, homa_tune_overcommit__too_little_traffic)
+{
+	self->homa.rtt_bytes = 10000;
+	self->homa.cycles_per_kbyte = 10;
+	self->homa.last_tune_cycles = 1000;
+	mock_cycles = 2000;
+
+	atomic64_set(&self->homa.sched_grant_bytes, 5000);
+	atomic64_set(&self->homa.sched_arrival_bytes, 1000);
+	homa_tune_overcommit(&self->homa);
+	EXPECT_EQ(8, self->homa.max_overcommit);
+	EXPECT_EQ(0, unit_get_metrics()->overcommit_retunes);
+
+	/* The snapshots were still updated. */
+	EXPECT_EQ(5000, self->homa.prev_grant_bytes);
+	EXPECT_EQ(1000, self->homa.prev_arrival_bytes);
+}
+TEST_F(homa_utils, homa_tune_overcommit__rates_balanced)
+{
+	self->homa.rtt_bytes = 10000;
+	self->homa.cycles_per_kbyte = 10;
+	self->homa.last_tune_cycles = 1000;
+	mock_cycles = 2000;
+
+	atomic64_set(&self->homa.sched_grant_bytes, 60000);
+	atomic64_set(&self->homa.sched_arrival_bytes, 58000);
+	homa_tune_overcommit(&self->homa);
+	EXPECT_EQ(8, self->homa.max_overcommit);
+	EXPECT_EQ(0, unit_get_metrics()->overcommit_retunes);
 }
\ No newline at end of file
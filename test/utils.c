@@ -284,14 +284,20 @@ void unit_log_skb_list(struct sk_buff_head *packets, int verbose)
 
 /**
  * unit_log_throttled() - Append to the test log information about all of
- * the messages in homa->throttle_rpcs.
+ * the messages in the first link's throttled_rpcs (including any that are
+ * still waiting in its throttled_staging: they get drained into the list
+ * first, as the pacer would do).
  * @homa:     Homa's overall state.
  */
 void unit_log_throttled(struct homa *homa)
 {
+	struct homa_link *link = &homa->links[0];
 	struct homa_rpc *rpc;
 	int offset;
-	list_for_each_entry_rcu(rpc, &homa->throttled_rpcs, throttled_links) {
+	homa_throttle_lock(link);
+	homa_throttle_drain_staging(link);
+	homa_throttle_unlock(link);
+	list_for_each_entry_rcu(rpc, &link->throttled_rpcs, throttled_links) {
 		if (rpc->msgout.next_packet)
 			offset = homa_data_offset(rpc->msgout.next_packet);
 		else
@@ -65,6 +65,7 @@ bool is_server = false;
 int id = -1;
 uint32_t server_max = 1;
 double net_bw = 0.0;
+bool open_loop = false;
 int port_threads = 1;
 const char *protocol = "homa";
 int server_nodes = 1;
@@ -172,6 +173,11 @@ void print_help(const char *name)
 		"                      not be sent to node-I (default: -1)\n"
 		"    --net-bw          Target network utilization, including only message data,\n"
 		"                      GB/s; 0 means send continuously (default: %.1f)\n"
+		"    --open-loop       Send requests at their scheduled (Poisson) times\n"
+		"                      regardless of how many are outstanding, and measure\n"
+		"                      latency from the scheduled send time; this avoids\n"
+		"                      coordinated omission, so tail latencies include\n"
+		"                      queuing delays (requires --net-bw > 0)\n"
 		"    --protocol        Transport protocol to use: homa or tcp (default: %s)\n"
 		"    --server-max      Maximum number of outstanding requests from a single\n"
 		"                      client thread to a single server port (default: %d)\n"
@@ -184,6 +190,8 @@ void print_help(const char *name)
 		"                      (default: %d)\n"
 		"    --workload        Name of distribution for request lengths (e.g., 'w1')\n"
 		"                      or integer for fixed length (default: %s)\n\n"
+		"dump_hist file        Log latency histograms (collected per message-size\n"
+		"                      bucket) to file, with percentiles up to P99.99\n\n"
 		"dump_times file       Log RTT times (and lengths) to file\n\n"
 		"exit                  Exit the application\n\n"
 		"log [options] [msg]   Configure logging as determined by the options. If\n"
@@ -885,9 +893,163 @@ void tcp_server::read(int fd)
 	}
 }
 
+/**
+ * class latency_histogram - Records a distribution of latencies in HDR
+ * (high dynamic range) form: logarithmic major buckets, each divided into
+ * 64 linear sub-buckets, so any latency can be recorded with at most 1.6%
+ * relative error using a few KB of memory. Unlike the fixed-size sample
+ * buffer in client::actual_rtts, which wraps and forgets, a histogram
+ * accumulates every RPC over an arbitrarily long run, so tail percentiles
+ * such as P99.9 are meaningful.
+ */
+class latency_histogram {
+    public:
+	latency_histogram();
+	void add(latency_histogram &other);
+	uint64_t percentile(double fraction);
+	void record(uint64_t cycles);
+	static uint64_t bucket_value(int index);
+
+	/**
+	 * define HIST_BUCKETS: total number of buckets; enough to cover
+	 * every possible 64-bit cycle count (64 linear buckets for values
+	 * less than 64, then 64 sub-buckets for each higher power of two).
+	 */
+#define HIST_BUCKETS ((58*64) + 64)
+
+	/** @buckets: entry i counts samples whose value maps to bucket i. */
+	std::vector<uint64_t> buckets;
+
+	/** @count: total number of samples recorded. */
+	uint64_t count;
+
+	/** @min_val: smallest sample recorded (only valid if count > 0). */
+	uint64_t min_val;
+
+	/** @max_val: largest sample recorded (only valid if count > 0). */
+	uint64_t max_val;
+};
+
+/**
+ * latency_histogram::latency_histogram() - Constructor for (empty)
+ * latency_histograms.
+ */
+latency_histogram::latency_histogram()
+	: buckets(HIST_BUCKETS, 0)
+	, count(0)
+	, min_val(0)
+	, max_val(0)
+{
+}
+
+/**
+ * latency_histogram::record() - Add one sample to a histogram.
+ * @cycles:  The sample, measured in rdtsc cycles.
+ */
+void latency_histogram::record(uint64_t cycles)
+{
+	int index;
+
+	if (cycles < 64)
+		index = cycles;
+	else {
+		/* The top 7 bits of the value select the bucket; the
+		 * leading 1 bit identifies the major (power of two) range
+		 * and the next 6 bits the linear sub-bucket within it.
+		 */
+		int msb = 63 - __builtin_clzll(cycles);
+		index = (msb - 5)*64 + (int) (cycles >> (msb - 6)) - 64;
+	}
+	buckets[index]++;
+	if ((count == 0) || (cycles < min_val))
+		min_val = cycles;
+	if ((count == 0) || (cycles > max_val))
+		max_val = cycles;
+	count++;
+}
+
+/**
+ * latency_histogram::bucket_value() - Returns a representative value
+ * (in rdtsc cycles) for all of the samples in a bucket: the midpoint
+ * of the range of values that map to that bucket.
+ * @index:  Index of a bucket within @buckets.
+ */
+uint64_t latency_histogram::bucket_value(int index)
+{
+	int major, sub;
+
+	if (index < 64)
+		return index;
+	major = index/64;
+	sub = (index & 63) + 64;
+	return (((uint64_t) sub) << (major - 1)) + (1L << (major - 1))/2;
+}
+
+/**
+ * latency_histogram::percentile() - Returns the smallest latency (in
+ * rdtsc cycles) such that at least @fraction of all recorded samples
+ * are less than or equal to it, or 0 if the histogram is empty.
+ * @fraction:  A value between 0.0 and 1.0, such as .999 for P99.9.
+ */
+uint64_t latency_histogram::percentile(double fraction)
+{
+	uint64_t need, seen = 0;
+	int i;
+
+	if (count == 0)
+		return 0;
+	need = (uint64_t) (fraction * (double) count);
+	if (need < 1)
+		need = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= need)
+			return bucket_value(i);
+	}
+	return max_val;
+}
+
+/**
+ * latency_histogram::add() - Merge all of the samples from another
+ * histogram into this one.
+ * @other:  The histogram to merge in; not modified.
+ */
+void latency_histogram::add(latency_histogram &other)
+{
+	if (other.count == 0)
+		return;
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		buckets[i] += other.buckets[i];
+	if ((count == 0) || (other.min_val < min_val))
+		min_val = other.min_val;
+	if ((count == 0) || (other.max_val > max_val))
+		max_val = other.max_val;
+	count += other.count;
+}
+
+/**
+ * size_bucket() - Maps a message length to one of a small number of
+ * message-size classes (class k holds lengths in the range
+ * [2**k, 2**(k+1))); each class gets its own latency histogram.
+ * @length:  Length of a message, in bytes.
+ */
+int size_bucket(int length)
+{
+	/**
+	 * define NUM_SIZE_BUCKETS: number of message-size classes used
+	 * for latency histograms; the last class also absorbs all larger
+	 * messages.
+	 */
+#define NUM_SIZE_BUCKETS 21
+	int bucket = 31 - __builtin_clz(length | 1);
+	if (bucket >= NUM_SIZE_BUCKETS)
+		bucket = NUM_SIZE_BUCKETS - 1;
+	return bucket;
+}
+
 /**
  * class client - Holds information that is common to both Homa clients
- * and TCP clients. 
+ * and TCP clients.
  */
 class client {
     public:
@@ -916,19 +1078,11 @@ class client {
 	uint32_t next_server;
 	
 	/**
-	 * @request_lengths: a randomly chosen collection of lengths to
-	 * use for outgoing RPCs. Precomputed to save time during the
-	 * actual measurements, and based on a given distribution.
-	 * Note: lengths are always at least 4 (this is needed in order
-	 * to include a 32-bit timestamp in the request).
+	 * @length_sampler: generates the length for each outgoing RPC,
+	 * drawn from the workload distribution in O(1) time (see
+	 * dist_sampler in dist.h).
 	 */
-	std::vector<int> request_lengths;
-
-	/**
-	 * @cnext_length: index into request_lengths of the length to use for
-	 * the next outgoing RPC.
-	 */
-	uint32_t next_length;
+	dist_sampler length_sampler;
 	
 	/**
 	 * @request_intervals: a randomly chosen collection of inter-request
@@ -969,6 +1123,12 @@ class client {
 	 * where info about the next RPC completion will be stored.
 	 */
 	uint32_t next_result;
+
+	/**
+	 * @latency_hists: one latency histogram for each message-size
+	 * class (see size_bucket); updated only by the receiving thread.
+	 */
+	std::vector<latency_histogram> latency_hists;
 	
 	/** @requests: total number of RPCs issued so far for each server. */
 	std::vector<uint64_t> requests;
@@ -1024,13 +1184,14 @@ client::client(int id)
 	, receiver_running(0)
 	, request_servers()
 	, next_server(0)
-	, request_lengths()
-	, next_length(0)
+	, length_sampler(workload, (((uint64_t) rand_gen()) << 32)
+			| rand_gen())
 	, request_intervals()
 	, next_interval(0)
 	, actual_lengths(NUM_CLIENT_STATS, 0)
 	, actual_rtts(NUM_CLIENT_STATS, 0)
 	, next_result(0)
+	, latency_hists(NUM_SIZE_BUCKETS)
 	, requests()
 	, responses()
 	, total_requests(0)
@@ -1053,7 +1214,7 @@ client::client(int id)
 		int server = server_dist(rand_gen);
 		request_servers.push_back(server);
 	}
-	if (!dist_sample(workload, &rand_gen, NUM_LENGTHS, &request_lengths)) {
+	if (!length_sampler.valid()) {
 		printf("FATAL: invalid workload '%s'\n", workload);
 		exit(1);
 	}
@@ -1072,8 +1233,8 @@ client::client(int id)
 	requests.resize(server_addrs.size());
 	responses.resize(server_addrs.size());
 	double avg_length = 0;
-	for (size_t i = 0; i < request_lengths.size(); i++)
-		avg_length += request_lengths[i];
+	for (int i = 0; i < NUM_LENGTHS; i++)
+		avg_length += length_sampler.sample();
 	avg_length /= NUM_LENGTHS;
 	uint64_t interval_sum = 0;
 	for (size_t i = 0; i < request_intervals.size(); i++)
@@ -1193,6 +1354,7 @@ void homa_client::wait_response(uint64_t id)
 	total_rtt += elapsed;
 	actual_lengths[next_result] = length;
 	actual_rtts[next_result] = elapsed;
+	latency_hists[size_bucket(length)].record(elapsed);
 	next_result++;
 	if (next_result >= actual_lengths.size())
 			next_result = 0;
@@ -1214,7 +1376,10 @@ void homa_client::sender()
 		int server;
 		
 		/* Wait until (a) we have reached the next start time
-		 * and (b) there aren't too many requests outstanding.
+		 * and (b) there aren't too many requests outstanding. In
+		 * open-loop mode (b) is skipped: holding back requests when
+		 * responses are slow is exactly the coordinated omission
+		 * that hides queuing delays from the latency numbers.
 		 */
 		while (1) {
 			if (stop)
@@ -1222,25 +1387,35 @@ void homa_client::sender()
 			now = rdtsc();
 			if (now < next_start)
 				continue;
+			if (open_loop)
+				break;
 			if ((total_requests - total_responses) < client_max)
 				break;
 		}
-		
+
 		server = request_servers[next_server];
 		next_server++;
 		if (next_server >= request_servers.size())
 			next_server = 0;
-		if ((requests[server] - responses[server]) >= server_max) {
+		if (!open_loop && ((requests[server] - responses[server])
+				>= server_max)) {
 			/* This server is overloaded, so skip it (don't
 			 * let one slow server stop the whole benchmark).
-			 */ 
+			 */
 			continue;
 		}
-		
-		header->length = request_lengths[next_length];
+
+		header->length = length_sampler.sample();
 		if (header->length < sizeof32(*header))
 			header->length = sizeof32(*header);
-		header->start_time = now & 0xffffffff;
+
+		/* In open-loop mode, measure latency from the time the
+		 * request was scheduled to be sent, not the time it was
+		 * actually sent; this charges any sender-side delay to
+		 * the RPC's latency.
+		 */
+		header->start_time = (open_loop ? next_start : now)
+				& 0xffffffff;
 		header->server_id = server;
 		int status = homa_send(fd, request, header->length,
 			reinterpret_cast<struct sockaddr *>(
@@ -1258,9 +1433,6 @@ void homa_client::sender()
 		}
 		requests[server]++;
 		total_requests++;
-		next_length++;
-		if (next_length >= request_lengths.size())
-			next_length = 0;
 		lag = now - next_start;
 		next_start = next_start + request_intervals[next_interval];
 		next_interval++;
@@ -1452,7 +1624,10 @@ void tcp_client::sender()
 		int server;
 		
 		/* Wait until (a) we have reached the next start time
-		 * and (b) there aren't too many requests outstanding.
+		 * and (b) there aren't too many requests outstanding. In
+		 * open-loop mode (b) is skipped: holding back requests when
+		 * responses are slow is exactly the coordinated omission
+		 * that hides queuing delays from the latency numbers.
 		 */
 		while (1) {
 			if (stop)
@@ -1460,23 +1635,27 @@ void tcp_client::sender()
 			now = rdtsc();
 			if (now < next_start)
 				continue;
+			if (open_loop)
+				break;
 			if ((total_requests - total_responses) < client_max)
 				break;
 		}
-		
+
 		server = request_servers[next_server];
 		next_server++;
 		if (next_server >= request_servers.size())
 			next_server = 0;
-		if (requests[server] >= (responses[server] + server_max)) {
+		if (!open_loop && (requests[server]
+				>= (responses[server] + server_max))) {
 			/* This server is overloaded, so skip it (don't
 			 * let one slow server stop the whole benchmark).
 			 */
 			continue;
 		}
-		
-		header.length = request_lengths[next_length];
-		header.start_time = now & 0xffffffff;
+
+		header.length = length_sampler.sample();
+		header.start_time = (open_loop ? next_start : now)
+				& 0xffffffff;
 		header.server_id = server;
 		int status = send_message(messages[server].fd, &header);
 		if (status != 0) {
@@ -1490,12 +1669,9 @@ void tcp_client::sender()
 			log(NORMAL, "tcp_client %d sent request to server port "
 					"%d, length %d\n",
 					id, header.server_id,
-					request_lengths[next_length]);
+					header.length);
 		requests[server]++;
 		total_requests++;
-		next_length++;
-		if (next_length >= request_lengths.size())
-			next_length = 0;
 		lag = now - next_start;
 		next_start += request_intervals[next_interval];
 		next_interval++;
@@ -1545,6 +1721,8 @@ void tcp_client::receiver(void)
 				total_rtt += elapsed;
 				actual_lengths[next_result] = header->length;
 				actual_rtts[next_result] = elapsed;
+				latency_hists[size_bucket(header->length)]
+						.record(elapsed);
 				next_result++;
 				if (next_result >= actual_lengths.size())
 					next_result = 0;
@@ -1707,6 +1885,7 @@ int client_cmd(std::vector<string> &words)
 	first_server = 1;
 	server_max = 1;
 	net_bw = 0.0;
+	open_loop = false;
 	port_threads = 1;
 	protocol = "homa";
 	server_nodes = 1;
@@ -1732,6 +1911,8 @@ int client_cmd(std::vector<string> &words)
 			if (!parse_float(words, i+1, &net_bw, option))
 				return 0;
 			i++;
+		} else if (strcmp(option, "--open-loop") == 0) {
+			open_loop = true;
 		} else if (strcmp(option, "--protocol") == 0) {
 			if ((i + 1) >= words.size()) {
 				printf("No value provided for %s\n",
@@ -1775,6 +1956,11 @@ int client_cmd(std::vector<string> &words)
 			return 0;
 		}
 	}
+	if (open_loop && (net_bw == 0.0)) {
+		printf("--open-loop requires --net-bw > 0 (an open-loop "
+				"client needs scheduled send times)\n");
+		return 0;
+	}
 	init_server_addrs();
 
 	/* Create clients. */
@@ -1788,6 +1974,79 @@ int client_cmd(std::vector<string> &words)
 	return 1;
 }
 
+/**
+ * dump_hist_cmd() - Parse the arguments for a "dump_hist" command and
+ * execute it.
+ * @words:  Command arguments (including the command name as @words[0]).
+ *
+ * Return:  Nonzero means success, zero means there was an error.
+ */
+int dump_hist_cmd(std::vector<string> &words)
+{
+	FILE *f;
+	time_t now;
+	char time_buffer[100];
+
+	if (words.size() != 2) {
+		printf("Wrong # args; must be 'dump_hist file'\n");
+		return 0;
+	}
+	f = fopen(words[1].c_str(), "w");
+	if (f == NULL) {
+		printf("Couldn't open file %s: %s\n", words[1].c_str(),
+				strerror(errno));
+		return 0;
+	}
+
+	time(&now);
+	strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S",
+			localtime(&now));
+	fprintf(f, "# Latency histograms measured by cp_node at %s\n",
+			time_buffer);
+	fprintf(f, "# --protocol %s, --workload %s, --net-bw %.1f --threads %d,\n",
+			protocol, workload, net_bw, client_threads);
+	fprintf(f, "# --server-nodes %d --server-ports %d, --thread-max %d, "
+			"--server-max %d, open loop: %d\n",
+			server_nodes, server_ports, client_max, server_max,
+			open_loop ? 1 : 0);
+	fprintf(f, "# For each message-size class, a summary line with "
+			"percentiles (usec),\n");
+	fprintf(f, "# followed by the full histogram as "
+			"\"usec count cum_fraction\" lines.\n");
+	for (int bucket = 0; bucket < NUM_SIZE_BUCKETS; bucket++) {
+		latency_histogram merged;
+		uint64_t seen = 0;
+
+		for (client *client: clients)
+			merged.add(client->latency_hists[bucket]);
+		if (merged.count == 0)
+			continue;
+		fprintf(f, "sizes [%d, %d): %lu samples, min %.2f P50 %.2f "
+				"P90 %.2f P99 %.2f P99.9 %.2f P99.99 %.2f "
+				"max %.2f\n",
+				1 << bucket, 1 << (bucket + 1), merged.count,
+				1e06*to_seconds(merged.min_val),
+				1e06*to_seconds(merged.percentile(.5)),
+				1e06*to_seconds(merged.percentile(.9)),
+				1e06*to_seconds(merged.percentile(.99)),
+				1e06*to_seconds(merged.percentile(.999)),
+				1e06*to_seconds(merged.percentile(.9999)),
+				1e06*to_seconds(merged.max_val));
+		for (int i = 0; i < HIST_BUCKETS; i++) {
+			if (merged.buckets[i] == 0)
+				continue;
+			seen += merged.buckets[i];
+			fprintf(f, "%12.2f %10lu %8.6f\n",
+					1e06*to_seconds(
+					latency_histogram::bucket_value(i)),
+					merged.buckets[i],
+					((double) seen)/((double) merged.count));
+		}
+	}
+	fclose(f);
+	return 1;
+}
+
 /**
  * dump_times_cmd() - Parse the arguments for a "dump_times" command and
  * execute it.
@@ -2051,6 +2310,8 @@ int exec_words(std::vector<string> &words)
 		return 1;
 	if (words[0].compare("client") == 0) {
 		return client_cmd(words);
+	} else if (words[0].compare("dump_hist") == 0) {
+		return dump_hist_cmd(words);
 	} else if (words[0].compare("dump_times") == 0) {
 		return dump_times_cmd(words);
 	} else if (words[0].compare("log") == 0) {
@@ -22,6 +22,29 @@
 #include "dist.h"
 #include "homa.h"
 
+/**
+ * dist_lookup() - Find the CDF table for a named workload.
+ * @dist:   Name of the desired workload, such as "w1".
+ *
+ * Return:  The table of dist_points for the workload, or NULL if
+ *          @dist isn't a valid workload name.
+ */
+static dist_point *dist_lookup(const char *dist)
+{
+	if (strcmp(dist, "w1") == 0) {
+		return w1;
+	} else if (strcmp(dist, "w2") == 0) {
+		return w2;
+	} else if (strcmp(dist, "w3") == 0) {
+		return w3;
+	} else if (strcmp(dist, "w4") == 0) {
+		return w4;
+	} else if (strcmp(dist, "w5") == 0) {
+		return w5;
+	}
+	return NULL;
+}
+
 /**
  * dist_sample() - Generate a collection of values sampled randomly from a
  * particular workload distribution.
@@ -52,20 +75,10 @@ int dist_sample(const char *dist, std::mt19937 *rand_gen, int num_samples,
 		return 1;
 	}
 	
-	if (strcmp(dist, "w1") == 0) {
-		points = w1;
-	} else if (strcmp(dist, "w2") == 0) {
-		points = w2;
-	} else if (strcmp(dist, "w3") == 0) {
-		points = w3;
-	} else if (strcmp(dist, "w4") == 0) {
-		points = w4;
-	} else if (strcmp(dist, "w5") == 0) {
-		points = w5;
-	} else {
+	points = dist_lookup(dist);
+	if (points == NULL)
 		return 0;
-	}
-	
+
 	for (int i = 0; i < num_samples; i++) {
 		double cdf_fraction = uniform_dist(*rand_gen);
 		for (dist_point *p = points; ; p++) {
@@ -102,20 +115,10 @@ double dist_mean(const char *dist)
 		return length;
 	}
 	
-	if (strcmp(dist, "w1") == 0) {
-		points = w1;
-	} else if (strcmp(dist, "w2") == 0) {
-		points = w2;
-	} else if (strcmp(dist, "w3") == 0) {
-		points = w3;
-	} else if (strcmp(dist, "w4") == 0) {
-		points = w4;
-	} else if (strcmp(dist, "w5") == 0) {
-		points = w5;
-	} else {
+	points = dist_lookup(dist);
+	if (points == NULL)
 		return 0;
-	}
-	
+
 	mean = 0;
 	prev_fraction = 0.0;
 	for (dist_point *p = points; ; p++) {
@@ -131,6 +134,114 @@ double dist_mean(const char *dist)
 	return mean;
 }
 
+/**
+ * dist_sampler::dist_sampler() - Constructor for dist_samplers: builds
+ * the alias table for a workload, using Vose's algorithm.
+ * @dist:   Specifies the distribution to sample from, in the same way
+ *          as the @dist argument to dist_sample. If this isn't a valid
+ *          workload name, then valid() will return false and sample()
+ *          must not be invoked.
+ * @seed:   Seed for the random number generator, so different samplers
+ *          can produce different sequences.
+ */
+dist_sampler::dist_sampler(const char *dist, uint64_t seed)
+	: lengths()
+	, alias_lengths()
+	, thresholds()
+	, state(seed | 1)
+	, ok(false)
+{
+	std::vector<double> probs;
+	std::vector<double> scaled;
+	std::vector<int> small, large;
+	double prev_fraction, total;
+	dist_point *points;
+	char *end;
+	int length, n;
+
+	/* First check for a fixed-size distribution. */
+	length = strtol(dist, &end, 10);
+	if ((length != 0) && (*end == 0)) {
+		lengths.push_back(length);
+		alias_lengths.push_back(length);
+		thresholds.push_back(0xffffffffu);
+		ok = true;
+		return;
+	}
+
+	points = dist_lookup(dist);
+	if (points == NULL)
+		return;
+
+	/* Convert the CDF into a PMF, merging adjacent points with the
+	 * same length (the tables contain many of these) and clamping
+	 * lengths as in dist_sample.
+	 */
+	prev_fraction = 0.0;
+	for (dist_point *p = points; ; p++) {
+		int length = p->length;
+		if (length > HOMA_MAX_MESSAGE_LENGTH)
+			length = HOMA_MAX_MESSAGE_LENGTH;
+		if (!lengths.empty() && (length == lengths.back()))
+			probs.back() += p->fraction - prev_fraction;
+		else {
+			lengths.push_back(length);
+			probs.push_back(p->fraction - prev_fraction);
+		}
+		prev_fraction = p->fraction;
+		if (p->fraction >= 1.0)
+			break;
+	}
+
+	/* Vose's alias algorithm: scale each probability by n, then
+	 * repeatedly fill an under-full slot from an over-full one, so
+	 * that every slot ends up representing exactly 1/n of the total
+	 * probability, split between at most two lengths.
+	 */
+	n = static_cast<int>(lengths.size());
+	thresholds.resize(n);
+	alias_lengths.resize(n);
+	scaled.resize(n);
+	total = 0.0;
+	for (double prob: probs)
+		total += prob;
+	for (int i = 0; i < n; i++) {
+		scaled[i] = probs[i]*n/total;
+		if (scaled[i] < 1.0)
+			small.push_back(i);
+		else
+			large.push_back(i);
+	}
+	while (!small.empty() && !large.empty()) {
+		int s = small.back();
+		int l = large.back();
+		small.pop_back();
+		large.pop_back();
+		thresholds[s] = static_cast<uint32_t>(
+				scaled[s]*4294967296.0);
+		alias_lengths[s] = lengths[l];
+		scaled[l] -= 1.0 - scaled[s];
+		if (scaled[l] < 1.0)
+			small.push_back(l);
+		else
+			large.push_back(l);
+	}
+
+	/* Leftover slots (in either list; small can end up with slots
+	 * whose scaled value is infinitesimally below 1.0 because of
+	 * floating-point rounding) get the full probability.
+	 */
+	for (int s: small) {
+		thresholds[s] = 0xffffffffu;
+		alias_lengths[s] = lengths[s];
+	}
+	for (int l: large) {
+		thresholds[l] = 0xffffffffu;
+		alias_lengths[l] = lengths[l];
+	}
+	ok = true;
+}
+
 /*
  * The following arrays store CDFs for Workloads 1-5 from the Homa
  * SIGCOMM paper.
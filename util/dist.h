@@ -20,6 +20,7 @@
 #ifndef _DIST_H
 #define _DIST_H
 
+#include <cstdint>
 #include <random>
 #include <vector>
 
@@ -38,6 +39,83 @@ struct dist_point {
 	double fraction;
 };
 
+/**
+ * class dist_sampler - Generates message lengths from a workload
+ * distribution in O(1) time per sample, using Walker's alias method:
+ * the distribution is precomputed at startup into a table where each
+ * slot holds two candidate lengths plus a threshold for choosing
+ * between them, so a sample costs one random number and two array
+ * reads (no search through the CDF, as in dist_sample). Intended for
+ * use on the fast path of load generators.
+ */
+class dist_sampler {
+    public:
+	dist_sampler(const char *dist, uint64_t seed);
+	int sample();
+
+	/**
+	 * valid() - Returns true if the constructor's @dist argument
+	 * named a known workload, false if not.
+	 */
+	bool valid()
+	{
+		return ok;
+	}
+
+	/**
+	 * @lengths: one entry per slot in the alias table: the length
+	 * to return if the slot's threshold test succeeds.
+	 */
+	std::vector<int> lengths;
+
+	/**
+	 * @alias_lengths: one entry per slot: the length to return if
+	 * the slot's threshold test fails.
+	 */
+	std::vector<int> alias_lengths;
+
+	/**
+	 * @thresholds: one entry per slot: return @lengths[slot] if a
+	 * uniform 32-bit random value is less than this, else
+	 * @alias_lengths[slot].
+	 */
+	std::vector<uint32_t> thresholds;
+
+	/** @state: state of the random number generator; never zero. */
+	uint64_t state;
+
+	/** @ok: true means the constructor succeeded. */
+	bool ok;
+};
+
+/**
+ * dist_sampler::sample() - Returns one message length drawn from the
+ * sampler's distribution.
+ */
+inline int dist_sampler::sample()
+{
+	uint64_t r;
+	uint32_t slot;
+
+	/* xorshift64* generator: much cheaper than std::mt19937, and
+	 * more than random enough for load generation.
+	 */
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	r = state * 0x2545f4914f6cdd1dull;
+
+	/* Map the high 32 bits of r to a table slot (multiply-shift
+	 * avoids an integer divide) and use the low 32 bits for the
+	 * threshold test.
+	 */
+	slot = (uint32_t) ((((uint64_t) (uint32_t) (r >> 32))
+			* lengths.size()) >> 32);
+	if (((uint32_t) r) < thresholds[slot])
+		return lengths[slot];
+	return alias_lengths[slot];
+}
+
 extern double   dist_mean(const char *dist);
 extern int      dist_sample(const char *dist, std::mt19937 *rand_gen,
 			int num_samples, std::vector<int> *sizes);